@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_ANNOTATE_H
+#define CS_TRACE_ANNOTATE_H
+
+#include <stdint.h>
+
+#define ANNOTATE_PORTS_ENV "CSTRACE_STM_PORTS" /* Set by cs-trace --annotate */
+#define ANNOTATE_CHANNEL_MAX 256
+#define ANNOTATE_PORT_SIZE 0x100 /* Extended stimulus port of a channel */
+#define ANNOTATE_PORT_G_D 0x18   /* Guaranteed data without marker or time */
+
+extern volatile uint8_t *annotate_ports;
+
+int init_annotations(void);
+void fini_annotations(void);
+
+/* Write value to channel. It is a single store, which does nothing until
+ * init_annotations() succeeds. */
+static inline void annotate(unsigned int channel, uint32_t value)
+{
+  if (annotate_ports && channel < ANNOTATE_CHANNEL_MAX) {
+    *(volatile uint32_t *)(annotate_ports + channel * ANNOTATE_PORT_SIZE +
+                           ANNOTATE_PORT_G_D) = value;
+  }
+}
+
+#endif /* CS_TRACE_ANNOTATE_H */
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_CLOCK_H
+#define CS_TRACE_CLOCK_H
+
+#include <stddef.h>
+
+#define DEFAULT_CLOCK_NAME "cstrace.clock.txt"
+#define TIMESTAMP_SYNC_PERIOD 12 /* Timestamp with A-sync every 2^12 bytes */
+
+/* A system counter value read together with CLOCK_MONOTONIC. */
+struct clock_sample {
+  unsigned long counter;
+  unsigned long monotonic_ns;
+};
+
+/* The clock at the time trace up to offset was drained. */
+struct clock_drain {
+  size_t offset;
+  struct clock_sample sample;
+};
+
+/* Maps ETM timestamps, which count the system counter, to CLOCK_MONOTONIC. */
+struct trace_clock {
+  unsigned long frequency; /* Counter ticks per second */
+  struct clock_sample start;
+  struct clock_sample end;
+  struct clock_drain *drains;
+  size_t drain_count;
+  size_t drain_size;
+};
+
+unsigned long read_system_counter(void);
+unsigned long get_monotonic_ns(void);
+int compare_latency(const void *a, const void *b);
+double get_latency_quantile(const unsigned long *latency, size_t count,
+                            double q);
+unsigned long read_system_counter_frequency(void);
+int sample_trace_clock(struct clock_sample *sample);
+int init_trace_clock(struct trace_clock *clock);
+void fini_trace_clock(struct trace_clock *clock);
+int add_trace_clock_drain(struct trace_clock *clock, size_t offset);
+int export_trace_clock(const struct trace_clock *clock, const char *path);
+unsigned long monotonic_to_counter(const struct trace_clock *clock,
+                                   unsigned long monotonic_ns);
+
+#endif /* CS_TRACE_CLOCK_H */
@@ -7,6 +7,12 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#define DEFAULT_SIGNATURE_DEPTH 16 /* Taken branches in a crash signature */
+#define SIGNATURE_SYNC_PERIOD 12   /* A-sync every 4 KiB to decode the tail */
+#define DEFAULT_TRACE_ARGS_NAME "decoderargs.txt"
+#define DEFAULT_TRACE_MAPS_NAME "cstrace.maps.txt"
+#define DEFAULT_TRACE_EDGES_NAME "cstrace.edges.txt"
+
 typedef enum {
   edge_cov,
   path_cov,
@@ -17,7 +23,18 @@ int decode_trace(void);
 int init_trace(pid_t parent_pid, pid_t pid);
 void fini_trace(void);
 int start_trace(pid_t pid, bool use_pid_trace);
+int attach_trace(pid_t pid);
+int detach_trace(void);
+int restart_trace(pid_t pid);
+int retarget_trace(pid_t pid);
+int follow_trace(pid_t pid);
+int unfollow_trace(pid_t pid);
 int stop_trace(bool disable_all);
+ssize_t export_trace_window(unsigned int index);
+int snapshot_trace(unsigned int index, bool resume);
+int sign_trace_tail(unsigned int depth, const char *dir,
+                    unsigned long *signature);
 void trace_suspend_resume_callback(void);
+bool is_trace_suspend_requested(void);
 
 #endif /* CS_TRACE_COMMON_H */
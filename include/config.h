@@ -20,5 +20,35 @@ int enable_trace(const struct board *board, struct cs_devices_t *devices);
 int disable_trace(const struct board *board, struct cs_devices_t *devices);
 int enable_trace_sinks_only(const struct board *board, struct cs_devices_t *devices);
 int disable_trace_sinks_only(const struct board *board, struct cs_devices_t *devices);
+int configure_trace_source(const struct board *board,
+                           struct cs_devices_t *devices, int cpu, int trace_id,
+                           struct map_info *range, int range_count, pid_t pid);
+int enable_trace_source(const struct board *board,
+                        struct cs_devices_t *devices, int cpu);
+int disable_trace_source(const struct board *board,
+                         struct cs_devices_t *devices, int cpu);
+int reconfigure_trace_source(const struct board *board,
+                             struct cs_devices_t *devices, int cpu,
+                             struct map_info *range, int range_count,
+                             pid_t pid);
+int reconfigure_trace_source_pids(const struct board *board,
+                                  struct cs_devices_t *devices, int cpu,
+                                  struct map_info *range, int range_count,
+                                  const pid_t *pids, int pid_count);
+int resume_trace_source(const struct board *board,
+                        struct cs_devices_t *devices, int cpu);
+int suspend_trace_source(const struct board *board,
+                         struct cs_devices_t *devices, int cpu);
+int enable_shared_sink(const struct board *board, struct cs_devices_t *devices);
+int disable_shared_sink(const struct board *board,
+                        struct cs_devices_t *devices);
+int flush_shared_sink(struct cs_devices_t *devices);
+int enable_stm_source(struct cs_devices_t *devices, int stm_trace_id);
+int disable_stm_source(struct cs_devices_t *devices);
+int enable_marked_trace(const struct board *board,
+                        struct cs_devices_t *devices, int stm_trace_id);
+int disable_marked_trace(const struct board *board,
+                         struct cs_devices_t *devices);
+int write_stm_marker(struct cs_devices_t *devices, unsigned int marker);
 
 #endif /* CS_TRACE_CONFIG_H */
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_DECODER_H
+#define CS_TRACE_DECODER_H
+
+#include <stddef.h>
+
+#include "libcsdec.h"
+
+#include "common.h"
+#include "utils.h"
+
+struct libcsdec_memory_image *alloc_decoder_images(
+    const struct map_info *map_info, int map_info_num);
+struct libcsdec_memory_map *alloc_decoder_maps(const struct map_info *map_info,
+                                               int map_info_num);
+libcsdec_t init_cov_decoder(cov_type_t type, unsigned char *bitmap,
+                            size_t bitmap_size, int map_info_num,
+                            struct libcsdec_memory_image *mem_img);
+int reset_cov_decoder(cov_type_t type, libcsdec_t decoder, int trace_id,
+                      int map_info_num, struct libcsdec_memory_map *mem_map);
+int run_cov_decoder(cov_type_t type, libcsdec_t decoder, void *buf,
+                    size_t buf_size);
+int fini_cov_decoder(cov_type_t type, libcsdec_t decoder);
+
+#endif /* CS_TRACE_DECODER_H */
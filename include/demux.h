@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_DEMUX_H
+#define CS_TRACE_DEMUX_H
+
+#include <stddef.h>
+
+#include "ring.h"
+
+#define CS_FRAME_SIZE 16
+#define CS_TRACE_ID_MAX 0x6f
+#define TRACE_STREAM_BUF_SIZE 0x1000
+/* Frames carrying size bytes of a single ID, 14 bytes each. */
+#define FORMATTED_TRACE_SIZE(size) \
+  (((size) + CS_FRAME_SIZE - 3) / (CS_FRAME_SIZE - 2) * CS_FRAME_SIZE)
+
+/* Per trace ID stream, re-formatted into frames carrying the single ID. */
+struct trace_stream {
+  struct trace_ring *ring;
+  unsigned char frame[CS_FRAME_SIZE];
+  int frame_pos;
+  unsigned char buf[TRACE_STREAM_BUF_SIZE];
+  size_t buf_len;
+};
+
+struct trace_demux {
+  int cur_id;
+  struct trace_stream *streams[CS_TRACE_ID_MAX + 1];
+};
+
+void deformat_trace(int *cur_id, const void *buf, size_t size,
+                    void (*emit)(void *, int, unsigned char), void *arg);
+void init_trace_demux(struct trace_demux *demux);
+void fini_trace_demux(struct trace_demux *demux);
+int add_trace_stream(struct trace_demux *demux, int trace_id,
+                     struct trace_ring *ring);
+void remove_trace_stream(struct trace_demux *demux, int trace_id);
+void demux_trace(struct trace_demux *demux, const void *buf, size_t size);
+void flush_trace_stream(struct trace_demux *demux, int trace_id);
+size_t extract_trace_chunk(int *cur_id, int trace_id, const void *buf,
+                           size_t size, unsigned char *out);
+size_t extract_trace_stream(int trace_id, const void *buf, size_t size,
+                            unsigned char *out);
+size_t format_trace(int trace_id, const void *buf, size_t size,
+                    unsigned char *out);
+
+#endif /* CS_TRACE_DEMUX_H */
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_EVENT_H
+#define CS_TRACE_EVENT_H
+
+#include <stdatomic.h>
+
+#define EVENT_QUEUE_SIZE 64 /* Power of two */
+#define EVENT_MASK(event) (1U << (event))
+
+struct event_slot {
+  atomic_uint seq; /* Index + 1 once published, 0 while being written */
+  atomic_int event;
+};
+
+/* Lock-free broadcast queue. Any thread posts events and every reader follows
+ * them in order with its own cursor, so no event is overwritten by the next
+ * one before it is seen. Readers sleep on a futex. */
+struct event_queue {
+  atomic_uint tail;  /* Index of the next event */
+  atomic_uint futex; /* Bumped on every post */
+  atomic_uint waiters;
+  struct event_slot slots[EVENT_QUEUE_SIZE];
+};
+
+struct event_cursor {
+  unsigned int head; /* Index of the next event to read */
+};
+
+void init_event_queue(struct event_queue *queue);
+void init_event_cursor(struct event_queue *queue, struct event_cursor *cursor);
+void post_event(struct event_queue *queue, int event);
+int wait_event(struct event_queue *queue, struct event_cursor *cursor,
+               unsigned int mask);
+
+#endif /* CS_TRACE_EVENT_H */
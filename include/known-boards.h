@@ -12,14 +12,27 @@
 #include "csregisters.h"
 #include "csregistration.h"
 
+#include "topology.h"
+
 #include <stdbool.h>
 #include <string.h>
 
 #define AXICTL_COMMON (CS_ETB_AXICTL_PROT_CTL_B1 | CS_ETB_AXICTL_AXCACHE_OS)
+#define JETSON_NANO_STM_PORTS 0x71000000
+#define JETSON_TX2_STM_PORTS 0x0a000000
+#define THUNDERX2_CS_BASE 0x410000000
+#define THUNDERX2_CS_SIZE 0x8000000
+#define JETSON_NANO_CS_BASE 0x72000000
+#define JETSON_NANO_CS_SIZE 0x2000000
+#define JETSON_TX2_CS_BASE 0x8000000
+#define JETSON_TX2_CS_SIZE 0x2000000
 
 const bool etr_mode = true; /* etr_mode switches ETF and ETR. */
 
 int get_trace_id(const char *hardware, int cpu);
+unsigned long get_stm_ports(const char *hardware);
+int get_coresight_window(const char *hardware, unsigned long *base,
+                         unsigned long *size);
 
 static int do_registration_thunderx2(struct cs_devices_t *devices)
 {
@@ -31,32 +44,34 @@ static int do_registration_thunderx2(struct cs_devices_t *devices)
 
   cs_device_t rep, tpiu, etr, etf, funnel;
 
-  cs_register_romtable(0x410000000);
+  register_topology_romtable(THUNDERX2_CS_BASE);
 
   for (int i = 0; i < num_cs_cpu; i++) {
     /* CTI affinities */
-    cs_device_set_affinity(cs_device_register(cti_base + (0x100000 * i)), i);
+    set_topology_affinity(register_topology_device(cti_base + (0x100000 * i)),
+                          i);
     /* ETM affinities */
-    cs_device_set_affinity(cs_device_register(etm_base + (0x100000 * i)), i);
+    set_topology_affinity(register_topology_device(etm_base + (0x100000 * i)),
+                          i);
   }
 
-  funnel = cs_device_get(0x410001000);
+  funnel = get_topology_device(0x410001000);
   /* FIXME: funnel has 3 in ports. Hardcode to connect CPU #0 to #2 */
-  cs_atb_register(cs_cpu_get_device(0, CS_DEVCLASS_SOURCE), 0, funnel, 0);
-  cs_atb_register(cs_cpu_get_device(1, CS_DEVCLASS_SOURCE), 0, funnel, 1);
-  cs_atb_register(cs_cpu_get_device(2, CS_DEVCLASS_SOURCE), 0, funnel, 2);
+  register_topology_atb(cs_cpu_get_device(0, CS_DEVCLASS_SOURCE), 0, funnel, 0);
+  register_topology_atb(cs_cpu_get_device(1, CS_DEVCLASS_SOURCE), 0, funnel, 1);
+  register_topology_atb(cs_cpu_get_device(2, CS_DEVCLASS_SOURCE), 0, funnel, 2);
 
-  etf = cs_device_get(0x410002000);
-  cs_atb_register(funnel, 0, etf, 0);
+  etf = get_topology_device(0x410002000);
+  register_topology_atb(funnel, 0, etf, 0);
 
-  rep = cs_atb_add_replicator(2);
-  cs_atb_register(etf, 0, rep, 0);
+  rep = add_topology_replicator(2);
+  register_topology_atb(etf, 0, rep, 0);
 
-  etr = cs_device_get(0x410004000);
-  tpiu = cs_device_get(0x410005000);
+  etr = get_topology_device(0x410004000);
+  tpiu = get_topology_device(0x410005000);
 
-  cs_atb_register(rep, 0, etr, 0);
-  cs_atb_register(rep, 1, tpiu, 0);
+  register_topology_atb(rep, 0, etr, 0);
+  register_topology_atb(rep, 1, tpiu, 0);
 
   devices->etb = etr_mode ? etr : etf;
   devices->trace_sinks[0] = etr_mode ? etf : NULL;
@@ -75,82 +90,75 @@ static int do_registration_jetson_nano(struct cs_devices_t *devices)
   int i;
   cs_device_t funnel_a57, funnel_major, etf, rep, etr, tpiu, stm, sys_cti;
 
-  cs_register_romtable(0x72000000);
+  register_topology_romtable(JETSON_NANO_CS_BASE);
 
   /* CTI affinities */
-  cs_device_set_affinity(cs_device_register(0x73420000), A57_0);
-  cs_device_set_affinity(cs_device_register(0x73520000), A57_1);
-  cs_device_set_affinity(cs_device_register(0x73620000), A57_2);
-  cs_device_set_affinity(cs_device_register(0x73720000), A57_3);
+  set_topology_affinity(register_topology_device(0x73420000), A57_0);
+  set_topology_affinity(register_topology_device(0x73520000), A57_1);
+  set_topology_affinity(register_topology_device(0x73620000), A57_2);
+  set_topology_affinity(register_topology_device(0x73720000), A57_3);
 
   /* PMU affinities */
-  cs_device_set_affinity(cs_device_register(0x73430000), A57_0);
-  cs_device_set_affinity(cs_device_register(0x73530000), A57_1);
-  cs_device_set_affinity(cs_device_register(0x73630000), A57_2);
-  cs_device_set_affinity(cs_device_register(0x73730000), A57_3);
+  set_topology_affinity(register_topology_device(0x73430000), A57_0);
+  set_topology_affinity(register_topology_device(0x73530000), A57_1);
+  set_topology_affinity(register_topology_device(0x73630000), A57_2);
+  set_topology_affinity(register_topology_device(0x73730000), A57_3);
 
   /* ETM affinities */
-  cs_device_set_affinity(cs_device_register(0x73440000), A57_0);
-  cs_device_set_affinity(cs_device_register(0x73540000), A57_1);
-  cs_device_set_affinity(cs_device_register(0x73640000), A57_2);
-  cs_device_set_affinity(cs_device_register(0x73740000), A57_3);
-
-  funnel_a57 = cs_device_get(0x73010000);
-  cs_atb_register(cs_cpu_get_device(A57_0, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  0);
-  cs_atb_register(cs_cpu_get_device(A57_1, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  1);
-  cs_atb_register(cs_cpu_get_device(A57_2, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  2);
-  cs_atb_register(cs_cpu_get_device(A57_3, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  3);
-
-  funnel_major = cs_device_get(0x72010000);
-  etf = cs_device_get(0x72030000);
-  rep = cs_device_get(0x72040000);
-  etr = cs_device_get(0x72050000);
-  tpiu = cs_device_get(0x72060000);
-  stm = cs_device_get(0x72070000);
-
-  cs_atb_register(funnel_a57, 0, funnel_major, 0);
-  cs_atb_register(stm, 0, funnel_major, 3);
-
-  cs_atb_register(funnel_major, 0, etf, 0);
-  cs_atb_register(etf, 0, rep, 0);
-  cs_atb_register(rep, 0, etr, 0);
-  cs_atb_register(rep, 1, tpiu, 0);
+  set_topology_affinity(register_topology_device(0x73440000), A57_0);
+  set_topology_affinity(register_topology_device(0x73540000), A57_1);
+  set_topology_affinity(register_topology_device(0x73640000), A57_2);
+  set_topology_affinity(register_topology_device(0x73740000), A57_3);
+
+  funnel_a57 = get_topology_device(0x73010000);
+  register_topology_atb(cs_cpu_get_device(A57_0, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 0);
+  register_topology_atb(cs_cpu_get_device(A57_1, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 1);
+  register_topology_atb(cs_cpu_get_device(A57_2, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 2);
+  register_topology_atb(cs_cpu_get_device(A57_3, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 3);
+
+  funnel_major = get_topology_device(0x72010000);
+  etf = get_topology_device(0x72030000);
+  rep = get_topology_device(0x72040000);
+  etr = get_topology_device(0x72050000);
+  tpiu = get_topology_device(0x72060000);
+  stm = get_topology_device(0x72070000);
+
+  register_topology_atb(funnel_a57, 0, funnel_major, 0);
+  register_topology_atb(stm, 0, funnel_major, 3);
+
+  register_topology_atb(funnel_major, 0, etf, 0);
+  register_topology_atb(etf, 0, rep, 0);
+  register_topology_atb(rep, 0, etr, 0);
+  register_topology_atb(rep, 1, tpiu, 0);
 
   devices->itm = stm;
   devices->etb = etr_mode ? etr : etf;
   devices->trace_sinks[0] = etr_mode ? etf : NULL;
 
-  cs_stm_config_master(stm, 0, 0x71000000);
-  cs_stm_select_master(stm, 0);
+  config_topology_stm_master(stm, 0, JETSON_NANO_STM_PORTS);
+  select_topology_stm_master(stm, 0);
 
   /* etf */
-  sys_cti = cs_device_register(0x72020000);
-  cs_cti_connect_trigsrc(etf, CS_TRIGOUT_ETB_FULL, cs_cti_trigsrc(sys_cti, 0));
-  cs_cti_connect_trigsrc(etf, CS_TRIGOUT_ETB_ACQCOMP,
-                         cs_cti_trigsrc(sys_cti, 1));
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 0), etf, CS_TRIGIN_ETB_TRIGIN);
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 1), etf,
-                         CS_TRIGIN_ETB_FLUSHIN);
+  sys_cti = register_topology_device(0x72020000);
+  connect_topology_trigsrc(etf, CS_TRIGOUT_ETB_FULL, sys_cti, 0);
+  connect_topology_trigsrc(etf, CS_TRIGOUT_ETB_ACQCOMP, sys_cti, 1);
+  connect_topology_trigdst(sys_cti, 0, etf, CS_TRIGIN_ETB_TRIGIN);
+  connect_topology_trigdst(sys_cti, 1, etf, CS_TRIGIN_ETB_FLUSHIN);
 
   /* etr */
-  cs_cti_connect_trigsrc(etr, CS_TRIGOUT_ETB_FULL, cs_cti_trigsrc(sys_cti, 2));
-  cs_cti_connect_trigsrc(etr, CS_TRIGOUT_ETB_ACQCOMP,
-                         cs_cti_trigsrc(sys_cti, 3));
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 2), etr, CS_TRIGIN_ETB_TRIGIN);
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 3), etr,
-                         CS_TRIGIN_ETB_FLUSHIN);
+  connect_topology_trigsrc(etr, CS_TRIGOUT_ETB_FULL, sys_cti, 2);
+  connect_topology_trigsrc(etr, CS_TRIGOUT_ETB_ACQCOMP, sys_cti, 3);
+  connect_topology_trigdst(sys_cti, 2, etr, CS_TRIGIN_ETB_TRIGIN);
+  connect_topology_trigdst(sys_cti, 3, etr, CS_TRIGIN_ETB_FLUSHIN);
 
   /* stm */
-  cs_cti_connect_trigsrc(stm, CS_TRIGOUT_STM_ASYNCOUT,
-                         cs_cti_trigsrc(sys_cti, 4));
-  cs_cti_connect_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSPTE,
-                         cs_cti_trigsrc(sys_cti, 5));
-  cs_cti_connect_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSW,
-                         cs_cti_trigsrc(sys_cti, 6));
+  connect_topology_trigsrc(stm, CS_TRIGOUT_STM_ASYNCOUT, sys_cti, 4);
+  connect_topology_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSPTE, sys_cti, 5);
+  connect_topology_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSW, sys_cti, 6);
 
   for (i = 0; i < 4; i++) {
     devices->cpu_id[i] = cpu_id[i];
@@ -168,95 +176,88 @@ static int do_registration_jetsontx2(struct cs_devices_t *devices)
 
   cs_device_t rep, etr, etf, funnel_major, funnel_a57, stm, tpiu, sys_cti;
 
-  cs_register_romtable(0x8000000);
+  register_topology_romtable(JETSON_TX2_CS_BASE);
 
   /* CTI affinities */
-  cs_device_set_affinity(cs_device_register(0x9820000), A57_0);
-  cs_device_set_affinity(cs_device_register(0x9920000), A57_3);
-  cs_device_set_affinity(cs_device_register(0x9A20000), A57_4);
-  cs_device_set_affinity(cs_device_register(0x9B20000), A57_5);
+  set_topology_affinity(register_topology_device(0x9820000), A57_0);
+  set_topology_affinity(register_topology_device(0x9920000), A57_3);
+  set_topology_affinity(register_topology_device(0x9A20000), A57_4);
+  set_topology_affinity(register_topology_device(0x9B20000), A57_5);
 
-  // cs_device_set_affinity(cs_device_register(0x9420000), Denver_0);
-  // cs_device_set_affinity(cs_device_register(0x9520000), Denver_1);
+  // set_topology_affinity(register_topology_device(0x9420000), Denver_0);
+  // set_topology_affinity(register_topology_device(0x9520000), Denver_1);
 
   /* PMU affinities */
-  cs_device_set_affinity(cs_device_register(0x9830000), A57_0);
-  cs_device_set_affinity(cs_device_register(0x9930000), A57_3);
-  cs_device_set_affinity(cs_device_register(0x9A30000), A57_4);
-  cs_device_set_affinity(cs_device_register(0x9B30000), A57_5);
+  set_topology_affinity(register_topology_device(0x9830000), A57_0);
+  set_topology_affinity(register_topology_device(0x9930000), A57_3);
+  set_topology_affinity(register_topology_device(0x9A30000), A57_4);
+  set_topology_affinity(register_topology_device(0x9B30000), A57_5);
 
-  // cs_device_set_affinity(cs_device_register(0x9430000), Denver_0);
-  // cs_device_set_affinity(cs_device_register(0x9530000), Denver_1);
+  // set_topology_affinity(register_topology_device(0x9430000), Denver_0);
+  // set_topology_affinity(register_topology_device(0x9530000), Denver_1);
 
   /* PTM affinities(ETM) */
-  cs_device_set_affinity(cs_device_register(0x9840000), A57_0);
-  cs_device_set_affinity(cs_device_register(0x9940000), A57_3);
-  cs_device_set_affinity(cs_device_register(0x9A40000), A57_4);
-  cs_device_set_affinity(cs_device_register(0x9B40000), A57_5);
+  set_topology_affinity(register_topology_device(0x9840000), A57_0);
+  set_topology_affinity(register_topology_device(0x9940000), A57_3);
+  set_topology_affinity(register_topology_device(0x9A40000), A57_4);
+  set_topology_affinity(register_topology_device(0x9B40000), A57_5);
 
-  // cs_device_set_affinity(cs_device_register(0x9440000), Denver_0);
-  // cs_device_set_affinity(cs_device_register(0x9540000), Denver_1);
+  // set_topology_affinity(register_topology_device(0x9440000), Denver_0);
+  // set_topology_affinity(register_topology_device(0x9540000), Denver_1);
 
   /* funnels in A57 clusters */
-  funnel_a57 = cs_device_get(0x9010000);
-  cs_atb_register(cs_cpu_get_device(A57_0, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  0);
-  cs_atb_register(cs_cpu_get_device(A57_3, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  1);
-  cs_atb_register(cs_cpu_get_device(A57_4, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  2);
-  cs_atb_register(cs_cpu_get_device(A57_5, CS_DEVCLASS_SOURCE), 0, funnel_a57,
-                  3);
+  funnel_a57 = get_topology_device(0x9010000);
+  register_topology_atb(cs_cpu_get_device(A57_0, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 0);
+  register_topology_atb(cs_cpu_get_device(A57_3, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 1);
+  register_topology_atb(cs_cpu_get_device(A57_4, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 2);
+  register_topology_atb(cs_cpu_get_device(A57_5, CS_DEVCLASS_SOURCE), 0,
+                        funnel_a57, 3);
 
   /* setup for coresight major */
-  funnel_major = cs_device_get(0x8010000);
-  stm = cs_device_get(0x8070000);
-  etf = cs_device_get(0x8030000);
-  rep = cs_device_get(0x8040000);
-  etr = cs_device_get(0x8050000);
-  tpiu = cs_device_get(0x8060000);
+  funnel_major = get_topology_device(0x8010000);
+  stm = get_topology_device(0x8070000);
+  etf = get_topology_device(0x8030000);
+  rep = get_topology_device(0x8040000);
+  etr = get_topology_device(0x8050000);
+  tpiu = get_topology_device(0x8060000);
 
-  cs_atb_register(funnel_a57, 0, funnel_major, 0);
-  cs_atb_register(stm, 0, funnel_major, 3);
+  register_topology_atb(funnel_a57, 0, funnel_major, 0);
+  register_topology_atb(stm, 0, funnel_major, 3);
 
   /* implementing trace-bus connections according to
    * coresight-tools/top_rom_table.txt */
-  cs_atb_register(funnel_major, 0, etf, 0);
-  cs_atb_register(etf, 0, rep, 0);
-  cs_atb_register(rep, 1, etr, 0);
-  cs_atb_register(rep, 0, tpiu, 0);
+  register_topology_atb(funnel_major, 0, etf, 0);
+  register_topology_atb(etf, 0, rep, 0);
+  register_topology_atb(rep, 1, etr, 0);
+  register_topology_atb(rep, 0, tpiu, 0);
 
   devices->itm = stm;
   devices->etb = etr_mode ? etr : etf;
   devices->trace_sinks[0] = etr_mode ? etf : NULL;
 
   /* stm registration */
-  cs_stm_config_master(stm, 0, 0x0a000000);
-  cs_stm_select_master(stm, 0);
+  config_topology_stm_master(stm, 0, JETSON_TX2_STM_PORTS);
+  select_topology_stm_master(stm, 0);
 
   /* Connect system CTI to devices according to Table 136 in Parker TRM */
-  sys_cti = cs_device_register(0x8020000);
+  sys_cti = register_topology_device(0x8020000);
   /* etf */
-  cs_cti_connect_trigsrc(etf, CS_TRIGOUT_ETB_FULL, cs_cti_trigsrc(sys_cti, 0));
-  cs_cti_connect_trigsrc(etf, CS_TRIGOUT_ETB_ACQCOMP,
-                         cs_cti_trigsrc(sys_cti, 1));
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 0), etf, CS_TRIGIN_ETB_TRIGIN);
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 1), etf,
-                         CS_TRIGIN_ETB_FLUSHIN);
+  connect_topology_trigsrc(etf, CS_TRIGOUT_ETB_FULL, sys_cti, 0);
+  connect_topology_trigsrc(etf, CS_TRIGOUT_ETB_ACQCOMP, sys_cti, 1);
+  connect_topology_trigdst(sys_cti, 0, etf, CS_TRIGIN_ETB_TRIGIN);
+  connect_topology_trigdst(sys_cti, 1, etf, CS_TRIGIN_ETB_FLUSHIN);
   /* etr */
-  cs_cti_connect_trigsrc(etr, CS_TRIGOUT_ETB_FULL, cs_cti_trigsrc(sys_cti, 2));
-  cs_cti_connect_trigsrc(etr, CS_TRIGOUT_ETB_ACQCOMP,
-                         cs_cti_trigsrc(sys_cti, 3));
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 2), etr, CS_TRIGIN_ETB_TRIGIN);
-  cs_cti_connect_trigdst(cs_cti_trigdst(sys_cti, 3), etr,
-                         CS_TRIGIN_ETB_FLUSHIN);
+  connect_topology_trigsrc(etr, CS_TRIGOUT_ETB_FULL, sys_cti, 2);
+  connect_topology_trigsrc(etr, CS_TRIGOUT_ETB_ACQCOMP, sys_cti, 3);
+  connect_topology_trigdst(sys_cti, 2, etr, CS_TRIGIN_ETB_TRIGIN);
+  connect_topology_trigdst(sys_cti, 3, etr, CS_TRIGIN_ETB_FLUSHIN);
   /* stm */
-  cs_cti_connect_trigsrc(stm, CS_TRIGOUT_STM_ASYNCOUT,
-                         cs_cti_trigsrc(sys_cti, 4));
-  cs_cti_connect_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSPTE,
-                         cs_cti_trigsrc(sys_cti, 5));
-  cs_cti_connect_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSW,
-                         cs_cti_trigsrc(sys_cti, 6));
+  connect_topology_trigsrc(stm, CS_TRIGOUT_STM_ASYNCOUT, sys_cti, 4);
+  connect_topology_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSPTE, sys_cti, 5);
+  connect_topology_trigsrc(stm, CS_TRIGOUT_STM_TRIGOUTSW, sys_cti, 6);
   /* TPIU (should be here but the document says TPIU not supported) */
 
   /* There are A57x4 and denver cluster inside Parker SoC -
@@ -309,4 +310,36 @@ int get_trace_id(const char *hardware, int cpu)
   return -1;
 }
 
+/* Physical address of the stimulus ports of STM master 0. */
+unsigned long get_stm_ports(const char *hardware)
+{
+  if (strcmp(hardware, "Jetson TX2") == 0) {
+    return JETSON_TX2_STM_PORTS;
+  } else if (strcmp(hardware, "Jetson Nano") == 0) {
+    return JETSON_NANO_STM_PORTS;
+  }
+
+  return 0;
+}
+
+/* Physical window holding the ROM table and every CoreSight device. */
+int get_coresight_window(const char *hardware, unsigned long *base,
+                         unsigned long *size)
+{
+  if (strcmp(hardware, "Marvell ThunderX2") == 0) {
+    *base = THUNDERX2_CS_BASE;
+    *size = THUNDERX2_CS_SIZE;
+  } else if (strcmp(hardware, "Jetson TX2") == 0) {
+    *base = JETSON_TX2_CS_BASE;
+    *size = JETSON_TX2_CS_SIZE;
+  } else if (strcmp(hardware, "Jetson Nano") == 0) {
+    *base = JETSON_NANO_CS_BASE;
+    *size = JETSON_NANO_CS_SIZE;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
 #endif /* CS_TRACE_KNOWN_BOARDS_H */
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_PROFILE_H
+#define CS_TRACE_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm.h"
+#include "utils.h"
+
+#define PROFILE_SYNC_PERIOD 16 /* ETM A-sync every 2^16 bytes */
+#define PROFILE_SCAN_MAX 0x4000 /* Instructions without a branch */
+
+#define DEFAULT_FOLDED_NAME "cstrace.folded.txt"
+#define DEFAULT_CYCLES_NAME "cstrace.cycles.txt"
+#define DEFAULT_CYCLE_THRESHOLD 4
+#define CYCLE_HIST_BUCKETS 16
+#define DEFAULT_HISTORY_SIZE 4096 /* Taken branches kept in a history */
+#define DEFAULT_ANNOTATION_NAME "cstrace.annotations.txt"
+#define CONTEXT_PACKET_MAX 64 /* Longer than any packet the walker knows */
+#define CONTEXT_SYNC_MAX (12 + CONTEXT_PACKET_MAX) /* A-sync and trace info */
+
+typedef enum {
+  autofdo_profile, /* llvm-profgen unsymbolized profile */
+  bolt_profile,    /* BOLT pre-aggregated profile */
+  folded_profile,  /* Folded call stacks for flame graphs */
+  cycles_profile,  /* Cycles of basic blocks and edges */
+} profile_format_t;
+
+typedef enum {
+  insn_weight, /* Instructions run */
+  time_weight, /* Timestamp ticks */
+} stack_weight_t;
+
+typedef enum {
+  not_branch,
+  direct_branch,
+  indirect_branch,
+} branch_type_t;
+
+typedef enum {
+  not_call,
+  call_insn,
+  return_insn,
+} call_type_t;
+
+/* Counts of a pair of addresses, either a range run without taken branches
+ * or a taken branch. An entry with a zero count is empty. */
+struct profile_count {
+  unsigned long from;
+  unsigned long to;
+  unsigned long count;
+};
+
+struct profile_table {
+  struct profile_count *entries;
+  size_t size; /* Power of two */
+  size_t used;
+};
+
+/* A node of the call tree, which stands for the call stack from the root
+ * to it. */
+struct stack_node {
+  unsigned long addr;    /* Called address, or any address at a root */
+  long parent;           /* -1 at a root */
+  unsigned int depth;
+  unsigned long weight;  /* Self weight */
+  unsigned long pending; /* Instructions since the last timestamp */
+};
+
+struct call_tree {
+  stack_weight_t weight;
+  struct stack_node *nodes;
+  size_t size;
+  size_t used;
+  struct profile_table children; /* Parent and address to node index */
+  long *touched;                 /* Nodes with pending instructions */
+  size_t touched_size;
+  size_t touched_used;
+};
+
+/* Cycles of a basic block, from its first instruction to its branch. */
+struct block_cycles {
+  unsigned long start;
+  unsigned long end;
+  unsigned long count;
+  unsigned long cycles;
+  /* Executions by cycles. Bucket n > 0 counts [2^(n-1), 2^n) cycles and the
+   * last one everything above. */
+  unsigned long hist[CYCLE_HIST_BUCKETS];
+};
+
+/* A block run since the last cycle count. */
+struct cycle_sample {
+  long block;
+  unsigned long to; /* Next block, 0 while unknown */
+  unsigned long insns;
+};
+
+struct cycle_profile {
+  struct block_cycles *blocks;
+  size_t size;
+  size_t used;
+  struct profile_table index; /* Block start and end to block index */
+  struct profile_table edges; /* Cycles of the blocks leaving by an edge */
+  struct cycle_sample *pending;
+  size_t pending_size;
+  size_t pending_used;
+};
+
+/* A taken branch in trace order. */
+struct branch_record {
+  unsigned long from;
+  unsigned long to;
+};
+
+/* The last taken branches. Once full, the oldest is at head. */
+struct branch_history {
+  struct branch_record *records;
+  size_t size;
+  size_t head;
+  size_t count;
+};
+
+/* Only the trace between timestamps start and end is counted. */
+struct profile_window {
+  bool on;
+  unsigned long start;
+  unsigned long end;
+};
+
+struct profile {
+  struct profile_table ranges;
+  struct profile_table branches;
+  struct profile_window window;
+  struct call_tree stacks;     /* Only with init_profile_stacks() */
+  struct cycle_profile cycles; /* Only with init_profile_cycles() */
+  struct branch_history history; /* Only with init_profile_history() */
+  struct stm_annotations annotations; /* Only with decode_stm_annotations() */
+  unsigned long overflows;            /* Overflow packets seen */
+};
+
+struct profile_walker;
+
+/* Finds the packets carrying a context ID in the stream of a single trace
+ * ID, chunk by chunk. sync holds an A-sync and the last trace info packet,
+ * which bring a decoder joining the stream in sync. */
+struct context_scanner {
+  struct profile_walker *walker;
+  struct profile profile;
+  bool synced;
+  unsigned char sync[CONTEXT_SYNC_MAX];
+  size_t sync_len; /* 0 until a trace info packet is seen */
+};
+
+int parse_profile_format(const char *name, profile_format_t *format);
+branch_type_t get_branch_type(uint32_t insn, unsigned long pc,
+                              unsigned long *target);
+call_type_t get_call_type(uint32_t insn);
+int add_profile_count(struct profile_table *table, unsigned long from,
+                      unsigned long to, unsigned long count);
+const struct profile_count *find_profile_count(
+    const struct profile_table *table, unsigned long from, unsigned long to);
+int parse_stack_weight(const char *name, stack_weight_t *weight);
+int init_profile(struct profile *profile);
+void fini_profile(struct profile *profile);
+int init_profile_stacks(struct profile *profile, stack_weight_t weight);
+int init_profile_cycles(struct profile *profile);
+int init_profile_history(struct profile *profile, size_t size);
+int decode_profile(struct profile *profile, const void *buf, size_t size,
+                   const int *trace_ids, int trace_id_count,
+                   struct map_info *map_info, int map_info_num, int jobs);
+int export_profile(struct profile *profile, profile_format_t format,
+                   struct map_info *map_info, int map_info_num);
+int export_profile_history(struct profile *profile, const char *path,
+                           struct map_info *map_info, int map_info_num);
+int export_profile_annotations(struct profile *profile, const char *path,
+                               struct map_info *map_info, int map_info_num);
+unsigned long count_trace_overflows(const void *buf, size_t size,
+                                    const int *trace_ids, int trace_id_count);
+int init_context_scanner(struct context_scanner *scanner);
+void fini_context_scanner(struct context_scanner *scanner);
+void reset_context_scanner(struct context_scanner *scanner);
+size_t scan_trace_contexts(struct context_scanner *scanner,
+                           const unsigned char *stream, size_t size,
+                           void (*emit)(void *, size_t, unsigned long),
+                           void *arg);
+unsigned long get_history_signature(const struct profile *profile,
+                                    const struct map_info *map_info,
+                                    int map_info_num);
+
+#endif /* CS_TRACE_PROFILE_H */
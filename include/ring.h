@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_RING_H
+#define CS_TRACE_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#define TRACE_RING_NAME_FMT "/cs-trace-ring-%02x"
+#define TRACE_RING_MAGIC 0x52545343 /* "CSTR" */
+#define DEFAULT_TRACE_RING_SIZE 0x400000
+
+/* Single-producer single-consumer ring in POSIX shared memory. The sink owner
+ * writes the formatted trace of one trace ID and a tracer reads it. */
+struct trace_ring {
+  uint32_t magic;
+  uint32_t trace_id;
+  uint64_t size;              /* Power of two */
+  atomic_uint_least64_t head; /* Total bytes written */
+  atomic_uint_least64_t tail; /* Total bytes read */
+  atomic_uint_least64_t lost; /* Total bytes dropped on overflow or wrap */
+  atomic_uint flush_req;      /* Incremented by the reader */
+  atomic_uint flush_ack;      /* Set to flush_req by the writer */
+  unsigned char data[];
+};
+
+struct trace_ring *create_trace_ring(int trace_id, size_t size, uid_t owner);
+struct trace_ring *open_trace_ring(int trace_id);
+void close_trace_ring(struct trace_ring *ring);
+void unlink_trace_ring(int trace_id);
+void add_trace_ring_loss(struct trace_ring *ring, size_t size);
+size_t write_trace_ring(struct trace_ring *ring, const void *buf, size_t size);
+size_t read_trace_ring(struct trace_ring *ring, void *buf, size_t size);
+size_t get_trace_ring_unread(struct trace_ring *ring);
+int flush_trace_ring(struct trace_ring *ring);
+bool get_trace_ring_flush_req(struct trace_ring *ring, unsigned int *req);
+void ack_trace_ring_flush(struct trace_ring *ring, unsigned int req);
+
+#endif /* CS_TRACE_RING_H */
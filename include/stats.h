@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_STATS_H
+#define CS_TRACE_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_STATS_MAGIC 0x53545343 /* "CSTS" */
+#define TRACE_STATS_VERSION 3
+#define STATS_HIST_BUCKETS 32
+
+/* Steps of an execution whose latency is counted. */
+typedef enum {
+  enable_phase,  /* Enable the ETMs and sinks */
+  disable_phase, /* Stop or mark the session */
+  flush_phase,   /* Wait for the formatter to flush */
+  drain_phase,   /* Wait for the worker to drain the session */
+  fetch_phase,   /* Copy trace out of the sink */
+  decode_phase,  /* Decode a chunk into the bitmap */
+  relay_phase,   /* Round trip to the target forkserver */
+  exec_phase,    /* From the start of the target to its status */
+  trace_phase_count,
+} trace_phase_t;
+
+/* Trace that did not make it into the coverage of an execution. */
+typedef enum {
+  lost_bytes,    /* Known to be dropped before they were read */
+  sink_wraps,    /* Drains that found the sink wrapped */
+  etm_overflows, /* Overflow packets of the ETMs */
+  late_drains,   /* Drains that started well past their threshold */
+  trace_loss_count,
+} trace_loss_t;
+
+/* Latencies in system counter ticks. Bucket n > 0 counts [2^(n-1), 2^n)
+ * ticks and the last one everything above. */
+struct phase_stats {
+  atomic_uint_least64_t count;
+  atomic_uint_least64_t ticks;
+  atomic_uint_least64_t max;
+  atomic_uint_least64_t hist[STATS_HIST_BUCKETS];
+};
+
+/* Always counted. Placed in POSIX shared memory by open_trace_stats() so
+ * that other processes can read it. */
+struct trace_stats {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t frequency; /* System counter ticks per second */
+  int32_t pid;
+  uint32_t phase_count;
+  uint32_t loss_count;
+  uint32_t nooverflow; /* ETMs stall the CPU instead of overflowing */
+  atomic_uint_least64_t execs;
+  atomic_uint_least64_t lossy_execs; /* Executions with any loss */
+  atomic_uint_least64_t hung_execs;  /* Executions ended early as hung */
+  struct phase_stats phases[trace_phase_count];
+  atomic_uint_least64_t loss[trace_loss_count];      /* Since the start */
+  atomic_uint_least64_t last_loss[trace_loss_count]; /* Last execution */
+};
+
+extern struct trace_stats *trace_stats;
+
+const char *get_trace_phase_name(trace_phase_t phase);
+const char *get_trace_loss_name(trace_loss_t loss);
+int open_trace_stats(const char *name);
+const struct trace_stats *map_trace_stats(const char *name);
+void add_trace_stats(trace_phase_t phase, unsigned long start);
+void add_trace_loss(trace_loss_t loss, unsigned long count);
+bool count_trace_exec(void);
+void count_trace_hang(void);
+
+#endif /* CS_TRACE_STATS_H */
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_STM_H
+#define CS_TRACE_STM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STM_TRACE_ID 0x0f /* Below the ETM trace IDs, which start at 0x10 */
+#define STM_MARKER_CHANNEL 0 /* Session markers of AFLCS_STM_MARKERS */
+
+/* A value written to an STM channel, placed in an ETM stream by the bytes of
+ * the stream that came before it. */
+struct stm_annotation {
+  size_t offset;
+  unsigned int master;
+  unsigned int channel;
+  unsigned long value;
+  unsigned long pc; /* Decoded address at the annotation */
+  long node;        /* Call tree node at the annotation */
+  bool placed;
+};
+
+struct stm_annotations {
+  struct stm_annotation *entries;
+  size_t count;
+  size_t size;
+  size_t next;  /* The first one not placed yet */
+  int trace_id; /* ETM stream the annotations are placed in */
+  bool placing; /* Set while that stream is walked */
+};
+
+struct stp_parser;
+
+/* Follows the STM stream in formatted trace, chunk by chunk, to find markers
+ * written to one channel. */
+struct stm_marker_finder {
+  struct stp_parser *parser;
+  int cur_id; /* Trace ID carried across chunks */
+};
+
+int decode_stm_annotations(struct stm_annotations *annotations,
+                           const void *buf, size_t size, int stm_trace_id,
+                           int etm_trace_id);
+void fini_stm_annotations(struct stm_annotations *annotations);
+int init_stm_marker_finder(struct stm_marker_finder *finder, int stm_trace_id,
+                           unsigned int channel);
+void fini_stm_marker_finder(struct stm_marker_finder *finder);
+void reset_stm_marker_finder(struct stm_marker_finder *finder);
+size_t find_stm_marker(struct stm_marker_finder *finder, unsigned long marker,
+                       const void *buf, size_t size);
+
+#endif /* CS_TRACE_STM_H */
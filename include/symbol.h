@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_SYMBOL_H
+#define CS_TRACE_SYMBOL_H
+
+#include <stddef.h>
+
+#include "utils.h"
+
+#define SYMBOL_IMAGE_MAX 64
+
+/* A function symbol at its runtime address. */
+struct symbol {
+  unsigned long addr;
+  unsigned long size;
+  const char *name;
+};
+
+struct symbol_image {
+  void *buf;
+  size_t size;
+};
+
+struct symbol_table {
+  struct symbol *symbols;
+  size_t count;
+  struct symbol_image images[SYMBOL_IMAGE_MAX];
+  int image_count;
+};
+
+int load_symbol_table(struct symbol_table *table, struct map_info *map_info,
+                      int map_info_num);
+void free_symbol_table(struct symbol_table *table);
+const struct symbol *find_symbol(const struct symbol_table *table,
+                                 unsigned long addr);
+unsigned long get_load_bias(const struct map_info *map_info);
+
+#endif /* CS_TRACE_SYMBOL_H */
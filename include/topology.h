@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TOPOLOGY_H
+#define CS_TRACE_TOPOLOGY_H
+
+#include <stdbool.h>
+
+#include "csaccess.h"
+#include "csregistration.h"
+
+#define DEFAULT_TOPOLOGY_CACHE_DIR "/var/cache/cs-trace"
+#define DEFAULT_TOPOLOGY_CACHE_FMT DEFAULT_TOPOLOGY_CACHE_DIR "/topology-%s"
+#define TOPOLOGY_MAGIC 0x504f5443 /* "CTOP" */
+#define TOPOLOGY_VERSION 1
+#define TOPOLOGY_OP_MAX 1024
+#define TOPOLOGY_CPU_MAX 256
+
+extern bool topology_cache;
+extern char *topology_cache_path;
+
+/* Registration calls used by known boards. They forward to CSAL and, while
+ * a board is being registered, record the resolved device graph. */
+int register_topology_romtable(cs_physaddr_t addr);
+cs_device_t register_topology_device(cs_physaddr_t addr);
+cs_device_t get_topology_device(cs_physaddr_t addr);
+int set_topology_affinity(cs_device_t dev, unsigned int cpu);
+cs_device_t add_topology_replicator(unsigned int n_out_ports);
+int register_topology_atb(cs_device_t from, unsigned int from_port,
+                          cs_device_t to, unsigned int to_port);
+int connect_topology_trigsrc(cs_device_t dev, unsigned int dev_port,
+                             cs_device_t cti, unsigned int cti_port);
+int connect_topology_trigdst(cs_device_t cti, unsigned int cti_port,
+                             cs_device_t dev, unsigned int dev_port);
+int config_topology_stm_master(cs_device_t stm, unsigned int master,
+                               cs_physaddr_t addr);
+int select_topology_stm_master(cs_device_t stm, unsigned int master);
+
+int setup_cached_board(const char *board_name, const struct board **board,
+                       struct cs_devices_t *devices,
+                       const struct board *board_list);
+
+#endif /* CS_TRACE_TOPOLOGY_H */
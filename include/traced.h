@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_TRACED_H
+#define CS_TRACE_TRACED_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "utils.h"
+
+#define DEFAULT_TRACED_SOCKET_PATH "/run/cs-traced.sock"
+#define TRACED_RANGE_MAX 8
+
+/* Requests from tracers to cs-traced. A connection holds at most one lease,
+ * which is released when the connection is closed. */
+typedef enum {
+  traced_lease,
+  traced_release,
+  traced_configure,
+  traced_enable,
+  traced_disable,
+  traced_resume,
+  traced_suspend,
+} traced_cmd_t;
+
+struct traced_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+struct traced_request {
+  uint32_t cmd;
+  int32_t cpu; /* traced_lease: CPU to lease, or -1 for any */
+  int32_t pid; /* traced_configure: context ID to filter, or 0 */
+  int32_t range_count;
+  struct traced_range ranges[TRACED_RANGE_MAX];
+};
+
+struct traced_response {
+  int32_t ret;
+  int32_t cpu;
+  int32_t trace_id;
+};
+
+extern char *traced_socket_path;
+
+int connect_traced(void);
+void disconnect_traced(void);
+int lease_traced_cpu(int cpu, int *leased_cpu, int *trace_id);
+int configure_traced_source(struct map_info *range, int range_count,
+                            pid_t pid);
+int enable_traced_source(void);
+int disable_traced_source(void);
+int resume_traced_source(void);
+int suspend_traced_source(void);
+
+#endif /* CS_TRACE_TRACED_H */
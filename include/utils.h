@@ -39,17 +39,32 @@ struct mmap_params {
 void dump_buf(void *buf, size_t buf_size, const char *buf_path);
 void dump_maps(FILE *stream, pid_t pid);
 void dump_map_info(FILE *stream, struct map_info *map_info, int count);
+int read_map_info(pid_t pid, struct map_info **map_info, int info_count_max);
+int mmap_map_info(struct map_info *map_info, int count);
+void munmap_map_info(struct map_info *map_info, int count);
+bool is_same_map_info(struct map_info *a, int a_count, struct map_info *b,
+                      int b_count);
 int setup_map_info(pid_t pid, struct map_info **map_info, int info_count_max);
 int export_decoder_args(int trace_id, const char *trace_path,
                         const char *args_path, struct map_info *map_info,
                         int count);
+int import_decoder_args(const char *args_path, char *trace_path,
+                        int *trace_id, struct map_info **map_info);
+int import_map_offsets(const char *maps_path, struct map_info *map_info,
+                       int count);
 int get_preferred_cpu(pid_t pid);
 int find_free_cpu(void);
 int set_cpu_affinity(int cpu, pid_t pid);
+int set_cpu_list_affinity(const bool *cpus, int n_cpus, pid_t pid);
+int get_cpu_list_affinity(pid_t pid, bool *cpus, int n_cpus);
+int set_task_cpu_list_affinity(pid_t pid, const bool *cpus, int n_cpus);
 int set_pthread_cpu_affinity(int cpu, pthread_t thread);
 void read_pid_fd_path(pid_t pid, int fd, char *buf, size_t size);
 int get_mmap_params(pid_t pid, struct mmap_params *params);
+pid_t get_thread_group(pid_t tid);
 bool is_syscall_exit_group(pid_t pid);
 int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size);
+void *map_udmabuf(int udmabuf_num, size_t size);
+int parse_cpu_list(const char *str, bool *cpus, int n_cpus);
 
 #endif /* CS_TRACE_UTILS_H */
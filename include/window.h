@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef CS_TRACE_WINDOW_H
+#define CS_TRACE_WINDOW_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+#define DEFAULT_WINDOW_INDEX_NAME "cstrace.windows.txt"
+
+/* Trace window opened on entry to a function and closed on its exit. Both
+ * addresses are trapped with software breakpoints in the tracee, so every
+ * thread of it must be traced. */
+struct trace_window {
+  pid_t pid;
+  pid_t tid; /* Thread that opened the window */
+  unsigned long entry;
+  unsigned long exit;
+  unsigned long entry_insn; /* Original instruction words */
+  unsigned long exit_insn;
+  bool open;
+  unsigned int index;
+  struct timespec start;
+  FILE *index_fp;
+};
+
+int parse_trace_window(const char *spec, unsigned long *entry_addr,
+                       unsigned long *exit_addr);
+int insert_trace_window(struct trace_window *window, pid_t pid,
+                        unsigned long entry_addr, unsigned long exit_addr,
+                        struct map_info *map_info, int map_info_num);
+int handle_trace_window_stop(struct trace_window *window, pid_t pid);
+void finish_trace_window(struct trace_window *window);
+
+#endif /* CS_TRACE_WINDOW_H */
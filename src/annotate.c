@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "annotate.h"
+
+#define ANNOTATE_PORTS_SIZE (ANNOTATE_CHANNEL_MAX * ANNOTATE_PORT_SIZE)
+
+volatile uint8_t *annotate_ports = NULL;
+
+/* Map the stimulus ports of the STM master given by cs-trace. Without it,
+ * annotations are dropped. */
+int init_annotations(void)
+{
+  const char *env;
+  unsigned long addr;
+  void *ports;
+  int fd;
+
+  if (annotate_ports) {
+    return 0;
+  }
+
+  env = getenv(ANNOTATE_PORTS_ENV);
+  if (!env) {
+    return -1;
+  }
+  addr = strtoul(env, NULL, 0);
+  if (addr == 0) {
+    fprintf(stderr, "Invalid %s: %s\n", ANNOTATE_PORTS_ENV, env);
+    return -1;
+  }
+
+  fd = open("/dev/mem", O_RDWR | O_SYNC);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+  ports = mmap(NULL, ANNOTATE_PORTS_SIZE, PROT_WRITE, MAP_SHARED, fd,
+               (off_t)addr);
+  close(fd);
+  if (ports == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  annotate_ports = (volatile uint8_t *)ports;
+
+  return 0;
+}
+
+void fini_annotations(void)
+{
+  if (annotate_ports) {
+    munmap((void *)annotate_ports, ANNOTATE_PORTS_SIZE);
+    annotate_ports = NULL;
+  }
+}
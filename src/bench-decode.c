@@ -0,0 +1,610 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <libgen.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libcsdec.h"
+
+#include "clock.h"
+#include "common.h"
+#include "decoder.h"
+#include "utils.h"
+
+#define DEFAULT_BENCH_REPEAT 100
+#define DEFAULT_BENCH_WARMUP 1
+#define DEFAULT_TRACE_BITMAP_SIZE (1U << 16)
+#define BENCH_TRACE_INIT 16
+
+/* An exported trace with the images it was decoded against. */
+struct bench_trace {
+  char dir[PATH_MAX];
+  void *buf;
+  size_t size;
+  int trace_id;
+  int map_count;
+  struct map_info *map_info;
+  struct libcsdec_memory_image *mem_img;
+  struct libcsdec_memory_map *mem_map;
+};
+
+static struct bench_trace *traces = NULL;
+static int trace_count = 0;
+static int trace_size = 0;
+
+static unsigned char *trace_bitmap = NULL;
+static unsigned int trace_bitmap_size = DEFAULT_TRACE_BITMAP_SIZE;
+static int verbose = 0;
+
+/* Recorded paths are those of the traced board. A copy in the trace
+ * directory is used first so that a corpus can be moved to another host. */
+static int resolve_bench_path(const char *dir, const char *path, char *buf,
+                              size_t size)
+{
+  char name[PATH_MAX];
+
+  if (snprintf(name, sizeof(name), "%s", path) >= (int)sizeof(name)) {
+    fprintf(stderr, "Path is too long: %s\n", path);
+    return -1;
+  }
+  if (snprintf(buf, size, "%s/%s", dir, basename(name)) < (int)size &&
+      access(buf, R_OK) == 0) {
+    return 0;
+  }
+  if (snprintf(buf, size, "%s", path) >= (int)size) {
+    fprintf(stderr, "Path is too long: %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int read_bench_file(const char *path, void **buf, size_t *size)
+{
+  struct stat st;
+  ssize_t n;
+  size_t done;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    perror("open");
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  *size = (size_t)st.st_size;
+  *buf = malloc(*size ? *size : 1);
+  if (!*buf) {
+    perror("malloc");
+    close(fd);
+    return -1;
+  }
+
+  for (done = 0; done < *size; done += (size_t)n) {
+    n = read(fd, (char *)*buf + done, *size - done);
+    if (n <= 0) {
+      perror("read");
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+
+  return 0;
+}
+
+static int map_bench_images(struct bench_trace *trace)
+{
+  char path[PATH_MAX];
+  struct map_info *info;
+  size_t size;
+  void *buf;
+  int fd;
+  int i;
+
+  for (i = 0; i < trace->map_count; i++) {
+    info = &trace->map_info[i];
+    if (resolve_bench_path(trace->dir, info->path, path, sizeof(path)) < 0) {
+      return -1;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0) {
+      fprintf(stderr, "Image %s is not found\n", info->path);
+      return -1;
+    }
+    size = (size_t)ALIGN_UP(info->end - info->start, PAGE_SIZE);
+    buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, info->offset);
+    close(fd);
+    if (buf == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+    }
+    info->buf = buf;
+  }
+
+  trace->mem_img = alloc_decoder_images(trace->map_info, trace->map_count);
+  trace->mem_map = alloc_decoder_maps(trace->map_info, trace->map_count);
+  if (!trace->mem_img || !trace->mem_map) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_bench_trace(struct bench_trace *trace)
+{
+  int i;
+
+  for (i = 0; trace->map_info && i < trace->map_count; i++) {
+    if (trace->map_info[i].buf) {
+      munmap(trace->map_info[i].buf,
+             (size_t)ALIGN_UP(trace->map_info[i].end - trace->map_info[i].start,
+                              PAGE_SIZE));
+    }
+  }
+  free(trace->map_info);
+  free(trace->mem_img);
+  free(trace->mem_map);
+  free(trace->buf);
+  memset(trace, 0, sizeof(*trace));
+}
+
+/* Load a trace directory written by cs-trace --export. */
+static int load_bench_trace(const char *dir, struct bench_trace *trace)
+{
+  char path[PATH_MAX];
+  char trace_path[PATH_MAX];
+  int ret;
+
+  ret = -1;
+  memset(trace, 0, sizeof(*trace));
+  if (snprintf(trace->dir, sizeof(trace->dir), "%s", dir) >=
+          (int)sizeof(trace->dir) ||
+      snprintf(path, sizeof(path), "%s/%s", dir, DEFAULT_TRACE_ARGS_NAME) >=
+          (int)sizeof(path)) {
+    fprintf(stderr, "Path is too long: %s\n", dir);
+    return -1;
+  }
+
+  trace->map_count = import_decoder_args(path, trace_path, &trace->trace_id,
+                                         &trace->map_info);
+  if (trace->map_count < 0) {
+    trace->map_count = 0;
+    goto exit;
+  }
+
+  /* Without the map dump of cs-trace, each mapping is assumed to start at
+   * the beginning of its image. */
+  if (snprintf(path, sizeof(path), "%s/%s", dir, DEFAULT_TRACE_MAPS_NAME) <
+      (int)sizeof(path)) {
+    import_map_offsets(path, trace->map_info, trace->map_count);
+  }
+
+  if (resolve_bench_path(dir, trace_path, path, sizeof(path)) < 0 ||
+      read_bench_file(path, &trace->buf, &trace->size) < 0 ||
+      map_bench_images(trace) < 0) {
+    goto exit;
+  }
+
+  ret = 0;
+
+exit:
+  if (ret < 0) {
+    free_bench_trace(trace);
+  }
+
+  return ret;
+}
+
+static int add_bench_trace(const char *dir)
+{
+  struct bench_trace *new_traces;
+  int size;
+
+  if (trace_count == trace_size) {
+    size = trace_size ? trace_size * 2 : BENCH_TRACE_INIT;
+    new_traces = realloc(traces, size * sizeof(struct bench_trace));
+    if (!new_traces) {
+      perror("realloc");
+      return -1;
+    }
+    traces = new_traces;
+    trace_size = size;
+  }
+
+  if (load_bench_trace(dir, &traces[trace_count]) < 0) {
+    fprintf(stderr, "Skipped %s\n", dir);
+    return 0;
+  }
+  trace_count++;
+
+  return 0;
+}
+
+static bool is_trace_dir(const char *dir)
+{
+  char path[PATH_MAX];
+
+  if (snprintf(path, sizeof(path), "%s/%s", dir, DEFAULT_TRACE_ARGS_NAME) >=
+      (int)sizeof(path)) {
+    return false;
+  }
+
+  return access(path, R_OK) == 0;
+}
+
+/* A corpus is a trace directory, or a directory of them such as the trace
+ * directory of make trace. */
+static int load_bench_corpus(const char *dir)
+{
+  struct dirent **entries;
+  char path[PATH_MAX];
+  int count;
+  int ret;
+  int i;
+
+  if (is_trace_dir(dir)) {
+    return add_bench_trace(dir);
+  }
+
+  if ((count = scandir(dir, &entries, NULL, alphasort)) < 0) {
+    perror("scandir");
+    return -1;
+  }
+
+  ret = 0;
+  for (i = 0; i < count; i++) {
+    if (ret == 0 && entries[i]->d_name[0] != '.' &&
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name) <
+            (int)sizeof(path)) {
+      if (is_trace_dir(path)) {
+        ret = add_bench_trace(path);
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+
+  return ret;
+}
+
+/* Print the rate and latencies of count sorted executions. */
+static void print_bench_result(cov_type_t type, const unsigned long *latency,
+                               size_t count, size_t bytes,
+                               unsigned long total_ns, const char *label)
+{
+  printf("%-4s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %s\n",
+         type == path_cov ? "path" : "edge", count,
+         (double)bytes / ((double)total_ns / 1e9) / 1e6,
+         (double)count / ((double)total_ns / 1e9),
+         get_latency_quantile(latency, count, 0.5),
+         get_latency_quantile(latency, count, 0.9),
+         get_latency_quantile(latency, count, 0.99),
+         (double)latency[count - 1] / 1e3, label);
+}
+
+/* Decode every trace repeat times as one execution each, from the decoder
+ * reset of the execution to the end of its trace. */
+static int bench_decoder(cov_type_t type, int repeat, int warmup)
+{
+  unsigned long *latency;
+  unsigned long start;
+  unsigned long total_ns, trace_ns;
+  size_t total_bytes, trace_bytes;
+  size_t count;
+  size_t first;
+  libcsdec_t decoder;
+  int i, j;
+
+  latency = malloc((size_t)trace_count * repeat * sizeof(unsigned long));
+  if (!latency) {
+    perror("malloc");
+    return -1;
+  }
+
+  count = 0;
+  total_ns = 0;
+  total_bytes = 0;
+  for (i = 0; i < trace_count; i++) {
+    if (!(decoder = init_cov_decoder(type, trace_bitmap, trace_bitmap_size,
+                                     traces[i].map_count,
+                                     traces[i].mem_img))) {
+      fprintf(stderr, "init_cov_decoder() failed for %s\n", traces[i].dir);
+      continue;
+    }
+
+    first = count;
+    trace_ns = 0;
+    trace_bytes = 0;
+    for (j = 0; j < warmup + repeat; j++) {
+      memset(trace_bitmap, 0, trace_bitmap_size);
+      start = get_monotonic_ns();
+      if (reset_cov_decoder(type, decoder, traces[i].trace_id,
+                            traces[i].map_count, traces[i].mem_map) < 0 ||
+          run_cov_decoder(type, decoder, traces[i].buf, traces[i].size) < 0) {
+        fprintf(stderr, "run_cov_decoder() failed for %s\n", traces[i].dir);
+        count = first;
+        break;
+      }
+      if (j < warmup) {
+        continue;
+      }
+      latency[count] = get_monotonic_ns() - start;
+      trace_ns += latency[count];
+      trace_bytes += traces[i].size;
+      count++;
+    }
+    fini_cov_decoder(type, decoder);
+
+    if (count == first) {
+      continue;
+    }
+    total_ns += trace_ns;
+    total_bytes += trace_bytes;
+    if (verbose > 0) {
+      qsort(&latency[first], count - first, sizeof(unsigned long),
+            compare_latency);
+      print_bench_result(type, &latency[first], count - first, trace_bytes,
+                         trace_ns, traces[i].dir);
+    }
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "No trace was decoded\n");
+    free(latency);
+    return -1;
+  }
+
+  qsort(latency, count, sizeof(unsigned long), compare_latency);
+  print_bench_result(type, latency, count, total_bytes, total_ns, "all");
+  fflush(stdout);
+
+  free(latency);
+
+  return 0;
+}
+
+/* Count the distinct edges synth-trace expects the decoder to find. */
+static int count_bench_edges(const char *dir, size_t *count)
+{
+  char path[PATH_MAX];
+  char line[128];
+  FILE *fp;
+
+  if (snprintf(path, sizeof(path), "%s/%s", dir, DEFAULT_TRACE_EDGES_NAME) >=
+      (int)sizeof(path)) {
+    fprintf(stderr, "Path is too long: %s\n", dir);
+    return -1;
+  }
+  fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+
+  *count = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] != '\n') {
+      (*count)++;
+    }
+  }
+  fclose(fp);
+
+  return 0;
+}
+
+/* Decode each synthetic trace once in edge mode and check that the bitmap
+ * has a slot for each expected edge. Edges that share a slot are counted
+ * once, so the bitmap should be large enough to keep them apart. */
+static int check_decoder(void)
+{
+  libcsdec_t decoder;
+  size_t expected;
+  size_t decoded;
+  unsigned int j;
+  int checked;
+  int ret;
+  int i;
+
+  ret = 0;
+  checked = 0;
+  for (i = 0; i < trace_count; i++) {
+    if (count_bench_edges(traces[i].dir, &expected) < 0) {
+      fprintf(stderr, "No expected edges in %s\n", traces[i].dir);
+      continue;
+    }
+    if (!(decoder = init_cov_decoder(edge_cov, trace_bitmap,
+                                     trace_bitmap_size, traces[i].map_count,
+                                     traces[i].mem_img))) {
+      fprintf(stderr, "init_cov_decoder() failed for %s\n", traces[i].dir);
+      ret = -1;
+      continue;
+    }
+
+    memset(trace_bitmap, 0, trace_bitmap_size);
+    if (reset_cov_decoder(edge_cov, decoder, traces[i].trace_id,
+                          traces[i].map_count, traces[i].mem_map) < 0 ||
+        run_cov_decoder(edge_cov, decoder, traces[i].buf, traces[i].size) <
+            0) {
+      fprintf(stderr, "run_cov_decoder() failed for %s\n", traces[i].dir);
+      fini_cov_decoder(edge_cov, decoder);
+      ret = -1;
+      continue;
+    }
+    fini_cov_decoder(edge_cov, decoder);
+
+    decoded = 0;
+    for (j = 0; j < trace_bitmap_size; j++) {
+      if (trace_bitmap[j]) {
+        decoded++;
+      }
+    }
+    printf("check: %zu edges expected, %zu decoded %s %s\n", expected,
+           decoded, decoded == expected ? "ok" : "MISMATCH", traces[i].dir);
+    if (decoded != expected) {
+      ret = -1;
+    }
+    checked++;
+  }
+
+  if (checked == 0) {
+    fprintf(stderr, "No trace was checked\n");
+    return -1;
+  }
+
+  return ret;
+}
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS] DIR...\n", argv0);
+  fprintf(stderr,
+          "Measure the decoder over traces exported by cs-trace --export\n");
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr,
+          "  -d, --decoding={edge,path}\tdecode only this coverage type "
+          "(default: both)\n");
+  fprintf(stderr,
+          "  -r, --repeat=INT\t\texecutions per trace (default: %d)\n",
+          DEFAULT_BENCH_REPEAT);
+  fprintf(stderr,
+          "  -w, --warmup=INT\t\tuntimed executions per trace first "
+          "(default: %d)\n",
+          DEFAULT_BENCH_WARMUP);
+  fprintf(stderr,
+          "  -b, --bitmap-size=SIZE\tcoverage bitmap size (default: %#x)\n",
+          DEFAULT_TRACE_BITMAP_SIZE);
+  fprintf(stderr, "  -c, --check\t\t\tcompare the edges of synth-trace "
+                  "traces instead\n");
+  fprintf(stderr, "  -v, --verbose\t\t\tshow the results of each trace too\n");
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"decoding", required_argument, NULL, 'd'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"warmup", required_argument, NULL, 'w'},
+      {"bitmap-size", required_argument, NULL, 'b'},
+      {"check", no_argument, NULL, 'c'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  bool edge_on, path_on;
+  bool check;
+  int repeat, warmup;
+  int ret;
+  int opt;
+  int option_index;
+  int i;
+
+  edge_on = true;
+  path_on = true;
+  repeat = DEFAULT_BENCH_REPEAT;
+  warmup = DEFAULT_BENCH_WARMUP;
+  check = false;
+
+  while ((opt = getopt_long(argc, argv, "d:r:w:b:cvh", long_options,
+                            &option_index)) != -1) {
+    switch (opt) {
+      case 'd':
+        if (!strcmp(optarg, "edge")) {
+          path_on = false;
+        } else if (!strcmp(optarg, "path")) {
+          edge_on = false;
+        } else {
+          usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'r':
+        repeat = atoi(optarg);
+        break;
+      case 'w':
+        warmup = atoi(optarg);
+        break;
+      case 'b':
+        trace_bitmap_size = (unsigned int)strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        check = true;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc || repeat <= 0 || warmup < 0 || trace_bitmap_size == 0) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = optind; i < argc; i++) {
+    if (load_bench_corpus(argv[i]) < 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (trace_count == 0) {
+    fprintf(stderr, "No trace is found\n");
+    exit(EXIT_FAILURE);
+  }
+
+  trace_bitmap = malloc(trace_bitmap_size);
+  if (!trace_bitmap) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  ret = 0;
+  if (check) {
+    ret = check_decoder();
+    goto exit;
+  }
+
+  printf("%-4s %8s %10s %10s %10s %10s %10s %10s %s\n", "mode", "execs",
+         "MB/s", "execs/s", "p50_us", "p90_us", "p99_us", "max_us", "trace");
+
+  if (edge_on && bench_decoder(edge_cov, repeat, warmup) < 0) {
+    ret = -1;
+  }
+  if (path_on && bench_decoder(path_cov, repeat, warmup) < 0) {
+    ret = -1;
+  }
+
+exit:
+
+  for (i = 0; i < trace_count; i++) {
+    free_bench_trace(&traces[i]);
+  }
+  free(traces);
+  free(trace_bitmap);
+
+  return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
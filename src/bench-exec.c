@@ -0,0 +1,502 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "afl/config.h"
+#include "afl/types.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "clock.h"
+
+#define DEFAULT_BENCH_EXECS 1000
+#define DEFAULT_BENCH_WARMUP 1
+#define DEFAULT_BENCH_TIMEOUT 1000 /* Milliseconds */
+#define INIT_TIMEOUT_SCALE 10      /* The first exec initializes the trace */
+#define INPUT_PATH_ARG "@@"
+
+/* Fork server side of afl-fuzz, enough to drive cs-proxy. */
+struct forkserver {
+  pid_t pid;
+  int ctl_fd;
+  int st_fd;
+  int shm_id;
+  unsigned char *trace_bits;
+  unsigned int map_size;
+  int input_fd; /* Stdin of the target when it takes no path */
+  unsigned int timeout;
+};
+
+/* Bitmap bytes as afl-fuzz compares them for stability. */
+struct stability {
+  unsigned char *first;
+  bool *touched;
+  bool *variable;
+  bool taken;
+};
+
+static int verbose = 0;
+
+/* Hit count classes of afl-fuzz. */
+static unsigned char classify_count(unsigned char count)
+{
+  if (count <= 3) {
+    return count == 3 ? 4 : count;
+  }
+  if (count <= 7) {
+    return 8;
+  }
+  if (count <= 15) {
+    return 16;
+  }
+  if (count <= 31) {
+    return 32;
+  }
+
+  return count <= 127 ? 64 : 128;
+}
+
+/* Read a status word, or fail after timeout milliseconds. */
+static int read_status(int fd, s32 *status, unsigned int timeout)
+{
+  struct pollfd pfd;
+  int ret;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  ret = poll(&pfd, 1, (int)timeout);
+  if (ret < 0) {
+    perror("poll");
+    return -1;
+  }
+  if (ret == 0) {
+    return 1;
+  }
+  if (read(fd, status, 4) != 4) {
+    fprintf(stderr, "Fork server is gone\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int init_trace_bits(struct forkserver *fsrv)
+{
+  char id_str[16];
+
+  fsrv->shm_id = shmget(IPC_PRIVATE, fsrv->map_size,
+                        IPC_CREAT | IPC_EXCL | 0600);
+  if (fsrv->shm_id < 0) {
+    perror("shmget");
+    return -1;
+  }
+  fsrv->trace_bits = shmat(fsrv->shm_id, NULL, 0);
+  if (fsrv->trace_bits == (void *)-1) {
+    perror("shmat");
+    shmctl(fsrv->shm_id, IPC_RMID, NULL);
+    return -1;
+  }
+
+  snprintf(id_str, sizeof(id_str), "%d", fsrv->shm_id);
+  setenv(SHM_ENV_VAR, id_str, 1);
+
+  return 0;
+}
+
+static void fini_trace_bits(struct forkserver *fsrv)
+{
+  shmdt(fsrv->trace_bits);
+  shmctl(fsrv->shm_id, IPC_RMID, NULL);
+}
+
+/* Check the options of the hello message as afl-fuzz does. */
+static int check_forkserver_options(struct forkserver *fsrv, u32 status)
+{
+  unsigned int map_size;
+
+  if ((status & FS_OPT_ERROR) == FS_OPT_ERROR) {
+    fprintf(stderr, "Fork server failed with error 0x%x\n",
+            FS_OPT_GET_ERROR(status));
+    return -1;
+  }
+  if ((status & FS_OPT_ENABLED) != FS_OPT_ENABLED) {
+    return 0;
+  }
+
+  if ((status & FS_OPT_SHDMEM_FUZZ) || (status & FS_OPT_AUTODICT) ==
+                                          FS_OPT_AUTODICT) {
+    fprintf(stderr, "Shared memory test cases and dictionaries are not "
+                    "supported\n");
+    return -1;
+  }
+  if (status & FS_OPT_MAPSIZE) {
+    map_size = FS_OPT_GET_MAPSIZE(status);
+    if (map_size > fsrv->map_size) {
+      fprintf(stderr, "Fork server needs a map of %u bytes, set --map-size\n",
+              map_size);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int start_forkserver(struct forkserver *fsrv, char *argv[])
+{
+  int st_pipe[2], ctl_pipe[2];
+  u32 status;
+
+  if (pipe(st_pipe) || pipe(ctl_pipe)) {
+    perror("pipe");
+    return -1;
+  }
+
+  fsrv->pid = fork();
+  if (fsrv->pid < 0) {
+    perror("fork");
+    return -1;
+  }
+
+  if (!fsrv->pid) {
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0 ||
+        dup2(st_pipe[1], FORKSRV_FD + 1) < 0) {
+      perror("dup2");
+      _exit(EXIT_FAILURE);
+    }
+    if (fsrv->input_fd >= 0 && dup2(fsrv->input_fd, STDIN_FILENO) < 0) {
+      perror("dup2");
+      _exit(EXIT_FAILURE);
+    }
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    execvp(argv[0], argv);
+    perror("execvp");
+    _exit(EXIT_FAILURE);
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+  fsrv->ctl_fd = ctl_pipe[1];
+  fsrv->st_fd = st_pipe[0];
+
+  if (read_status(fsrv->st_fd, (s32 *)&status,
+                  fsrv->timeout * INIT_TIMEOUT_SCALE) != 0) {
+    fprintf(stderr, "No hello from the fork server\n");
+    return -1;
+  }
+
+  return check_forkserver_options(fsrv, status);
+}
+
+/* Close the control pipe so that the fork server finishes the trace, and
+ * wait for it. */
+static void stop_forkserver(struct forkserver *fsrv)
+{
+  close(fsrv->ctl_fd);
+  close(fsrv->st_fd);
+  waitpid(fsrv->pid, NULL, 0);
+}
+
+/* Run one exec as afl-fuzz does. Returns 1 on a timeout. */
+static int run_forkserver(struct forkserver *fsrv, s32 *status,
+                          bool *was_killed, unsigned int timeout)
+{
+  s32 child_pid;
+  s32 killed;
+  int ret;
+
+  memset(fsrv->trace_bits, 0, fsrv->map_size);
+  if (fsrv->input_fd >= 0) {
+    lseek(fsrv->input_fd, 0, SEEK_SET);
+  }
+
+  killed = *was_killed;
+  if (write(fsrv->ctl_fd, &killed, 4) != 4) {
+    fprintf(stderr, "Fork server is gone\n");
+    return -1;
+  }
+  if (read_status(fsrv->st_fd, &child_pid, timeout) != 0 || child_pid <= 0) {
+    fprintf(stderr, "Fork server failed to start a child\n");
+    return -1;
+  }
+
+  *was_killed = false;
+  if ((ret = read_status(fsrv->st_fd, status, timeout)) < 0) {
+    return -1;
+  }
+  if (ret > 0) {
+    kill(child_pid, SIGKILL);
+    *was_killed = true;
+    if (read_status(fsrv->st_fd, status, timeout) != 0) {
+      return -1;
+    }
+  }
+
+  return ret;
+}
+
+static int init_stability(struct stability *stab, unsigned int map_size)
+{
+  stab->first = calloc(map_size, 1);
+  stab->touched = calloc(map_size, sizeof(bool));
+  stab->variable = calloc(map_size, sizeof(bool));
+  stab->taken = false;
+  if (!stab->first || !stab->touched || !stab->variable) {
+    perror("calloc");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void update_stability(struct stability *stab,
+                             const unsigned char *trace_bits,
+                             unsigned int map_size)
+{
+  unsigned char count;
+  unsigned int i;
+
+  for (i = 0; i < map_size; i++) {
+    count = classify_count(trace_bits[i]);
+    if (!stab->taken) {
+      stab->first[i] = count;
+    } else if (count != stab->first[i]) {
+      stab->variable[i] = true;
+    }
+    stab->touched[i] |= count != 0;
+  }
+  stab->taken = true;
+}
+
+/* Share of the touched bytes that were the same in every exec. */
+static double get_stability(const struct stability *stab,
+                            unsigned int map_size, unsigned int *touched)
+{
+  unsigned int variable;
+  unsigned int i;
+
+  *touched = 0;
+  variable = 0;
+  for (i = 0; i < map_size; i++) {
+    *touched += stab->touched[i];
+    variable += stab->variable[i];
+  }
+
+  return *touched ? 100.0 * (1.0 - (double)variable / *touched) : 100.0;
+}
+
+static void fini_stability(struct stability *stab)
+{
+  free(stab->first);
+  free(stab->touched);
+  free(stab->variable);
+}
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS] -- PROXY [ARGS]\n", argv0);
+  fprintf(stderr,
+          "Drive a fork server such as cs-proxy as afl-fuzz does and measure "
+          "it\n");
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr, "  -n, --execs=INT\t\texecs to measure (default: %d)\n",
+          DEFAULT_BENCH_EXECS);
+  fprintf(stderr,
+          "  -w, --warmup=INT\t\tuntimed execs first (default: %d)\n",
+          DEFAULT_BENCH_WARMUP);
+  fprintf(stderr,
+          "  -i, --input=FILE\t\ttest case given as " INPUT_PATH_ARG
+          " or stdin (default: empty)\n");
+  fprintf(stderr,
+          "  -t, --timeout=MS\t\ttimeout of an exec (default: %d)\n",
+          DEFAULT_BENCH_TIMEOUT);
+  fprintf(stderr, "  -m, --map-size=SIZE\t\tcoverage map size (default: %#x)\n",
+          MAP_SIZE);
+  fprintf(stderr, "  -v, --verbose\t\t\tshow the status of each exec\n");
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"execs", required_argument, NULL, 'n'},
+      {"warmup", required_argument, NULL, 'w'},
+      {"input", required_argument, NULL, 'i'},
+      {"timeout", required_argument, NULL, 't'},
+      {"map-size", required_argument, NULL, 'm'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  struct forkserver fsrv;
+  struct stability stab;
+  char input_path[PATH_MAX];
+  char map_size_str[16];
+  unsigned long *latency;
+  unsigned long start, total_ns;
+  unsigned long crashes, timeouts;
+  unsigned int touched;
+  double stability;
+  unsigned int timeout;
+  bool was_killed;
+  bool path_arg;
+  char *input;
+  int execs, warmup;
+  s32 status;
+  int ret;
+  int opt;
+  int option_index;
+  int i;
+
+  execs = DEFAULT_BENCH_EXECS;
+  warmup = DEFAULT_BENCH_WARMUP;
+  input = NULL;
+  memset(&fsrv, 0, sizeof(fsrv));
+  fsrv.map_size = MAP_SIZE;
+  fsrv.timeout = DEFAULT_BENCH_TIMEOUT;
+  fsrv.input_fd = -1;
+
+  while ((opt = getopt_long(argc, argv, "n:w:i:t:m:vh", long_options,
+                            &option_index)) != -1) {
+    switch (opt) {
+      case 'n':
+        execs = atoi(optarg);
+        break;
+      case 'w':
+        warmup = atoi(optarg);
+        break;
+      case 'i':
+        input = optarg;
+        break;
+      case 't':
+        fsrv.timeout = (unsigned int)atoi(optarg);
+        break;
+      case 'm':
+        fsrv.map_size = (unsigned int)strtoul(optarg, NULL, 0);
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc || execs <= 0 || warmup < 0 || fsrv.timeout == 0 ||
+      fsrv.map_size == 0) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  /* The test case never changes, so it is passed as is. */
+  if (!realpath(input ? input : "/dev/null", input_path)) {
+    perror("realpath");
+    exit(EXIT_FAILURE);
+  }
+  path_arg = false;
+  for (i = optind; i < argc; i++) {
+    if (!strcmp(argv[i], INPUT_PATH_ARG)) {
+      argv[i] = input_path;
+      path_arg = true;
+    }
+  }
+  if (!path_arg && (fsrv.input_fd = open(input_path, O_RDONLY)) < 0) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+
+  snprintf(map_size_str, sizeof(map_size_str), "%u", fsrv.map_size);
+  setenv("AFL_MAP_SIZE", map_size_str, 1);
+
+  latency = malloc((size_t)execs * sizeof(unsigned long));
+  if (!latency || init_stability(&stab, fsrv.map_size) < 0) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  if (init_trace_bits(&fsrv) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  ret = -1;
+  if (start_forkserver(&fsrv, &argv[optind]) < 0) {
+    goto exit;
+  }
+
+  was_killed = false;
+  crashes = 0;
+  timeouts = 0;
+  total_ns = 0;
+  for (i = 0; i < warmup + execs; i++) {
+    /* The first exec sets up the trace for the target. */
+    timeout = i == 0 ? fsrv.timeout * INIT_TIMEOUT_SCALE : fsrv.timeout;
+    start = get_monotonic_ns();
+    if (run_forkserver(&fsrv, &status, &was_killed, timeout) < 0) {
+      goto exit;
+    }
+    if (i < warmup) {
+      continue;
+    }
+
+    latency[i - warmup] = get_monotonic_ns() - start;
+    total_ns += latency[i - warmup];
+    if (was_killed) {
+      timeouts++;
+    } else if (WIFSIGNALED(status)) {
+      crashes++;
+    }
+    update_stability(&stab, fsrv.trace_bits, fsrv.map_size);
+
+    if (verbose > 0) {
+      printf("exec %d status 0x%x %.1f us%s\n", i - warmup, status,
+             (double)latency[i - warmup] / 1e3, was_killed ? " timeout" : "");
+    }
+  }
+
+  qsort(latency, (size_t)execs, sizeof(unsigned long), compare_latency);
+  printf("execs %d (%.1f/s), %lu crashes, %lu timeouts\n", execs,
+         (double)execs / ((double)total_ns / 1e9), crashes, timeouts);
+  printf("latency_us p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+         get_latency_quantile(latency, (size_t)execs, 0.5),
+         get_latency_quantile(latency, (size_t)execs, 0.9),
+         get_latency_quantile(latency, (size_t)execs, 0.99),
+         (double)latency[execs - 1] / 1e3);
+  stability = get_stability(&stab, fsrv.map_size, &touched);
+  printf("stability %.2f%% of %u map bytes\n", stability, touched);
+
+  ret = 0;
+
+exit:
+  if (fsrv.pid > 0) {
+    stop_forkserver(&fsrv);
+  }
+  fini_trace_bits(&fsrv);
+  fini_stability(&stab);
+  free(latency);
+
+  return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+
+#define CLOCK_SAMPLE_TRIAL 8
+#define CLOCK_DRAIN_INIT 0x100
+
+unsigned long read_system_counter(void)
+{
+#if defined(__aarch64__)
+  unsigned long value;
+
+  __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(value)::"memory");
+  return value;
+#else
+  return 0;
+#endif
+}
+
+unsigned long read_system_counter_frequency(void)
+{
+#if defined(__aarch64__)
+  unsigned long value;
+
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(value));
+  return value;
+#else
+  return 0;
+#endif
+}
+
+unsigned long get_monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+int compare_latency(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+
+  if (x != y) {
+    return x < y ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/* Nearest-rank q-quantile of sorted latencies in nanoseconds, in
+ * microseconds. */
+double get_latency_quantile(const unsigned long *latency, size_t count,
+                            double q)
+{
+  size_t rank;
+
+  rank = (size_t)(q * (double)count + 0.999999);
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  return (double)latency[rank - 1] / 1e3;
+}
+
+/* Read the counter between two clock reads. The read with the shortest gap
+ * is kept and placed at the middle of it. */
+int sample_trace_clock(struct clock_sample *sample)
+{
+  unsigned long before, after, counter;
+  unsigned long gap;
+  int i;
+
+  gap = ~0UL;
+  for (i = 0; i < CLOCK_SAMPLE_TRIAL; i++) {
+    before = get_monotonic_ns();
+    counter = read_system_counter();
+    after = get_monotonic_ns();
+    if (after - before < gap) {
+      gap = after - before;
+      sample->counter = counter;
+      sample->monotonic_ns = before + gap / 2;
+    }
+  }
+
+  return sample->counter > 0 ? 0 : -1;
+}
+
+int init_trace_clock(struct trace_clock *clock)
+{
+  memset(clock, 0, sizeof(*clock));
+
+  clock->frequency = read_system_counter_frequency();
+  if (clock->frequency == 0 || sample_trace_clock(&clock->start) < 0) {
+    fprintf(stderr, "System counter is not available\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void fini_trace_clock(struct trace_clock *clock)
+{
+  free(clock->drains);
+  memset(clock, 0, sizeof(*clock));
+}
+
+int add_trace_clock_drain(struct trace_clock *clock, size_t offset)
+{
+  struct clock_drain *drains;
+  size_t size;
+
+  if (clock->drain_count == clock->drain_size) {
+    size = clock->drain_size ? clock->drain_size * 2 : CLOCK_DRAIN_INIT;
+    drains = realloc(clock->drains, size * sizeof(struct clock_drain));
+    if (!drains) {
+      perror("realloc");
+      return -1;
+    }
+    clock->drains = drains;
+    clock->drain_size = size;
+  }
+
+  clock->drains[clock->drain_count].offset = offset;
+  if (sample_trace_clock(&clock->drains[clock->drain_count].sample) < 0) {
+    return -1;
+  }
+  clock->drain_count++;
+
+  return 0;
+}
+
+/* Write the calibration record. The end sample is taken by the caller. */
+int export_trace_clock(const struct trace_clock *clock, const char *path)
+{
+  FILE *fp;
+  size_t i;
+
+  fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  fprintf(fp, "frequency %lu\n", clock->frequency);
+  fprintf(fp, "start %lu %lu\n", clock->start.counter,
+          clock->start.monotonic_ns);
+  fprintf(fp, "end %lu %lu\n", clock->end.counter, clock->end.monotonic_ns);
+  for (i = 0; i < clock->drain_count; i++) {
+    fprintf(fp, "drain %zu %lu %lu\n", clock->drains[i].offset,
+            clock->drains[i].sample.counter,
+            clock->drains[i].sample.monotonic_ns);
+  }
+
+  fclose(fp);
+
+  return 0;
+}
+
+/* Convert a CLOCK_MONOTONIC time to a counter value by the line through the
+ * start and end samples, or by the frequency without an end sample. */
+unsigned long monotonic_to_counter(const struct trace_clock *clock,
+                                   unsigned long monotonic_ns)
+{
+  double ticks_per_ns;
+  double delta;
+
+  if (clock->end.monotonic_ns > clock->start.monotonic_ns &&
+      clock->end.counter > clock->start.counter) {
+    ticks_per_ns = (double)(clock->end.counter - clock->start.counter) /
+                   (double)(clock->end.monotonic_ns -
+                            clock->start.monotonic_ns);
+  } else {
+    ticks_per_ns = (double)clock->frequency / 1e9;
+  }
+
+  delta = ((double)monotonic_ns - (double)clock->start.monotonic_ns) *
+          ticks_per_ns;
+  if (delta < -(double)clock->start.counter) {
+    return 0;
+  }
+
+  return (unsigned long)((double)clock->start.counter + delta);
+}
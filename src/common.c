@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <stdatomic.h>
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
@@ -32,6 +33,16 @@
 #include "common.h"
 #include "known-boards.h"
 #include "config.h"
+#include "decoder.h"
+#include "event.h"
+#include "clock.h"
+#include "demux.h"
+#include "profile.h"
+#include "ring.h"
+#include "stats.h"
+#include "stm.h"
+#include "topology.h"
+#include "traced.h"
 #include "utils.h"
 
 #define DEFAULT_TRACE_CPU 0
@@ -40,8 +51,21 @@
 #define DEFAULT_ETF_SIZE 0x1000
 #define DEFAULT_TRACE_SIZE 0x80000
 #define DEFAULT_TRACE_NAME "cstrace.bin"
-#define DEFAULT_TRACE_ARGS_NAME "decoderargs.txt"
-
+#define WINDOW_TRACE_NAME_FMT "cstrace.%u.bin"
+#define WINDOW_BITMAP_NAME_FMT "%s_coverage_bitmap.%u.out"
+#define PROCESS_BITMAP_NAME_FMT "%s_coverage_bitmap.pid%d.out"
+#define SNAPSHOT_TRACE_NAME_FMT "cstrace.snapshot.%u.bin"
+#define SNAPSHOT_HISTORY_NAME_FMT "cstrace.history.%u.txt"
+#define TRACE_CPU_MAX 256
+#define FOLLOW_PID_MAX 64
+#define CONTEXT_THREAD_MAX 256 /* Threads mapped to their process */
+#define FLIGHT_SYNC_PERIOD 12 /* A-sync every 4 KiB to decode a ring tail */
+#define SIGNATURE_TAIL_SIZE 0x4000 /* Trace tail decoded first for a signature */
+#define SIGNATURE_NAME_FMT "%s/%016lx.txt"
+#define STM_MARKER_TRIAL 8
+#define STM_MARKER_TRIAL_USLEEP 10
+
+#define LATE_DRAIN_DIVISOR 2 /* Late by 1/2 of the threshold past it */
 #define TRACE_DISABLE_TRIAL 8
 #define TRACE_DISABLE_TRIAL_USLEEP 10
 
@@ -66,6 +90,7 @@ typedef enum {
   stop_event,
   suspend_event,
   resume_event,
+  drained_event, /* The decoder worker finished a session */
 } trace_event_t;
 
 char *board_name = DEFAULT_BOARD_NAME;
@@ -82,6 +107,23 @@ struct map_info *map_info;
 struct libcsdec_memory_map *mem_map = NULL;
 struct libcsdec_memory_image *mem_img = NULL;
 cov_type_t cov_type = edge_cov;
+bool shared_sink = false;
+unsigned long trace_budget = 0;      /* Max trace bytes per session */
+unsigned int hang_chunk_limit = 0;   /* Max decoded chunks without new edges */
+char *trace_cpu_list = NULL;         /* CPUs for a multi-threaded tracee */
+bool trace_nonstop = false;          /* Drain sinks without stopping tracee */
+bool profiling = false;              /* Write a branch profile at the end */
+profile_format_t profile_format = autofdo_profile;
+int profile_jobs = 0;                /* Profile decoder threads, 0 for all */
+stack_weight_t stack_weight = insn_weight;
+bool time_slice_on = false;          /* Profile only a CLOCK_MONOTONIC window */
+unsigned long time_slice_start = 0;  /* In nanoseconds */
+unsigned long time_slice_end = 0;
+bool flight_recorder = false;        /* Let the sink wrap until a snapshot */
+bool stm_markers = false;            /* Delimit sessions by STM markers */
+bool stm_annotations = false;        /* Place target STM writes in the flow */
+bool loss_check = false;             /* Count ETM overflows of each session */
+bool split_contexts = false;         /* Decode followed processes apart */
 
 unsigned char *trace_bitmap = NULL;
 unsigned int trace_bitmap_size = 0;
@@ -94,52 +136,151 @@ static void *trace_buf = NULL;
 static size_t trace_buf_size = 0;
 static void *trace_buf_ptr = NULL;
 static void *decoded_trace_buf = NULL;
+static struct trace_ring *sink_ring = NULL;
+static unsigned long sink_ring_lost = 0; /* Drops of sink_ring counted */
+
+/* With stm_markers, the sinks keep capturing across sessions and the trace is
+ * read from the sink memory at etr_read_offset. */
+static void *etr_buf = NULL;
+static unsigned long etr_read_offset = 0;
+static unsigned int exec_marker = 0;
+static struct stm_marker_finder marker_finder;
+
+/* The stream of one trace ID, taken out of the formatted trace chunk by
+ * chunk to be cut at its context packets. */
+struct context_stream {
+  struct context_scanner scanner;
+  int cur_id; /* Trace ID carried across chunks */
+  unsigned char *stream;
+  unsigned char *frames; /* Segments formatted again for the decoder */
+  size_t size;
+  size_t held;              /* Cut packet at stream */
+  unsigned long context_id; /* Last one seen, 0 for none */
+};
+
+/* A segment of a context stream on its way to a decoder. */
+struct context_split {
+  struct context_stream *contexts;
+  int trace_id;
+  libcsdec_t decoder;
+  size_t start;
+  int ret;
+};
+
+/* Multi-CPU mode traces the tracee on every CPU in trace_cpu_list. decoder
+ * and trace_id belong to trace_cpu, the first CPU in the list. Each other CPU
+ * has a decoder lane which decodes its own trace ID from the same trace in
+ * parallel into a bitmap of its own, which decode_trace() adds to
+ * trace_bitmap once all lanes are done. Threads sharing a CPU are not told
+ * apart by the ETM filter, so with thread_split_on the decoder of each CPU is
+ * reset wherever the context ID changes. */
+struct decoder_lane {
+  int cpu;
+  int trace_id;
+  libcsdec_t decoder;
+  unsigned char *bitmap;
+  struct context_stream contexts;
+  pthread_t thread;
+  int ret;
+};
+
+static bool trace_cpus[TRACE_CPU_MAX];
+static int trace_cpu_count = 0;
+static struct decoder_lane decoder_lanes[TRACE_CPU_MAX];
+static int decoder_lane_count = 0;
+static pthread_barrier_t lane_start_barrier;
+static pthread_barrier_t lane_done_barrier;
+static void *lane_buf = NULL;
+static size_t lane_buf_size = 0;
+static bool lanes_exiting = false;
+static bool thread_split_on = false;
+static struct context_stream cpu_contexts; /* Of trace_cpu */
+
+/* Processes traced along with child_pid, including child_pid itself. */
+static pid_t followed_pids[FOLLOW_PID_MAX];
+static int followed_pid_count = 0;
+static bool pid_filter_on = false;
+
+/* With split_contexts, the trace of trace_cpu is split by context ID. The
+ * target is decoded by decoder into trace_bitmap, and every other process by
+ * a decoder into a bitmap of its own. */
+struct process_decoder {
+  pid_t pid;
+  libcsdec_t decoder;
+  unsigned char *bitmap;
+  bool synced; /* Given the trace sync in this session */
+};
+
+static struct process_decoder process_decoders[FOLLOW_PID_MAX];
+static int process_decoder_count = 0;
+static struct process_decoder *context_process = NULL; /* NULL for target */
+static struct context_stream process_contexts;
+static bool context_scanner_on = false;
+
+/* Context IDs are thread IDs. The process of each thread seen is kept, since
+ * a thread may be gone by the time its trace is decoded. */
+struct context_thread {
+  pid_t tid;
+  pid_t tgid;
+};
+
+static struct context_thread context_threads[CONTEXT_THREAD_MAX];
+static int context_thread_count = 0;
+
+/* CPU affinity of an attached process before attach_trace(). */
+static bool attached_cpus[TRACE_CPU_MAX];
+
+/* Calibration of ETM timestamps, only with etm_timestamp. */
+static struct trace_clock trace_clock;
+static bool trace_clock_on = false;
 
 static pthread_t decoder_thread;
 
 static pthread_mutex_t trace_mutex;
-static pthread_mutex_t trace_state_mutex;
-static pthread_mutex_t trace_event_mutex;
-static pthread_cond_t trace_event_cond;
-static trace_state_t trace_state = init_state;
-static trace_event_t trace_event = init_event;
-
-static pthread_mutex_t trace_decoder_mutex;
-static pthread_cond_t trace_decoder_cond;
-static bool decoder_ready = true;
+static _Atomic trace_state_t trace_state = init_state;
+static struct event_queue trace_events;
+static struct event_cursor worker_cursor; /* Decoder or poll worker */
+static struct event_cursor tracer_cursor; /* Thread that drives the tracee */
+
+/* Polling threads keep draining while the session is active. A persistent
+ * mode tracee stays alive across sessions, so the process liveness alone is
+ * not enough to tell when to stop. */
+static atomic_bool trace_active = false;
+/* Set when the tracer stops the tracee to drain the sinks. Other SIGSTOPs
+ * come from the tracee itself. */
+static atomic_bool suspend_requested = false;
+/* Set when the tracee ran over the trace budget or looped without coverage. */
+static atomic_bool hang_detected = false;
 
 extern int registration_verbose;
+extern bool etm_timestamp;
+extern unsigned int etm_sync_period;
+extern bool etm_context_ids;
 
 static int enable_cs_trace(pid_t pid);
 static int disable_cs_trace(bool disable_all);
+static int get_trace_ids(int *trace_ids);
 
 static void signal_trace_event(trace_event_t event)
 {
-  pthread_mutex_lock(&trace_event_mutex);
-  trace_event = event;
-  pthread_cond_broadcast(&trace_event_cond);
-  pthread_mutex_unlock(&trace_event_mutex);
+  post_event(&trace_events, event);
 }
 
-static void wait_trace_event(trace_event_t event)
+static trace_event_t wait_trace_event(struct event_cursor *cursor,
+                                      unsigned int mask)
 {
-  pthread_mutex_lock(&trace_event_mutex);
-  while (trace_event != event) {
-    pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
-  }
-  pthread_mutex_unlock(&trace_event_mutex);
+  return (trace_event_t)wait_event(&trace_events, cursor, mask);
 }
+
 void wait_resume_event() {
-    wait_trace_event(resume_event);
+    wait_trace_event(&tracer_cursor, EVENT_MASK(resume_event));
 }
 
 static void set_trace_state(trace_state_t new_state)
 {
   trace_state_t old_state;
 
-  pthread_mutex_lock(&trace_state_mutex);
-  old_state = trace_state;
-  trace_state = new_state;
+  old_state = atomic_exchange(&trace_state, new_state);
   if (old_state == init_state) {
     signal_trace_event(init_event);
   } else if (new_state == fini_state) {
@@ -156,7 +297,114 @@ static void set_trace_state(trace_state_t new_state)
     fprintf(stderr, "Unexpected trace state transition: %d -> %d\n", old_state,
             new_state);
   }
-  pthread_mutex_unlock(&trace_state_mutex);
+}
+
+static unsigned int count_trace_bitmap_edges(void)
+{
+  unsigned int count;
+  unsigned int i;
+
+  count = 0;
+  for (i = 0; i < trace_bitmap_size; i++) {
+    count += trace_bitmap[i] != 0;
+  }
+
+  return count;
+}
+
+/* Check the session against the trace budget. */
+static bool is_trace_over_budget(void)
+{
+  return trace_budget > 0 &&
+         (unsigned long)((char *)trace_buf_ptr - (char *)trace_buf) >
+             trace_budget;
+}
+
+/* Check for chunks of trace that decode to no new edges, which is what a
+ * hung loop emits. Only when decoding. */
+static bool is_trace_stalled(unsigned int *stall_chunks,
+                             unsigned int *last_edges)
+{
+  unsigned int edges;
+
+  if (!decoding_on || hang_chunk_limit == 0 || !trace_bitmap) {
+    return false;
+  }
+
+  edges = count_trace_bitmap_edges();
+  if (edges > *last_edges) {
+    *last_edges = edges;
+    *stall_chunks = 0;
+  } else if (++*stall_chunks >= hang_chunk_limit) {
+    return true;
+  }
+
+  return false;
+}
+
+static void drop_undecoded_trace(void)
+{
+  pthread_mutex_lock(&trace_mutex);
+  trace_buf_ptr = decoded_trace_buf;
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+/* End the session of a hung tracee right away. Its trace is stopped, and
+ * trace not decoded yet is dropped since the rest is more of the same loop.
+ * The tracee keeps running, and afl-fuzz judges it on its own timeout, so
+ * that a slow but live tracee is not reported as a hang. */
+static void end_hung_session(void)
+{
+  atomic_store(&hang_detected, true);
+  count_trace_hang();
+
+  atomic_store(&trace_active, false);
+  if (disable_cs_trace(false) < 0) {
+    fprintf(stderr, "disable_cs_trace() failed\n");
+  }
+
+  if (decoding_on) {
+    drop_undecoded_trace();
+  }
+}
+
+/* The poller saw the sink only well after it passed the threshold, so the
+ * sink may have filled up in between. */
+static void check_late_drain(unsigned long unread, unsigned long threshold)
+{
+  if (unread > threshold + threshold / LATE_DRAIN_DIVISOR) {
+    add_trace_loss(late_drains, 1);
+  }
+}
+
+/* Trace written to the continuously capturing sink since the last fetch. */
+static unsigned long get_marked_trace_unread(void)
+{
+  unsigned long write_offset;
+
+  write_offset = (cs_get_buffer_rwp(devices.etb) - etr_ram_addr) &
+                 ~(unsigned long)(CS_FRAME_SIZE - 1);
+
+  return (write_offset + etr_ram_size - etr_read_offset) % etr_ram_size;
+}
+
+/* Drain the sinks while the tracee keeps running. Trace emitted while the
+ * sinks are re-armed is lost, except with STM markers which keep them
+ * capturing. */
+static int drain_trace_nonstop(void)
+{
+  int ret;
+
+  if ((ret = disable_cs_trace(false)) < 0) {
+    fprintf(stderr, "disable_cs_trace() failed\n");
+  }
+  fetch_trace();
+  if (enable_cs_trace(child_pid) < 0) {
+    fprintf(stderr, "enable_cs_trace() failed\n");
+    ret = -1;
+  }
+
+  return ret;
 }
 
 static int trace_sink_polling_raw(unsigned long decoding_threshold)
@@ -166,14 +414,35 @@ static int trace_sink_polling_raw(unsigned long decoding_threshold)
   unsigned long curr_offset;
 
   ret = 0;
-  init_pos = cs_get_buffer_rwp(devices.etb);
-
-  while (!kill(child_pid, 0)) {
-    curr_offset = cs_get_buffer_rwp(devices.etb) - init_pos;
+  init_pos = shared_sink ? 0 : cs_get_buffer_rwp(devices.etb);
+
+  while (atomic_load(&trace_active) && !kill(child_pid, 0)) {
+    if (shared_sink) {
+      /* The sink owner keeps draining, so the tracee need not be stopped. */
+      if (get_trace_ring_unread(sink_ring) > decoding_threshold) {
+        fetch_trace();
+        if (is_trace_over_budget()) {
+          end_hung_session();
+          goto exit;
+        }
+      }
+      continue;
+    }
+    curr_offset = stm_markers ? get_marked_trace_unread()
+                              : cs_get_buffer_rwp(devices.etb) - init_pos;
+    if (curr_offset > decoding_threshold) {
+      check_late_drain(curr_offset, decoding_threshold);
+    }
+    if (curr_offset > decoding_threshold && (trace_nonstop || stm_markers)) {
+      drain_trace_nonstop();
+      continue;
+    }
     if (curr_offset > decoding_threshold) {
       /* Suspend child_pid process. */
+      atomic_store(&suspend_requested, true);
       ret = kill(child_pid, SIGSTOP);
       if (ret < 0) {
+        atomic_store(&suspend_requested, false);
         if (errno == ESRCH) {
           /* child_pid killed. */
           goto exit;
@@ -182,14 +451,26 @@ static int trace_sink_polling_raw(unsigned long decoding_threshold)
         goto exit;
       }
 
-      /* Wait for suspending trace. */
-      wait_trace_event(suspend_event);
+      /* Wait for suspending trace. The session may be stopped first while
+       * the tracee is held by the tracer. */
+      if (wait_trace_event(&worker_cursor, EVENT_MASK(suspend_event) |
+                                               EVENT_MASK(stop_event)) ==
+          stop_event) {
+        atomic_store(&suspend_requested, false);
+        goto exit;
+      }
 
       if ((ret = disable_cs_trace(false)) < 0) {
         fprintf(stderr, "disable_cs_trace() failed\n");
         //goto exit;
       }
       fetch_trace();
+      if (is_trace_over_budget()) {
+        end_hung_session();
+        /* Let the tracer resume it. */
+        set_trace_state(running_state);
+        goto exit;
+      }
 
       enable_cs_trace(child_pid);
       /* Continue child_pid process. */
@@ -207,21 +488,50 @@ static int trace_sink_polling(unsigned long decoding_threshold)
   int ret;
   unsigned long init_pos;
   unsigned long curr_offset;
-
-  pthread_mutex_lock(&trace_decoder_mutex);
-  decoder_ready = false;
-  pthread_cond_broadcast(&trace_decoder_cond);
-  pthread_mutex_unlock(&trace_decoder_mutex);
+  unsigned int stall_chunks;
+  unsigned int last_edges;
 
   ret = 0;
-  init_pos = cs_get_buffer_rwp(devices.etb);
-
-  while (!kill(child_pid, 0)) {
-    curr_offset = cs_get_buffer_rwp(devices.etb) - init_pos;
+  init_pos = shared_sink ? 0 : cs_get_buffer_rwp(devices.etb);
+  stall_chunks = 0;
+  last_edges = 0;
+
+  while (atomic_load(&trace_active) && !kill(child_pid, 0)) {
+    if (shared_sink) {
+      /* The sink owner keeps draining, so the tracee need not be stopped. */
+      if (get_trace_ring_unread(sink_ring) > decoding_threshold) {
+        fetch_trace();
+        if ((ret = decode_trace()) < 0) {
+          fprintf(stderr, "decode_trace() failed\n");
+          goto exit;
+        }
+        if (is_trace_over_budget() ||
+            is_trace_stalled(&stall_chunks, &last_edges)) {
+          end_hung_session();
+          goto killed;
+        }
+      }
+      continue;
+    }
+    curr_offset = stm_markers ? get_marked_trace_unread()
+                              : cs_get_buffer_rwp(devices.etb) - init_pos;
+    if (curr_offset > decoding_threshold) {
+      check_late_drain(curr_offset, decoding_threshold);
+    }
+    if (curr_offset > decoding_threshold && (trace_nonstop || stm_markers)) {
+      drain_trace_nonstop();
+      if ((ret = decode_trace()) < 0) {
+        fprintf(stderr, "decode_trace() failed\n");
+        goto exit;
+      }
+      continue;
+    }
     if (curr_offset > decoding_threshold) {
       /* Suspend child_pid process. */
+      atomic_store(&suspend_requested, true);
       ret = kill(child_pid, SIGSTOP);
       if (ret < 0) {
+        atomic_store(&suspend_requested, false);
         if (errno == ESRCH) {
           /* child_pid killed. */
           goto killed;
@@ -230,8 +540,14 @@ static int trace_sink_polling(unsigned long decoding_threshold)
         goto exit;
       }
 
-      /* Wait for suspending trace. */
-      wait_trace_event(suspend_event);
+      /* Wait for suspending trace. The session may be stopped first while
+       * the tracee is held by the tracer. */
+      if (wait_trace_event(&worker_cursor, EVENT_MASK(suspend_event) |
+                                               EVENT_MASK(stop_event)) ==
+          stop_event) {
+        atomic_store(&suspend_requested, false);
+        goto stopped;
+      }
 
       if ((ret = disable_cs_trace(false)) < 0) {
         fprintf(stderr, "disable_cs_trace() failed\n");
@@ -241,6 +557,7 @@ static int trace_sink_polling(unsigned long decoding_threshold)
 
       enable_cs_trace(child_pid);
       /* Continue child_pid process. */
+      set_trace_state(running_state);
       ret = kill(child_pid, SIGCONT);
       if (ret < 0) {
         if (errno == ESRCH) {
@@ -256,28 +573,32 @@ static int trace_sink_polling(unsigned long decoding_threshold)
         fprintf(stderr, "decode_trace() failed\n");
         goto exit;
       }
+      if (is_trace_over_budget() ||
+          is_trace_stalled(&stall_chunks, &last_edges)) {
+        end_hung_session();
+        goto killed;
+      }
     }
   }
 
 killed:
-  pthread_mutex_lock(&trace_event_mutex);
-  while (trace_event != stop_event && trace_event != fini_event) {
-    pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
-  }
-  pthread_mutex_unlock(&trace_event_mutex);
+  wait_trace_event(&worker_cursor,
+                   EVENT_MASK(stop_event) | EVENT_MASK(fini_event));
 
+stopped:
+  /* Fetch the rest of a hung session only to drop it, so that it is not
+   * taken for the trace of the next one. */
   fetch_trace();
+  if (atomic_load(&hang_detected)) {
+    drop_undecoded_trace();
+    goto exit;
+  }
   if ((ret = decode_trace()) < 0) {
     fprintf(stderr, "decode_trace() failed\n");
     goto exit;
   }
 
 exit:
-  pthread_mutex_lock(&trace_decoder_mutex);
-  decoder_ready = true;
-  pthread_cond_broadcast(&trace_decoder_cond);
-  pthread_mutex_unlock(&trace_decoder_mutex);
-
   return ret;
 }
 
@@ -287,31 +608,37 @@ static void *poll_worker(void *arg)
   size_t etf_ram_size;
   unsigned long decoding_threshold;
 
-  if (etr_ram_size == 0) {
-    etr_ram_size = cs_get_buffer_size_bytes(devices.etb);
-  }
-  if (devices.trace_sinks[0]) {
-    etf_ram_size = (size_t)cs_get_buffer_size_bytes(devices.trace_sinks[0]);
-    if (etf_ram_size < etr_ram_size) {
-      decoding_threshold = etf_ram_size;
+  if (shared_sink) {
+    decoding_threshold = sink_ring->size / 2;
+  } else {
+    if (etr_ram_size == 0) {
+      etr_ram_size = cs_get_buffer_size_bytes(devices.etb);
+    }
+    if (devices.trace_sinks[0]) {
+      etf_ram_size = (size_t)cs_get_buffer_size_bytes(devices.trace_sinks[0]);
+      if (etf_ram_size < etr_ram_size) {
+        decoding_threshold = etf_ram_size;
+      } else {
+        decoding_threshold = etr_ram_size;
+      }
     } else {
       decoding_threshold = etr_ram_size;
     }
-  } else {
-    decoding_threshold = etr_ram_size;
+    /* Drain the wrapping sink before it overwrites unread trace. */
+    if (stm_markers) {
+      decoding_threshold = etr_ram_size / 2;
+    }
   }
 
   while (1) {
-    pthread_mutex_lock(&trace_event_mutex);
-    while (trace_event != start_event \
-            && trace_event != fini_event \
-            && trace_event != resume_event) {
-      pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
-    }
-    event = trace_event; /* TODO: trace_event can be changed in if cond. */
-    pthread_mutex_unlock(&trace_event_mutex);
+    event = wait_trace_event(&worker_cursor, EVENT_MASK(start_event) |
+                                                 EVENT_MASK(fini_event) |
+                                                 EVENT_MASK(resume_event));
     if (event == fini_event) {
         break;
+    } else if (flight_recorder) {
+        /* The sink wraps around until snapshot_trace(). */
+        continue;
     } else {
         // TODO: tune threshold to avoid FIFO overflow (maybe?)
         trace_sink_polling_raw(decoding_threshold);
@@ -326,29 +653,35 @@ static void *decoder_worker(void *arg)
   size_t etf_ram_size;
   unsigned long decoding_threshold;
 
-  if (etr_ram_size == 0) {
-    etr_ram_size = cs_get_buffer_size_bytes(devices.etb);
-  }
-  if (devices.trace_sinks[0]) {
-    etf_ram_size = (size_t)cs_get_buffer_size_bytes(devices.trace_sinks[0]);
-    if (etf_ram_size < etr_ram_size) {
-      decoding_threshold = etf_ram_size * 2;
+  if (shared_sink) {
+    decoding_threshold = sink_ring->size / 2;
+  } else {
+    if (etr_ram_size == 0) {
+      etr_ram_size = cs_get_buffer_size_bytes(devices.etb);
+    }
+    if (devices.trace_sinks[0]) {
+      etf_ram_size = (size_t)cs_get_buffer_size_bytes(devices.trace_sinks[0]);
+      if (etf_ram_size < etr_ram_size) {
+        decoding_threshold = etf_ram_size * 2;
+      } else {
+        decoding_threshold = etr_ram_size;
+      }
     } else {
       decoding_threshold = etr_ram_size;
     }
-  } else {
-    decoding_threshold = etr_ram_size;
+    /* Drain the wrapping sink before it overwrites unread trace. */
+    if (stm_markers) {
+      decoding_threshold = etr_ram_size / 2;
+    }
   }
 
   while (1) {
-    pthread_mutex_lock(&trace_event_mutex);
-    while (trace_event != start_event && trace_event != fini_event) {
-      pthread_cond_wait(&trace_event_cond, &trace_event_mutex);
-    }
-    event = trace_event; /* TODO: trace_event can be changed in if cond. */
-    pthread_mutex_unlock(&trace_event_mutex);
+    event = wait_trace_event(&worker_cursor,
+                             EVENT_MASK(start_event) | EVENT_MASK(fini_event));
     if (event == start_event) {
       trace_sink_polling(decoding_threshold);
+      /* Every started session is acknowledged once, in order. */
+      signal_trace_event(drained_event);
     } else if (event == fini_event) {
       break;
     }
@@ -357,241 +690,804 @@ static void *decoder_worker(void *arg)
   return NULL;
 }
 
-/* TODO: Take cov_type as a argument. */
-static int reset_decoder(struct map_info *map_info, int map_info_num)
+/* The decoders of a session share the images of map_info. */
+static int reset_decoder(libcsdec_t decoder, int trace_id,
+                         struct map_info *map_info, int map_info_num)
 {
-  libcsdec_result_t ret;
-  int i;
-
-  if (!decoder) {
+  if (!mem_map && !(mem_map = alloc_decoder_maps(map_info, map_info_num))) {
     return -1;
   }
 
-  if (!mem_map) {
-    mem_map = malloc(sizeof(struct libcsdec_memory_map) * map_info_num);
-    if (!mem_map) {
-      perror("malloc");
-      return -1;
-    }
-    for (i = 0; i < map_info_num; i++) {
-      mem_map[i].start = map_info[i].start;
-      mem_map[i].end = map_info[i].end;
-      strncpy(mem_map[i].path, map_info[i].path, sizeof(map_info[i].path) - 1);
-    }
-  }
+  return reset_cov_decoder(cov_type, decoder, trace_id, map_info_num,
+                           mem_map);
+}
 
-  ret = LIBCSDEC_ERROR;
+static int run_decoder(libcsdec_t decoder, void *buf, size_t buf_size)
+{
+  return run_cov_decoder(cov_type, decoder, buf, buf_size);
+}
 
-  switch (cov_type) {
-    case edge_cov:
-      ret = libcsdec_reset_edge(decoder, trace_id, map_info_num, mem_map);
-      break;
-    case path_cov:
-      ret = libcsdec_reset_path(decoder, trace_id, map_info_num, mem_map);
-      break;
-    default:
-      return -1;
+static libcsdec_t init_decoder(unsigned char *bitmap,
+                               struct map_info *map_info, int map_info_num)
+{
+  if (!mem_img && !(mem_img = alloc_decoder_images(map_info, map_info_num))) {
+    return (libcsdec_t)NULL;
   }
 
-  return (ret == LIBCSDEC_SUCCESS) ? 0 : -1;
+  return init_cov_decoder(cov_type, bitmap, trace_bitmap_size, map_info_num,
+                          mem_img);
 }
 
-/* TODO: Take cov_type as a argument. */
-static int run_decoder(void *buf, size_t buf_size)
+static int fini_decoder(libcsdec_t decoder)
 {
-  libcsdec_result_t ret;
-
-  if (!decoder) {
-    return -1;
-  }
+  return fini_cov_decoder(cov_type, decoder);
+}
 
-  ret = LIBCSDEC_ERROR;
+static int init_context_stream(struct context_stream *contexts)
+{
+  memset(contexts, 0, sizeof(*contexts));
 
-  switch (cov_type) {
-    case edge_cov:
-      ret = libcsdec_run_edge(decoder, buf, buf_size);
-      break;
-    case path_cov:
-      ret = libcsdec_run_path(decoder, buf, buf_size);
-      break;
-    default:
-      return -1;
-  }
+  return init_context_scanner(&contexts->scanner);
+}
 
-  return (ret == LIBCSDEC_SUCCESS) ? 0 : -1;
+static void reset_context_stream(struct context_stream *contexts)
+{
+  reset_context_scanner(&contexts->scanner);
+  contexts->cur_id = 0;
+  contexts->held = 0;
+  contexts->context_id = 0;
 }
 
-static libcsdec_t init_decoder(struct map_info *map_info, int map_info_num)
+static void fini_context_stream(struct context_stream *contexts)
 {
-  libcsdec_t decoder;
-  int i;
+  fini_context_scanner(&contexts->scanner);
+  free(contexts->stream);
+  contexts->stream = NULL;
+  free(contexts->frames);
+  contexts->frames = NULL;
+  contexts->size = 0;
+}
 
-  if (!trace_bitmap) {
-    trace_bitmap = malloc(trace_bitmap_size);
-    if (!trace_bitmap) {
-      perror("malloc");
-      decoder = (libcsdec_t)NULL;
-      goto exit;
-    }
-  }
+static int decode_context_bytes(struct context_split *split,
+                                const unsigned char *stream, size_t size)
+{
+  size_t len;
 
-  if (!mem_img) {
-    mem_img = malloc(sizeof(struct libcsdec_memory_image) * map_info_num);
-    if (!mem_img) {
-      perror("malloc");
-      decoder = (libcsdec_t)NULL;
-      goto exit;
-    }
-    for (i = 0; i < map_info_num; i++) {
-      mem_img[i].data = map_info[i].buf;
-      mem_img[i].size =
-          (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE);
-    }
+  if (size == 0) {
+    return 0;
   }
 
-  switch (cov_type) {
-    case edge_cov:
-      decoder = libcsdec_init_edge(trace_bitmap, trace_bitmap_size,
-                                   map_info_num, mem_img);
-      break;
-    case path_cov:
-      decoder = libcsdec_init_path(trace_bitmap, trace_bitmap_size,
-                                   map_info_num, mem_img);
-      break;
-    default:
-      decoder = (libcsdec_t)NULL;
-      break;
-  }
+  len = format_trace(split->trace_id, stream, size, split->contexts->frames);
 
-exit:
-  return decoder;
+  return run_decoder(split->decoder, split->contexts->frames, len);
 }
 
-/* TODO: Take cov_type as a argument. */
-static int fini_decoder(void)
+/* Hand the segment up to pos to the decoder of split. */
+static void decode_context_segment(struct context_split *split, size_t pos)
 {
-  if (!decoder) {
-    return -1;
+  if (decode_context_bytes(split, split->contexts->stream + split->start,
+                           pos - split->start) < 0) {
+    split->ret = -1;
   }
+  split->start = pos;
+}
 
-  switch (cov_type) {
-    case edge_cov:
-      libcsdec_finish_edge(decoder);
-      break;
-    case path_cov:
-      libcsdec_finish_path(decoder);
-      break;
+/* Take the stream of split->trace_id out of a chunk of formatted trace and
+ * decode it. emit is called at each context packet, and may cut the segment
+ * and change the decoder. A packet cut by the chunk end is held. */
+static int decode_context_stream(struct context_split *split, void *buf,
+                                 size_t buf_size,
+                                 void (*emit)(void *, size_t, unsigned long))
+{
+  struct context_stream *contexts;
+  unsigned char *stream;
+  unsigned char *frames;
+  size_t size;
+  size_t end;
+
+  contexts = split->contexts;
+  size = contexts->held + buf_size + CONTEXT_SYNC_MAX;
+  if (size > contexts->size) {
+    stream = realloc(contexts->stream, size);
+    if (!stream) {
+      perror("realloc");
+      return -1;
+    }
+    contexts->stream = stream;
+    frames = realloc(contexts->frames, FORMATTED_TRACE_SIZE(size));
+    if (!frames) {
+      perror("realloc");
+      return -1;
+    }
+    contexts->frames = frames;
+    contexts->size = size;
   }
 
-  return 0;
+  size = contexts->held +
+         extract_trace_chunk(&contexts->cur_id, split->trace_id, buf, buf_size,
+                             contexts->stream + contexts->held);
+
+  split->start = 0;
+  split->ret = 0;
+  end = scan_trace_contexts(&contexts->scanner, contexts->stream, size, emit,
+                            split);
+  decode_context_segment(split, end);
+
+  contexts->held = size - end;
+  memmove(contexts->stream, contexts->stream + end, contexts->held);
+
+  return split->ret;
 }
 
-/* FIXME: Do not initialize global variables in the function */
-static int alloc_trace_buf(void)
+/* Restart the decoder of split at pos, where another thread takes the CPU,
+ * so that no edge joins the flows of two threads. */
+static void restart_context_decoder(struct context_split *split, size_t pos)
 {
-  trace_buf = mmap(NULL, DEFAULT_TRACE_SIZE, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!trace_buf) {
-    perror("mmap");
-    return -1;
+  struct context_scanner *scanner;
+
+  scanner = &split->contexts->scanner;
+  decode_context_segment(split, pos);
+  if (reset_decoder(split->decoder, split->trace_id, map_info,
+                    range_count) < 0 ||
+      decode_context_bytes(split, scanner->sync, scanner->sync_len) < 0) {
+    split->ret = -1;
   }
-  trace_buf_size = DEFAULT_TRACE_SIZE;
-  trace_buf_ptr = trace_buf;
-  decoded_trace_buf = trace_buf_ptr;
-
-  return 0;
 }
 
-/* FIXME: Make it better */
-static void free_trace_buf(void)
+static void switch_thread(void *arg, size_t pos, unsigned long context_id)
 {
-  if (devices.etb) {
-    cs_empty_trace_buffer(devices.etb);
+  struct context_split *split;
+
+  split = (struct context_split *)arg;
+  if (context_id == split->contexts->context_id) {
+    return;
   }
 
-  if (trace_buf) {
-    munmap(trace_buf, trace_buf_size);
-    trace_buf_ptr = NULL;
-    decoded_trace_buf = NULL;
+  if (split->contexts->context_id != 0) {
+    restart_context_decoder(split, pos);
   }
+  split->contexts->context_id = context_id;
 }
 
-static int export_trace(const char *trace_name, const char *trace_args_name)
+/* Decode the trace of a CPU in a chunk of formatted trace thread by thread. */
+static int decode_thread_contexts(struct context_stream *contexts,
+                                  libcsdec_t decoder, int trace_id, void *buf,
+                                  size_t buf_size)
 {
-  int ret;
-  char *cwd;
-  char trace_path[PATH_MAX];
-  char decoder_args_path[PATH_MAX];
-  FILE *fp;
+  struct context_split split;
 
-  ret = -1;
+  split.contexts = contexts;
+  split.trace_id = trace_id;
+  split.decoder = decoder;
 
-  cwd = getcwd(NULL, 0);
-  if (!cwd) {
-    perror("getcwd");
-    goto exit;
-  }
+  return decode_context_stream(&split, buf, buf_size, switch_thread);
+}
 
-  memset(trace_path, 0, sizeof(trace_path));
-  memset(decoder_args_path, 0, sizeof(decoder_args_path));
-  snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, trace_name);
-  snprintf(decoder_args_path, sizeof(decoder_args_path), "%s/%s", cwd,
-           trace_args_name);
+static void *decoder_lane_worker(void *arg)
+{
+  struct decoder_lane *lane;
 
-  if (export_decoder_args(trace_id, trace_path, decoder_args_path, map_info,
-                          range_count) < 0) {
-    goto exit;
-  }
+  lane = (struct decoder_lane *)arg;
 
-  fp = fopen(trace_path, "wb");
-  if (!fp) {
-    perror("fopen");
-    goto exit;
+  while (1) {
+    pthread_barrier_wait(&lane_start_barrier);
+    if (lanes_exiting) {
+      break;
+    }
+    if (thread_split_on) {
+      lane->ret = decode_thread_contexts(&lane->contexts, lane->decoder,
+                                         lane->trace_id, lane_buf,
+                                         lane_buf_size);
+    } else {
+      lane->ret = run_decoder(lane->decoder, lane_buf, lane_buf_size);
+    }
+    pthread_barrier_wait(&lane_done_barrier);
   }
 
-  fwrite(trace_buf, (size_t)((char *)trace_buf_ptr - (char *)trace_buf), 1, fp);
-  fclose(fp);
+  return NULL;
+}
 
-  ret = 0;
+static int init_decoder_lanes(struct map_info *map_info, int map_info_num)
+{
+  int i;
 
-exit:
-  if (cwd) {
-    free(cwd);
+  for (i = 0; i < decoder_lane_count; i++) {
+    decoder_lanes[i].bitmap = calloc(1, trace_bitmap_size);
+    if (!decoder_lanes[i].bitmap) {
+      perror("calloc");
+      return -1;
+    }
+    decoder_lanes[i].decoder =
+        init_decoder(decoder_lanes[i].bitmap, map_info, map_info_num);
+    if (!decoder_lanes[i].decoder) {
+      fprintf(stderr, "init_decoder() failed for CPU #%d\n",
+              decoder_lanes[i].cpu);
+      return -1;
+    }
+    if (thread_split_on &&
+        init_context_stream(&decoder_lanes[i].contexts) < 0) {
+      return -1;
+    }
   }
 
-  return ret;
+  return 0;
 }
 
-static int enable_cs_trace(pid_t pid)
+static int reset_decoder_lanes(struct map_info *map_info, int map_info_num)
 {
-  int ret;
-
-  ret = -1;
-
-  pthread_mutex_lock(&trace_mutex);
+  int i;
 
-  if (is_first_trace) {
-    /* Do not specify traced PID in forkserver mode */
-    if (configure_trace(board, &devices, map_info, range_count, pid) < 0) {
-      fprintf(stderr, "configure_trace() failed\n");
-      //goto exit;
-    }
-    /* Enable ETMs and trace sinks for the first time */
-    if (enable_trace(board, &devices) < 0) {
-      fprintf(stderr, "enable_trace() failed\n");
-      //goto exit;
+  for (i = 0; i < decoder_lane_count; i++) {
+    if (reset_decoder(decoder_lanes[i].decoder, decoder_lanes[i].trace_id,
+                      map_info, map_info_num) < 0) {
+      fprintf(stderr, "reset_decoder() failed for CPU #%d\n",
+              decoder_lanes[i].cpu);
+      return -1;
     }
-    is_first_trace = false;
-  } else {
-    /* Enable trace sinks only once ETMs enabled */
-    if (enable_trace_sinks_only(board, &devices) < 0) {
-      fprintf(stderr, "enable_trace_sinks_only() failed\n");
-      goto exit;
+    if (thread_split_on) {
+      reset_context_stream(&decoder_lanes[i].contexts);
     }
   }
-
-  if (export_config) {
-    do_dump_config(board, &devices, 0);
+  if (thread_split_on) {
+    reset_context_stream(&cpu_contexts);
+  }
+
+  return 0;
+}
+
+static void fini_decoder_lanes(void)
+{
+  int i;
+
+  for (i = 0; i < decoder_lane_count; i++) {
+    fini_decoder(decoder_lanes[i].decoder);
+    decoder_lanes[i].decoder = NULL;
+    free(decoder_lanes[i].bitmap);
+    decoder_lanes[i].bitmap = NULL;
+    if (thread_split_on) {
+      fini_context_stream(&decoder_lanes[i].contexts);
+    }
+  }
+}
+
+/* Add the hit counts of a lane to trace_bitmap. Counts saturate instead of
+ * wrapping to zero, and the lane bitmap is cleared for the next chunk. */
+static void merge_lane_bitmap(struct decoder_lane *lane)
+{
+  unsigned int hits;
+  unsigned int i;
+
+  for (i = 0; i < trace_bitmap_size; i++) {
+    if (lane->bitmap[i]) {
+      hits = trace_bitmap[i] + lane->bitmap[i];
+      trace_bitmap[i] = hits > UCHAR_MAX ? UCHAR_MAX : hits;
+      lane->bitmap[i] = 0;
+    }
+  }
+}
+
+/* Returns the decoder of a followed process, set up on its first trace. */
+static struct process_decoder *get_process_decoder(pid_t pid)
+{
+  struct process_decoder *process;
+  int i;
+
+  process = NULL;
+  for (i = 0; i < process_decoder_count; i++) {
+    if (process_decoders[i].pid == pid) {
+      process = &process_decoders[i];
+      break;
+    }
+  }
+
+  if (!process) {
+    if (process_decoder_count >= FOLLOW_PID_MAX) {
+      return NULL;
+    }
+    process = &process_decoders[process_decoder_count];
+    process->bitmap = calloc(1, trace_bitmap_size);
+    if (!process->bitmap) {
+      perror("calloc");
+      return NULL;
+    }
+    process->pid = pid;
+    process->decoder = NULL;
+    process_decoder_count++;
+  }
+
+  if (!process->decoder) {
+    process->decoder = init_decoder(process->bitmap, map_info, range_count);
+    if (!process->decoder ||
+        reset_decoder(process->decoder, trace_id, map_info, range_count) <
+            0) {
+      fprintf(stderr, "init_decoder() failed for PID %d\n", pid);
+      fini_decoder(process->decoder);
+      process->decoder = NULL;
+      return NULL;
+    }
+    process->synced = false;
+  }
+
+  return process;
+}
+
+static int reset_process_decoders(void)
+{
+  int i;
+
+  for (i = 0; i < process_decoder_count; i++) {
+    if (!process_decoders[i].decoder) {
+      continue;
+    }
+    if (reset_decoder(process_decoders[i].decoder, trace_id, map_info,
+                      range_count) < 0) {
+      fprintf(stderr, "reset_decoder() failed for PID %d\n",
+              process_decoders[i].pid);
+      return -1;
+    }
+    process_decoders[i].synced = false;
+  }
+
+  reset_context_stream(&process_contexts);
+  context_process = NULL;
+  pthread_mutex_lock(&trace_mutex);
+  context_thread_count = 0;
+  pthread_mutex_unlock(&trace_mutex);
+
+  return 0;
+}
+
+/* Drop the decoders, which refer to the images, but keep the coverage. */
+static void release_process_decoders(void)
+{
+  int i;
+
+  for (i = 0; i < process_decoder_count; i++) {
+    fini_decoder(process_decoders[i].decoder);
+    process_decoders[i].decoder = NULL;
+  }
+}
+
+static void fini_process_decoders(void)
+{
+  int i;
+
+  release_process_decoders();
+  for (i = 0; i < process_decoder_count; i++) {
+    free(process_decoders[i].bitmap);
+    process_decoders[i].bitmap = NULL;
+  }
+  process_decoder_count = 0;
+
+  if (context_scanner_on) {
+    fini_context_stream(&process_contexts);
+    context_scanner_on = false;
+  }
+}
+
+/* Remember the process of a thread. Called with trace_mutex held. */
+static void add_context_thread(pid_t tid, pid_t tgid)
+{
+  if (context_thread_count < CONTEXT_THREAD_MAX) {
+    context_threads[context_thread_count].tid = tid;
+    context_threads[context_thread_count].tgid = tgid;
+    context_thread_count++;
+  }
+}
+
+/* Returns the process of the thread a context ID names. A thread gone before
+ * it was first seen is taken as a process of its own. */
+static pid_t get_context_process(pid_t tid)
+{
+  pid_t tgid;
+  int i;
+
+  tgid = -1;
+  pthread_mutex_lock(&trace_mutex);
+  for (i = 0; i < context_thread_count; i++) {
+    if (context_threads[i].tid == tid) {
+      tgid = context_threads[i].tgid;
+      break;
+    }
+  }
+  if (tgid < 0) {
+    if ((tgid = get_thread_group(tid)) < 0) {
+      tgid = tid;
+    }
+    add_context_thread(tid, tgid);
+  }
+  pthread_mutex_unlock(&trace_mutex);
+
+  return tgid;
+}
+
+/* Hand the stream to the decoder of the process from pos on. */
+static void switch_context(void *arg, size_t pos, unsigned long context_id)
+{
+  struct context_split *split;
+  struct process_decoder *process;
+  struct context_scanner *scanner;
+  unsigned long last_id;
+  pid_t tgid;
+
+  split = (struct context_split *)arg;
+  scanner = &split->contexts->scanner;
+  last_id = split->contexts->context_id;
+  if (context_id == last_id) {
+    return;
+  }
+  split->contexts->context_id = context_id;
+
+  tgid = get_context_process((pid_t)context_id);
+  if (tgid == child_pid) {
+    process = NULL;
+  } else {
+    /* Beyond FOLLOW_PID_MAX processes, the rest goes to the target. */
+    process = get_process_decoder(tgid);
+  }
+  if (process == context_process) {
+    /* Another thread of the same process. */
+    if (last_id != 0) {
+      restart_context_decoder(split, pos);
+    }
+    return;
+  }
+
+  decode_context_segment(split, pos);
+  context_process = process;
+  split->decoder = process ? process->decoder : decoder;
+
+  /* A decoder joining the stream in the middle needs to sync first. */
+  if (process && !process->synced && scanner->sync_len > 0) {
+    if (decode_context_bytes(split, scanner->sync, scanner->sync_len) < 0) {
+      split->ret = -1;
+    }
+    process->synced = true;
+  }
+}
+
+/* Decode the trace of trace_cpu in a chunk of formatted trace by process. */
+static int decode_trace_contexts(void *buf, size_t buf_size)
+{
+  struct context_split split;
+
+  split.contexts = &process_contexts;
+  split.trace_id = trace_id;
+  split.decoder = context_process ? context_process->decoder : decoder;
+
+  return decode_context_stream(&split, buf, buf_size, switch_context);
+}
+
+/* Write the coverage of every followed process but the target. */
+static void export_process_coverage(void)
+{
+  char path[PATH_MAX];
+  FILE *fp;
+  int i;
+
+  for (i = 0; i < process_decoder_count; i++) {
+    snprintf(path, sizeof(path), PROCESS_BITMAP_NAME_FMT,
+             cov_type == path_cov ? "path" : "edge", process_decoders[i].pid);
+    fp = fopen(path, "wb");
+    if (!fp) {
+      perror("fopen");
+      continue;
+    }
+    fwrite(process_decoders[i].bitmap, trace_bitmap_size, 1, fp);
+    fclose(fp);
+  }
+}
+
+static int start_decoder_lanes(void)
+{
+  int i;
+  int ret;
+
+  pthread_barrier_init(&lane_start_barrier, NULL, decoder_lane_count + 1);
+  pthread_barrier_init(&lane_done_barrier, NULL, decoder_lane_count + 1);
+
+  for (i = 0; i < decoder_lane_count; i++) {
+    ret = pthread_create(&decoder_lanes[i].thread, NULL, decoder_lane_worker,
+                         &decoder_lanes[i]);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create() failed: %d\n", ret);
+      /* Lanes wait for each other, so the started ones cannot be used. */
+      decoder_lane_count = 0;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void stop_decoder_lanes(void)
+{
+  int i;
+
+  if (!decoding_on || decoder_lane_count == 0) {
+    return;
+  }
+
+  lanes_exiting = true;
+  pthread_barrier_wait(&lane_start_barrier);
+  for (i = 0; i < decoder_lane_count; i++) {
+    pthread_join(decoder_lanes[i].thread, NULL);
+  }
+
+  pthread_barrier_destroy(&lane_done_barrier);
+  pthread_barrier_destroy(&lane_start_barrier);
+}
+
+/* Parse trace_cpu_list. trace_cpu becomes the first CPU in the list, and the
+ * rest get a decoder lane each. */
+static int setup_trace_cpus(void)
+{
+  int cpu;
+  int trace_id;
+
+  trace_cpu_count = parse_cpu_list(trace_cpu_list, trace_cpus, TRACE_CPU_MAX);
+  if (trace_cpu_count <= 0) {
+    fprintf(stderr, "Invalid CPU list '%s'\n", trace_cpu_list);
+    return -1;
+  }
+
+  trace_cpu = -1;
+  decoder_lane_count = 0;
+  for (cpu = 0; cpu < TRACE_CPU_MAX; cpu++) {
+    if (!trace_cpus[cpu]) {
+      continue;
+    }
+    if (trace_cpu < 0) {
+      trace_cpu = cpu;
+      continue;
+    }
+    if ((trace_id = get_trace_id(board_name, cpu)) < 0) {
+      fprintf(stderr, "No trace ID for CPU #%d\n", cpu);
+      return -1;
+    }
+    decoder_lanes[decoder_lane_count].cpu = cpu;
+    decoder_lanes[decoder_lane_count].trace_id = trace_id;
+    decoder_lane_count++;
+  }
+
+  return 0;
+}
+
+/* FIXME: Do not initialize global variables in the function */
+static int alloc_trace_buf(void)
+{
+  /* Reuse the buffer from the previous session. */
+  if (!trace_buf) {
+    trace_buf = mmap(NULL, DEFAULT_TRACE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (trace_buf == MAP_FAILED) {
+      perror("mmap");
+      trace_buf = NULL;
+      return -1;
+    }
+    trace_buf_size = DEFAULT_TRACE_SIZE;
+  }
+  trace_buf_ptr = trace_buf;
+  decoded_trace_buf = trace_buf_ptr;
+  trace_clock.drain_count = 0;
+
+  return 0;
+}
+
+/* FIXME: Make it better */
+static void free_trace_buf(void)
+{
+  if (devices.etb && !shared_sink) {
+    cs_empty_trace_buffer(devices.etb);
+  }
+
+  if (trace_buf) {
+    munmap(trace_buf, trace_buf_size);
+    trace_buf = NULL;
+    trace_buf_ptr = NULL;
+    decoded_trace_buf = NULL;
+  }
+}
+
+static int export_trace(const char *trace_name, const char *trace_args_name)
+{
+  int ret;
+  char *cwd;
+  char trace_path[PATH_MAX];
+  char decoder_args_path[PATH_MAX];
+  FILE *fp;
+
+  ret = -1;
+
+  cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    perror("getcwd");
+    goto exit;
+  }
+
+  memset(trace_path, 0, sizeof(trace_path));
+  memset(decoder_args_path, 0, sizeof(decoder_args_path));
+  snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, trace_name);
+  snprintf(decoder_args_path, sizeof(decoder_args_path), "%s/%s", cwd,
+           trace_args_name);
+
+  if (export_decoder_args(trace_id, trace_path, decoder_args_path, map_info,
+                          range_count) < 0) {
+    goto exit;
+  }
+
+  /* The decoder arguments lack file offsets, which bench-decode needs. */
+  fp = fopen(DEFAULT_TRACE_MAPS_NAME, "w");
+  if (!fp) {
+    perror("fopen");
+    goto exit;
+  }
+  dump_map_info(fp, map_info, range_count);
+  fclose(fp);
+
+  fp = fopen(trace_path, "wb");
+  if (!fp) {
+    perror("fopen");
+    goto exit;
+  }
+
+  fwrite(trace_buf, (size_t)((char *)trace_buf_ptr - (char *)trace_buf), 1, fp);
+  fclose(fp);
+
+  if (trace_clock_on) {
+    sample_trace_clock(&trace_clock.end);
+    if (export_trace_clock(&trace_clock, DEFAULT_CLOCK_NAME) < 0) {
+      goto exit;
+    }
+  }
+
+  ret = 0;
+
+exit:
+  if (cwd) {
+    free(cwd);
+  }
+
+  return ret;
+}
+
+/* Write the trace of the stopped session, and its coverage when decoding, as
+ * the index-th window. The coverage is cleared for the next window. Returns
+ * the trace size. */
+ssize_t export_trace_window(unsigned int index)
+{
+  char path[PATH_MAX];
+  size_t size;
+  FILE *fp;
+
+  size = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
+
+  snprintf(path, sizeof(path), WINDOW_TRACE_NAME_FMT, index);
+  fp = fopen(path, "wb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+  fwrite(trace_buf, size, 1, fp);
+  fclose(fp);
+
+  if (decoding_on && trace_bitmap) {
+    snprintf(path, sizeof(path), WINDOW_BITMAP_NAME_FMT,
+             cov_type == path_cov ? "path" : "edge", index);
+    fp = fopen(path, "wb");
+    if (!fp) {
+      perror("fopen");
+      return -1;
+    }
+    fwrite(trace_bitmap, trace_bitmap_size, 1, fp);
+    fclose(fp);
+    memset(trace_bitmap, 0, trace_bitmap_size);
+  }
+
+  return (ssize_t)size;
+}
+
+static int enable_shared_cs_trace(pid_t pid)
+{
+  int ret;
+
+  ret = -1;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  /* cs-traced programs the ETM of the leased CPU. */
+  if (is_first_trace) {
+    if (configure_traced_source(map_info, range_count, pid) < 0) {
+      fprintf(stderr, "configure_traced_source() failed\n");
+      goto exit;
+    }
+    if (enable_traced_source() < 0) {
+      fprintf(stderr, "enable_traced_source() failed\n");
+      goto exit;
+    }
+    is_first_trace = false;
+  } else {
+    if (resume_traced_source() < 0) {
+      fprintf(stderr, "resume_traced_source() failed\n");
+      goto exit;
+    }
+  }
+
+  ret = 0;
+
+exit:
+  pthread_mutex_unlock(&trace_mutex);
+
+  return ret;
+}
+
+static int disable_shared_cs_trace(bool disable_all)
+{
+  int ret;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  if (disable_all) {
+    ret = disable_traced_source();
+  } else {
+    ret = suspend_traced_source();
+  }
+
+  pthread_mutex_unlock(&trace_mutex);
+
+  return ret;
+}
+
+static int enable_cs_trace(pid_t pid)
+{
+  int ret;
+
+  if (shared_sink) {
+    return enable_shared_cs_trace(pid);
+  }
+
+  ret = -1;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  if (is_first_trace) {
+    /* Do not specify traced PID in forkserver mode */
+    if (configure_trace(board, &devices, map_info, range_count,
+                        trace_cpu_count > 1 ? 0 : pid) < 0) {
+      fprintf(stderr, "configure_trace() failed\n");
+      //goto exit;
+    }
+    /* Enable ETMs and trace sinks for the first time */
+    if (stm_markers) {
+      if (enable_marked_trace(board, &devices, STM_TRACE_ID) < 0) {
+        fprintf(stderr, "enable_marked_trace() failed\n");
+        goto exit;
+      }
+      etr_read_offset = (cs_get_buffer_rwp(devices.etb) - etr_ram_addr) &
+                        ~(unsigned long)(CS_FRAME_SIZE - 1);
+      reset_stm_marker_finder(&marker_finder);
+    } else if (enable_trace(board, &devices) < 0) {
+      fprintf(stderr, "enable_trace() failed\n");
+      //goto exit;
+    }
+    /* The STM is already a source of marked trace. */
+    if (stm_annotations && !stm_markers &&
+        enable_stm_source(&devices, STM_TRACE_ID) < 0) {
+      fprintf(stderr, "enable_stm_source() failed\n");
+      goto exit;
+    }
+    is_first_trace = false;
+  } else if (!stm_markers) {
+    /* Enable trace sinks only once ETMs enabled. With STM markers, they keep
+     * capturing across sessions. */
+    if (enable_trace_sinks_only(board, &devices) < 0) {
+      fprintf(stderr, "enable_trace_sinks_only() failed\n");
+      goto exit;
+    }
+  }
+
+  if (export_config) {
+    do_dump_config(board, &devices, 0);
   }
 
   ret = 0;
@@ -605,13 +1501,52 @@ exit:
   return ret;
 }
 
+/* Keep the sinks capturing with STM markers. A stopped session is closed by
+ * a marker, then in-flight trace is pushed into the sink memory. */
+static int mark_cs_trace(bool disable_all)
+{
+  int ret;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  if (disable_all) {
+    ret = disable_marked_trace(board, &devices);
+    goto exit;
+  }
+
+  ret = 0;
+  if (!atomic_load(&trace_active)) {
+    ret = write_stm_marker(&devices, ++exec_marker);
+  }
+  if (flush_shared_sink(&devices) < 0) {
+    ret = -1;
+  }
+
+exit:
+  pthread_mutex_unlock(&trace_mutex);
+
+  return ret;
+}
+
 static int disable_cs_trace(bool disable_all)
 {
   int ret;
   int disable_trial;
 
+  if (shared_sink) {
+    return disable_shared_cs_trace(disable_all);
+  }
+
+  if (stm_markers) {
+    return mark_cs_trace(disable_all);
+  }
+
   pthread_mutex_lock(&trace_mutex);
 
+  if (disable_all && stm_annotations) {
+    disable_stm_source(&devices);
+  }
+
   disable_trial = 0;
   while (disable_trial++ < TRACE_DISABLE_TRIAL) {
     if (disable_all) {
@@ -635,136 +1570,653 @@ static int disable_cs_trace(bool disable_all)
   return ret;
 }
 
-int fetch_trace(void)
+/* Grow trace_buf to have at least len bytes after trace_buf_ptr. Returns the
+ * remaining size. Must be called with trace_mutex held. */
+static ssize_t reserve_trace_buf(size_t len)
+{
+  size_t buf_used;
+  void *new_trace_buf;
+  size_t new_trace_buf_size;
+
+  trace_buf_ptr = (void *)ALIGN_UP((unsigned long)trace_buf_ptr, 0x8);
+  buf_used = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
+
+  /* No space left in trace_buf. */
+  if (len > trace_buf_size - buf_used) {
+    new_trace_buf_size = trace_buf_size * 2;
+    while (len > new_trace_buf_size - buf_used) {
+      new_trace_buf_size *= 2;
+    }
+    new_trace_buf = mremap(trace_buf, trace_buf_size, new_trace_buf_size,
+                           MREMAP_MAYMOVE);
+    if (new_trace_buf == MAP_FAILED) {
+      perror("mremap");
+      return -1;
+    }
+    decoded_trace_buf =
+        (void *)((char *)new_trace_buf +
+                 ((char *)decoded_trace_buf - (char *)trace_buf));
+    trace_buf_ptr = (void *)((char *)new_trace_buf + buf_used);
+    trace_buf = new_trace_buf;
+    trace_buf_size = new_trace_buf_size;
+  }
+
+  return (ssize_t)(trace_buf_size - buf_used);
+}
+
+/* Note when the trace up to trace_buf_ptr was drained. Must be called with
+ * trace_mutex held. */
+static void record_trace_drain(void)
+{
+  if (trace_clock_on) {
+    add_trace_clock_drain(&trace_clock,
+                          (size_t)((char *)trace_buf_ptr - (char *)trace_buf));
+  }
+}
+
+static int fetch_shared_trace(void)
+{
+  int ret;
+  size_t len;
+  size_t n;
+  unsigned long lost;
+
+  ret = -1;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  /* Trace is drained on the fly while the session is active. Once stopped,
+   * ask the sink owner to write out the rest. */
+  if (!atomic_load(&trace_active) && flush_trace_ring(sink_ring) < 0) {
+    fprintf(stderr, "flush_trace_ring() failed\n");
+  }
+
+  len = get_trace_ring_unread(sink_ring);
+  if (reserve_trace_buf(len) < 0) {
+    goto exit;
+  }
+
+  n = read_trace_ring(sink_ring, trace_buf_ptr, len);
+  trace_buf_ptr = (void *)((char *)trace_buf_ptr + n);
+  record_trace_drain();
+
+  /* The sink owner drops what does not fit in the ring. */
+  lost = atomic_load(&sink_ring->lost);
+  add_trace_loss(lost_bytes, lost - sink_ring_lost);
+  sink_ring_lost = lost;
+
+  ret = 0;
+
+exit:
+  pthread_mutex_unlock(&trace_mutex);
+  return ret;
+}
+
+/* Copy the trace written since the last fetch out of the sink memory. Once
+ * the session is stopped, the trace is taken up to its STM marker, and the
+ * rest is left in the sink for the next session. The STM stream is followed
+ * through every fetch, so that the marker is told from other STM packets. */
+static int fetch_marked_trace(void)
+{
+  unsigned long write_offset;
+  size_t len, first, end, rest;
+  void *chunk;
+  int trial;
+  int ret;
+
+  ret = -1;
+
+  pthread_mutex_lock(&trace_mutex);
+
+  trial = 0;
+  while (1) {
+    write_offset = (cs_get_buffer_rwp(devices.etb) - etr_ram_addr) &
+                   ~(unsigned long)(CS_FRAME_SIZE - 1);
+    len = (write_offset + etr_ram_size - etr_read_offset) % etr_ram_size;
+    if (reserve_trace_buf(len) < 0) {
+      goto exit;
+    }
+
+    first = etr_ram_size - etr_read_offset;
+    if (first > len) {
+      first = len;
+    }
+    memcpy(trace_buf_ptr, (char *)etr_buf + etr_read_offset, first);
+    memcpy((char *)trace_buf_ptr + first, etr_buf, len - first);
+    chunk = trace_buf_ptr;
+    trace_buf_ptr = (void *)((char *)trace_buf_ptr + len);
+    etr_read_offset = write_offset;
+
+    /* The marker of the session is written only once it is stopped. */
+    end = find_stm_marker(&marker_finder, exec_marker, chunk, len);
+    if (atomic_load(&trace_active)) {
+      break;
+    }
+
+    if (end > 0) {
+      rest = len - end;
+      trace_buf_ptr = (void *)((char *)trace_buf_ptr - rest);
+      etr_read_offset = (etr_read_offset + etr_ram_size - rest) % etr_ram_size;
+      break;
+    }
+
+    /* The marker may still be on its way from the STM. */
+    if (++trial >= STM_MARKER_TRIAL) {
+      fprintf(stderr, "STM marker #%u not found\n", exec_marker);
+      break;
+    }
+    usleep(STM_MARKER_TRIAL_USLEEP);
+    flush_shared_sink(&devices);
+  }
+  record_trace_drain();
+
+  ret = 0;
+
+exit:
+  pthread_mutex_unlock(&trace_mutex);
+  return ret;
+}
+
+static int fetch_sink_trace(void)
 {
   int ret;
   cs_device_t etb;
   int len;
-  size_t buf_remain;
-  void *new_trace_buf;
-  size_t new_trace_buf_size;
+  ssize_t buf_remain;
   int n;
 
   ret = -1;
 
   pthread_mutex_lock(&trace_mutex);
 
-  etb = devices.etb;
-  len = cs_get_buffer_unread_bytes(etb);
+  etb = devices.etb;
+  len = cs_get_buffer_unread_bytes(etb);
+
+  if ((buf_remain = reserve_trace_buf((size_t)len)) < 0) {
+    goto exit;
+  }
+
+  /* The oldest trace since the last drain was overwritten. The flight
+   * recorder wraps on purpose. */
+  if (!flight_recorder && cs_buffer_has_wrapped(etb)) {
+    add_trace_loss(sink_wraps, 1);
+  }
+
+  n = cs_get_trace_data(etb, trace_buf_ptr, (unsigned int)buf_remain);
+  if (n <= 0) {
+    fprintf(stderr, "Failed to get trace\n");
+    add_trace_loss(lost_bytes, len > 0 ? (unsigned long)len : 0);
+  } else if (n < len) {
+    fprintf(stderr, "Got incomplete trace\n");
+    add_trace_loss(lost_bytes, (unsigned long)(len - n));
+  }
+  cs_empty_trace_buffer(etb);
+  if (n > 0) {
+    trace_buf_ptr = (void *)((char *)trace_buf_ptr + n);
+  }
+  record_trace_drain();
+
+  ret = 0;
+
+exit:
+  pthread_mutex_unlock(&trace_mutex);
+  return ret;
+}
+
+int fetch_trace(void)
+{
+  unsigned long start;
+  int ret;
+
+  start = read_system_counter();
+  if (shared_sink) {
+    ret = fetch_shared_trace();
+  } else if (stm_markers) {
+    ret = fetch_marked_trace();
+  } else {
+    ret = fetch_sink_trace();
+  }
+  add_trace_stats(fetch_phase, start);
+
+  return ret;
+}
+
+int decode_trace(void)
+{
+  unsigned long start;
+  int ret;
+  void *buf;
+  size_t buf_size;
+  int i;
+
+  start = read_system_counter();
+  buf = decoded_trace_buf;
+  buf_size = (size_t)((char *)trace_buf_ptr - (char *)buf);
+
+  /* Lanes pick out their own trace IDs from the same chunk while this thread
+   * decodes trace_cpu. */
+  if (decoder_lane_count > 0) {
+    lane_buf = buf;
+    lane_buf_size = buf_size;
+    pthread_barrier_wait(&lane_start_barrier);
+  }
+
+  if (context_scanner_on) {
+    ret = decode_trace_contexts(buf, buf_size);
+  } else if (thread_split_on) {
+    ret = decode_thread_contexts(&cpu_contexts, decoder, trace_id, buf,
+                                 buf_size);
+  } else {
+    ret = run_decoder(decoder, buf, buf_size);
+  }
+
+  if (decoder_lane_count > 0) {
+    pthread_barrier_wait(&lane_done_barrier);
+    for (i = 0; i < decoder_lane_count; i++) {
+      merge_lane_bitmap(&decoder_lanes[i]);
+      if (decoder_lanes[i].ret < 0) {
+        fprintf(stderr, "Failed to decode trace of CPU #%d\n",
+                decoder_lanes[i].cpu);
+        ret = -1;
+      }
+    }
+  }
+  if (ret < 0) {
+    goto exit;
+  }
+
+  decoded_trace_buf = (void *)((char *)buf + buf_size);
+
+exit:
+  add_trace_stats(decode_phase, start);
+
+  return ret;
+}
+
+void trace_suspend_resume_callback(void)
+{
+  atomic_store(&suspend_requested, false);
+  set_trace_state(suspended_state);
+}
+
+bool is_trace_suspend_requested(void)
+{
+  return atomic_load(&suspend_requested);
+}
+
+static int begin_trace_session(pid_t pid, bool use_pid_trace)
+{
+  unsigned long start;
+  int ret;
+
+  if ((ret = alloc_trace_buf()) < 0) {
+    goto exit;
+  }
+
+  if (decoding_on &&
+      ((ret = reset_decoder(decoder, trace_id, map_info, range_count)) < 0)) {
+    fprintf(stderr, "reset_decoder() failed\n");
+    goto exit;
+  }
+  if (decoding_on && ((ret = reset_decoder_lanes(map_info, range_count)) < 0)) {
+    goto exit;
+  }
+  if (context_scanner_on && ((ret = reset_process_decoders()) < 0)) {
+    goto exit;
+  }
+
+  child_pid = pid;
+  followed_pids[0] = pid;
+  followed_pid_count = 1;
+  pid_filter_on = use_pid_trace && trace_cpu_count <= 1;
+  atomic_store(&hang_detected, false);
+  start = read_system_counter();
+  if ((ret = enable_cs_trace(use_pid_trace ? pid : 0)) < 0) {
+    fprintf(stderr, "enable_cs_trace() failed\n");
+    goto exit;
+  }
+  add_trace_stats(enable_phase, start);
+
+  atomic_store(&trace_active, true);
+  set_trace_state(running_state);
+
+exit:
+  return ret;
+}
+
+/* Start trace session. CoreSight and decoder must be initialized. */
+int start_trace(pid_t pid, bool use_pid_trace)
+{
+  int ret;
+
+  /* Threads created by the tracee inherit the affinity. */
+  if (trace_cpu_count > 1) {
+    ret = set_cpu_list_affinity(trace_cpus, TRACE_CPU_MAX, pid);
+  } else {
+    ret = set_cpu_affinity(trace_cpu, pid);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "Failed to set CPU affinity of PID %d\n", pid);
+    goto exit;
+  }
+
+  ret = begin_trace_session(pid, use_pid_trace);
+
+exit:
+  return ret;
+}
+
+/* Start trace session on a running process without stopping it. Only its
+ * main thread matches the context ID filter, so only that thread is moved to
+ * trace_cpu until detach_trace(). With trace_cpu_list, all of its threads are
+ * moved to the traced CPUs. */
+int attach_trace(pid_t pid)
+{
+  bool cpus[TRACE_CPU_MAX];
+  int ret;
+
+  if ((ret = get_cpu_list_affinity(pid, attached_cpus, TRACE_CPU_MAX)) < 0) {
+    fprintf(stderr, "Failed to get CPU affinity of PID %d\n", pid);
+    goto exit;
+  }
+
+  if (trace_cpu_count > 1) {
+    ret = set_task_cpu_list_affinity(pid, trace_cpus, TRACE_CPU_MAX);
+  } else {
+    memset(cpus, 0, sizeof(cpus));
+    cpus[trace_cpu] = true;
+    ret = set_cpu_list_affinity(cpus, TRACE_CPU_MAX, pid);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "Failed to set CPU affinity of PID %d\n", pid);
+    goto exit;
+  }
+
+  trace_nonstop = true;
+  ret = begin_trace_session(pid, true);
+
+exit:
+  return ret;
+}
+
+/* Give the attached process its CPU affinity back. The session must be
+ * stopped. */
+int detach_trace(void)
+{
+  int ret;
+
+  if (trace_cpu_count > 1) {
+    ret = set_task_cpu_list_affinity(child_pid, attached_cpus, TRACE_CPU_MAX);
+  } else {
+    ret = set_cpu_list_affinity(attached_cpus, TRACE_CPU_MAX, child_pid);
+  }
+  if (ret < 0) {
+    fprintf(stderr, "Failed to restore CPU affinity of PID %d\n", child_pid);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Restart trace session for the next persistent mode iteration. The tracee is
+ * already bound to trace_cpu and ETMs are kept configured, so only the trace
+ * sinks are re-armed and the decoder is reset. */
+int restart_trace(pid_t pid)
+{
+  return begin_trace_session(pid, false);
+}
+
+/* Replace the memory map with the one of the new tracee. The decoder is
+ * rebuilt only when the tracee is loaded at different addresses. */
+static int update_map_info(pid_t pid, bool *changed)
+{
+  struct map_info *new_map_info;
+  int new_range_count;
+  int ret;
+
+  ret = -1;
+  *changed = false;
+
+  new_map_info = malloc(sizeof(struct map_info) * RANGE_MAX);
+  if (!new_map_info) {
+    perror("malloc");
+    goto exit;
+  }
+  if ((new_range_count = read_map_info(pid, &new_map_info, RANGE_MAX)) < 0) {
+    fprintf(stderr, "read_map_info() failed\n");
+    goto exit;
+  }
+
+  if (is_same_map_info(map_info, range_count, new_map_info, new_range_count)) {
+    ret = 0;
+    goto exit;
+  }
+
+  if (mmap_map_info(new_map_info, new_range_count) < 0) {
+    fprintf(stderr, "mmap_map_info() failed\n");
+    goto exit;
+  }
+
+  if (decoding_on) {
+    fini_decoder(decoder);
+    fini_decoder_lanes();
+    release_process_decoders();
+    free(mem_img);
+    mem_img = NULL;
+    free(mem_map);
+    mem_map = NULL;
+    if (!(decoder = init_decoder(trace_bitmap, new_map_info,
+                                 new_range_count)) ||
+        init_decoder_lanes(new_map_info, new_range_count) < 0) {
+      fprintf(stderr, "init_decoder() failed\n");
+      munmap_map_info(new_map_info, new_range_count);
+      goto exit;
+    }
+  }
+
+  munmap_map_info(map_info, range_count);
+  free(map_info);
+  map_info = new_map_info;
+  range_count = new_range_count;
+  new_map_info = NULL;
+  *changed = true;
+
+  ret = 0;
+
+exit:
+  if (new_map_info) {
+    free(new_map_info);
+  }
+
+  return ret;
+}
+
+/* Point the trace at a new tracee without a fork server. CoreSight, the
+ * decoder and its worker thread are kept from the first tracee. Only the
+ * context ID filter is updated, along with the address ranges and the
+ * decoder images when the load address changes. */
+int retarget_trace(pid_t pid)
+{
+  bool changed;
+  int cpu;
+  int ret;
 
-  trace_buf_ptr = (void *)ALIGN_UP((unsigned long)trace_buf_ptr, 0x8);
+  if ((ret = update_map_info(pid, &changed)) < 0) {
+    goto exit;
+  }
 
-  buf_remain =
-      trace_buf_size - (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
-  /* No space left in trace_buf. */
-  if ((size_t)len > buf_remain) {
-    new_trace_buf_size = trace_buf_size * 2;
-    new_trace_buf = mremap(trace_buf, trace_buf_size, new_trace_buf_size, 0);
+  if (registration_verbose > 0 && changed) {
+    dump_map_info(stderr, map_info, range_count);
+  }
 
-    if (!new_trace_buf) {
-      perror("mremap");
-      goto exit;
+  pthread_mutex_lock(&trace_mutex);
+  if (shared_sink) {
+    /* The ETM is suspended and thus programmable since stop_trace(). */
+    ret = configure_traced_source(map_info, range_count, pid);
+  } else if (trace_cpu_count > 1) {
+    /* Threads have their own context IDs, so only the ranges are updated. */
+    ret = 0;
+    for (cpu = 0; cpu < board->n_cpu && cpu < TRACE_CPU_MAX; cpu++) {
+      if (trace_cpus[cpu] &&
+          reconfigure_trace_source(board, &devices, cpu, map_info,
+                                   range_count, 0) < 0) {
+        ret = -1;
+      }
     }
-    decoded_trace_buf =
-        (void *)((char *)new_trace_buf +
-                 ((char *)decoded_trace_buf - (char *)trace_buf));
-    trace_buf_ptr = (void *)((char *)new_trace_buf +
-                             ((char *)trace_buf_ptr - (char *)trace_buf));
-    trace_buf = new_trace_buf;
-    trace_buf_size = new_trace_buf_size;
-    buf_remain = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
+  } else {
+    ret = reconfigure_trace_source(board, &devices, trace_cpu, map_info,
+                                   range_count, pid);
   }
+  pthread_mutex_unlock(&trace_mutex);
 
-  n = cs_get_trace_data(etb, trace_buf_ptr, buf_remain);
-  if (n <= 0) {
-    fprintf(stderr, "Failed to get trace\n");
-  } else if (n < len) {
-    fprintf(stderr, "Got incomplete trace\n");
+  if (ret < 0) {
+    fprintf(stderr, "Failed to retarget trace to PID %d\n", pid);
   }
-  cs_empty_trace_buffer(etb);
-  trace_buf_ptr = (void *)((char *)trace_buf_ptr + n);
-
-  ret = 0;
 
 exit:
-  pthread_mutex_unlock(&trace_mutex);
   return ret;
 }
 
-int decode_trace(void)
+/* Program the context ID filter with followed_pids. Must be called with
+ * trace_mutex held. */
+static int update_followed_pids(void)
+{
+  if (!pid_filter_on) {
+    return 0;
+  }
+
+  if (shared_sink) {
+    /* cs-traced filters a single context ID. Trace the ranges only. */
+    return configure_traced_source(
+        map_info, range_count, followed_pid_count > 1 ? 0 : followed_pids[0]);
+  }
+
+  return reconfigure_trace_source_pids(board, &devices, trace_cpu, map_info,
+                                       range_count, followed_pids,
+                                       followed_pid_count);
+}
+
+/* Add a forked child of the tracee to the session. The child shares the
+ * address ranges of the tracee, so only the context ID filter is extended. */
+int follow_trace(pid_t pid)
 {
+  pid_t tgid;
   int ret;
-  void *buf;
-  size_t buf_size;
 
-  buf = decoded_trace_buf;
-  buf_size = (size_t)((char *)trace_buf_ptr - (char *)buf);
+  pthread_mutex_lock(&trace_mutex);
 
-  ret = run_decoder(buf, buf_size);
-  if (ret < 0) {
+  if (followed_pid_count >= FOLLOW_PID_MAX) {
+    fprintf(stderr, "Too many processes to follow. PID %d is ignored\n", pid);
+    ret = -1;
     goto exit;
   }
+  followed_pids[followed_pid_count++] = pid;
+  /* The new thread is stopped, so it is still there to look up. */
+  if (context_scanner_on && (tgid = get_thread_group(pid)) > 0) {
+    add_context_thread(pid, tgid);
+  }
 
-  decoded_trace_buf = (void *)((char *)buf + buf_size);
+  if ((ret = update_followed_pids()) < 0) {
+    fprintf(stderr, "Failed to follow PID %d\n", pid);
+  }
 
 exit:
+  pthread_mutex_unlock(&trace_mutex);
 
   return ret;
 }
 
-void trace_suspend_resume_callback(void) { set_trace_state(suspended_state); }
-
-/* Start trace session. CoreSight and decoder must be initialized. */
-int start_trace(pid_t pid, bool use_pid_trace)
+/* Remove an exited child of the tracee from the session. */
+int unfollow_trace(pid_t pid)
 {
   int ret;
+  int i;
 
-  if ((ret = set_cpu_affinity(trace_cpu, pid)) < 0) {
-    fprintf(stderr, "set_cpu_affinity() failed\n");
-    goto exit;
-  }
+  ret = 0;
 
-  alloc_trace_buf();
+  pthread_mutex_lock(&trace_mutex);
 
-  if (decoding_on && ((ret = reset_decoder(map_info, range_count)) < 0)) {
-    fprintf(stderr, "reset_decoder() failed\n");
-    goto exit;
+  for (i = 1; i < followed_pid_count; i++) {
+    if (followed_pids[i] == pid) {
+      followed_pids[i] = followed_pids[--followed_pid_count];
+      ret = update_followed_pids();
+      break;
+    }
   }
 
-  child_pid = pid;
-  if ((ret = enable_cs_trace(use_pid_trace ? pid : 0)) < 0) {
-    fprintf(stderr, "enable_cs_trace() failed\n");
-  }
+  pthread_mutex_unlock(&trace_mutex);
 
-  if (ret < 0) {
-    goto exit;
-  }
+  return ret;
+}
 
-  set_trace_state(running_state);
+/* Count the ETM overflow packets in the trace of the session. */
+static void count_session_overflows(void)
+{
+  int trace_ids[TRACE_CPU_MAX];
 
-exit:
-  return ret;
+  add_trace_loss(etm_overflows,
+                 count_trace_overflows(
+                     trace_buf,
+                     (size_t)((char *)trace_buf_ptr - (char *)trace_buf),
+                     trace_ids, get_trace_ids(trace_ids)));
+}
+
+/* Write the loss counted since the start, if any. */
+static void report_trace_loss(void)
+{
+  unsigned long count;
+  bool lossy;
+  int i;
+
+  lossy = false;
+  for (i = 0; i < trace_loss_count; i++) {
+    count = atomic_load(&trace_stats->loss[i]);
+    if (count == 0) {
+      continue;
+    }
+    fprintf(stderr, "%s %s=%lu", lossy ? "" : "WARNING: Trace lost:",
+            get_trace_loss_name((trace_loss_t)i), count);
+    lossy = true;
+  }
+  if (lossy) {
+    fputc('\n', stderr);
+  }
 }
 
 /* Stop trace session. CoreSight and decoder are still available. */
 int stop_trace(bool disable_all)
 {
+  unsigned long start;
+  bool started;
   int ret;
 
-  if ((ret = disable_cs_trace(disable_all)) < 0) {
+  ret = 0;
+  started = atomic_load(&trace_state) != ready_state;
+
+  atomic_store(&trace_active, false);
+
+  /* The trace of a hung session was stopped when the hang was detected. */
+  start = read_system_counter();
+  if ((disable_all || !atomic_load(&hang_detected)) &&
+      (ret = disable_cs_trace(disable_all)) < 0) {
     fprintf(stderr, "disable_cs_trace() failed\n");
     goto exit;
   }
+  add_trace_stats(disable_phase, start);
 
+  start = read_system_counter();
   set_trace_state(ready_state);
 
-  /* FIXME: Hang with condition trace_state == ready_state && trace_event ==
-   * stop_event */
-  pthread_mutex_lock(&trace_decoder_mutex);
-  while (!decoder_ready) {
-    pthread_cond_wait(&trace_decoder_cond, &trace_decoder_mutex);
+  /* Wait for the decoder worker to drain the session. It sees the stop event
+   * even if it is still handling an earlier one, since events are queued. */
+  if (decoding_on && started) {
+    wait_trace_event(&tracer_cursor, EVENT_MASK(drained_event));
+  }
+  add_trace_stats(drain_phase, start);
+
+  if (loss_check && !disable_all) {
+    count_session_overflows();
   }
-  pthread_mutex_unlock(&trace_decoder_mutex);
 
 exit:
   return ret;
@@ -780,12 +2232,61 @@ int init_trace(pid_t parent_pid, pid_t pid)
   ret = -1;
 
   pthread_mutex_init(&trace_mutex, NULL);
-  pthread_mutex_init(&trace_state_mutex, NULL);
-  pthread_mutex_init(&trace_event_mutex, NULL);
-  pthread_cond_init(&trace_event_cond, NULL);
+  init_event_queue(&trace_events);
+  init_event_cursor(&trace_events, &worker_cursor);
+  init_event_cursor(&trace_events, &tracer_cursor);
+
+  if (etm_timestamp) {
+    if (init_trace_clock(&trace_clock) < 0) {
+      goto exit;
+    }
+    trace_clock_on = true;
+  }
+
+  if (flight_recorder) {
+    if (shared_sink || decoding_on) {
+      fprintf(stderr, "Flight recorder needs exclusive access to CoreSight "
+                      "and no decoding\n");
+      goto exit;
+    }
+    if (etm_sync_period == 0 || etm_sync_period > FLIGHT_SYNC_PERIOD) {
+      etm_sync_period = FLIGHT_SYNC_PERIOD;
+    }
+  }
+
+  if (stm_markers && (shared_sink || flight_recorder)) {
+    fprintf(stderr, "STM markers need exclusive access to CoreSight and no "
+                    "flight recorder\n");
+    goto exit;
+  }
+
+  if (stm_annotations && shared_sink) {
+    fprintf(stderr, "STM annotations need exclusive access to CoreSight\n");
+    goto exit;
+  }
+
+  if (trace_cpu_list) {
+    if (shared_sink) {
+      fprintf(stderr, "Multi-CPU trace needs exclusive access to CoreSight\n");
+      goto exit;
+    }
+    if (setup_trace_cpus() < 0) {
+      goto exit;
+    }
+  }
 
-  pthread_mutex_init(&trace_decoder_mutex, NULL);
-  pthread_cond_init(&trace_decoder_cond, NULL);
+  /* In shared sink mode, cs-traced owns the CoreSight hardware and leases a
+   * CPU with its trace ID. trace_cpu < 0 leases any free CPU. */
+  if (shared_sink) {
+    if (connect_traced() < 0) {
+      fprintf(stderr, "connect_traced() failed\n");
+      goto exit;
+    }
+    if (lease_traced_cpu(trace_cpu, &trace_cpu, &trace_id) < 0) {
+      fprintf(stderr, "lease_traced_cpu() failed\n");
+      goto exit;
+    }
+  }
 
   if (trace_cpu < 0) {
     if ((preferred_cpu = get_preferred_cpu(parent_pid)) < 0) {
@@ -799,7 +2300,9 @@ int init_trace(pid_t parent_pid, pid_t pid)
     trace_cpu = preferred_cpu >= 0 ? preferred_cpu : DEFAULT_TRACE_CPU;
   }
 
-  if (get_udmabuf_info(udmabuf_num, &etr_ram_addr, &etr_ram_size) < 0) {
+  /* The trace sinks are set up by the sink owner in shared sink mode. */
+  if (!shared_sink &&
+      get_udmabuf_info(udmabuf_num, &etr_ram_addr, &etr_ram_size) < 0) {
     fprintf(stderr, "Failed to get u-dma-buf info\n");
     goto exit;
   }
@@ -810,21 +2313,69 @@ int init_trace(pid_t parent_pid, pid_t pid)
     goto exit;
   }
 
-  if (setup_named_board(board_name, &board, &devices, known_boards) < 0) {
-    fprintf(stderr, "setup_named_board() failed\n");
-    goto exit;
-  }
+  if (shared_sink) {
+    if (!(sink_ring = open_trace_ring(trace_id))) {
+      fprintf(stderr, "open_trace_ring() failed\n");
+      goto exit;
+    }
+    sink_ring_lost = atomic_load(&sink_ring->lost);
+  } else {
+    if (setup_cached_board(board_name, &board, &devices, known_boards) < 0) {
+      fprintf(stderr, "setup_cached_board() failed\n");
+      goto exit;
+    }
 
-  if ((trace_id = get_trace_id(board_name, trace_cpu)) < 0) {
-    goto exit;
+    if ((trace_id = get_trace_id(board_name, trace_cpu)) < 0) {
+      goto exit;
+    }
+
+    if ((stm_markers || stm_annotations) && !devices.itm) {
+      fprintf(stderr, "No STM registered on %s\n", board->hardware);
+      goto exit;
+    }
+    if (stm_markers) {
+      if (!(etr_buf = map_udmabuf(udmabuf_num, etr_ram_size))) {
+        goto exit;
+      }
+      if (init_stm_marker_finder(&marker_finder, STM_TRACE_ID,
+                                 STM_MARKER_CHANNEL) < 0) {
+        goto exit;
+      }
+    }
   }
 
   if (decoding_on) {
-    decoder = init_decoder(map_info, range_count);
+    if (!trace_bitmap) {
+      trace_bitmap = malloc(trace_bitmap_size);
+      if (!trace_bitmap) {
+        perror("malloc");
+        goto exit;
+      }
+    }
+    decoder = init_decoder(trace_bitmap, map_info, range_count);
     if (!decoder) {
       fprintf(stderr, "init_decoder() failed\n");
       goto exit;
     }
+    /* Trace context IDs, unfiltered, to tell threads on a CPU apart. */
+    if (decoder_lane_count > 0) {
+      if (init_context_stream(&cpu_contexts) < 0) {
+        goto exit;
+      }
+      thread_split_on = true;
+      etm_context_ids = true;
+    }
+    if (init_decoder_lanes(map_info, range_count) < 0 ||
+        start_decoder_lanes() < 0) {
+      goto exit;
+    }
+    /* Processes are only told apart on a single CPU. */
+    if (split_contexts && decoder_lane_count == 0) {
+      if (init_context_stream(&process_contexts) < 0) {
+        goto exit;
+      }
+      context_scanner_on = true;
+    }
     ret = pthread_create(&decoder_thread, NULL, decoder_worker, NULL);
     if (ret != 0) {
       fprintf(stderr, "pthread_create() failed: %d\n", ret);
@@ -857,9 +2408,210 @@ int init_trace(pid_t parent_pid, pid_t pid)
 
 exit:
   if (ret != 0) {
-    cs_shutdown();
+    if (shared_sink) {
+      disconnect_traced();
+    } else {
+      cs_shutdown();
+    }
+  }
+
+  return ret;
+}
+
+static int get_trace_ids(int *trace_ids)
+{
+  int count;
+  int i;
+
+  trace_ids[0] = trace_id;
+  count = 1;
+  for (i = 0; i < decoder_lane_count; i++) {
+    trace_ids[count++] = decoder_lanes[i].trace_id;
+  }
+
+  return count;
+}
+
+/* Freeze the sink and write its content, which is the tail of the trace in
+ * flight recorder mode, with the last taken branches decoded from it. The
+ * sink is re-armed when resume is set. */
+int snapshot_trace(unsigned int index, bool resume)
+{
+  struct profile profile;
+  int trace_ids[TRACE_CPU_MAX];
+  char path[PATH_MAX];
+  size_t size;
+  FILE *fp;
+  int ret;
+
+  if ((ret = disable_cs_trace(false)) < 0) {
+    fprintf(stderr, "disable_cs_trace() failed\n");
+  }
+  pthread_mutex_lock(&trace_mutex);
+  trace_buf_ptr = trace_buf;
+  decoded_trace_buf = trace_buf;
+  pthread_mutex_unlock(&trace_mutex);
+  fetch_trace();
+  size = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
+
+  snprintf(path, sizeof(path), SNAPSHOT_TRACE_NAME_FMT, index);
+  fp = fopen(path, "wb");
+  if (!fp) {
+    perror("fopen");
+    ret = -1;
+    goto exit;
+  }
+  fwrite(trace_buf, size, 1, fp);
+  fclose(fp);
+
+  if (init_profile(&profile) < 0) {
+    ret = -1;
+    goto exit;
+  }
+  snprintf(path, sizeof(path), SNAPSHOT_HISTORY_NAME_FMT, index);
+  if (init_profile_history(&profile, DEFAULT_HISTORY_SIZE) < 0 ||
+      decode_profile(&profile, trace_buf, size, trace_ids,
+                     get_trace_ids(trace_ids), map_info, range_count, 1) < 0 ||
+      export_profile_history(&profile, path, map_info, range_count) < 0) {
+    fprintf(stderr, "Failed to write branch history\n");
+    ret = -1;
+  }
+  fini_profile(&profile);
+
+exit:
+  if (resume && enable_cs_trace(child_pid) < 0) {
+    fprintf(stderr, "enable_cs_trace() failed\n");
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/* Sign the last depth taken branches of the session, which was stopped. Only
+ * the tail of the trace is decoded unless it has too few branches. The
+ * branch history is written to dir when the signature is new. Returns 1 for
+ * a new signature, 0 for a known one or -1 on error. */
+int sign_trace_tail(unsigned int depth, const char *dir,
+                    unsigned long *signature)
+{
+  struct profile profile;
+  int trace_ids[TRACE_CPU_MAX];
+  char path[PATH_MAX];
+  size_t size, start;
+  int count;
+  int ret;
+
+  size = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
+  count = get_trace_ids(trace_ids);
+  start = size > SIGNATURE_TAIL_SIZE
+              ? (size - SIGNATURE_TAIL_SIZE) & ~(size_t)0xf /* Frame */
+              : 0;
+
+  while (1) {
+    if (init_profile(&profile) < 0) {
+      return -1;
+    }
+    if (init_profile_history(&profile, depth) < 0 ||
+        decode_profile(&profile, (char *)trace_buf + start, size - start,
+                       trace_ids, count, map_info, range_count, 1) < 0) {
+      ret = -1;
+      goto exit;
+    }
+    if (profile.history.count >= depth || start == 0) {
+      break;
+    }
+    fini_profile(&profile);
+    start = 0;
+  }
+
+  if (profile.history.count == 0) {
+    ret = -1;
+    goto exit;
+  }
+
+  *signature = get_history_signature(&profile, map_info, range_count);
+  snprintf(path, sizeof(path), SIGNATURE_NAME_FMT, dir, *signature);
+  if (access(path, F_OK) == 0) {
+    ret = 0;
+  } else if (export_profile_history(&profile, path, map_info, range_count) <
+             0) {
+    ret = -1;
+  } else {
+    ret = 1;
+  }
+
+exit:
+  fini_profile(&profile);
+  return ret;
+}
+
+/* Decode the whole trace into branch and range counts of each image. */
+static int write_trace_profile(void)
+{
+  struct profile profile;
+  int trace_ids[TRACE_CPU_MAX];
+  int count;
+  int ret;
+
+  count = get_trace_ids(trace_ids);
+
+  if (init_profile(&profile) < 0) {
+    return -1;
+  }
+  if (profile_format == folded_profile &&
+      init_profile_stacks(&profile, stack_weight) < 0) {
+    fini_profile(&profile);
+    return -1;
+  }
+  if (profile_format == cycles_profile && init_profile_cycles(&profile) < 0) {
+    fini_profile(&profile);
+    return -1;
+  }
+  if (time_slice_on && trace_clock_on) {
+    sample_trace_clock(&trace_clock.end);
+    profile.window.on = true;
+    profile.window.start = monotonic_to_counter(&trace_clock, time_slice_start);
+    profile.window.end = monotonic_to_counter(&trace_clock, time_slice_end);
+  }
+
+  ret = decode_profile(&profile, trace_buf,
+                       (size_t)((char *)trace_buf_ptr - (char *)trace_buf),
+                       trace_ids, count, map_info, range_count, profile_jobs);
+  if (ret == 0) {
+    ret = export_profile(&profile, profile_format, map_info, range_count);
   }
 
+  fini_profile(&profile);
+
+  return ret;
+}
+
+/* Place the STM annotations in the flow of the traced CPU and write them
+ * with their call stacks. */
+static int write_trace_annotations(void)
+{
+  struct profile profile;
+  size_t size;
+  int ret;
+
+  size = (size_t)((char *)trace_buf_ptr - (char *)trace_buf);
+
+  if (init_profile(&profile) < 0) {
+    return -1;
+  }
+  ret = -1;
+  if (init_profile_stacks(&profile, insn_weight) < 0 ||
+      decode_stm_annotations(&profile.annotations, trace_buf, size,
+                             STM_TRACE_ID, trace_id) < 0 ||
+      decode_profile(&profile, trace_buf, size, &trace_id, 1, map_info,
+                     range_count, 1) < 0) {
+    goto exit;
+  }
+  ret = export_profile_annotations(&profile, DEFAULT_ANNOTATION_NAME, map_info,
+                                   range_count);
+
+exit:
+  fini_profile(&profile);
   return ret;
 }
 
@@ -878,21 +2630,59 @@ void fini_trace(void)
 
   export_trace(DEFAULT_TRACE_NAME, DEFAULT_TRACE_ARGS_NAME);
 
+  if (!loss_check) {
+    count_session_overflows();
+  }
+  report_trace_loss();
+
+  if (profiling && write_trace_profile() < 0) {
+    fprintf(stderr, "Failed to write profile\n");
+  }
+
+  if (stm_annotations && write_trace_annotations() < 0) {
+    fprintf(stderr, "Failed to write STM annotations\n");
+  }
+
   if (registration_verbose > 0) {
     dump_map_info(stderr, map_info, range_count);
   }
 
-  fini_decoder();
+  if (context_scanner_on) {
+    export_process_coverage();
+  }
+
+  stop_decoder_lanes();
+  fini_decoder_lanes();
+  if (thread_split_on) {
+    fini_context_stream(&cpu_contexts);
+    thread_split_on = false;
+  }
+  fini_process_decoders();
+  fini_decoder(decoder);
 
   free_trace_buf();
 
-  cs_shutdown();
+  if (etr_buf) {
+    munmap(etr_buf, etr_ram_size);
+    etr_buf = NULL;
+    fini_stm_marker_finder(&marker_finder);
+  }
+
+  if (sink_ring) {
+    close_trace_ring(sink_ring);
+    sink_ring = NULL;
+  }
+
+  if (shared_sink) {
+    disconnect_traced();
+  } else {
+    cs_shutdown();
+  }
 
-  pthread_cond_destroy(&trace_decoder_cond);
-  pthread_mutex_destroy(&trace_decoder_mutex);
+  if (trace_clock_on) {
+    fini_trace_clock(&trace_clock);
+    trace_clock_on = false;
+  }
 
-  pthread_cond_destroy(&trace_event_cond);
-  pthread_mutex_destroy(&trace_event_mutex);
-  pthread_mutex_destroy(&trace_state_mutex);
   pthread_mutex_destroy(&trace_mutex);
 }
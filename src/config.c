@@ -14,11 +14,20 @@
 #include "csregisters.h"
 #include "cs_util_create_snapshot.h"
 
+#include "clock.h"
+#include "stats.h"
+#include "stm.h"
 #include "utils.h"
 
 #define SHOW_ETM_CONFIG 0
+#define MAX_TRACE_CIDS 4 /* Comparators covered by TRCCIDCCTLR0 */
+#define STM_MARKER_TRANS 0x00 /* Guaranteed data, marked and timestamped */
 
 const bool return_stack = false;
+unsigned int etm_sync_period = 0; /* A-sync every 2^N bytes, 0 to disable */
+bool etm_timestamp = false;       /* Timestamp at every trace sync */
+bool etm_context_ids = false;     /* Trace context IDs also unfiltered */
+unsigned int etm_cycle_threshold = 0; /* Cycle counting, 0 to disable */
 
 extern unsigned long etr_ram_addr;
 extern size_t etr_ram_size;
@@ -27,8 +36,10 @@ extern int registration_verbose;
 void cs_etb_flush_and_wait_stop(struct cs_devices_t *devices)
 {
   unsigned int ffcr_val, status_val;
+  unsigned long start;
 
   if (cs_sink_is_enabled(devices->etb)) {
+    start = read_system_counter();
     ffcr_val = cs_device_read(devices->etb, CS_ETB_FLFMT_CTRL);
     ffcr_val |= CS_ETB_FLFMT_CTRL_FOnMan;
     cs_device_write(devices->etb, CS_ETB_FLFMT_CTRL, ffcr_val);
@@ -38,6 +49,7 @@ void cs_etb_flush_and_wait_stop(struct cs_devices_t *devices)
               "ETB collection not stopped on flush on trigger. STS: 0x%08x\n",
               status_val);
     }
+    add_trace_stats(flush_phase, start);
   }
 }
 
@@ -77,24 +89,48 @@ static void set_etmv4_addr_range(struct map_info *range,
   addr_comp[1].acatr_l = acc_type;
 }
 
-static int configure_etmv4_addr_range_cid(cs_device_t etm,
-                                          struct map_info *range,
-                                          int range_count, unsigned long cid)
+/* Trace the address ranges in each of the context IDs. A pair of address
+ * comparators is linked to a context ID comparator for every range and
+ * context ID. If the ETM runs out of comparators for more than one context
+ * ID, the context ID filter is dropped and only the ranges are traced. The
+ * context IDs are still traced, so that the trace can be split by them. */
+static int configure_etmv4_addr_range_cids(cs_device_t etm,
+                                           struct map_info *range,
+                                           int range_count,
+                                           const unsigned long *cids,
+                                           int cid_count)
 {
   cs_etmv4_config_t tconfig;
+  bool trace_cids;
   int error_count;
   size_t cididx;
   size_t addridx;
+  size_t i;
 
   /* default settings are trace everything - already set. */
   cs_etm_config_init_ex(etm, &tconfig);
   tconfig.flags = CS_ETMC_TRACE_ENABLE | CS_ETMC_CONFIG | CS_ETMC_EVENTSELECT;
   cs_etm_config_get_ex(etm, &tconfig);
 
+  trace_cids = etm_context_ids || (cid_count > 0 && cids[0] != 0);
+  if (cid_count > 1 &&
+      (cid_count > MAX_TRACE_CIDS ||
+       cid_count > tconfig.scv4->idr4.bits.numcidc ||
+       cid_count * range_count > tconfig.scv4->idr4.bits.numacpairs)) {
+    fprintf(stderr,
+            "WARNING: Not enough comparators for %d context IDs. "
+            "Trace by address range only\n",
+            cid_count);
+    cid_count = 0;
+  }
+  if (cid_count > 0 && cids[0] == 0) {
+    cid_count = 0;
+  }
+
   if (tconfig.scv4->idr2.bits.vmidsize > 0)
     /* XXX: VMID trace must be disabled to use context ID trace only. */
     tconfig.configr.bits.vmid = 0;
-  if (tconfig.scv4->idr2.bits.cidsize > 0 && cid > 0) {
+  if (tconfig.scv4->idr2.bits.cidsize > 0 && trace_cids) {
     tconfig.configr.bits.cid = 1; /* context ID trace enable. */
   } else {
     tconfig.configr.bits.cid = 0; /* context ID trace disable. */
@@ -102,25 +138,28 @@ static int configure_etmv4_addr_range_cid(cs_device_t etm,
 
   if (return_stack) tconfig.configr.bits.rs = 1; /* set the return stack */
 
-  if (cid > 0) {
-    cididx = 0;
-    tconfig.cxid_comps[cididx].cidcvr_l = cid & 0xFFFFFFFF;
-    tconfig.cxid_comps[cididx].cidcvr_h = (cid >> 32) & 0xFFFFFFFF;
-    tconfig.cidcctlr0 &= ~(1 << cididx);
+  for (cididx = 0; cididx < cid_count; cididx++) {
+    tconfig.cxid_comps[cididx].cidcvr_l = cids[cididx] & 0xFFFFFFFF;
+    tconfig.cxid_comps[cididx].cidcvr_h = (cids[cididx] >> 32) & 0xFFFFFFFF;
+    tconfig.cidcctlr0 &= ~(0xFF << (cididx * 8));
     tconfig.cxid_comps_acc_mask |= (1 << cididx);
     tconfig.flags |= CS_ETMC_CXID_COMP;
   }
 
   addridx = 0;
+  tconfig.viiectlr = 0; /* Drop ranges of the previous configuration */
   /* XXX: Assuming range[0] is the tracee itself. */
   /* Set and enable Context ID filtering */
-  for (addridx = 0; addridx < range_count && \
-          addridx < tconfig.scv4->idr4.bits.numacpairs; addridx++) {
-    set_etmv4_addr_range(&range[addridx], &tconfig.addr_comps[addridx*2],
-            cid > 0 ? (cididx << 4) | (0x1 << 2) : 0);
-    tconfig.addr_comps_acc_mask |= 0x3 << (addridx*2);
-    tconfig.viiectlr |= 1 << addridx;
-  }
+  cididx = 0;
+  do {
+    for (i = 0; i < range_count && \
+            addridx < tconfig.scv4->idr4.bits.numacpairs; i++, addridx++) {
+      set_etmv4_addr_range(&range[i], &tconfig.addr_comps[addridx*2],
+              cid_count > 0 ? (cididx << 4) | (0x1 << 2) : 0);
+      tconfig.addr_comps_acc_mask |= 0x3 << (addridx*2);
+      tconfig.viiectlr |= 1 << addridx;
+    }
+  } while (++cididx < cid_count);
 
   tconfig.flags |= CS_ETMC_ADDR_COMP;
 
@@ -141,6 +180,13 @@ static int configure_etmv4_addr_range_cid(cs_device_t etm,
   return 0;
 }
 
+static int configure_etmv4_addr_range_cid(cs_device_t etm,
+                                          struct map_info *range,
+                                          int range_count, unsigned long cid)
+{
+  return configure_etmv4_addr_range_cids(etm, range, range_count, &cid, 1);
+}
+
 int init_etm(cs_device_t dev)
 {
   int rc;
@@ -177,7 +223,23 @@ int init_etm(cs_device_t dev)
   v4config.eventctlr1r = 0;
   /* config */
   v4config.stallcrlr = (1 << 13); /* NOOVERFLOW */
-  v4config.syncpr = 0;            /* no sync */
+  /* Without support, the ETM drops trace and emits an overflow packet. */
+  trace_stats->nooverflow = v4config.scv4->idr3.bits.nooverflow;
+  v4config.syncpr = etm_sync_period;
+  if (etm_timestamp && v4config.scv4->idr0.bits.tssize > 0) {
+    v4config.configr.bits.ts = 1;
+  }
+  if (etm_cycle_threshold > 0) {
+    if (v4config.scv4->idr0.bits.cci) {
+      v4config.configr.bits.cci = 1;
+      v4config.ccctlr = etm_cycle_threshold;
+      if (v4config.ccctlr < v4config.scv4->idr3.bits.ccitmin) {
+        v4config.ccctlr = v4config.scv4->idr3.bits.ccitmin;
+      }
+    } else {
+      fprintf(stderr, "WARNING: Cycle counting is not supported\n");
+    }
+  }
   cs_etm_config_put_ex(dev, &v4config);
 
   return 0;
@@ -391,3 +453,388 @@ int disable_trace_sinks_only(const struct board *board, struct cs_devices_t *dev
 
   return 0;
 }
+
+/* Configure the ETM of a single CPU, leaving trace sinks and other CPUs
+ * untouched. Used when the trace sinks are owned by another process. */
+int configure_trace_source(const struct board *board,
+                           struct cs_devices_t *devices, int cpu, int trace_id,
+                           struct map_info *range, int range_count, pid_t pid)
+{
+  cs_device_t etm;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  etm = cs_cpu_get_device(cpu, CS_DEVCLASS_SOURCE);
+  if (etm == CS_ERRDESC) {
+    fprintf(stderr, "Failed to get trace source for CPU #%d\n", cpu);
+    return -1;
+  }
+  devices->ptm[cpu] = etm;
+
+  if (cs_set_trace_source_id(etm, trace_id) < 0) {
+    fprintf(stderr, "Failed to set trace source id for CPU #%d\n", cpu);
+  }
+  if (init_etm(etm) < 0) {
+    fprintf(stderr, "Failed to init etm for CPU #%d\n", cpu);
+    return -1;
+  }
+  cs_checkpoint();
+
+  if (CS_ETMVERSION_MAJOR(cs_etm_get_version(etm)) < CS_ETMVERSION_ETMv4) {
+    fprintf(stderr, "Unsupported ETM for CPU #%d\n", cpu);
+    return -1;
+  }
+
+  return configure_etmv4_addr_range_cid(etm, range, range_count,
+                                        (unsigned long)pid);
+}
+
+int enable_trace_source(const struct board *board,
+                        struct cs_devices_t *devices, int cpu)
+{
+  int error_count;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  cs_trace_enable(devices->ptm[cpu]);
+  cs_checkpoint();
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when enabling trace source\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+int disable_trace_source(const struct board *board,
+                         struct cs_devices_t *devices, int cpu)
+{
+  int error_count;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  cs_trace_disable(devices->ptm[cpu]);
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when disabling trace source\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Point the enabled ETM of the CPU at another process. Only the context ID
+ * and address range comparators are reprogrammed. */
+int reconfigure_trace_source(const struct board *board,
+                             struct cs_devices_t *devices, int cpu,
+                             struct map_info *range, int range_count,
+                             pid_t pid)
+{
+  cs_device_t etm;
+  int ret;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  etm = devices->ptm[cpu];
+  if (!etm) {
+    return -1;
+  }
+
+  cs_etm_enable_programming(etm);
+  ret = configure_etmv4_addr_range_cid(etm, range, range_count,
+                                       (unsigned long)pid);
+  cs_etm_disable_programming(etm);
+  cs_checkpoint();
+
+  return ret;
+}
+
+/* Point the enabled ETM of the CPU at a set of processes which share the
+ * address ranges, e.g. a process and its forked children. */
+int reconfigure_trace_source_pids(const struct board *board,
+                                  struct cs_devices_t *devices, int cpu,
+                                  struct map_info *range, int range_count,
+                                  const pid_t *pids, int pid_count)
+{
+  cs_device_t etm;
+  unsigned long cids[MAX_TRACE_CIDS];
+  int i;
+  int ret;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu || !pids ||
+      pid_count <= 0) {
+    return -1;
+  }
+
+  etm = devices->ptm[cpu];
+  if (!etm) {
+    return -1;
+  }
+
+  if (pid_count > MAX_TRACE_CIDS) {
+    /* Too many to filter by context ID. Trace by address range only. */
+    cids[0] = 0;
+    pid_count = 1;
+  } else {
+    for (i = 0; i < pid_count; i++) {
+      cids[i] = (unsigned long)pids[i];
+    }
+  }
+
+  cs_etm_enable_programming(etm);
+  ret = configure_etmv4_addr_range_cids(etm, range, range_count, cids,
+                                        pid_count);
+  cs_etm_disable_programming(etm);
+  cs_checkpoint();
+
+  return ret;
+}
+
+/* Resume the enabled ETM of the CPU without reprogramming it. */
+int resume_trace_source(const struct board *board,
+                        struct cs_devices_t *devices, int cpu)
+{
+  int error_count;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  cs_etm_disable_programming(devices->ptm[cpu]);
+  cs_checkpoint();
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when resuming trace source\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+int suspend_trace_source(const struct board *board,
+                         struct cs_devices_t *devices, int cpu)
+{
+  int error_count;
+
+  if (!board || !devices || cpu < 0 || cpu >= board->n_cpu) {
+    return -1;
+  }
+
+  cs_etm_enable_programming(devices->ptm[cpu]);
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when suspending trace source\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Enable trace sinks to capture continuously. Unlike enable_trace(), a flush
+ * does not stop the capture, so that the sinks can be shared by tracers. */
+int enable_shared_sink(const struct board *board, struct cs_devices_t *devices)
+{
+  unsigned int ffcr_val;
+  int error_count;
+
+  if (!board || !devices) {
+    return -1;
+  }
+
+  cs_sink_disable(devices->etb);
+  if (cs_sink_etr_setup(devices->etb, etr_ram_addr, etr_ram_size,
+                        board->etr_axictl) != 0) {
+    fprintf(stderr, "Failed to setup ETR\n");
+    return -1;
+  }
+  ffcr_val = cs_device_read(devices->etb, CS_ETB_FLFMT_CTRL);
+  ffcr_val &= ~CS_ETB_FLFMT_CTRL_StopFl;
+  if (cs_device_write(devices->etb, CS_ETB_FLFMT_CTRL, ffcr_val) != 0) {
+    fprintf(stderr, "Failed to clear stop on flush\n");
+    return -1;
+  }
+  if (cs_sink_enable(devices->etb) != 0) {
+    fprintf(stderr, "Failed to enable ETR\n");
+    return -1;
+  }
+
+  if (devices->trace_sinks[0]) {
+    if (cs_sink_etf_setup(devices->trace_sinks[0], CS_ETB_RAM_MODE_HW_FIFO) !=
+        0) {
+      fprintf(stderr, "Failed to setup ETF\n");
+      return -1;
+    }
+    if (cs_sink_enable(devices->trace_sinks[0]) != 0) {
+      fprintf(stderr, "Failed to enable ETF\n");
+      return -1;
+    }
+  }
+
+  cs_checkpoint();
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when enabling shared sink\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+int disable_shared_sink(const struct board *board,
+                        struct cs_devices_t *devices)
+{
+  int error_count;
+
+  if (!board || !devices) {
+    return -1;
+  }
+
+  cs_etb_flush_and_wait_stop(devices);
+
+  if (devices->trace_sinks[0]) {
+    cs_sink_disable(devices->trace_sinks[0]);
+  }
+  cs_sink_disable(devices->etb);
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when disabling shared sink\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Enable the ETMs and the STM into trace sinks capturing continuously. The
+ * STM writes markers between executions into the same trace. */
+/* Let software write to every stimulus port of the STM. */
+int enable_stm_source(struct cs_devices_t *devices, int stm_trace_id)
+{
+  if (!devices || !devices->itm) {
+    return -1;
+  }
+
+  if (cs_set_trace_source_id(devices->itm, stm_trace_id) != 0 ||
+      cs_trace_swstim_enable_all_ports(devices->itm) != 0 ||
+      cs_trace_enable(devices->itm) != 0) {
+    fprintf(stderr, "Failed to enable STM\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int disable_stm_source(struct cs_devices_t *devices)
+{
+  if (!devices || !devices->itm) {
+    return -1;
+  }
+
+  return cs_trace_disable(devices->itm) != 0 ? -1 : 0;
+}
+
+int enable_marked_trace(const struct board *board,
+                        struct cs_devices_t *devices, int stm_trace_id)
+{
+  int i, error_count;
+
+  if (!board || !devices || !devices->itm) {
+    return -1;
+  }
+
+  if (enable_shared_sink(board, devices) < 0) {
+    return -1;
+  }
+
+  if (enable_stm_source(devices, stm_trace_id) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < board->n_cpu; ++i) {
+    cs_trace_enable(devices->ptm[i]);
+  }
+
+  cs_checkpoint();
+
+  error_count = cs_error_count();
+  if (error_count > 0) {
+    fprintf(stderr, "%u errors reported when enabling marked trace\n",
+            error_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+int disable_marked_trace(const struct board *board,
+                         struct cs_devices_t *devices)
+{
+  if (!board || !devices || !devices->itm) {
+    return -1;
+  }
+
+  disable_stm_source(devices);
+
+  return disable_trace(board, devices);
+}
+
+int write_stm_marker(struct cs_devices_t *devices, unsigned int marker)
+{
+  if (!devices || !devices->itm) {
+    return -1;
+  }
+
+  if (cs_stm_ext_write(devices->itm, STM_MARKER_CHANNEL,
+                       (const unsigned char *)&marker, sizeof(marker),
+                       STM_MARKER_TRANS) < 0) {
+    fprintf(stderr, "Failed to write STM marker\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Push in-flight trace into the sink memory while keeping it capturing. */
+int flush_shared_sink(struct cs_devices_t *devices)
+{
+  unsigned int ffcr_val;
+  unsigned long start;
+
+  if (!devices) {
+    return -1;
+  }
+
+  start = read_system_counter();
+  ffcr_val = cs_device_read(devices->etb, CS_ETB_FLFMT_CTRL);
+  ffcr_val |= CS_ETB_FLFMT_CTRL_FOnMan;
+  cs_device_write(devices->etb, CS_ETB_FLFMT_CTRL, ffcr_val);
+  /* FlushMan reads as 1 until the flush completes. */
+  if (cs_device_wait(devices->etb, CS_ETB_FLFMT_CTRL, CS_ETB_FLFMT_CTRL_FOnMan,
+                     CS_REG_WAITBITS_ALL_0, 0, &ffcr_val) != 0) {
+    fprintf(stderr, "ETB flush not completed. FFCR: 0x%08x\n", ffcr_val);
+    return -1;
+  }
+  add_trace_stats(flush_phase, start);
+
+  return 0;
+}
@@ -12,8 +12,12 @@
 #include "afl/types.h"
 #include "afl/debug.h"
 
+#include "clock.h"
 #include "config.h"
 #include "common.h"
+#include "stats.h"
+#include "topology.h"
+#include "traced.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,16 +27,20 @@
 #include <assert.h>
 #include <stdint.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/ptrace.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #define AFLCS_PROXY_NAME "afl-cs-proxy"
 #define AFLCS_FORKSRV_FD (FORKSRV_FD - 3)
+#define AFLCS_SIGNATURE_LOG "signatures.txt"
 
 char *__afl_proxy_name = AFLCS_PROXY_NAME;
 
@@ -41,6 +49,20 @@ s32 proxy_ctl_fd = -1;
 s32 proxy_st_fd = -1;
 u8 first_run = 1;
 u8 no_forksrv = 0;
+u8 persistent_mode = 0;
+u8 child_stopped = 0;
+s32 last_child_pid = -1;
+
+u8 shmem_fuzz = 0;
+u32 *shmem_fuzz_len = NULL;
+u8 *shmem_fuzz_buf = NULL;
+s32 input_fd = -1;
+
+char *crash_signature_dir = NULL;
+u32 crash_signature_depth = DEFAULT_SIGNATURE_DEPTH;
+char *cur_input_path = NULL;
+char *input_file = NULL; /* File afl-fuzz substitutes for @@ */
+unsigned long exec_start = 0;
 
 #ifdef EXEC_COUNT
 u32 exec_count = 0;
@@ -52,6 +74,15 @@ extern bool decoding_on;
 extern unsigned char *trace_bitmap;
 extern unsigned int trace_bitmap_size;
 extern cov_type_t cov_type;
+extern bool shared_sink;
+extern bool stm_markers;
+extern bool trace_nonstop;
+extern bool loss_check;
+extern int trace_cpu;
+extern char *trace_cpu_list;
+extern unsigned long trace_budget;
+extern unsigned int hang_chunk_limit;
+extern unsigned int etm_sync_period;
 
 /* Error reporting to forkserver controller */
 
@@ -140,6 +171,137 @@ static void __afl_map_shm(void)
   }
 }
 
+/* Shared memory test case setup. */
+
+static void __afl_map_shm_fuzz(void)
+{
+  char *id_str = getenv(SHM_FUZZ_ENV_VAR);
+  u8 *map = NULL;
+
+  if (!id_str) {
+    send_forkserver_error(FS_ERROR_SHM_OPEN);
+    FATAL("Error: %s is not set", SHM_FUZZ_ENV_VAR);
+  }
+
+#ifdef USEMMAP
+  const char *shm_file_path = id_str;
+  int shm_fd = -1;
+
+  /* create the shared memory segment as if it was a file */
+  shm_fd = shm_open(shm_file_path, O_RDONLY, 0600);
+  if (shm_fd == -1) {
+    send_forkserver_error(FS_ERROR_SHM_OPEN);
+    PFATAL("shm_open() failed");
+  }
+
+  map = mmap(0, MAX_FILE + sizeof(u32), PROT_READ, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (map == MAP_FAILED) {
+    send_forkserver_error(FS_ERROR_MMAP);
+    PFATAL("mmap() failed");
+  }
+#else
+  u32 shm_id = atoi(id_str);
+
+  map = shmat(shm_id, NULL, SHM_RDONLY);
+  if (map == (void *)-1) {
+    send_forkserver_error(FS_ERROR_SHMAT);
+    PFATAL("shmat() failed");
+  }
+#endif
+
+  shmem_fuzz_len = (u32 *)map;
+  shmem_fuzz_buf = map + sizeof(u32);
+}
+
+/* Whether arg is the file afl-fuzz substitutes for @@. It is the -f file if
+ * given, or .cur_input in the output directory. */
+static bool __afl_is_input_path(const char *arg)
+{
+  const char *cur_input = "/.cur_input";
+  size_t cur_input_len = strlen(cur_input);
+  size_t len;
+
+  if (input_file) {
+    return !strcmp(arg, input_file);
+  }
+
+  len = strlen(arg);
+  return len >= cur_input_len && !strcmp(arg + len - cur_input_len, cur_input);
+}
+
+/* Replace the AFL input file with an in-memory file. The target reads test
+ * cases from it either by path or through stdin, while afl-fuzz writes them
+ * to the shared memory. */
+static void __afl_setup_input_fd(char *argv[])
+{
+  static char input_path[PATH_MAX];
+  int i;
+
+  /* The fd must be inherited by the target, thus no MFD_CLOEXEC. */
+  input_fd = memfd_create("afl-cs-input", 0);
+  if (input_fd < 0) {
+    PFATAL("memfd_create() failed");
+  }
+
+  snprintf(input_path, sizeof(input_path), "/proc/self/fd/%d", input_fd);
+
+  for (i = 0; argv[i]; i++) {
+    if (__afl_is_input_path(argv[i])) {
+      argv[i] = input_path;
+    }
+  }
+
+  /* Also serve the test case to targets reading from stdin. The target
+   * shares the file offset with us, which is rewound on every exec. */
+  if (dup2(input_fd, STDIN_FILENO) < 0) {
+    PFATAL("dup2() failed");
+  }
+}
+
+static s32 __afl_write_testcase(void)
+{
+  u32 len = *shmem_fuzz_len;
+
+  if (len > MAX_FILE) len = MAX_FILE;
+
+  if (ftruncate(input_fd, len) < 0) return -1;
+  if (pwrite(input_fd, shmem_fuzz_buf, len, 0) != (ssize_t)len) return -1;
+  if (lseek(input_fd, 0, SEEK_SET) < 0) return -1;
+
+  return 0;
+}
+
+/* Send the forkserver options to AFL and finish the option negotiation. */
+static void __afl_send_options(u32 status)
+{
+  u32 reply;
+
+  if (shmem_fuzz) {
+    if ((status & FS_OPT_AUTODICT) == FS_OPT_AUTODICT) {
+      FATAL("Error: shared memory fuzzing does not support AUTODICT targets");
+    }
+    status |= (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ);
+  }
+
+  /* Phone home and tell the parent that we're OK. */
+
+  if (write(FORKSRV_FD + 1, &status, 4) != 4) {
+    PFATAL("write() failed");
+  }
+
+  if (shmem_fuzz) {
+    if (read(FORKSRV_FD, &reply, 4) != 4) {
+      PFATAL("read() failed");
+    }
+    if ((reply & (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) !=
+        (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) {
+      FATAL("Error: AFL refused shared memory fuzzing");
+    }
+    __afl_map_shm_fuzz();
+  }
+}
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(char *argv[])
@@ -197,43 +359,134 @@ static void __afl_start_forkserver(char *argv[])
     if (trace_bitmap_size <= FS_OPT_MAX_MAPSIZE)
       status |= (FS_OPT_SET_MAPSIZE(trace_bitmap_size) | FS_OPT_MAPSIZE);
     if (status) status |= (FS_OPT_ENABLED);
-    memcpy(tmp, &status, 4);
   }
 
-  /* Phone home and tell the parent that we're OK. */
-
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) {
-    PFATAL("write() failed");
-  }
+  __afl_send_options(status);
 }
 
 static u32 __afl_next_testcase(void)
 {
   s32 was_killed, child_pid;
+  unsigned long start;
 
   /* Wait for parent by reading from the pipe. Abort if read fails. */
   if (read(FORKSRV_FD, &was_killed, 4) != 4) return 1;
+
+  if (shmem_fuzz && __afl_write_testcase() < 0) return -1;
+
+  /* In persistent mode, the stopped child is resumed by the target
+   * forkserver itself. Re-arm the trace sinks before relaying the request so
+   * that the next iteration is traced from its beginning. */
+  if (child_stopped && !was_killed) {
+    if (restart_trace(last_child_pid) < 0) return -1;
+  } else {
+    child_stopped = 0;
+  }
+
+  start = read_system_counter();
   if (write(proxy_ctl_fd, &was_killed, 4) != 4) return -1;
 
   /* Wait for child by reading from the pipe. Abort if read fails. */
   if (read(proxy_st_fd, &child_pid, 4) != 4) return -1;
+  add_trace_stats(relay_phase, start);
 
   if (unlikely(first_run)) {
     if (init_trace(fsrv_pid, child_pid) < 0) return -1;
     first_run = 0;
   }
 
-  start_trace(child_pid, false);
+  if (!child_stopped) {
+    start_trace(child_pid, false);
+  }
+  last_child_pid = child_pid;
 
   /* report that we are starting the target */
   if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) return -1;
 
   /* Resume child process. */
+  exec_start = read_system_counter();
   kill(child_pid, SIGCONT);
 
   return child_pid;
 }
 
+/* Save the test case of a new crash signature. */
+static void __afl_save_crash_input(const char *path)
+{
+  u8 buf[4096];
+  ssize_t n;
+  off_t off;
+  int in_fd, out_fd;
+
+  if (shmem_fuzz) {
+    in_fd = input_fd;
+  } else if (cur_input_path) {
+    in_fd = open(cur_input_path, O_RDONLY);
+  } else {
+    in_fd = STDIN_FILENO;
+  }
+  if (in_fd < 0) {
+    WARNF("Failed to open the test case");
+    return;
+  }
+
+  out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out_fd < 0) {
+    WARNF("Failed to create %s", path);
+    goto exit;
+  }
+
+  /* pread() leaves the offset shared with the target as it is. */
+  off = 0;
+  while ((n = pread(in_fd, buf, sizeof(buf), off)) > 0) {
+    if (write(out_fd, buf, n) != n) {
+      WARNF("Failed to write %s", path);
+      break;
+    }
+    off += n;
+  }
+  close(out_fd);
+
+exit:
+  if (in_fd != input_fd && in_fd != STDIN_FILENO) {
+    close(in_fd);
+  }
+}
+
+/* Sign a crash by the last branches in the tail of its trace. Crashes with
+ * the same signature are logged but their test cases are saved only once. */
+static void __afl_sign_crash(s32 status)
+{
+  char path[PATH_MAX];
+  unsigned long signature;
+  FILE *fp;
+  int ret;
+
+  if (!crash_signature_dir || !WIFSIGNALED(status)) {
+    return;
+  }
+
+  ret = sign_trace_tail(crash_signature_depth, crash_signature_dir,
+                        &signature);
+  if (ret < 0) {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "%s/" AFLCS_SIGNATURE_LOG, crash_signature_dir);
+  fp = fopen(path, "a");
+  if (fp) {
+    fprintf(fp, "%016lx sig:%02d time:%lu%s\n", signature, WTERMSIG(status),
+            (unsigned long)time(NULL), ret > 0 ? " new" : "");
+    fclose(fp);
+  }
+
+  if (ret > 0) {
+    snprintf(path, sizeof(path), "%s/%016lx.input", crash_signature_dir,
+             signature);
+    __afl_save_crash_input(path);
+  }
+}
+
 static s32 __afl_end_testcase(s32 status)
 {
   if (write(FORKSRV_FD + 1, &status, 4) != 4) return -1;
@@ -243,20 +496,20 @@ static s32 __afl_end_testcase(s32 status)
 
 static s32 __afl_fauxsrv_execv(char *argv[])
 {
-  u8 tmp[4] = {0, 0, 0, 0};
   int status = 0;
   s32 was_killed, child_pid;
 
-  /* Phone home and tell the parent that we're OK. */
-
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return -1;
+  __afl_send_options(0);
 
   while (1) {
     /* Wait for parent by reading from the pipe. Abort if read fails. */
     if (read(FORKSRV_FD, &was_killed, 4) != 4) return -1;
 
+    if (shmem_fuzz && __afl_write_testcase() < 0) return -1;
+
     /* Create a clone of our process. */
 
+    exec_start = read_system_counter();
     child_pid = fork();
 
     if (child_pid < 0) {
@@ -283,7 +536,13 @@ static s32 __afl_fauxsrv_execv(char *argv[])
 
     waitpid(child_pid, &status, 0);
     if (WIFSTOPPED(status) && WSTOPSIG(status) == PTRACE_EVENT_VFORK_DONE) {
-      init_trace(getpid(), child_pid);
+      /* Initialize once, then only point the trace at each new child. */
+      if (unlikely(first_run)) {
+        if (init_trace(getpid(), child_pid) < 0) return -1;
+        first_run = 0;
+      } else if (retarget_trace(child_pid) < 0) {
+        return -1;
+      }
       start_trace(child_pid, true);
       ptrace(PTRACE_CONT, child_pid, NULL, NULL);
     }
@@ -303,6 +562,10 @@ static s32 __afl_fauxsrv_execv(char *argv[])
     }
 
     if (stop_trace(false) < 0) return -1;
+    add_trace_stats(exec_phase, exec_start);
+    count_trace_exec();
+
+    __afl_sign_crash(status);
 
     /* Relay wait status to AFL pipe, then loop back. */
     if (write(FORKSRV_FD + 1, &status, 4) != 4) return -1;
@@ -353,6 +616,24 @@ int main(int argc, char *argv[])
     no_forksrv = 1;
   }
 
+  if (getenv("AFLCS_PERSISTENT")) {
+    persistent_mode = 1;
+    /* A drain stop would be told from the SIGSTOP of the harness only by
+     * suspend_requested, and the two merge into one stop when they race.
+     * Drain without stopping the tracee, so that every SIGSTOP ends an
+     * iteration. */
+    trace_nonstop = true;
+  }
+
+  if (getenv("AFLCS_SHMEM_FUZZ")) {
+    if (getenv(SHM_FUZZ_ENV_VAR)) {
+      shmem_fuzz = 1;
+    } else {
+      WARNF("%s is not set, shared memory fuzzing disabled\n",
+            SHM_FUZZ_ENV_VAR);
+    }
+  }
+
   if ((ptr = getenv("AFLCS_COV")) != NULL) {
     if (!strcmp(ptr, "edge")) {
       cov_type = edge_cov;
@@ -367,9 +648,92 @@ int main(int argc, char *argv[])
     udmabuf_num = atoi(ptr);
   }
 
+  if ((ptr = getenv("AFLCS_CPU")) != NULL) {
+    trace_cpu = atoi(ptr);
+  }
+
+  if ((ptr = getenv("AFLCS_CPUS")) != NULL) {
+    trace_cpu_list = ptr;
+  }
+
+  if ((ptr = getenv("AFLCS_TRACE_BUDGET")) != NULL) {
+    trace_budget = strtoul(ptr, NULL, 0);
+  }
+
+  if ((ptr = getenv("AFLCS_HANG_CHUNKS")) != NULL) {
+    hang_chunk_limit = (unsigned int)atoi(ptr);
+  }
+
+  if (getenv("AFLCS_SHARED_SINK")) {
+    shared_sink = true;
+  }
+
+  if (getenv("AFLCS_STM_MARKERS")) {
+    stm_markers = true;
+  }
+
+  if ((ptr = getenv("AFLCS_TRACED_SOCKET")) != NULL) {
+    traced_socket_path = ptr;
+  }
+
+  if ((ptr = getenv("AFLCS_TOPOLOGY_CACHE")) != NULL) {
+    topology_cache_path = ptr;
+  }
+
+  if (getenv("AFLCS_NO_TOPOLOGY_CACHE")) {
+    topology_cache = false;
+  }
+
+  if ((ptr = getenv("AFLCS_CRASH_SIGNATURES")) != NULL) {
+    crash_signature_dir = ptr;
+    if (mkdir(ptr, 0700) < 0 && errno != EEXIST) {
+      PFATAL("Failed to create %s", ptr);
+    }
+    /* Frequent A-sync lets the tail be decoded without the rest. */
+    if (etm_sync_period == 0 || etm_sync_period > SIGNATURE_SYNC_PERIOD) {
+      etm_sync_period = SIGNATURE_SYNC_PERIOD;
+    }
+  }
+
+  if (getenv("AFLCS_LOSS_CHECK")) {
+    loss_check = true;
+  }
+
+  if ((ptr = getenv("AFLCS_STATS")) != NULL) {
+    if (open_trace_stats(ptr) < 0) {
+      FATAL("Error: failed to open stats page '%s'", ptr);
+    }
+  }
+
+  if ((ptr = getenv("AFLCS_CRASH_DEPTH")) != NULL) {
+    crash_signature_depth = (u32)atoi(ptr);
+    if (crash_signature_depth == 0) {
+      FATAL("Error: AFLCS_CRASH_DEPTH must be positive");
+    }
+  }
+
+  /* Remember the input file before it may be replaced by an in-memory one. */
+  input_file = getenv("AFLCS_INPUT_FILE");
+  for (i = 0; argvp && argvp[i]; i++) {
+    if (__afl_is_input_path(argvp[i])) {
+      cur_input_path = argvp[i];
+    }
+  }
+  if (shmem_fuzz && input_file && !cur_input_path) {
+    /* The target opens the file by itself, which afl-fuzz never writes in
+     * shared memory mode. */
+    FATAL("Error: %s is not an argument of the target, which shared memory "
+          "fuzzing cannot serve",
+          input_file);
+  }
+
   /* then we initialize the shared memory map and start the forkserver */
   __afl_map_shm();
 
+  if (shmem_fuzz) {
+    __afl_setup_input_fd(argvp);
+  }
+
   if (no_forksrv) {
     return __afl_fauxsrv_execv(argvp);
   }
@@ -381,14 +745,27 @@ int main(int argc, char *argv[])
     while (1) {
       if (read(proxy_st_fd, &status, 4) != 4) return -1;
       if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP) {
+        if (persistent_mode) {
+          /* The child stopped itself at the end of a persistent loop
+           * iteration. The tracer never stops it in persistent mode. */
+          child_stopped = 1;
+          break;
+        }
         trace_suspend_resume_callback();
       } else {
         /* Child process has exited. */
+        child_stopped = 0;
         break;
       }
     }
 
     if (stop_trace(false) < 0) return -1;
+    add_trace_stats(exec_phase, exec_start);
+    count_trace_exec();
+
+    if (!child_stopped) {
+      __afl_sign_crash(status);
+    }
 
     /* report the test case is done and wait for the next */
     if (__afl_end_testcase(status) < 0) return -1;
@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "stats.h"
+
+#define DEFAULT_STATS_INTERVAL 1.0
+
+/* Plain copy of a stats page to take differences. */
+struct stats_snapshot {
+  unsigned long execs;
+  unsigned long lossy_execs;
+  unsigned long hung_execs;
+  unsigned long loss[trace_loss_count];
+  unsigned long last_loss[trace_loss_count];
+  unsigned long count[trace_phase_count];
+  unsigned long ticks[trace_phase_count];
+  unsigned long max[trace_phase_count];
+  unsigned long hist[trace_phase_count][STATS_HIST_BUCKETS];
+};
+
+static void take_stats_snapshot(const struct trace_stats *stats,
+                                struct stats_snapshot *snapshot)
+{
+  const struct phase_stats *phase;
+  int i, j;
+
+  snapshot->execs = atomic_load(&stats->execs);
+  snapshot->lossy_execs = atomic_load(&stats->lossy_execs);
+  snapshot->hung_execs = atomic_load(&stats->hung_execs);
+  for (i = 0; i < trace_loss_count; i++) {
+    snapshot->loss[i] = atomic_load(&stats->loss[i]);
+    snapshot->last_loss[i] = atomic_load(&stats->last_loss[i]);
+  }
+  for (i = 0; i < trace_phase_count; i++) {
+    phase = &stats->phases[i];
+    snapshot->count[i] = atomic_load(&phase->count);
+    snapshot->ticks[i] = atomic_load(&phase->ticks);
+    snapshot->max[i] = atomic_load(&phase->max);
+    for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+      snapshot->hist[i][j] = atomic_load(&phase->hist[j]);
+    }
+  }
+}
+
+/* Upper bound of the bucket holding the q-quantile of the interval. */
+static unsigned long get_stats_quantile(const struct stats_snapshot *cur,
+                                        const struct stats_snapshot *prev,
+                                        int phase, double q)
+{
+  unsigned long count, seen;
+  int i;
+
+  count = cur->count[phase] - prev->count[phase];
+  seen = 0;
+  for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+    seen += cur->hist[phase][i] - prev->hist[phase][i];
+    if ((double)seen >= q * (double)count) {
+      return 1UL << i;
+    }
+  }
+
+  return cur->max[phase];
+}
+
+static double ticks_to_us(const struct trace_stats *stats, double ticks)
+{
+  return stats->frequency ? ticks * 1e6 / (double)stats->frequency : ticks;
+}
+
+static void print_stats(const struct trace_stats *stats,
+                        const struct stats_snapshot *cur,
+                        const struct stats_snapshot *prev, double interval)
+{
+  unsigned long count;
+  int i;
+
+  printf("pid %d execs %lu (%.1f/s)\n", stats->pid, cur->execs,
+         (double)(cur->execs - prev->execs) / interval);
+  printf("%-8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us",
+         "p50_us", "p99_us", "max_us");
+  for (i = 0; i < trace_phase_count; i++) {
+    count = cur->count[i] - prev->count[i];
+    if (count == 0) {
+      continue;
+    }
+    printf("%-8s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+           get_trace_phase_name((trace_phase_t)i), count,
+           ticks_to_us(stats, (double)(cur->ticks[i] - prev->ticks[i]) /
+                                  (double)count),
+           ticks_to_us(stats, (double)get_stats_quantile(cur, prev, i, 0.5)),
+           ticks_to_us(stats, (double)get_stats_quantile(cur, prev, i, 0.99)),
+           ticks_to_us(stats, (double)cur->max[i]));
+  }
+
+  printf("hung execs %lu (+%lu)\n", cur->hung_execs,
+         cur->hung_execs - prev->hung_execs);
+  printf("lossy execs %lu (+%lu)%s\n", cur->lossy_execs,
+         cur->lossy_execs - prev->lossy_execs,
+         stats->nooverflow ? ", ETMs stall instead of overflowing" : "");
+  printf("%-14s %12s %12s %12s\n", "loss", "total", "interval",
+         "last_exec");
+  for (i = 0; i < trace_loss_count; i++) {
+    printf("%-14s %12lu %12lu %12lu\n", get_trace_loss_name((trace_loss_t)i),
+           cur->loss[i], cur->loss[i] - prev->loss[i], cur->last_loss[i]);
+  }
+  putchar('\n');
+  fflush(stdout);
+}
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS] NAME\n", argv0);
+  fprintf(stderr, "Show the latency stats page NAME of cs-proxy live\n");
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr,
+          "  -i, --interval=SEC\t\tseconds between updates (default: %.1f)\n",
+          DEFAULT_STATS_INTERVAL);
+  fprintf(stderr,
+          "  -n, --count=INT\t\tupdates to show, 0 for totals once "
+          "(default: forever)\n");
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"interval", required_argument, NULL, 'i'},
+      {"count", required_argument, NULL, 'n'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  const struct trace_stats *stats;
+  struct stats_snapshot cur, prev;
+  double interval;
+  int count;
+  int opt;
+  int option_index;
+  int i;
+
+  interval = DEFAULT_STATS_INTERVAL;
+  count = -1;
+
+  while ((opt = getopt_long(argc, argv, "i:n:h", long_options,
+                            &option_index)) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = atof(optarg);
+        break;
+      case 'n':
+        count = atoi(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc || interval <= 0) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (!(stats = map_trace_stats(argv[optind]))) {
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&prev, 0, sizeof(prev));
+  take_stats_snapshot(stats, &cur);
+  if (count == 0) {
+    print_stats(stats, &cur, &prev, 1.0);
+    return EXIT_SUCCESS;
+  }
+
+  for (i = 0; count < 0 || i < count; i++) {
+    prev = cur;
+    usleep((useconds_t)(interval * 1e6));
+    take_stats_snapshot(stats, &cur);
+    print_stats(stats, &cur, &prev, interval);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -13,6 +13,9 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
@@ -28,12 +31,19 @@
 
 #include "libcsdec.h"
 
+#include "annotate.h"
+#include "clock.h"
 #include "common.h"
 #include "config.h"
+#include "profile.h"
+#include "topology.h"
+#include "traced.h"
 #include "utils.h"
+#include "window.h"
 
 #define DEFAULT_TRACE_BITMAP_SIZE_POW2 (16)
 #define DEFAULT_TRACE_BITMAP_SIZE (1U << (DEFAULT_TRACE_BITMAP_SIZE_POW2))
+#define ATTACH_POLL_USLEEP 10000
 
 extern int registration_verbose;
 
@@ -41,11 +51,38 @@ extern char *board_name;
 extern int udmabuf_num;
 extern bool decoding_on;
 extern int trace_cpu;
+extern char *trace_cpu_list;
 extern bool export_config;
 extern cov_type_t cov_type;
+extern bool shared_sink;
 
 extern unsigned char *trace_bitmap;
 extern unsigned int trace_bitmap_size;
+extern struct map_info *map_info;
+extern bool profiling;
+extern profile_format_t profile_format;
+extern int profile_jobs;
+extern stack_weight_t stack_weight;
+extern unsigned int etm_sync_period;
+extern bool etm_timestamp;
+extern unsigned int etm_cycle_threshold;
+extern bool time_slice_on;
+extern bool flight_recorder;
+extern bool stm_annotations;
+extern bool split_contexts;
+extern unsigned long time_slice_start;
+extern unsigned long time_slice_end;
+extern int range_count;
+
+extern unsigned long get_stm_ports(const char *hardware);
+
+static bool follow_forks = false;
+static pid_t attach_pid = 0;
+static double attach_duration = 0;
+static volatile sig_atomic_t window_closed = 0;
+static char *window_spec = NULL;
+static volatile sig_atomic_t snapshot_requested = 0;
+static unsigned int snapshot_count = 0;
 
 void child(char *argv[])
 {
@@ -58,57 +95,306 @@ void child(char *argv[])
   execvp(argv[0], argv);
 }
 
+static void request_snapshot(int sig)
+{
+  snapshot_requested = 1;
+}
+
+/* Signals whose default action kills the tracee with a core dump. */
+static bool is_crash_signal(int sig)
+{
+  switch (sig) {
+    case SIGSEGV:
+    case SIGBUS:
+    case SIGILL:
+    case SIGFPE:
+    case SIGABRT:
+    case SIGSYS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* SIGUSR1 takes a snapshot in flight recorder mode. It interrupts waitpid()
+ * so that the snapshot is taken at once. */
+static void setup_snapshot_trigger(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_snapshot;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+    perror("sigaction");
+  }
+}
+
 void parent(pid_t pid, int *child_status)
 {
   int ret, wstatus;
+  pid_t wpid;
+  unsigned long new_pid;
+  int event;
+  int live;
+  unsigned long entry_addr, exit_addr;
+  struct trace_window window;
 
   ptrace(PTRACE_ATTACH, pid, NULL, NULL);
   ret = waitpid(pid, &wstatus, 0);
   if (WIFSTOPPED(wstatus) && WSTOPSIG(wstatus) == PTRACE_EVENT_VFORK_DONE) {
     init_trace(getpid(), pid);
     start_trace(pid, true);
+    if (follow_forks &&
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                   PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC) < 0)
+      perror("PTRACE SETOPTIONS error");
+    if (window_spec) {
+      /* Trace only inside the windows. Drop what was traced so far. */
+      stop_trace(false);
+      if (trace_bitmap) {
+        memset(trace_bitmap, 0, trace_bitmap_size);
+      }
+      if (parse_trace_window(window_spec, &entry_addr, &exit_addr) < 0 ||
+          insert_trace_window(&window, pid, entry_addr, exit_addr, map_info,
+                              range_count) < 0) {
+        fprintf(stderr, "Invalid trace window '%s'\n", window_spec);
+        window_spec = NULL;
+      }
+    }
+    if (flight_recorder) {
+      setup_snapshot_trigger();
+    }
     if (ptrace(PTRACE_CONT, pid, NULL, NULL) < 0)
       perror("PTRACE CONT error");
   }
 
+  /* The session ends when the tracee and all followed children exit. */
+  live = 1;
   while (1) {
-    ret = waitpid(pid, &wstatus, WUNTRACED);
-    if (WIFEXITED(wstatus)) {
-      stop_trace(true);
-      fini_trace();
+    wpid = waitpid(follow_forks ? -1 : pid, &wstatus, __WALL | WUNTRACED);
+    if (wpid < 0) {
+      if (errno == EINTR) {
+        if (snapshot_requested) {
+          snapshot_requested = 0;
+          snapshot_trace(snapshot_count++, true);
+        }
+        continue;
+      }
+      perror("waitpid");
       break;
-    } else if (WIFSTOPPED(wstatus) && WSTOPSIG(wstatus) == SIGSTOP) {
+    }
+    if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+      if (wpid == pid && child_status) {
+        *child_status = wstatus;
+      }
+      if (wpid != pid) {
+        unfollow_trace(wpid);
+      }
+      if (--live == 0) {
+        if (window_spec) {
+          finish_trace_window(&window);
+        }
+        stop_trace(true);
+        fini_trace();
+        break;
+      }
+      continue;
+    }
+    if (!WIFSTOPPED(wstatus))
+      continue;
+
+    event = wstatus >> 16;
+    if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK ||
+        event == PTRACE_EVENT_CLONE) {
+      if (ptrace(PTRACE_GETEVENTMSG, wpid, NULL, &new_pid) == 0) {
+        follow_trace((pid_t)new_pid);
+        live++;
+      }
+      if (ptrace(PTRACE_CONT, wpid, NULL, NULL) < 0)
+        perror("PTRACE CONT error");
+    } else if (event == PTRACE_EVENT_EXEC && wpid != pid) {
+      /* The new image of a child is outside the traced address ranges. */
+      unfollow_trace(wpid);
+      if (ptrace(PTRACE_DETACH, wpid, NULL, NULL) < 0)
+        perror("PTRACE DETACH error");
+      live--;
+    } else if (event == PTRACE_EVENT_EXEC) {
+      /* Trace the new image of the target from here on. */
+      if (window_spec) {
+        fprintf(stderr, "The new image is not traced in trace windows\n");
+      } else if (stop_trace(false) < 0 || retarget_trace(pid) < 0 ||
+                 start_trace(pid, true) < 0) {
+        fprintf(stderr, "Failed to retarget trace to the new image\n");
+      }
+      if (ptrace(PTRACE_CONT, wpid, NULL, NULL) < 0)
+        perror("PTRACE CONT error");
+    } else if (flight_recorder && is_crash_signal(WSTOPSIG(wstatus))) {
+      /* Keep the trace up to the fault, then let the signal through. The
+       * sink is re-armed for a target that handles the signal. */
+      snapshot_trace(snapshot_count++, true);
+      if (ptrace(PTRACE_CONT, wpid, NULL, WSTOPSIG(wstatus)) < 0)
+        perror("PTRACE CONT error");
+    } else if (window_spec && WSTOPSIG(wstatus) == SIGTRAP &&
+               (ret = handle_trace_window_stop(&window, wpid)) != 0) {
+      if (ret > 0 && ptrace(PTRACE_CONT, wpid, NULL, NULL) < 0)
+        perror("PTRACE CONT error");
+    } else if (wpid == pid && WSTOPSIG(wstatus) == SIGSTOP &&
+               is_trace_suspend_requested()) {
       trace_suspend_resume_callback();
       wait_resume_event();
       if (ptrace(PTRACE_CONT, pid, NULL, SIGCONT) < 0)
         perror("Resume with PTRACE CONT failed\n");
+    } else if (WSTOPSIG(wstatus) == SIGSTOP) {
+      /* Initial stop of a followed child, or a stop the tracer did not
+       * request. */
+      if (ptrace(PTRACE_CONT, wpid, NULL, NULL) < 0)
+        perror("PTRACE CONT error");
+    } else if (follow_forks) {
+      if (ptrace(PTRACE_CONT, wpid, NULL, WSTOPSIG(wstatus)) < 0)
+        perror("PTRACE CONT error");
     }
   }
+}
 
-  if (child_status) {
-    *child_status = wstatus;
+static void close_window(int sig)
+{
+  window_closed = 1;
+}
+
+/* Trace the running process for attach_duration seconds, or until it exits
+ * or cs-trace is interrupted. The process is never stopped. */
+int attach(pid_t pid)
+{
+  struct timespec start, now;
+  double elapsed;
+
+  signal(SIGINT, close_window);
+  signal(SIGTERM, close_window);
+
+  if (init_trace(getpid(), pid) < 0) {
+    fprintf(stderr, "init_trace() failed\n");
+    return -1;
   }
+  if (attach_trace(pid) < 0) {
+    fprintf(stderr, "Failed to attach to PID %d\n", pid);
+    fini_trace();
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!window_closed && !kill(pid, 0)) {
+    if (attach_duration > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (double)(now.tv_sec - start.tv_sec) +
+                (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+      if (elapsed >= attach_duration) {
+        break;
+      }
+    }
+    usleep(ATTACH_POLL_USLEEP);
+  }
+
+  stop_trace(true);
+  detach_trace();
+  fini_trace();
+
+  return 0;
+}
+
+/* Parse START:END in seconds of CLOCK_MONOTONIC. */
+static int parse_time_slice(const char *spec)
+{
+  char *end;
+  double start_sec, end_sec;
+
+  start_sec = strtod(spec, &end);
+  if (end == spec || *end != ':') {
+    return -1;
+  }
+  spec = end + 1;
+  end_sec = strtod(spec, &end);
+  if (end == spec || *end != '\0' || start_sec < 0 || end_sec <= start_sec) {
+    return -1;
+  }
+
+  time_slice_start = (unsigned long)(start_sec * 1e9);
+  time_slice_end = (unsigned long)(end_sec * 1e9);
+  time_slice_on = true;
+
+  return 0;
 }
 
 static void usage(char *argv0)
 {
   fprintf(stderr, "Usage: %s [OPTIONS] -- EXE [ARGS]\n", argv0);
+  fprintf(stderr, "       %s [OPTIONS] --pid=PID [--duration=SEC]\n", argv0);
   fprintf(stderr, "CoreSight process tracer\n");
   fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr,
+          "  -a, --cycle-threshold=INT\tcycle count threshold of "
+          "--profile=cycles (default: %d)\n",
+          DEFAULT_CYCLE_THRESHOLD);
   fprintf(stderr, "  -b, --board=NAME\t\tspecify board name (default: %s)\n",
           board_name);
   fprintf(stderr,
           "  -c, --cpu=INT\t\t\tbind traced process to CPU (default: %d)\n",
           trace_cpu);
+  fprintf(stderr,
+          "  -C, --cpus=LIST\t\ttrace multi-threaded process on CPUs "
+          "(e.g. 0-3)\n");
+  fprintf(stderr,
+          "  -D, --duration=SEC\t\tstop tracing attached process after SEC "
+          "(default: until exit)\n");
   fprintf(stderr,
           "  -d, --decoding={edge,path}\tenable trace decoding (default: "
           "off)\n");
   fprintf(stderr, "  -e, --export\t\t\tenable exporting config (default: %d)\n",
           export_config);
+  fprintf(stderr,
+          "  -f, --follow-forks\t\ttrace forked children of the process\n");
+  fprintf(stderr,
+          "  -F, --flight-recorder\t\tlet trace wrap and snapshot it on "
+          "crash or SIGUSR1\n");
+  fprintf(stderr,
+          "  -j, --jobs=INT\t\t\tprofile decoder threads (default: all "
+          "CPUs)\n");
+  fprintf(stderr,
+          "  -N, --annotate\t\twrite STM annotations of the process to "
+          DEFAULT_ANNOTATION_NAME "\n");
+  fprintf(stderr,
+          "  -P, --profile={autofdo,bolt,folded,cycles}\n"
+          "\t\t\t\twrite branch profile of each image, call stacks or "
+          "block cycles\n");
+  fprintf(stderr,
+          "  -p, --pid=PID\t\t\tattach to running process without "
+          "stopping it\n");
+  fprintf(stderr,
+          "  -S, --time-slice=START:END\tprofile only between CLOCK_MONOTONIC "
+          "seconds\n");
+  fprintf(stderr,
+          "  -s, --shared-sink[=PATH]\tlease trace sink from cs-traced "
+          "(default socket: %s)\n",
+          traced_socket_path);
+  fprintf(stderr,
+          "  -T, --timestamp\t\ttimestamp trace and write clock calibration "
+          "to " DEFAULT_CLOCK_NAME "\n");
+  fprintf(stderr,
+          "  -t, --topology-cache=PATH\tcache board topology in PATH "
+          "(default: " DEFAULT_TOPOLOGY_CACHE_FMT ")\n",
+          "BOARD");
   fprintf(stderr,
           "  -u, --udmabuf=INT\t\tspecify u-dma-buf device number to use "
           "(default: %d)",
           udmabuf_num);
+  fprintf(stderr,
+          "  -w, --window=ENTRY:EXIT\ttrace only between function entry and "
+          "exit addresses (needs -f)\n");
+  fprintf(stderr,
+          "  -W, --stack-weight={insns,time}\n"
+          "\t\t\t\tweight call stacks by instructions or timestamps "
+          "(default: insns)\n");
   fprintf(stderr,
           "  -v, --verbose[=INT]\t\tverbose output level (default: %d)\n",
           registration_verbose);
@@ -118,17 +404,33 @@ static void usage(char *argv0)
 int main(int argc, char *argv[])
 {
   const struct option long_options[] = {
+      {"cycle-threshold", required_argument, NULL, 'a'},
       {"board", required_argument, NULL, 'b'},
       {"cpu", required_argument, NULL, 'c'},
+      {"cpus", required_argument, NULL, 'C'},
       {"decoding", required_argument, NULL, 'd'},
+      {"duration", required_argument, NULL, 'D'},
       {"export", no_argument, NULL, 'e'},
+      {"follow-forks", no_argument, NULL, 'f'},
+      {"flight-recorder", no_argument, NULL, 'F'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"annotate", no_argument, NULL, 'N'},
+      {"pid", required_argument, NULL, 'p'},
+      {"profile", required_argument, NULL, 'P'},
+      {"shared-sink", optional_argument, NULL, 's'},
+      {"time-slice", required_argument, NULL, 'S'},
+      {"timestamp", no_argument, NULL, 'T'},
+      {"topology-cache", required_argument, NULL, 't'},
       {"udmabuf", required_argument, NULL, 'u'},
       {"verbose", optional_argument, NULL, 'v'},
+      {"window", required_argument, NULL, 'w'},
+      {"stack-weight", required_argument, NULL, 'W'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
   };
 
   char **argvp;
+  char stm_ports[32];
   pid_t pid;
   int opt;
   int option_index;
@@ -137,20 +439,26 @@ int main(int argc, char *argv[])
   registration_verbose = 0;
   trace_bitmap_size = DEFAULT_TRACE_BITMAP_SIZE;
 
-  if (argc < 3) {
+  if (argc < 2) {
     usage(argv[0]);
     exit(EXIT_SUCCESS);
   }
 
-  while ((opt = getopt_long(argc, argv, "b:c:d:ev::h", long_options,
-                            &option_index)) != -1) {
+  while ((opt = getopt_long(argc, argv, "a:b:c:C:d:D:efFj:Np:P:s::S:t:Tu:v::w:W:h",
+                            long_options, &option_index)) != -1) {
     switch (opt) {
+      case 'a':
+        etm_cycle_threshold = (unsigned int)atoi(optarg);
+        break;
       case 'b':
         board_name = optarg;
         break;
       case 'c':
         trace_cpu = atoi(optarg);
         break;
+      case 'C':
+        trace_cpu_list = optarg;
+        break;
       case 'd':
         if (!strcmp(optarg, "edge")) {
           cov_type = edge_cov;
@@ -162,9 +470,55 @@ int main(int argc, char *argv[])
         }
         decoding_on = true;
         break;
+      case 'D':
+        attach_duration = atof(optarg);
+        break;
       case 'e':
         export_config = true;
         break;
+      case 'f':
+        follow_forks = true;
+        break;
+      case 'F':
+        flight_recorder = true;
+        break;
+      case 'j':
+        profile_jobs = atoi(optarg);
+        break;
+      case 'N':
+        stm_annotations = true;
+        break;
+      case 'p':
+        attach_pid = (pid_t)atoi(optarg);
+        break;
+      case 'P':
+        if (parse_profile_format(optarg, &profile_format) < 0) {
+          fprintf(stderr, "Unknown profile format '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        profiling = true;
+        /* Periodic A-sync lets the profile decoder split the trace. */
+        etm_sync_period = PROFILE_SYNC_PERIOD;
+        break;
+      case 's':
+        shared_sink = true;
+        if (optarg) {
+          traced_socket_path = optarg;
+        }
+        break;
+      case 'S':
+        if (parse_time_slice(optarg) < 0) {
+          fprintf(stderr, "Invalid time slice '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        etm_timestamp = true;
+        break;
+      case 't':
+        topology_cache_path = optarg;
+        break;
+      case 'T':
+        etm_timestamp = true;
+        break;
       case 'u':
         udmabuf_num = atoi(optarg);
         break;
@@ -175,6 +529,15 @@ int main(int argc, char *argv[])
           registration_verbose = 1;
         }
         break;
+      case 'w':
+        window_spec = optarg;
+        break;
+      case 'W':
+        if (parse_stack_weight(optarg, &stack_weight) < 0) {
+          fprintf(stderr, "Unknown stack weight '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'h':
         usage(argv[0]);
         exit(EXIT_SUCCESS);
@@ -184,6 +547,49 @@ int main(int argc, char *argv[])
     }
   }
 
+  /* Followed processes are told apart by context ID, traced on one CPU. */
+  split_contexts = follow_forks && decoding_on && !trace_cpu_list;
+
+  if (window_spec && !follow_forks) {
+    /* A thread that is not traced dies on the window breakpoints. */
+    fprintf(stderr, "--window needs --follow-forks to trace all threads\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (profiling && profile_format == folded_profile &&
+      stack_weight == time_weight) {
+    etm_timestamp = true;
+  }
+
+  if (etm_timestamp &&
+      (etm_sync_period == 0 || etm_sync_period > TIMESTAMP_SYNC_PERIOD)) {
+    /* Timestamps come with trace sync, so sync more often. */
+    etm_sync_period = TIMESTAMP_SYNC_PERIOD;
+  }
+
+  if (profiling && profile_format == cycles_profile) {
+    if (etm_cycle_threshold == 0) {
+      etm_cycle_threshold = DEFAULT_CYCLE_THRESHOLD;
+    }
+  } else {
+    etm_cycle_threshold = 0;
+  }
+
+  if (stm_annotations) {
+    /* Tell the annotation library of the tracee where the STM is. */
+    if (get_stm_ports(board_name) == 0) {
+      fprintf(stderr, "No STM stimulus ports known on %s\n", board_name);
+      exit(EXIT_FAILURE);
+    }
+    snprintf(stm_ports, sizeof(stm_ports), "0x%lx",
+             get_stm_ports(board_name));
+    setenv(ANNOTATE_PORTS_ENV, stm_ports, 1);
+  }
+
+  if (attach_pid > 0) {
+    return attach(attach_pid) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
   if (argc <= optind || strcmp(argv[optind - 1], "--")) {
     usage(argv[0]);
     exit(EXIT_FAILURE);
@@ -0,0 +1,735 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "csaccess.h"
+#include "csregistration.h"
+#include "csregisters.h"
+
+#include "config.h"
+#include "demux.h"
+#include "ring.h"
+#include "topology.h"
+#include "traced.h"
+#include "utils.h"
+
+#define MAX_SHARED_CPUS 128
+#define MAX_CLIENTS 64
+#define DEFAULT_POLL_USLEEP 50
+
+/* A tracer connected to the daemon, holding at most one CPU lease. */
+struct client {
+  int fd;
+  struct ucred cred; /* Peer credentials at connection time */
+  int cpu;
+  int trace_id;
+  bool configured;
+  bool enabled;
+};
+
+extern int registration_verbose;
+
+extern char *board_name;
+extern const struct board *board;
+extern struct cs_devices_t devices;
+extern int udmabuf_num;
+extern unsigned long etr_ram_addr;
+extern size_t etr_ram_size;
+
+extern const struct board known_boards[];
+
+int get_trace_id(const char *hardware, int cpu);
+
+static volatile sig_atomic_t terminated = 0;
+
+static bool shared_cpus[MAX_SHARED_CPUS];
+static struct trace_ring *rings[MAX_SHARED_CPUS];
+static struct trace_demux demux;
+
+static int listen_fd = -1;
+static struct client clients[MAX_CLIENTS];
+
+static size_t ring_size = DEFAULT_TRACE_RING_SIZE;
+static useconds_t poll_usleep = DEFAULT_POLL_USLEEP;
+
+static void *etr_buf = NULL;
+static unsigned long read_offset = 0;
+
+static void handle_signal(int sig) { terminated = 1; }
+
+static int get_sink_write_offset(unsigned long *write_offset)
+{
+  unsigned long rwp;
+
+  /* RWP holds the AXI address of the next write. */
+  rwp = cs_get_buffer_rwp(devices.etb);
+  *write_offset = (rwp - etr_ram_addr) & ~(unsigned long)(CS_FRAME_SIZE - 1);
+  if (*write_offset >= etr_ram_size) {
+    fprintf(stderr, "ETR write pointer out of range: 0x%lx\n", rwp);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Demultiplex the trace from the read offset up to write_offset. A full sink
+ * holds a whole buffer of unread trace. */
+static size_t demux_sink(unsigned long write_offset, bool full)
+{
+  size_t len;
+
+  if (write_offset > read_offset || (write_offset == read_offset && !full)) {
+    len = write_offset - read_offset;
+    demux_trace(&demux, (char *)etr_buf + read_offset, len);
+  } else {
+    len = etr_ram_size - read_offset + write_offset;
+    demux_trace(&demux, (char *)etr_buf + read_offset,
+                etr_ram_size - read_offset);
+    demux_trace(&demux, etr_buf, write_offset);
+  }
+  read_offset = write_offset;
+
+  return len;
+}
+
+/* Charge trace overwritten in the sink to every leased stream, since the
+ * share of each is unknown. */
+static void add_sink_loss(size_t size)
+{
+  int cpu;
+
+  fprintf(stderr, "ETR wrapped over unread trace: at least 0x%zx bytes lost\n",
+          size);
+  for (cpu = 0; cpu < MAX_SHARED_CPUS; cpu++) {
+    if (rings[cpu]) {
+      add_trace_ring_loss(rings[cpu], size);
+    }
+  }
+}
+
+/* The full flag of the ETR stays set until the sink is re-armed, so re-arm it
+ * after every wrap to tell the next wrap from a lap over unread trace. */
+static int rearm_sink(void)
+{
+  unsigned long write_offset;
+
+  if (disable_shared_sink(board, &devices) < 0) {
+    return -1;
+  }
+  /* Take the trace flushed by stopping the sink. */
+  if (get_sink_write_offset(&write_offset) == 0) {
+    demux_sink(write_offset, false);
+  }
+  if (enable_shared_sink(board, &devices) < 0 ||
+      get_sink_write_offset(&read_offset) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Demultiplex the trace written since the last call. The ETR keeps capturing
+ * in circular buffer mode, so the owner must drain it before it wraps. */
+static size_t drain_sink(void)
+{
+  unsigned long write_offset;
+  bool wrapped;
+  size_t len;
+
+  wrapped = cs_buffer_has_wrapped(devices.etb) != 0;
+  if (get_sink_write_offset(&write_offset) < 0) {
+    return 0;
+  }
+
+  if (wrapped && write_offset > read_offset) {
+    /* The writer passed the read offset, so the buffer mixes two laps. Drop
+     * it rather than demultiplex torn trace. */
+    add_sink_loss(etr_ram_size + write_offset - read_offset);
+    read_offset = write_offset;
+    len = 0;
+  } else {
+    len = demux_sink(write_offset, wrapped);
+  }
+
+  if (wrapped && rearm_sink() < 0) {
+    fprintf(stderr, "Failed to re-arm the ETR\n");
+    terminated = 1;
+  }
+
+  return len;
+}
+
+/* Serve flush requests from tracers that stopped their trace sources. */
+static void handle_flush_requests(void)
+{
+  unsigned int reqs[MAX_SHARED_CPUS];
+  bool pending[MAX_SHARED_CPUS];
+  bool any_pending;
+  int i;
+
+  any_pending = false;
+  for (i = 0; i < MAX_SHARED_CPUS; i++) {
+    pending[i] = rings[i] && get_trace_ring_flush_req(rings[i], &reqs[i]);
+    any_pending |= pending[i];
+  }
+
+  if (!any_pending) {
+    return;
+  }
+
+  flush_shared_sink(&devices);
+  drain_sink();
+
+  for (i = 0; i < MAX_SHARED_CPUS; i++) {
+    if (pending[i]) {
+      flush_trace_stream(&demux, rings[i]->trace_id);
+      ack_trace_ring_flush(rings[i], reqs[i]);
+    }
+  }
+}
+
+static int init_shared_sink(void)
+{
+  int cpu;
+
+  if (setup_cached_board(board_name, &board, &devices, known_boards) < 0) {
+    fprintf(stderr, "setup_cached_board() failed\n");
+    return -1;
+  }
+
+  if (get_udmabuf_info(udmabuf_num, &etr_ram_addr, &etr_ram_size) < 0) {
+    fprintf(stderr, "Failed to get u-dma-buf info\n");
+    return -1;
+  }
+
+  if (!(etr_buf = map_udmabuf(udmabuf_num, etr_ram_size))) {
+    return -1;
+  }
+
+  init_trace_demux(&demux);
+
+  for (cpu = 0; cpu < MAX_SHARED_CPUS; cpu++) {
+    if (!shared_cpus[cpu]) {
+      continue;
+    }
+    if (cpu >= board->n_cpu) {
+      fprintf(stderr, "CPU #%d is not available on %s\n", cpu,
+              board->hardware);
+      return -1;
+    }
+  }
+
+  if (enable_shared_sink(board, &devices) < 0) {
+    fprintf(stderr, "enable_shared_sink() failed\n");
+    return -1;
+  }
+  if (get_sink_write_offset(&read_offset) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int lease_cpu(struct client *client, int cpu)
+{
+  int trace_id;
+
+  if (client->cpu >= 0) {
+    fprintf(stderr, "Client already leases CPU #%d\n", client->cpu);
+    return -1;
+  }
+
+  if (cpu < 0) {
+    for (cpu = 0; cpu < MAX_SHARED_CPUS; cpu++) {
+      if (shared_cpus[cpu] && !rings[cpu]) {
+        break;
+      }
+    }
+  }
+  if (cpu >= MAX_SHARED_CPUS || !shared_cpus[cpu] || rings[cpu]) {
+    fprintf(stderr, "No CPU available to lease\n");
+    return -1;
+  }
+
+  if ((trace_id = get_trace_id(board_name, cpu)) < 0) {
+    fprintf(stderr, "Failed to get trace ID for CPU #%d\n", cpu);
+    return -1;
+  }
+  if (!(rings[cpu] = create_trace_ring(trace_id, ring_size,
+                                        client->cred.uid))) {
+    fprintf(stderr, "create_trace_ring() failed\n");
+    return -1;
+  }
+  if (add_trace_stream(&demux, trace_id, rings[cpu]) < 0) {
+    fprintf(stderr, "add_trace_stream() failed\n");
+    unlink_trace_ring(trace_id);
+    close_trace_ring(rings[cpu]);
+    rings[cpu] = NULL;
+    return -1;
+  }
+
+  client->cpu = cpu;
+  client->trace_id = trace_id;
+
+  if (registration_verbose > 0) {
+    fprintf(stderr, "CPU #%d leased: trace ID 0x%x\n", cpu, trace_id);
+  }
+
+  return 0;
+}
+
+static void release_cpu(struct client *client)
+{
+  int cpu;
+
+  cpu = client->cpu;
+  if (cpu < 0) {
+    return;
+  }
+
+  if (client->enabled) {
+    disable_trace_source(board, &devices, cpu);
+    cs_reset_error_count();
+    client->enabled = false;
+  }
+
+  remove_trace_stream(&demux, client->trace_id);
+  unlink_trace_ring(client->trace_id);
+  close_trace_ring(rings[cpu]);
+  rings[cpu] = NULL;
+
+  client->cpu = -1;
+  client->trace_id = -1;
+  client->configured = false;
+
+  if (registration_verbose > 0) {
+    fprintf(stderr, "CPU #%d released\n", cpu);
+  }
+}
+
+/* Non-root peers may only trace their own processes. Context ID 0 traces
+ * every process on the CPU and is reserved to root. */
+static bool may_trace_pid(const struct client *client, pid_t pid)
+{
+  char path[32];
+  struct stat st;
+
+  if (client->cred.uid == 0) {
+    return true;
+  }
+  if (pid <= 0) {
+    return false;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d", pid);
+  if (stat(path, &st) < 0) {
+    return false;
+  }
+
+  return st.st_uid == client->cred.uid;
+}
+
+static int configure_cpu(struct client *client, struct traced_request *req)
+{
+  struct map_info range[TRACED_RANGE_MAX];
+  int range_count;
+  int i;
+
+  if (client->cpu < 0) {
+    return -1;
+  }
+
+  range_count = req->range_count;
+  if (range_count < 0 || range_count > TRACED_RANGE_MAX) {
+    return -1;
+  }
+
+  if (!may_trace_pid(client, (pid_t)req->pid)) {
+    fprintf(stderr, "uid %u may not trace pid %d\n", client->cred.uid,
+            req->pid);
+    return -1;
+  }
+
+  memset(range, 0, sizeof(range));
+  for (i = 0; i < range_count; i++) {
+    range[i].start = req->ranges[i].start;
+    range[i].end = req->ranges[i].end;
+  }
+
+  /* An enabled ETM is suspended by its client and only needs new filters. */
+  if (client->enabled) {
+    return reconfigure_trace_source(board, &devices, client->cpu, range,
+                                    range_count, (pid_t)req->pid);
+  }
+
+  if (configure_trace_source(board, &devices, client->cpu, client->trace_id,
+                             range, range_count, (pid_t)req->pid) < 0) {
+    return -1;
+  }
+  client->configured = true;
+
+  return 0;
+}
+
+static void close_client(struct client *client)
+{
+  release_cpu(client);
+  close(client->fd);
+  client->fd = -1;
+}
+
+static void handle_request(struct client *client)
+{
+  struct traced_request req;
+  struct traced_response res;
+  ssize_t n;
+
+  n = recv(client->fd, &req, sizeof(req), 0);
+  if (n <= 0) {
+    close_client(client);
+    return;
+  }
+
+  memset(&res, 0, sizeof(res));
+  res.ret = -1;
+
+  if (n == sizeof(req)) {
+    switch (req.cmd) {
+      case traced_lease:
+        res.ret = lease_cpu(client, req.cpu);
+        break;
+      case traced_release:
+        release_cpu(client);
+        res.ret = 0;
+        break;
+      case traced_configure:
+        res.ret = configure_cpu(client, &req);
+        break;
+      case traced_enable:
+        /* The ETM of a lease traces only after the filters were checked. */
+        if (client->cpu >= 0 && client->configured) {
+          res.ret = enable_trace_source(board, &devices, client->cpu);
+          client->enabled = res.ret == 0;
+        }
+        break;
+      case traced_disable:
+        if (client->cpu >= 0) {
+          res.ret = disable_trace_source(board, &devices, client->cpu);
+          client->enabled = false;
+        }
+        break;
+      case traced_resume:
+        if (client->enabled) {
+          res.ret = resume_trace_source(board, &devices, client->cpu);
+        }
+        break;
+      case traced_suspend:
+        if (client->enabled) {
+          res.ret = suspend_trace_source(board, &devices, client->cpu);
+        }
+        break;
+      default:
+        fprintf(stderr, "Unknown request: %u\n", req.cmd);
+        break;
+    }
+  }
+
+  /* Errors of a client must not fail the requests of the others. */
+  if (res.ret < 0) {
+    cs_reset_error_count();
+  }
+
+  res.cpu = client->cpu;
+  res.trace_id = client->trace_id;
+  if (send(client->fd, &res, sizeof(res), MSG_NOSIGNAL) != sizeof(res)) {
+    close_client(client);
+  }
+}
+
+static void accept_client(void)
+{
+  struct ucred cred;
+  socklen_t cred_len;
+  int fd;
+  int i;
+
+  fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) {
+    perror("accept4");
+    return;
+  }
+
+  cred_len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+    perror("getsockopt");
+    close(fd);
+    return;
+  }
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (clients[i].fd < 0) {
+      clients[i].fd = fd;
+      clients[i].cred = cred;
+      clients[i].cpu = -1;
+      clients[i].trace_id = -1;
+      clients[i].configured = false;
+      clients[i].enabled = false;
+      return;
+    }
+  }
+
+  fprintf(stderr, "Too many clients\n");
+  close(fd);
+}
+
+static int init_socket(void)
+{
+  struct sockaddr_un addr;
+  int i;
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, traced_socket_path, sizeof(addr.sun_path) - 1);
+
+  unlink(traced_socket_path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return -1;
+  }
+  if (chmod(traced_socket_path, 0660) < 0) {
+    perror("chmod");
+    return -1;
+  }
+  if (listen(listen_fd, MAX_CLIENTS) < 0) {
+    perror("listen");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void fini_socket(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) {
+      close_client(&clients[i]);
+    }
+  }
+
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(traced_socket_path);
+  }
+}
+
+/* Wait for requests up to timeout_us and serve them. */
+static void handle_clients(long timeout_us)
+{
+  struct pollfd fds[MAX_CLIENTS + 1];
+  struct client *fd_clients[MAX_CLIENTS + 1];
+  struct timespec timeout;
+  int nfds;
+  int i;
+
+  nfds = 0;
+  fds[nfds].fd = listen_fd;
+  fds[nfds].events = POLLIN;
+  fd_clients[nfds++] = NULL;
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) {
+      fds[nfds].fd = clients[i].fd;
+      fds[nfds].events = POLLIN;
+      fd_clients[nfds++] = &clients[i];
+    }
+  }
+
+  timeout.tv_sec = timeout_us / 1000000;
+  timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+  if (ppoll(fds, nfds, &timeout, NULL) <= 0) {
+    return;
+  }
+
+  for (i = 1; i < nfds; i++) {
+    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      handle_request(fd_clients[i]);
+    }
+  }
+  if (fds[0].revents & POLLIN) {
+    accept_client();
+  }
+}
+
+static void fini_shared_sink(void)
+{
+  fini_socket();
+
+  if (board) {
+    disable_shared_sink(board, &devices);
+  }
+
+  fini_trace_demux(&demux);
+
+  if (etr_buf) {
+    munmap(etr_buf, etr_ram_size);
+    etr_buf = NULL;
+  }
+
+  cs_shutdown();
+}
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS]\n", argv0);
+  fprintf(stderr, "CoreSight tracing daemon\n");
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr, "  -b, --board=NAME\t\tspecify board name (default: %s)\n",
+          board_name);
+  fprintf(stderr,
+          "  -c, --cpus=LIST\t\tCPUs to lease to tracers (default: all)\n");
+  fprintf(stderr,
+          "  -i, --interval=INT\t\tpolling interval in usec (default: %u)\n",
+          poll_usleep);
+  fprintf(stderr,
+          "  -s, --ring-size=INT\t\tper CPU ring size in bytes (default: "
+          "0x%lx)\n",
+          ring_size);
+  fprintf(stderr, "  -S, --socket=PATH\t\tlisten on the socket (default: %s)\n",
+          traced_socket_path);
+  fprintf(stderr,
+          "  -u, --udmabuf=INT\t\tspecify u-dma-buf device number to use "
+          "(default: %d)\n",
+          udmabuf_num);
+  fprintf(stderr,
+          "  -v, --verbose[=INT]\t\tverbose output level (default: %d)\n",
+          registration_verbose);
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"board", required_argument, NULL, 'b'},
+      {"cpus", required_argument, NULL, 'c'},
+      {"interval", required_argument, NULL, 'i'},
+      {"ring-size", required_argument, NULL, 's'},
+      {"socket", required_argument, NULL, 'S'},
+      {"udmabuf", required_argument, NULL, 'u'},
+      {"verbose", optional_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  int opt;
+  int option_index;
+  int n_shared_cpus;
+  int ret;
+  int i;
+
+  registration_verbose = 0;
+  n_shared_cpus = 0;
+
+  while ((opt = getopt_long(argc, argv, "b:c:i:s:S:u:v::h", long_options,
+                            &option_index)) != -1) {
+    switch (opt) {
+      case 'b':
+        board_name = optarg;
+        break;
+      case 'c':
+        n_shared_cpus = parse_cpu_list(optarg, shared_cpus, MAX_SHARED_CPUS);
+        if (n_shared_cpus < 0) {
+          fprintf(stderr, "Invalid CPU list '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'i':
+        poll_usleep = (useconds_t)atoi(optarg);
+        break;
+      case 's':
+        ring_size = (size_t)strtoul(optarg, NULL, 0);
+        break;
+      case 'S':
+        traced_socket_path = optarg;
+        break;
+      case 'u':
+        udmabuf_num = atoi(optarg);
+        break;
+      case 'v':
+        if (optarg) {
+          registration_verbose = atoi(optarg);
+        } else {
+          registration_verbose = 1;
+        }
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        break;
+    }
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  ret = EXIT_FAILURE;
+
+  if (init_shared_sink() < 0) {
+    goto exit;
+  }
+
+  if (n_shared_cpus == 0) {
+    for (i = 0; i < board->n_cpu && i < MAX_SHARED_CPUS; i++) {
+      shared_cpus[i] = true;
+    }
+  }
+
+  if (init_socket() < 0) {
+    goto exit;
+  }
+
+  while (!terminated) {
+    handle_flush_requests();
+    handle_clients(drain_sink() == 0 ? poll_usleep : 0);
+  }
+
+  ret = EXIT_SUCCESS;
+
+exit:
+  fini_shared_sink();
+
+  return ret;
+}
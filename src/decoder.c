@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "decoder.h"
+
+/* Images of the mapped address ranges for the decoder. */
+struct libcsdec_memory_image *alloc_decoder_images(
+    const struct map_info *map_info, int map_info_num)
+{
+  struct libcsdec_memory_image *mem_img;
+  int i;
+
+  mem_img = malloc(sizeof(struct libcsdec_memory_image) * map_info_num);
+  if (!mem_img) {
+    perror("malloc");
+    return NULL;
+  }
+  for (i = 0; i < map_info_num; i++) {
+    mem_img[i].data = map_info[i].buf;
+    mem_img[i].size =
+        (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE);
+  }
+
+  return mem_img;
+}
+
+/* Address ranges and paths of the images for the decoder. */
+struct libcsdec_memory_map *alloc_decoder_maps(const struct map_info *map_info,
+                                               int map_info_num)
+{
+  struct libcsdec_memory_map *mem_map;
+  int i;
+
+  mem_map = malloc(sizeof(struct libcsdec_memory_map) * map_info_num);
+  if (!mem_map) {
+    perror("malloc");
+    return NULL;
+  }
+  for (i = 0; i < map_info_num; i++) {
+    mem_map[i].start = map_info[i].start;
+    mem_map[i].end = map_info[i].end;
+    snprintf(mem_map[i].path, sizeof(mem_map[i].path), "%s",
+             map_info[i].path);
+  }
+
+  return mem_map;
+}
+
+libcsdec_t init_cov_decoder(cov_type_t type, unsigned char *bitmap,
+                            size_t bitmap_size, int map_info_num,
+                            struct libcsdec_memory_image *mem_img)
+{
+  switch (type) {
+    case edge_cov:
+      return libcsdec_init_edge(bitmap, bitmap_size, map_info_num, mem_img);
+    case path_cov:
+      return libcsdec_init_path(bitmap, bitmap_size, map_info_num, mem_img);
+    default:
+      return (libcsdec_t)NULL;
+  }
+}
+
+int reset_cov_decoder(cov_type_t type, libcsdec_t decoder, int trace_id,
+                      int map_info_num, struct libcsdec_memory_map *mem_map)
+{
+  libcsdec_result_t ret;
+
+  if (!decoder) {
+    return -1;
+  }
+
+  switch (type) {
+    case edge_cov:
+      ret = libcsdec_reset_edge(decoder, trace_id, map_info_num, mem_map);
+      break;
+    case path_cov:
+      ret = libcsdec_reset_path(decoder, trace_id, map_info_num, mem_map);
+      break;
+    default:
+      return -1;
+  }
+
+  return (ret == LIBCSDEC_SUCCESS) ? 0 : -1;
+}
+
+int run_cov_decoder(cov_type_t type, libcsdec_t decoder, void *buf,
+                    size_t buf_size)
+{
+  libcsdec_result_t ret;
+
+  if (!decoder) {
+    return -1;
+  }
+
+  switch (type) {
+    case edge_cov:
+      ret = libcsdec_run_edge(decoder, buf, buf_size);
+      break;
+    case path_cov:
+      ret = libcsdec_run_path(decoder, buf, buf_size);
+      break;
+    default:
+      return -1;
+  }
+
+  return (ret == LIBCSDEC_SUCCESS) ? 0 : -1;
+}
+
+int fini_cov_decoder(cov_type_t type, libcsdec_t decoder)
+{
+  if (!decoder) {
+    return -1;
+  }
+
+  switch (type) {
+    case edge_cov:
+      libcsdec_finish_edge(decoder);
+      break;
+    case path_cov:
+      libcsdec_finish_path(decoder);
+      break;
+  }
+
+  return 0;
+}
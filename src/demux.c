@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include "demux.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Trace sinks writing to memory produce 16-byte aligned formatter frames
+ * without frame synchronization packets:
+ *
+ *   byte 0-13: even bytes are either an ID change (bit 0 set) or data whose
+ *              bit 0 is in the auxiliary byte. Odd bytes are always data.
+ *   byte 14:   ID change effective from the next frame, or data.
+ *   byte 15:   auxiliary byte. Bit n is for byte 2n. For an ID change, the
+ *              bit is set if the following byte still belongs to the old ID.
+ */
+
+#define CS_FRAME_AUX (CS_FRAME_SIZE - 1)
+#define CS_FRAME_ID(id) ((unsigned char)(((id) << 1) | 1))
+#define CS_NULL_ID 0
+
+static void begin_frame_id(unsigned char *frame, int trace_id)
+{
+  memset(frame, 0, CS_FRAME_SIZE);
+  /* The ID takes effect from byte 1. */
+  frame[0] = CS_FRAME_ID(trace_id);
+}
+
+static void set_frame_byte(unsigned char *frame, int pos, unsigned char data)
+{
+  if (pos & 1) {
+    frame[pos] = data;
+  } else {
+    frame[pos] = data & ~1;
+    frame[CS_FRAME_AUX] |= (data & 1) << (pos / 2);
+  }
+}
+
+/* Fill a partial frame from pos with the null ID. */
+static void pad_frame(unsigned char *frame, int pos)
+{
+  unsigned char data;
+
+  if (pos & 1) {
+    /* Odd bytes cannot change the ID. Move the last data byte there and
+     * let the preceding ID change take effect after it. */
+    data = frame[pos - 1] | ((frame[CS_FRAME_AUX] >> ((pos - 1) / 2)) & 1);
+    frame[pos] = data;
+    frame[pos - 1] = CS_FRAME_ID(CS_NULL_ID);
+    frame[CS_FRAME_AUX] |= 1 << ((pos - 1) / 2);
+  } else {
+    frame[pos] = CS_FRAME_ID(CS_NULL_ID);
+    frame[CS_FRAME_AUX] &= ~(1 << (pos / 2));
+  }
+}
+
+static void emit_frame(struct trace_stream *stream)
+{
+  if (stream->buf_len + CS_FRAME_SIZE > sizeof(stream->buf)) {
+    write_trace_ring(stream->ring, stream->buf, stream->buf_len);
+    stream->buf_len = 0;
+  }
+  memcpy(&stream->buf[stream->buf_len], stream->frame, CS_FRAME_SIZE);
+  stream->buf_len += CS_FRAME_SIZE;
+}
+
+static void begin_frame(struct trace_stream *stream, int trace_id)
+{
+  begin_frame_id(stream->frame, trace_id);
+  stream->frame_pos = 1;
+}
+
+static void push_byte(struct trace_stream *stream, int trace_id,
+                      unsigned char data)
+{
+  set_frame_byte(stream->frame, stream->frame_pos, data);
+
+  if (++stream->frame_pos == CS_FRAME_AUX) {
+    emit_frame(stream);
+    begin_frame(stream, trace_id);
+  }
+}
+
+static void write_stream(struct trace_stream *stream)
+{
+  if (stream->buf_len > 0) {
+    write_trace_ring(stream->ring, stream->buf, stream->buf_len);
+    stream->buf_len = 0;
+  }
+}
+
+static inline void emit_byte(struct trace_demux *demux, int trace_id,
+                             unsigned char data)
+{
+  if (trace_id <= CS_TRACE_ID_MAX && demux->streams[trace_id]) {
+    push_byte(demux->streams[trace_id], trace_id, data);
+  }
+}
+
+void init_trace_demux(struct trace_demux *demux)
+{
+  memset(demux, 0, sizeof(*demux));
+  demux->cur_id = CS_NULL_ID;
+}
+
+void fini_trace_demux(struct trace_demux *demux)
+{
+  int i;
+
+  for (i = 0; i <= CS_TRACE_ID_MAX; i++) {
+    if (demux->streams[i]) {
+      free(demux->streams[i]);
+      demux->streams[i] = NULL;
+    }
+  }
+}
+
+int add_trace_stream(struct trace_demux *demux, int trace_id,
+                     struct trace_ring *ring)
+{
+  struct trace_stream *stream;
+
+  if (trace_id <= CS_NULL_ID || trace_id > CS_TRACE_ID_MAX || !ring) {
+    return -1;
+  }
+
+  stream = malloc(sizeof(struct trace_stream));
+  if (!stream) {
+    perror("malloc");
+    return -1;
+  }
+  stream->ring = ring;
+  stream->buf_len = 0;
+  begin_frame(stream, trace_id);
+
+  demux->streams[trace_id] = stream;
+
+  return 0;
+}
+
+void remove_trace_stream(struct trace_demux *demux, int trace_id)
+{
+  if (trace_id <= CS_NULL_ID || trace_id > CS_TRACE_ID_MAX) {
+    return;
+  }
+
+  if (demux->streams[trace_id]) {
+    free(demux->streams[trace_id]);
+    demux->streams[trace_id] = NULL;
+  }
+}
+
+/* Walk formatted trace and pass each data byte with its trace ID to emit.
+ * cur_id carries the ID across calls. */
+void deformat_trace(int *cur_id, const void *buf, size_t size,
+                    void (*emit)(void *, int, unsigned char), void *arg)
+{
+  const unsigned char *frame;
+  unsigned char aux;
+  unsigned char b;
+  size_t off;
+  int i;
+
+  for (off = 0; off + CS_FRAME_SIZE <= size; off += CS_FRAME_SIZE) {
+    frame = (const unsigned char *)buf + off;
+    aux = frame[CS_FRAME_AUX];
+
+    for (i = 0; i < CS_FRAME_AUX - 1; i += 2) {
+      b = frame[i];
+      if (b & 1) {
+        if (aux & (1 << (i / 2))) {
+          emit(arg, *cur_id, frame[i + 1]);
+          *cur_id = b >> 1;
+        } else {
+          *cur_id = b >> 1;
+          emit(arg, *cur_id, frame[i + 1]);
+        }
+      } else {
+        emit(arg, *cur_id, b | ((aux >> (i / 2)) & 1));
+        emit(arg, *cur_id, frame[i + 1]);
+      }
+    }
+
+    b = frame[CS_FRAME_AUX - 1];
+    if (b & 1) {
+      *cur_id = b >> 1;
+    } else {
+      emit(arg, *cur_id, b | ((aux >> 7) & 1));
+    }
+  }
+}
+
+static void emit_demux_byte(void *arg, int trace_id, unsigned char data)
+{
+  emit_byte((struct trace_demux *)arg, trace_id, data);
+}
+
+/* Split formatted trace into the registered streams. */
+void demux_trace(struct trace_demux *demux, const void *buf, size_t size)
+{
+  int i;
+
+  deformat_trace(&demux->cur_id, buf, size, emit_demux_byte, demux);
+
+  for (i = 0; i <= CS_TRACE_ID_MAX; i++) {
+    if (demux->streams[i]) {
+      write_stream(demux->streams[i]);
+    }
+  }
+}
+
+struct extract_state {
+  int trace_id;
+  unsigned char *out;
+  size_t len;
+};
+
+static void emit_extract_byte(void *arg, int trace_id, unsigned char data)
+{
+  struct extract_state *state;
+
+  state = (struct extract_state *)arg;
+  if (trace_id == state->trace_id) {
+    state->out[state->len++] = data;
+  }
+}
+
+/* Copy the raw bytes of a single trace ID out of a chunk of formatted trace.
+ * cur_id carries the ID across chunks. out must hold size bytes. Returns
+ * the number of bytes copied. */
+size_t extract_trace_chunk(int *cur_id, int trace_id, const void *buf,
+                           size_t size, unsigned char *out)
+{
+  struct extract_state state;
+
+  state.trace_id = trace_id;
+  state.out = out;
+  state.len = 0;
+
+  deformat_trace(cur_id, buf, size, emit_extract_byte, &state);
+
+  return state.len;
+}
+
+/* Copy the raw bytes of a single trace ID out of formatted trace. out must
+ * hold size bytes. Returns the number of bytes copied. */
+size_t extract_trace_stream(int trace_id, const void *buf, size_t size,
+                            unsigned char *out)
+{
+  int cur_id;
+
+  cur_id = CS_NULL_ID;
+
+  return extract_trace_chunk(&cur_id, trace_id, buf, size, out);
+}
+
+/* Pad the partial frame of the stream with the null ID and write it out. */
+void flush_trace_stream(struct trace_demux *demux, int trace_id)
+{
+  struct trace_stream *stream;
+
+  if (trace_id <= CS_NULL_ID || trace_id > CS_TRACE_ID_MAX ||
+      !(stream = demux->streams[trace_id])) {
+    return;
+  }
+
+  if (stream->frame_pos > 1) {
+    pad_frame(stream->frame, stream->frame_pos);
+    emit_frame(stream);
+    begin_frame(stream, trace_id);
+  }
+
+  write_stream(stream);
+}
+
+/* Format the raw bytes of a single trace ID into frames as a sink does. out
+ * must hold FORMATTED_TRACE_SIZE(size) bytes. Returns the formatted size. */
+size_t format_trace(int trace_id, const void *buf, size_t size,
+                    unsigned char *out)
+{
+  unsigned char *frame;
+  size_t len;
+  size_t i;
+  int pos;
+
+  frame = out;
+  len = 0;
+  pos = 0;
+  for (i = 0; i < size; i++) {
+    if (pos == 0) {
+      frame = out + len;
+      begin_frame_id(frame, trace_id);
+      pos = 1;
+    }
+    set_frame_byte(frame, pos, ((const unsigned char *)buf)[i]);
+    if (++pos == CS_FRAME_AUX) {
+      len += CS_FRAME_SIZE;
+      pos = 0;
+    }
+  }
+
+  if (pos > 1) {
+    pad_frame(frame, pos);
+    len += CS_FRAME_SIZE;
+  }
+
+  return len;
+}
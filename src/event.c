@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#define _GNU_SOURCE
+
+#include "event.h"
+
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void wait_futex(atomic_uint *addr, unsigned int val)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void wake_futex(atomic_uint *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void init_event_queue(struct event_queue *queue)
+{
+  int i;
+
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->futex, 0);
+  atomic_init(&queue->waiters, 0);
+  for (i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    atomic_init(&queue->slots[i].seq, 0);
+    atomic_init(&queue->slots[i].event, 0);
+  }
+}
+
+/* Start reading from the next posted event. */
+void init_event_cursor(struct event_queue *queue, struct event_cursor *cursor)
+{
+  cursor->head = atomic_load(&queue->tail);
+}
+
+void post_event(struct event_queue *queue, int event)
+{
+  struct event_slot *slot;
+  unsigned int index;
+
+  index = atomic_fetch_add(&queue->tail, 1);
+  slot = &queue->slots[index & (EVENT_QUEUE_SIZE - 1)];
+
+  /* Invalidate the slot first so that a lagging reader never pairs the new
+   * event with the old index. */
+  atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&slot->event, event, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+
+  atomic_fetch_add(&queue->futex, 1);
+  /* A reader that registers after this still sees the new futex value. */
+  if (atomic_load(&queue->waiters) > 0) {
+    wake_futex(&queue->futex);
+  }
+}
+
+/* Read the event at the cursor. Returns 1 and advances the cursor on success,
+ * 0 if it is not posted yet. A reader overrun by EVENT_QUEUE_SIZE events
+ * skips to the oldest one still in the queue. */
+static int read_event(struct event_queue *queue, struct event_cursor *cursor,
+                      int *event)
+{
+  struct event_slot *slot;
+  unsigned int seq, tail;
+
+  slot = &queue->slots[cursor->head & (EVENT_QUEUE_SIZE - 1)];
+  seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  *event = atomic_load_explicit(&slot->event, memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+
+  if (seq == cursor->head + 1 &&
+      atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) {
+    cursor->head++;
+    return 1;
+  }
+
+  tail = atomic_load(&queue->tail);
+  if ((int)(tail - cursor->head) > EVENT_QUEUE_SIZE) {
+    cursor->head = tail - EVENT_QUEUE_SIZE;
+    return read_event(queue, cursor, event);
+  }
+
+  return 0;
+}
+
+/* Wait for the next event in the mask. Events outside the mask are skipped. */
+int wait_event(struct event_queue *queue, struct event_cursor *cursor,
+               unsigned int mask)
+{
+  unsigned int futex;
+  int event;
+
+  while (1) {
+    futex = atomic_load(&queue->futex);
+    while (read_event(queue, cursor, &event)) {
+      if (mask & EVENT_MASK(event)) {
+        return event;
+      }
+    }
+    atomic_fetch_add(&queue->waiters, 1);
+    wait_futex(&queue->futex, futex);
+    atomic_fetch_sub(&queue->waiters, 1);
+  }
+}
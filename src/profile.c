@@ -0,0 +1,1982 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+
+#include "demux.h"
+#include "profile.h"
+#include "symbol.h"
+#include "utils.h"
+
+#define PROFILE_TABLE_INIT 0x1000
+#define PROFILE_JOBS_MAX 64
+#define PROFILE_CHUNK_MIN 0x10000
+#define PROFILE_STACK_MAX 512   /* Deeper calls are merged */
+#define STACK_TREE_INIT 0x400
+
+#define AUTOFDO_NAME_FMT "%s.autofdo.txt"
+#define BOLT_NAME_FMT "%s.bolt.fdata"
+
+#define ASYNC_LEN 12
+
+/* Instruction trace decoder state for a stream of a single trace ID. Only
+ * the packets of A64 instruction trace without data trace or speculation
+ * are understood. Anything else drops sync until the next A-sync. Cycle
+ * count packets are expected without commit fields (TRCIDR0.COMMOPT). */
+struct profile_walker {
+  const struct map_info *map_info;
+  int map_info_num;
+  struct profile *profile;
+  unsigned long addr_regs[3]; /* Address history */
+  unsigned long pc;
+  unsigned long range_start;
+  unsigned long branch_from;
+  bool pc_valid;
+  bool branch_pending;    /* Waiting for the target of an indirect branch */
+  bool exception_pending; /* Waiting for the exception return address */
+  bool call_pending;      /* Waiting for the target of an indirect call */
+  long node;              /* Call tree node of the current call stack */
+  unsigned int skipped;   /* Calls beyond PROFILE_STACK_MAX */
+  unsigned long timestamp;
+  bool timestamp_valid;
+  unsigned long block_start;
+  unsigned long cycle_threshold; /* From trace info */
+  long cycle_edge;               /* Cycle sample waiting for its target */
+  unsigned long edge_from;       /* Counted edge waiting for its target */
+  unsigned long edge_cycles;
+  bool muted; /* Outside the time window */
+  unsigned long context_id;
+  bool context_seen; /* A packet carried context_id */
+};
+
+struct profile_job {
+  pthread_t thread;
+  struct profile profile;
+  const unsigned char *stream;
+  size_t start;
+  size_t end;
+  const struct map_info *map_info;
+  int map_info_num;
+  int ret;
+};
+
+int parse_profile_format(const char *name, profile_format_t *format)
+{
+  if (!strcmp(name, "autofdo")) {
+    *format = autofdo_profile;
+  } else if (!strcmp(name, "bolt")) {
+    *format = bolt_profile;
+  } else if (!strcmp(name, "folded")) {
+    *format = folded_profile;
+  } else if (!strcmp(name, "cycles")) {
+    *format = cycles_profile;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+int parse_stack_weight(const char *name, stack_weight_t *weight)
+{
+  if (!strcmp(name, "insns")) {
+    *weight = insn_weight;
+  } else if (!strcmp(name, "time")) {
+    *weight = time_weight;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int init_profile_table(struct profile_table *table, size_t size)
+{
+  table->entries = calloc(size, sizeof(struct profile_count));
+  if (!table->entries) {
+    perror("calloc");
+    return -1;
+  }
+  table->size = size;
+  table->used = 0;
+
+  return 0;
+}
+
+static void fini_profile_table(struct profile_table *table)
+{
+  free(table->entries);
+  table->entries = NULL;
+  table->size = 0;
+  table->used = 0;
+}
+
+static inline size_t hash_profile_count(unsigned long from, unsigned long to,
+                                        size_t size)
+{
+  return (size_t)(((from >> 2) * 0x9e3779b97f4a7c15UL) ^ (to >> 2)) &
+         (size - 1);
+}
+
+static int grow_profile_table(struct profile_table *table)
+{
+  struct profile_table new_table;
+  size_t i;
+
+  if (init_profile_table(&new_table, table->size * 2) < 0) {
+    return -1;
+  }
+  for (i = 0; i < table->size; i++) {
+    if (table->entries[i].count > 0) {
+      add_profile_count(&new_table, table->entries[i].from,
+                        table->entries[i].to, table->entries[i].count);
+    }
+  }
+  fini_profile_table(table);
+  *table = new_table;
+
+  return 0;
+}
+
+int add_profile_count(struct profile_table *table, unsigned long from,
+                      unsigned long to, unsigned long count)
+{
+  struct profile_count *entry;
+  size_t i;
+
+  if (table->used * 2 >= table->size && grow_profile_table(table) < 0) {
+    return -1;
+  }
+
+  i = hash_profile_count(from, to, table->size);
+  while (1) {
+    entry = &table->entries[i];
+    if (entry->count == 0) {
+      entry->from = from;
+      entry->to = to;
+      entry->count = count;
+      table->used++;
+      return 0;
+    }
+    if (entry->from == from && entry->to == to) {
+      entry->count += count;
+      return 0;
+    }
+    i = (i + 1) & (table->size - 1);
+  }
+}
+
+const struct profile_count *find_profile_count(
+    const struct profile_table *table, unsigned long from, unsigned long to)
+{
+  const struct profile_count *entry;
+  size_t i;
+
+  i = hash_profile_count(from, to, table->size);
+  while (1) {
+    entry = &table->entries[i];
+    if (entry->count == 0) {
+      return NULL;
+    }
+    if (entry->from == from && entry->to == to) {
+      return entry;
+    }
+    i = (i + 1) & (table->size - 1);
+  }
+}
+
+static int merge_profile_table(struct profile_table *dst,
+                               const struct profile_table *src)
+{
+  size_t i;
+
+  for (i = 0; i < src->size; i++) {
+    if (src->entries[i].count > 0 &&
+        add_profile_count(dst, src->entries[i].from, src->entries[i].to,
+                          src->entries[i].count) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int init_profile(struct profile *profile)
+{
+  memset(&profile->window, 0, sizeof(profile->window));
+  memset(&profile->stacks, 0, sizeof(profile->stacks));
+  memset(&profile->cycles, 0, sizeof(profile->cycles));
+  memset(&profile->history, 0, sizeof(profile->history));
+  memset(&profile->annotations, 0, sizeof(profile->annotations));
+  profile->overflows = 0;
+  if (init_profile_table(&profile->ranges, PROFILE_TABLE_INIT) < 0) {
+    return -1;
+  }
+  if (init_profile_table(&profile->branches, PROFILE_TABLE_INIT) < 0) {
+    fini_profile_table(&profile->ranges);
+    return -1;
+  }
+
+  return 0;
+}
+
+void fini_profile(struct profile *profile)
+{
+  fini_profile_table(&profile->ranges);
+  fini_profile_table(&profile->branches);
+  if (profile->stacks.nodes) {
+    fini_profile_table(&profile->stacks.children);
+  }
+  free(profile->stacks.nodes);
+  free(profile->stacks.touched);
+  memset(&profile->stacks, 0, sizeof(profile->stacks));
+  if (profile->cycles.blocks) {
+    fini_profile_table(&profile->cycles.index);
+    fini_profile_table(&profile->cycles.edges);
+  }
+  free(profile->cycles.blocks);
+  free(profile->cycles.pending);
+  memset(&profile->cycles, 0, sizeof(profile->cycles));
+  free(profile->history.records);
+  memset(&profile->history, 0, sizeof(profile->history));
+  fini_stm_annotations(&profile->annotations);
+}
+
+/* Track call stacks while decoding. They are decoded in a single pass, as
+ * the call stack at the start of a chunk is unknown. */
+int init_profile_stacks(struct profile *profile, stack_weight_t weight)
+{
+  struct call_tree *tree;
+
+  tree = &profile->stacks;
+  tree->nodes = malloc(STACK_TREE_INIT * sizeof(struct stack_node));
+  if (!tree->nodes) {
+    perror("malloc");
+    return -1;
+  }
+  if (init_profile_table(&tree->children, STACK_TREE_INIT * 2) < 0) {
+    free(tree->nodes);
+    tree->nodes = NULL;
+    return -1;
+  }
+  tree->weight = weight;
+  tree->size = STACK_TREE_INIT;
+  tree->used = 0;
+  tree->touched = NULL;
+  tree->touched_size = 0;
+  tree->touched_used = 0;
+
+  return 0;
+}
+
+/* Count cycles of basic blocks. The trace must be cycle accurate. */
+int init_profile_cycles(struct profile *profile)
+{
+  struct cycle_profile *cycles;
+
+  cycles = &profile->cycles;
+  cycles->blocks = malloc(PROFILE_TABLE_INIT * sizeof(struct block_cycles));
+  if (!cycles->blocks) {
+    perror("malloc");
+    return -1;
+  }
+  if (init_profile_table(&cycles->index, PROFILE_TABLE_INIT * 2) < 0) {
+    goto error;
+  }
+  if (init_profile_table(&cycles->edges, PROFILE_TABLE_INIT) < 0) {
+    fini_profile_table(&cycles->index);
+    goto error;
+  }
+  cycles->size = PROFILE_TABLE_INIT;
+  cycles->used = 0;
+  cycles->pending = NULL;
+  cycles->pending_size = 0;
+  cycles->pending_used = 0;
+
+  return 0;
+
+error:
+  free(cycles->blocks);
+  cycles->blocks = NULL;
+  return -1;
+}
+
+/* Keep the last size taken branches in trace order. They are decoded in a
+ * single pass. */
+int init_profile_history(struct profile *profile, size_t size)
+{
+  struct branch_history *history;
+
+  history = &profile->history;
+  history->records = malloc(size * sizeof(struct branch_record));
+  if (!history->records) {
+    perror("malloc");
+    return -1;
+  }
+  history->size = size;
+  history->head = 0;
+  history->count = 0;
+
+  return 0;
+}
+
+/* Returns the index of the block, or -1 on error. */
+static long get_cycle_block(struct cycle_profile *cycles, unsigned long start,
+                            unsigned long end)
+{
+  const struct profile_count *entry;
+  struct block_cycles *blocks;
+  struct block_cycles *block;
+
+  entry = find_profile_count(&cycles->index, start, end);
+  if (entry) {
+    return (long)entry->count - 1;
+  }
+
+  if (cycles->used == cycles->size) {
+    blocks = realloc(cycles->blocks,
+                     cycles->size * 2 * sizeof(struct block_cycles));
+    if (!blocks) {
+      perror("realloc");
+      return -1;
+    }
+    cycles->blocks = blocks;
+    cycles->size *= 2;
+  }
+
+  block = &cycles->blocks[cycles->used];
+  memset(block, 0, sizeof(*block));
+  block->start = start;
+  block->end = end;
+  if (add_profile_count(&cycles->index, start, end, cycles->used + 1) < 0) {
+    return -1;
+  }
+
+  return (long)cycles->used++;
+}
+
+static int merge_profile_cycles(struct cycle_profile *dst,
+                                const struct cycle_profile *src)
+{
+  const struct block_cycles *from;
+  struct block_cycles *to;
+  long block;
+  size_t i;
+  int j;
+
+  for (i = 0; i < src->used; i++) {
+    from = &src->blocks[i];
+    if ((block = get_cycle_block(dst, from->start, from->end)) < 0) {
+      return -1;
+    }
+    to = &dst->blocks[block];
+    to->count += from->count;
+    to->cycles += from->cycles;
+    for (j = 0; j < CYCLE_HIST_BUCKETS; j++) {
+      to->hist[j] += from->hist[j];
+    }
+  }
+
+  return merge_profile_table(&dst->edges, &src->edges);
+}
+
+static int get_cycle_bucket(unsigned long cycles)
+{
+  int bucket;
+
+  bucket = 0;
+  while (cycles > 0 && bucket < CYCLE_HIST_BUCKETS - 1) {
+    cycles >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+/* Returns the child node of parent called at addr, or -1 on error. */
+static long get_stack_node(struct call_tree *tree, long parent,
+                           unsigned long addr)
+{
+  const struct profile_count *entry;
+  struct stack_node *nodes;
+  struct stack_node *node;
+  unsigned long key;
+
+  /* Node indexes are shifted as the hash drops the low two bits. */
+  key = (unsigned long)(parent + 1) << 2;
+  entry = find_profile_count(&tree->children, key, addr);
+  if (entry) {
+    return (long)entry->count - 1;
+  }
+
+  if (tree->used == tree->size) {
+    nodes = realloc(tree->nodes, tree->size * 2 * sizeof(struct stack_node));
+    if (!nodes) {
+      perror("realloc");
+      return -1;
+    }
+    tree->nodes = nodes;
+    tree->size *= 2;
+  }
+
+  node = &tree->nodes[tree->used];
+  node->addr = addr;
+  node->parent = parent;
+  node->depth = parent < 0 ? 0 : tree->nodes[parent].depth + 1;
+  node->weight = 0;
+  node->pending = 0;
+  if (add_profile_count(&tree->children, key, addr, tree->used + 1) < 0) {
+    return -1;
+  }
+
+  return (long)tree->used++;
+}
+
+/* Split the ticks between two timestamps over the call stacks by the
+ * instructions run in each. */
+static void distribute_stack_time(struct call_tree *tree, unsigned long ticks)
+{
+  struct stack_node *node;
+  unsigned long total;
+  unsigned long given;
+  unsigned long share;
+  size_t i;
+
+  total = 0;
+  for (i = 0; i < tree->touched_used; i++) {
+    total += tree->nodes[tree->touched[i]].pending;
+  }
+
+  given = 0;
+  for (i = 0; i < tree->touched_used; i++) {
+    node = &tree->nodes[tree->touched[i]];
+    if (i == tree->touched_used - 1) {
+      share = ticks - given;
+    } else {
+      share = (unsigned long)((double)ticks * node->pending / total);
+    }
+    node->weight += share;
+    node->pending = 0;
+    given += share;
+  }
+  tree->touched_used = 0;
+}
+
+static inline long sign_extend(unsigned long value, int bits)
+{
+  return (long)(value << (64 - bits)) >> (64 - bits);
+}
+
+/* Classify an A64 instruction. These are the P0 instructions that consume an
+ * atom: immediate branches and branches to register. */
+branch_type_t get_branch_type(uint32_t insn, unsigned long pc,
+                              unsigned long *target)
+{
+  if ((insn & 0x7c000000) == 0x14000000) {
+    /* B, BL */
+    *target = pc + (sign_extend(insn & 0x3ffffff, 26) << 2);
+    return direct_branch;
+  }
+  if ((insn & 0xff000000) == 0x54000000 ||
+      (insn & 0x7e000000) == 0x34000000) {
+    /* B.cond, BC.cond, CBZ, CBNZ */
+    *target = pc + (sign_extend((insn >> 5) & 0x7ffff, 19) << 2);
+    return direct_branch;
+  }
+  if ((insn & 0x7e000000) == 0x36000000) {
+    /* TBZ, TBNZ */
+    *target = pc + (sign_extend((insn >> 5) & 0x3fff, 14) << 2);
+    return direct_branch;
+  }
+  if ((insn & 0xfe000000) == 0xd6000000) {
+    /* BR, BLR, RET, ERET and their authenticated forms */
+    return indirect_branch;
+  }
+
+  return not_branch;
+}
+
+static const struct map_info *find_map_info(const struct profile_walker *w,
+                                            unsigned long addr)
+{
+  int i;
+
+  for (i = 0; i < w->map_info_num; i++) {
+    if (w->map_info[i].start <= addr && addr < w->map_info[i].end &&
+        w->map_info[i].buf) {
+      return &w->map_info[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Classify the calls and returns among the branches, which move the call
+ * stack. */
+call_type_t get_call_type(uint32_t insn)
+{
+  if ((insn & 0xfc000000) == 0x94000000) {
+    return call_insn; /* BL */
+  }
+  if ((insn & 0xfe000000) == 0xd6000000) {
+    switch ((insn >> 21) & 0x7) {
+      case 1:
+        return call_insn; /* BLR and its authenticated forms */
+      case 2:
+        return return_insn; /* RET and its authenticated forms */
+    }
+  }
+
+  return not_call;
+}
+
+static void push_stack(struct profile_walker *w, unsigned long addr)
+{
+  struct call_tree *tree;
+  long node;
+
+  tree = &w->profile->stacks;
+  if (!find_map_info(w, addr)) {
+    /* The callee is not traced. Trace resumes on its return. */
+    return;
+  }
+  if (w->node >= 0 && tree->nodes[w->node].depth >= PROFILE_STACK_MAX) {
+    w->skipped++;
+    return;
+  }
+  if ((node = get_stack_node(tree, w->node, addr)) >= 0) {
+    w->node = node;
+  }
+}
+
+static void pop_stack(struct profile_walker *w)
+{
+  if (w->skipped > 0) {
+    w->skipped--;
+    return;
+  }
+  if (w->node >= 0) {
+    /* Returning from the root leaves the call stack unknown until the
+     * next address. */
+    w->node = w->profile->stacks.nodes[w->node].parent;
+  }
+}
+
+/* Charge the instructions run to the current call stack. */
+static void charge_stack(struct profile_walker *w, unsigned long insns)
+{
+  struct call_tree *tree;
+  struct stack_node *node;
+  long *touched;
+  size_t size;
+
+  tree = &w->profile->stacks;
+  if (!tree->nodes || w->node < 0 || w->muted) {
+    return;
+  }
+
+  node = &tree->nodes[w->node];
+  if (tree->weight == insn_weight) {
+    node->weight += insns;
+    return;
+  }
+
+  if (node->pending == 0) {
+    if (tree->touched_used == tree->touched_size) {
+      size = tree->touched_size ? tree->touched_size * 2 : STACK_TREE_INIT;
+      touched = realloc(tree->touched, size * sizeof(long));
+      if (!touched) {
+        perror("realloc");
+        return;
+      }
+      tree->touched = touched;
+      tree->touched_size = size;
+    }
+    tree->touched[tree->touched_used++] = w->node;
+  }
+  node->pending += insns;
+}
+
+static void walk_call(struct profile_walker *w, uint32_t insn,
+                      branch_type_t type, unsigned long target)
+{
+  if (!w->profile->stacks.nodes) {
+    return;
+  }
+
+  switch (get_call_type(insn)) {
+    case call_insn:
+      if (type == direct_branch) {
+        push_stack(w, target);
+      } else {
+        w->call_pending = true;
+      }
+      break;
+    case return_insn:
+      pop_stack(w);
+      break;
+    default:
+      break;
+  }
+}
+
+static void walk_timestamp(struct profile_walker *w, unsigned long timestamp)
+{
+  struct call_tree *tree;
+  size_t i;
+
+  tree = &w->profile->stacks;
+  if (tree->nodes && tree->weight == time_weight) {
+    if (w->timestamp_valid && timestamp > w->timestamp) {
+      distribute_stack_time(tree, timestamp - w->timestamp);
+    } else {
+      /* Nothing to measure the instructions since the last sync with. */
+      for (i = 0; i < tree->touched_used; i++) {
+        tree->nodes[tree->touched[i]].pending = 0;
+      }
+      tree->touched_used = 0;
+    }
+  }
+  w->timestamp = timestamp;
+  w->timestamp_valid = true;
+
+  if (w->profile->window.on) {
+    w->muted = timestamp < w->profile->window.start ||
+               timestamp >= w->profile->window.end;
+  }
+}
+
+static void count_walker(struct profile_walker *w, struct profile_table *table,
+                         unsigned long from, unsigned long to)
+{
+  struct branch_history *history;
+  struct branch_record *record;
+
+  if (w->muted) {
+    return;
+  }
+  add_profile_count(table, from, to, 1);
+
+  history = &w->profile->history;
+  if (!history->records || table != &w->profile->branches) {
+    return;
+  }
+  if (history->count < history->size) {
+    record = &history->records[history->count++];
+  } else {
+    record = &history->records[history->head];
+    history->head = (history->head + 1) % history->size;
+  }
+  record->from = from;
+  record->to = to;
+}
+
+/* Record a block run, whose cycles come with the next cycle count. */
+static void add_cycle_sample(struct profile_walker *w, unsigned long end,
+                             unsigned long to, unsigned long insns)
+{
+  struct cycle_profile *cycles;
+  struct cycle_sample *pending;
+  size_t size;
+  long block;
+
+  cycles = &w->profile->cycles;
+  if (!cycles->blocks || w->muted) {
+    return;
+  }
+  if ((block = get_cycle_block(cycles, w->block_start, end)) < 0) {
+    return;
+  }
+
+  if (cycles->pending_used == cycles->pending_size) {
+    size = cycles->pending_size ? cycles->pending_size * 2 : STACK_TREE_INIT;
+    pending = realloc(cycles->pending, size * sizeof(struct cycle_sample));
+    if (!pending) {
+      perror("realloc");
+      return;
+    }
+    cycles->pending = pending;
+    cycles->pending_size = size;
+  }
+
+  if (to == 0) {
+    w->cycle_edge = (long)cycles->pending_used;
+  }
+  cycles->pending[cycles->pending_used].block = block;
+  cycles->pending[cycles->pending_used].to = to;
+  cycles->pending[cycles->pending_used].insns = insns;
+  cycles->pending_used++;
+}
+
+static void drop_cycle_samples(struct profile_walker *w)
+{
+  w->profile->cycles.pending_used = 0;
+  w->cycle_edge = -1;
+  w->edge_cycles = 0;
+}
+
+/* Split a cycle count over the blocks run since the last one by their
+ * instructions. The edge leaving a block is charged with its cycles. */
+static void walk_cycle_count(struct profile_walker *w, unsigned long count)
+{
+  struct cycle_profile *cycles;
+  struct cycle_sample *sample;
+  struct block_cycles *block;
+  unsigned long total;
+  unsigned long given;
+  unsigned long share;
+  size_t i;
+
+  cycles = &w->profile->cycles;
+  if (!cycles->blocks || cycles->pending_used == 0) {
+    return;
+  }
+
+  total = 0;
+  for (i = 0; i < cycles->pending_used; i++) {
+    total += cycles->pending[i].insns;
+  }
+
+  given = 0;
+  for (i = 0; i < cycles->pending_used; i++) {
+    sample = &cycles->pending[i];
+    if (i == cycles->pending_used - 1) {
+      share = count - given;
+    } else {
+      share = (unsigned long)((double)count * sample->insns / total);
+    }
+    given += share;
+
+    block = &cycles->blocks[sample->block];
+    block->count++;
+    block->cycles += share;
+    block->hist[get_cycle_bucket(share)]++;
+    if (share == 0) {
+      continue;
+    }
+    if (sample->to) {
+      add_profile_count(&cycles->edges, block->end, sample->to, share);
+    } else {
+      w->edge_from = block->end;
+      w->edge_cycles = share;
+    }
+  }
+  cycles->pending_used = 0;
+  w->cycle_edge = -1;
+}
+
+/* Resolve the edge of an indirect branch in the cycle samples. */
+static void set_cycle_edge(struct profile_walker *w, unsigned long addr)
+{
+  struct cycle_profile *cycles;
+
+  cycles = &w->profile->cycles;
+  if (!cycles->blocks) {
+    return;
+  }
+
+  if (w->cycle_edge >= 0) {
+    cycles->pending[w->cycle_edge].to = addr;
+    w->cycle_edge = -1;
+  } else if (w->edge_cycles > 0) {
+    add_profile_count(&cycles->edges, w->edge_from, addr, w->edge_cycles);
+  }
+  w->edge_cycles = 0;
+}
+
+static void reset_walker(struct profile_walker *w)
+{
+  memset(w->addr_regs, 0, sizeof(w->addr_regs));
+  w->pc_valid = false;
+  w->branch_pending = false;
+  w->exception_pending = false;
+  drop_cycle_samples(w);
+}
+
+static void set_walker_addr(struct profile_walker *w, unsigned long addr)
+{
+  w->addr_regs[2] = w->addr_regs[1];
+  w->addr_regs[1] = w->addr_regs[0];
+  w->addr_regs[0] = addr;
+
+  if (w->call_pending) {
+    push_stack(w, addr);
+    w->call_pending = false;
+  } else if (w->node < 0 && w->profile->stacks.nodes) {
+    w->node = get_stack_node(&w->profile->stacks, -1, addr);
+  }
+
+  if (w->exception_pending) {
+    /* The exception was taken at addr. What ran before it is a range. */
+    if (w->pc_valid && w->range_start < addr) {
+      count_walker(w, &w->profile->ranges, w->range_start, addr - 4);
+      charge_stack(w, (addr - w->range_start) / 4);
+    }
+    w->exception_pending = false;
+    w->pc_valid = false;
+    return;
+  }
+
+  if (w->branch_pending) {
+    count_walker(w, &w->profile->branches, w->branch_from, addr);
+    set_cycle_edge(w, addr);
+    w->branch_pending = false;
+  }
+  w->pc = addr;
+  w->range_start = addr;
+  w->block_start = addr;
+  w->pc_valid = true;
+}
+
+/* Walk the code from pc to the next P0 instruction and apply the atom. */
+static void walk_atom(struct profile_walker *w, bool taken)
+{
+  const struct map_info *map;
+  unsigned long target;
+  branch_type_t type;
+  uint32_t insn;
+  int n;
+
+  if (!w->pc_valid) {
+    return;
+  }
+
+  map = find_map_info(w, w->pc);
+  for (n = 0; n < PROFILE_SCAN_MAX; n++) {
+    if (!map || w->pc < map->start || w->pc + 4 > map->end) {
+      map = find_map_info(w, w->pc);
+      if (!map) {
+        w->pc_valid = false;
+        return;
+      }
+    }
+    memcpy(&insn, (const char *)map->buf + (w->pc - map->start), sizeof(insn));
+    type = get_branch_type(insn, w->pc, &target);
+    if (type == not_branch) {
+      w->pc += 4;
+      continue;
+    }
+
+    charge_stack(w, (unsigned long)n + 1);
+    if (!taken) {
+      add_cycle_sample(w, w->pc, w->pc + 4, (w->pc - w->block_start) / 4 + 1);
+      w->pc += 4;
+      w->block_start = w->pc;
+      return;
+    }
+
+    count_walker(w, &w->profile->ranges, w->range_start, w->pc);
+    add_cycle_sample(w, w->pc, type == direct_branch ? target : 0,
+                     (w->pc - w->block_start) / 4 + 1);
+    walk_call(w, insn, type, target);
+    if (type == direct_branch) {
+      count_walker(w, &w->profile->branches, w->pc, target);
+      w->pc = target;
+      w->range_start = target;
+      w->block_start = target;
+    } else {
+      w->branch_from = w->pc;
+      w->branch_pending = true;
+      w->pc_valid = false;
+    }
+    return;
+  }
+
+  /* Ran into data or lost track. */
+  w->pc_valid = false;
+}
+
+static void walk_atoms(struct profile_walker *w, unsigned int pattern,
+                       int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    walk_atom(w, (pattern >> i) & 1);
+  }
+}
+
+/* Skip a field with a continuation bit in bit 7 of each byte. Returns the
+ * field length or 0 if it runs past the end. */
+static size_t skip_leb(const unsigned char *p, size_t len, size_t max)
+{
+  size_t i;
+
+  for (i = 0; i < len && i < max; i++) {
+    if (!(p[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+
+  return i == max ? max : 0;
+}
+
+static unsigned long get_leb(const unsigned char *p, size_t len)
+{
+  unsigned long value;
+  size_t i;
+
+  value = 0;
+  for (i = 0; i < len; i++) {
+    value |= (unsigned long)(p[i] & 0x7f) << (7 * i);
+  }
+
+  return value;
+}
+
+static bool is_async(const unsigned char *p, size_t len)
+{
+  int i;
+
+  if (len < ASYNC_LEN) {
+    return false;
+  }
+  for (i = 0; i < ASYNC_LEN - 1; i++) {
+    if (p[i] != 0x00) {
+      return false;
+    }
+  }
+
+  return p[ASYNC_LEN - 1] == 0x80;
+}
+
+/* Returns the length of the context payload, which is an info byte followed
+ * by an optional VMID and context ID. */
+static size_t get_context_len(const unsigned char *p, size_t len)
+{
+  size_t n;
+
+  if (len < 1) {
+    return 0;
+  }
+  n = 1;
+  if (p[0] & 0x40) {
+    n += 1; /* 8-bit VMID */
+  }
+  if (p[0] & 0x80) {
+    n += 4; /* 32-bit context ID */
+  }
+
+  return n <= len ? n : 0;
+}
+
+/* Take the context ID out of a context payload of length len. */
+static void set_walker_context(struct profile_walker *w,
+                               const unsigned char *p, size_t len)
+{
+  if (!(p[0] & 0x80)) {
+    return;
+  }
+
+  p += len - 4;
+  w->context_id = (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+                  ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+  w->context_seen = true;
+}
+
+/* Returns the length of a timestamp payload and updates the low bits of
+ * timestamp with it, or 0 if it runs past the end. */
+static size_t get_timestamp(const unsigned char *p, size_t len,
+                            unsigned long *timestamp)
+{
+  unsigned long value;
+  unsigned long mask;
+  size_t i;
+
+  value = 0;
+  for (i = 0; i < len && i < 9; i++) {
+    if (i == 8) {
+      value |= (unsigned long)p[i] << 56;
+      break;
+    }
+    value |= (unsigned long)(p[i] & 0x7f) << (7 * i);
+    if (!(p[i] & 0x80)) {
+      break;
+    }
+  }
+  if (i == len) {
+    return 0;
+  }
+
+  mask = i == 8 ? ~0UL : (1UL << (7 * (i + 1))) - 1;
+  *timestamp = (*timestamp & ~mask) | value;
+
+  return i + 1;
+}
+
+static unsigned long get_long_addr(const unsigned char *p, int bytes)
+{
+  unsigned long addr;
+  int i;
+
+  /* IS0: A[8:2] and A[15:9] in the low 7 bits of the first two bytes. */
+  addr = ((unsigned long)(p[0] & 0x7f) << 2) |
+         ((unsigned long)(p[1] & 0x7f) << 9);
+  for (i = 2; i < bytes; i++) {
+    addr |= (unsigned long)p[i] << (8 * i);
+  }
+
+  return addr;
+}
+
+/* Decode one packet at p. Returns its length, or 0 if it is unknown or
+ * truncated. */
+static size_t walk_packet(struct profile_walker *w, const unsigned char *p,
+                          size_t len)
+{
+  unsigned char hdr;
+  unsigned long addr;
+  unsigned long timestamp;
+  size_t n, m;
+  int i;
+
+  hdr = p[0];
+
+  if (hdr >= 0xc0) {
+    /* Atoms. Bit n of the pattern is atom n, set for E. */
+    if (hdr <= 0xd4 || (hdr >= 0xe0 && hdr <= 0xf4)) {
+      /* Format 6: (hdr & 0x1f) + 3 E atoms and a last E or N. */
+      n = (hdr & 0x1f) + 3;
+      walk_atoms(w, (1U << n) - 1, (int)n);
+      walk_atom(w, !(hdr & 0x20));
+    } else if (hdr <= 0xd7 || hdr == 0xf5) {
+      /* Format 5 */
+      switch (((hdr >> 3) & 0x4) | (hdr & 0x3)) {
+        case 5:
+          walk_atoms(w, 0x1e, 5);
+          break;
+        case 1:
+          walk_atoms(w, 0x00, 5);
+          break;
+        case 2:
+          walk_atoms(w, 0x0a, 5);
+          break;
+        case 3:
+          walk_atoms(w, 0x15, 5);
+          break;
+      }
+    } else if (hdr <= 0xdb) {
+      walk_atoms(w, hdr & 0x3, 2); /* Format 2 */
+    } else if (hdr <= 0xdf) {
+      static const unsigned int f4[] = {0xe, 0x0, 0xa, 0x5};
+      walk_atoms(w, f4[hdr & 0x3], 4); /* Format 4 */
+    } else if (hdr <= 0xf7) {
+      walk_atoms(w, hdr & 0x1, 1); /* Format 1 */
+    } else {
+      walk_atoms(w, hdr & 0x7, 3); /* Format 3 */
+    }
+    return 1;
+  }
+
+  switch (hdr) {
+    case 0x00:
+      if (!is_async(p, len)) {
+        return 0;
+      }
+      reset_walker(w);
+      return ASYNC_LEN;
+    case 0x01:
+      /* Trace info. PLCTL selects the following fields. */
+      if (len < 2) {
+        return 0;
+      }
+      n = 2;
+      for (i = 0; i < 4; i++) {
+        if (p[1] & (1 << i)) {
+          if (!(m = skip_leb(p + n, len - n, 10))) {
+            return 0;
+          }
+          if (i == 3) {
+            /* Cycle count threshold */
+            w->cycle_threshold = get_leb(p + n, m);
+          }
+          n += m;
+        }
+      }
+      reset_walker(w);
+      return n;
+    case 0x02:
+    case 0x03:
+      /* Timestamp, with a cycle count for 0x03. */
+      timestamp = w->timestamp;
+      if (!(n = get_timestamp(p + 1, len - 1, &timestamp))) {
+        return 0;
+      }
+      n += 1;
+      if (hdr == 0x03) {
+        if (!(m = skip_leb(p + n, len - n, 3))) {
+          return 0;
+        }
+        walk_cycle_count(w, get_leb(p + n, m));
+        n += m;
+      }
+      walk_timestamp(w, timestamp);
+      return n;
+    case 0x04:
+      /* Trace on. The trace is discontinuous. */
+      w->pc_valid = false;
+      w->branch_pending = false;
+      w->call_pending = false;
+      return 1;
+    case 0x05:
+      /* Overflow. Trace was dropped, so the flow is lost until trace info. */
+      w->profile->overflows++;
+      reset_walker(w);
+      return 1;
+    case 0x07:
+    case 0x70:
+    case 0x80:
+      return 1;
+    case 0x06:
+      /* Exception. The address of the exception follows. */
+      if (len < 2) {
+        return 0;
+      }
+      n = (p[1] & 0x80) ? 3 : 2;
+      if (n > len) {
+        return 0;
+      }
+      if (w->branch_pending) {
+        /* An exception on the indirect branch target. */
+        w->branch_pending = false;
+      }
+      w->exception_pending = true;
+      return n;
+    case 0x0c:
+    case 0x0d:
+      /* Cycle count format 2 */
+      if (len < 2) {
+        return 0;
+      }
+      walk_cycle_count(w, w->cycle_threshold + (p[1] & 0xf));
+      return 2;
+    case 0x0e:
+    case 0x0f:
+      /* Cycle count format 1, unknown count for 0x0f. */
+      if (hdr == 0x0f) {
+        drop_cycle_samples(w);
+        return 1;
+      }
+      if (!(n = skip_leb(p + 1, len - 1, 3))) {
+        return 0;
+      }
+      walk_cycle_count(w, w->cycle_threshold + get_leb(p + 1, n));
+      return n + 1;
+    case 0x2d:
+    case 0x2e:
+    case 0x2f:
+      /* Commit and cancel format 1. */
+      if (!(n = skip_leb(p + 1, len - 1, 5))) {
+        return 0;
+      }
+      return n + 1;
+    case 0x81:
+      if (!(n = get_context_len(p + 1, len - 1))) {
+        return 0;
+      }
+      set_walker_context(w, p + 1, n);
+      return n + 1;
+    case 0x82:
+    case 0x85:
+      /* Address with context, IS0. */
+      n = hdr == 0x82 ? 4 : 8;
+      if (len < n + 1 || !(m = get_context_len(p + 1 + n, len - 1 - n))) {
+        return 0;
+      }
+      addr = get_long_addr(p + 1, (int)n);
+      if (n == 4) {
+        addr |= w->addr_regs[0] & ~0xffffffffUL;
+      }
+      set_walker_addr(w, addr);
+      set_walker_context(w, p + 1 + n, m);
+      return n + m + 1;
+    case 0x90:
+    case 0x91:
+    case 0x92:
+      set_walker_addr(w, w->addr_regs[hdr & 0x3]);
+      return 1;
+    case 0x95:
+      /* Short address, IS0: A[8:2] and optionally A[16:9]. */
+      if (len < 2) {
+        return 0;
+      }
+      if (p[1] & 0x80) {
+        if (len < 3) {
+          return 0;
+        }
+        addr = (w->addr_regs[0] & ~0x1ffffUL) |
+               ((unsigned long)(p[1] & 0x7f) << 2) |
+               ((unsigned long)p[2] << 9);
+        n = 3;
+      } else {
+        addr = (w->addr_regs[0] & ~0x1ffUL) |
+               ((unsigned long)(p[1] & 0x7f) << 2);
+        n = 2;
+      }
+      set_walker_addr(w, addr);
+      return n;
+    case 0x9a:
+      if (len < 5) {
+        return 0;
+      }
+      set_walker_addr(w, (w->addr_regs[0] & ~0xffffffffUL) |
+                             get_long_addr(p + 1, 4));
+      return 5;
+    case 0x9d:
+      if (len < 9) {
+        return 0;
+      }
+      set_walker_addr(w, get_long_addr(p + 1, 8));
+      return 9;
+  }
+
+  if (hdr >= 0x10 && hdr <= 0x1f) {
+    /* Cycle count format 3 */
+    walk_cycle_count(w, w->cycle_threshold + (hdr & 0x3));
+    return 1;
+  }
+  if ((hdr >= 0x30 && hdr <= 0x3f) || (hdr >= 0x71 && hdr <= 0x7f)) {
+    /* Mispredict, cancel formats 2 and 3, event. */
+    return 1;
+  }
+
+  /* Unsupported: A32/T32 addresses, data trace, Q. */
+  return 0;
+}
+
+static size_t find_async(const unsigned char *stream, size_t start,
+                         size_t end)
+{
+  size_t i;
+
+  for (i = start; i + ASYNC_LEN <= end; i++) {
+    if (stream[i + ASYNC_LEN - 1] == 0x80 && is_async(stream + i, end - i)) {
+      return i;
+    }
+  }
+
+  return end;
+}
+
+/* Record where the flow was when the annotations written up to pos of the
+ * stream came through the trace bus. */
+static void place_annotations(struct profile_walker *w, size_t pos)
+{
+  struct stm_annotations *annotations;
+  struct stm_annotation *entry;
+
+  annotations = &w->profile->annotations;
+  if (!annotations->placing) {
+    return;
+  }
+
+  while (annotations->next < annotations->count &&
+         annotations->entries[annotations->next].offset <= pos) {
+    entry = &annotations->entries[annotations->next++];
+    entry->pc = w->pc_valid ? w->pc : 0;
+    entry->node = w->node;
+    entry->placed = true;
+  }
+}
+
+static void walk_stream(struct profile_walker *w, const unsigned char *stream,
+                        size_t start, size_t end)
+{
+  size_t pos;
+  size_t n;
+
+  reset_walker(w);
+
+  pos = find_async(stream, start, end);
+  while (pos < end) {
+    place_annotations(w, pos);
+    n = walk_packet(w, stream + pos, end - pos);
+    if (n == 0) {
+      /* Lost sync. */
+      reset_walker(w);
+      pos = find_async(stream, pos + 1, end);
+      continue;
+    }
+    pos += n;
+  }
+  place_annotations(w, end);
+}
+
+static void init_walker(struct profile_walker *w, struct profile *profile,
+                        const struct map_info *map_info, int map_info_num)
+{
+  memset(w, 0, sizeof(*w));
+  w->map_info = map_info;
+  w->map_info_num = map_info_num;
+  w->profile = profile;
+  w->node = -1;
+  w->cycle_edge = -1;
+  /* The time is unknown until the first timestamp. */
+  w->muted = profile->window.on;
+}
+
+static void *profile_worker(void *arg)
+{
+  struct profile_job *job;
+  struct profile_walker walker;
+
+  job = (struct profile_job *)arg;
+
+  init_walker(&walker, &job->profile, job->map_info, job->map_info_num);
+  walk_stream(&walker, job->stream, job->start, job->end);
+
+  job->ret = 0;
+
+  return NULL;
+}
+
+/* Decode a single trace ID stream in chunks split at A-sync packets. Each
+ * chunk is decoded into its own profile in parallel and merged. */
+static int decode_profile_stream(struct profile *profile,
+                                 const unsigned char *stream, size_t len,
+                                 struct map_info *map_info, int map_info_num,
+                                 int jobs)
+{
+  struct profile_job job[PROFILE_JOBS_MAX];
+  struct profile_walker walker;
+  size_t chunk;
+  size_t pos;
+  int count;
+  int i;
+  int ret;
+
+  if (profile->stacks.nodes || profile->history.records ||
+      profile->annotations.placing) {
+    init_walker(&walker, profile, map_info, map_info_num);
+    walk_stream(&walker, stream, 0, len);
+    return 0;
+  }
+
+  chunk = len / (size_t)jobs;
+  if (chunk < PROFILE_CHUNK_MIN) {
+    chunk = PROFILE_CHUNK_MIN;
+  }
+
+  count = 0;
+  pos = 0;
+  while (pos < len && count < jobs) {
+    job[count].stream = stream;
+    job[count].start = pos;
+    job[count].end =
+        count == jobs - 1 ? len : find_async(stream, pos + chunk, len);
+    job[count].map_info = map_info;
+    job[count].map_info_num = map_info_num;
+    job[count].ret = -1;
+    pos = job[count].end;
+    count++;
+  }
+
+  ret = 0;
+  for (i = 0; i < count; i++) {
+    if (init_profile(&job[i].profile) < 0) {
+      count = i;
+      ret = -1;
+      goto exit;
+    }
+    job[i].profile.window = profile->window;
+    if (profile->cycles.blocks && init_profile_cycles(&job[i].profile) < 0) {
+      fini_profile(&job[i].profile);
+      count = i;
+      ret = -1;
+      goto exit;
+    }
+    if (pthread_create(&job[i].thread, NULL, profile_worker, &job[i]) != 0) {
+      fprintf(stderr, "pthread_create() failed\n");
+      fini_profile(&job[i].profile);
+      count = i;
+      ret = -1;
+      goto exit;
+    }
+  }
+
+exit:
+  for (i = 0; i < count; i++) {
+    pthread_join(job[i].thread, NULL);
+    if (job[i].ret < 0 ||
+        merge_profile_table(&profile->ranges, &job[i].profile.ranges) < 0 ||
+        merge_profile_table(&profile->branches, &job[i].profile.branches) <
+            0 ||
+        (profile->cycles.blocks &&
+         merge_profile_cycles(&profile->cycles, &job[i].profile.cycles) < 0)) {
+      ret = -1;
+    }
+    profile->overflows += job[i].profile.overflows;
+    fini_profile(&job[i].profile);
+  }
+
+  return ret;
+}
+
+/* Decode formatted trace into range and branch counts at runtime
+ * addresses. */
+int decode_profile(struct profile *profile, const void *buf, size_t size,
+                   const int *trace_ids, int trace_id_count,
+                   struct map_info *map_info, int map_info_num, int jobs)
+{
+  unsigned char *stream;
+  size_t len;
+  int ret;
+  int i;
+
+  if (jobs <= 0) {
+    jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs > PROFILE_JOBS_MAX) {
+    jobs = PROFILE_JOBS_MAX;
+  }
+  if (jobs <= 0) {
+    jobs = 1;
+  }
+
+  stream = malloc(size > 0 ? size : 1);
+  if (!stream) {
+    perror("malloc");
+    return -1;
+  }
+
+  ret = 0;
+  for (i = 0; i < trace_id_count; i++) {
+    len = extract_trace_stream(trace_ids[i], buf, size, stream);
+    profile->annotations.placing =
+        profile->annotations.entries &&
+        trace_ids[i] == profile->annotations.trace_id;
+    if (decode_profile_stream(profile, stream, len, map_info, map_info_num,
+                              jobs) < 0) {
+      fprintf(stderr, "Failed to decode profile of trace ID 0x%x\n",
+              trace_ids[i]);
+      ret = -1;
+    }
+  }
+
+  profile->annotations.placing = false;
+  free(stream);
+
+  return ret;
+}
+
+static bool is_in_map_info(const struct map_info *map_info,
+                           unsigned long addr)
+{
+  return map_info->start <= addr && addr < map_info->end;
+}
+
+static size_t count_profile_entries(const struct profile_table *table,
+                                    const struct map_info *map_info)
+{
+  size_t count;
+  size_t i;
+
+  count = 0;
+  for (i = 0; i < table->size; i++) {
+    if (table->entries[i].count > 0 &&
+        is_in_map_info(map_info, table->entries[i].from) &&
+        is_in_map_info(map_info, table->entries[i].to)) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+static void write_profile_table(FILE *fp, const struct profile_table *table,
+                                const struct map_info *map_info,
+                                unsigned long bias, const char *fmt)
+{
+  const struct profile_count *entry;
+  size_t i;
+
+  for (i = 0; i < table->size; i++) {
+    entry = &table->entries[i];
+    if (entry->count > 0 && is_in_map_info(map_info, entry->from) &&
+        is_in_map_info(map_info, entry->to)) {
+      fprintf(fp, fmt, entry->from - bias, entry->to - bias, entry->count);
+    }
+  }
+}
+
+static void write_addr_name(FILE *fp, const struct symbol_table *symbols,
+                            const struct map_info *map_info,
+                            int map_info_num, unsigned long addr,
+                            bool with_offset)
+{
+  const struct symbol *sym;
+  char name[PATH_MAX];
+  int i;
+
+  if ((sym = find_symbol(symbols, addr))) {
+    fputs(sym->name, fp);
+    if (with_offset && addr > sym->addr) {
+      fprintf(fp, "+0x%lx", addr - sym->addr);
+    }
+    return;
+  }
+
+  for (i = 0; i < map_info_num; i++) {
+    if (is_in_map_info(&map_info[i], addr)) {
+      strncpy(name, map_info[i].path, sizeof(name) - 1);
+      name[sizeof(name) - 1] = '\0';
+      fprintf(fp, "%s+0x%lx", basename(name),
+              addr - map_info[i].start + (unsigned long)map_info[i].offset);
+      return;
+    }
+  }
+
+  fprintf(fp, "0x%lx", addr);
+}
+
+/* Write the call stacks with their self weights, one per line from the root
+ * to the leaf. */
+static int export_folded_stacks(struct profile *profile,
+                                struct map_info *map_info, int map_info_num)
+{
+  const struct call_tree *tree;
+  struct symbol_table symbols;
+  long path[PROFILE_STACK_MAX + 1];
+  long node;
+  int depth;
+  size_t i;
+  FILE *fp;
+
+  tree = &profile->stacks;
+  if (load_symbol_table(&symbols, map_info, map_info_num) < 0) {
+    return -1;
+  }
+
+  fp = fopen(DEFAULT_FOLDED_NAME, "w");
+  if (!fp) {
+    perror("fopen");
+    free_symbol_table(&symbols);
+    return -1;
+  }
+
+  for (i = 0; i < tree->used; i++) {
+    if (tree->nodes[i].weight == 0) {
+      continue;
+    }
+    depth = 0;
+    for (node = (long)i; node >= 0 && depth <= PROFILE_STACK_MAX;
+         node = tree->nodes[node].parent) {
+      path[depth++] = node;
+    }
+    while (depth-- > 0) {
+      write_addr_name(fp, &symbols, map_info, map_info_num,
+                      tree->nodes[path[depth]].addr, false);
+      fputc(depth > 0 ? ';' : ' ', fp);
+    }
+    fprintf(fp, "%lu\n", tree->nodes[i].weight);
+  }
+
+  fclose(fp);
+  free_symbol_table(&symbols);
+
+  return 0;
+}
+
+static int compare_block_cycles(const void *a, const void *b)
+{
+  const struct block_cycles *x = *(const struct block_cycles *const *)a;
+  const struct block_cycles *y = *(const struct block_cycles *const *)b;
+
+  if (x->cycles != y->cycles) {
+    return x->cycles > y->cycles ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/* Write the blocks by their cycles, the most first, and the cycles of the
+ * edges leaving them. */
+static int export_block_cycles(struct profile *profile,
+                               struct map_info *map_info, int map_info_num)
+{
+  const struct cycle_profile *cycles;
+  const struct block_cycles **sorted;
+  const struct block_cycles *block;
+  struct symbol_table symbols;
+  size_t i;
+  int j;
+  FILE *fp;
+
+  cycles = &profile->cycles;
+  sorted = malloc((cycles->used > 0 ? cycles->used : 1) * sizeof(*sorted));
+  if (!sorted) {
+    perror("malloc");
+    return -1;
+  }
+  for (i = 0; i < cycles->used; i++) {
+    sorted[i] = &cycles->blocks[i];
+  }
+  qsort(sorted, cycles->used, sizeof(*sorted), compare_block_cycles);
+
+  if (load_symbol_table(&symbols, map_info, map_info_num) < 0) {
+    free(sorted);
+    return -1;
+  }
+
+  fp = fopen(DEFAULT_CYCLES_NAME, "w");
+  if (!fp) {
+    perror("fopen");
+    free_symbol_table(&symbols);
+    free(sorted);
+    return -1;
+  }
+
+  fprintf(fp, "# start-end count cycles mean histogram(0,1,2-3,...) "
+              "function\n");
+  for (i = 0; i < cycles->used; i++) {
+    block = sorted[i];
+    if (block->count == 0) {
+      continue;
+    }
+    fprintf(fp, "%lx-%lx %lu %lu %.1f ", block->start, block->end,
+            block->count, block->cycles,
+            (double)block->cycles / (double)block->count);
+    for (j = 0; j < CYCLE_HIST_BUCKETS; j++) {
+      fprintf(fp, j > 0 ? ",%lu" : "%lu", block->hist[j]);
+    }
+    fputc(' ', fp);
+    write_addr_name(fp, &symbols, map_info, map_info_num, block->start,
+                    false);
+    fputc('\n', fp);
+  }
+
+  fprintf(fp, "# from->to cycles\n");
+  for (i = 0; i < cycles->edges.size; i++) {
+    if (cycles->edges.entries[i].count > 0) {
+      fprintf(fp, "%lx->%lx %lu\n", cycles->edges.entries[i].from,
+              cycles->edges.entries[i].to, cycles->edges.entries[i].count);
+    }
+  }
+
+  fclose(fp);
+  free_symbol_table(&symbols);
+  free(sorted);
+
+  return 0;
+}
+
+/* Write the branch history, the oldest first. */
+int export_profile_history(struct profile *profile, const char *path,
+                           struct map_info *map_info, int map_info_num)
+{
+  const struct branch_history *history;
+  const struct branch_record *record;
+  struct symbol_table symbols;
+  size_t i;
+  FILE *fp;
+
+  history = &profile->history;
+  if (load_symbol_table(&symbols, map_info, map_info_num) < 0) {
+    return -1;
+  }
+
+  fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen");
+    free_symbol_table(&symbols);
+    return -1;
+  }
+
+  fprintf(fp, "# from->to\n");
+  for (i = 0; i < history->count; i++) {
+    record = &history->records[(history->head + i) % history->size];
+    fprintf(fp, "%lx->%lx ", record->from, record->to);
+    write_addr_name(fp, &symbols, map_info, map_info_num, record->from, true);
+    fputs(" -> ", fp);
+    write_addr_name(fp, &symbols, map_info, map_info_num, record->to, true);
+    fputc('\n', fp);
+  }
+
+  fclose(fp);
+  free_symbol_table(&symbols);
+
+  return 0;
+}
+
+/* Write the annotations in the order they were written, each with the call
+ * stack and the address the flow was at. */
+int export_profile_annotations(struct profile *profile, const char *path,
+                               struct map_info *map_info, int map_info_num)
+{
+  const struct call_tree *tree;
+  const struct stm_annotation *entry;
+  struct symbol_table symbols;
+  long path_nodes[PROFILE_STACK_MAX + 1];
+  long node;
+  int depth;
+  size_t i;
+  FILE *fp;
+
+  tree = &profile->stacks;
+  if (load_symbol_table(&symbols, map_info, map_info_num) < 0) {
+    return -1;
+  }
+
+  fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen");
+    free_symbol_table(&symbols);
+    return -1;
+  }
+
+  fprintf(fp, "# master:channel value stack;pc\n");
+  for (i = 0; i < profile->annotations.count; i++) {
+    entry = &profile->annotations.entries[i];
+    fprintf(fp, "%u:%u 0x%lx ", entry->master, entry->channel, entry->value);
+    if (!entry->placed || entry->pc == 0) {
+      fputs("?\n", fp);
+      continue;
+    }
+    depth = 0;
+    if (tree->nodes) {
+      for (node = entry->node; node >= 0 && depth <= PROFILE_STACK_MAX;
+           node = tree->nodes[node].parent) {
+        path_nodes[depth++] = node;
+      }
+    }
+    while (depth-- > 0) {
+      write_addr_name(fp, &symbols, map_info, map_info_num,
+                      tree->nodes[path_nodes[depth]].addr, false);
+      fputc(';', fp);
+    }
+    write_addr_name(fp, &symbols, map_info, map_info_num, entry->pc, true);
+    fputc('\n', fp);
+  }
+
+  fclose(fp);
+  free_symbol_table(&symbols);
+
+  return 0;
+}
+
+/* Count the overflow packets in the streams. Packets are only framed, so no
+ * image is needed. */
+unsigned long count_trace_overflows(const void *buf, size_t size,
+                                    const int *trace_ids, int trace_id_count)
+{
+  struct profile profile;
+  unsigned long overflows;
+
+  if (init_profile(&profile) < 0) {
+    return 0;
+  }
+  decode_profile(&profile, buf, size, trace_ids, trace_id_count, NULL, 0, 1);
+  overflows = profile.overflows;
+  fini_profile(&profile);
+
+  return overflows;
+}
+
+int init_context_scanner(struct context_scanner *scanner)
+{
+  memset(scanner, 0, sizeof(*scanner));
+
+  scanner->walker = malloc(sizeof(struct profile_walker));
+  if (!scanner->walker) {
+    perror("malloc");
+    return -1;
+  }
+  if (init_profile(&scanner->profile) < 0) {
+    free(scanner->walker);
+    scanner->walker = NULL;
+    return -1;
+  }
+  /* Without images, the walker only follows the packets. */
+  init_walker(scanner->walker, &scanner->profile, NULL, 0);
+  memset(scanner->sync, 0, ASYNC_LEN - 1);
+  scanner->sync[ASYNC_LEN - 1] = 0x80;
+
+  return 0;
+}
+
+void fini_context_scanner(struct context_scanner *scanner)
+{
+  if (!scanner->walker) {
+    return;
+  }
+
+  fini_profile(&scanner->profile);
+  free(scanner->walker);
+  scanner->walker = NULL;
+}
+
+void reset_context_scanner(struct context_scanner *scanner)
+{
+  reset_walker(scanner->walker);
+  scanner->walker->context_seen = false;
+  scanner->synced = false;
+  scanner->sync_len = 0;
+}
+
+/* Walk the stream and call emit with the offset and context ID of every
+ * packet which carries one. Returns the length walked. The rest is a packet
+ * cut off by the end of the chunk, to be walked again with the next one. */
+size_t scan_trace_contexts(struct context_scanner *scanner,
+                           const unsigned char *stream, size_t size,
+                           void (*emit)(void *, size_t, unsigned long),
+                           void *arg)
+{
+  struct profile_walker *w;
+  size_t pos;
+  size_t n;
+
+  w = scanner->walker;
+  pos = 0;
+  while (pos < size) {
+    if (!scanner->synced) {
+      n = find_async(stream, pos, size);
+      if (n == size) {
+        /* Keep what may be the start of an A-sync. */
+        if (size - pos >= ASYNC_LEN) {
+          pos = size - (ASYNC_LEN - 1);
+        }
+        break;
+      }
+      pos = n;
+      scanner->synced = true;
+    }
+
+    n = walk_packet(w, stream + pos, size - pos);
+    if (n == 0) {
+      if (size - pos < CONTEXT_PACKET_MAX) {
+        break;
+      }
+      /* Lost sync. */
+      reset_walker(w);
+      scanner->synced = false;
+      pos++;
+      continue;
+    }
+    if (stream[pos] == 0x01 && n <= CONTEXT_PACKET_MAX) {
+      memcpy(scanner->sync + ASYNC_LEN, stream + pos, n);
+      scanner->sync_len = ASYNC_LEN + n;
+    }
+    if (w->context_seen) {
+      w->context_seen = false;
+      emit(arg, pos, w->context_id);
+    }
+    pos += n;
+  }
+
+  return pos;
+}
+
+/* An address as its image and offset, which stay the same across loads. */
+static unsigned long normalize_addr(const struct map_info *map_info,
+                                    int map_info_num, unsigned long addr)
+{
+  int i;
+
+  for (i = 0; i < map_info_num; i++) {
+    if (is_in_map_info(&map_info[i], addr)) {
+      return ((unsigned long)(i + 1) << 48) ^
+             (addr - map_info[i].start + (unsigned long)map_info[i].offset);
+    }
+  }
+
+  return addr;
+}
+
+/* FNV-1a of the branch history, the oldest first. */
+unsigned long get_history_signature(const struct profile *profile,
+                                    const struct map_info *map_info,
+                                    int map_info_num)
+{
+  const struct branch_history *history;
+  const struct branch_record *record;
+  unsigned long addr[2];
+  unsigned long hash;
+  size_t i;
+  int j, k;
+
+  history = &profile->history;
+  hash = 0xcbf29ce484222325UL;
+  for (i = 0; i < history->count; i++) {
+    record = &history->records[(history->head + i) % history->size];
+    addr[0] = normalize_addr(map_info, map_info_num, record->from);
+    addr[1] = normalize_addr(map_info, map_info_num, record->to);
+    for (j = 0; j < 2; j++) {
+      for (k = 0; k < 8; k++) {
+        hash ^= (addr[j] >> (8 * k)) & 0xff;
+        hash *= 0x100000001b3UL;
+      }
+    }
+  }
+
+  return hash;
+}
+
+/* Write a profile for each traced image. Only the counts within the image
+ * are written, as both formats describe a single binary. */
+int export_profile(struct profile *profile, profile_format_t format,
+                   struct map_info *map_info, int map_info_num)
+{
+  char path[PATH_MAX];
+  char name[PATH_MAX];
+  size_t ranges, branches;
+  unsigned long bias;
+  FILE *fp;
+  int i;
+
+  if (format == folded_profile) {
+    return export_folded_stacks(profile, map_info, map_info_num);
+  }
+  if (format == cycles_profile) {
+    return export_block_cycles(profile, map_info, map_info_num);
+  }
+
+  for (i = 0; i < map_info_num; i++) {
+    ranges = count_profile_entries(&profile->ranges, &map_info[i]);
+    branches = count_profile_entries(&profile->branches, &map_info[i]);
+    if (ranges == 0 && branches == 0) {
+      continue;
+    }
+
+    strncpy(name, map_info[i].path, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    snprintf(path, sizeof(path),
+             format == bolt_profile ? BOLT_NAME_FMT : AUTOFDO_NAME_FMT,
+             basename(name));
+
+    fp = fopen(path, "w");
+    if (!fp) {
+      perror("fopen");
+      return -1;
+    }
+
+    bias = get_load_bias(&map_info[i]);
+    if (format == bolt_profile) {
+      write_profile_table(fp, &profile->ranges, &map_info[i], bias,
+                          "F %lx %lx %lu\n");
+      write_profile_table(fp, &profile->branches, &map_info[i], bias,
+                          "B %lx %lx %lu 0\n");
+    } else {
+      fprintf(fp, "%zu\n", ranges);
+      write_profile_table(fp, &profile->ranges, &map_info[i], bias,
+                          "%lx-%lx:%lu\n");
+      fprintf(fp, "%zu\n", branches);
+      write_profile_table(fp, &profile->branches, &map_info[i], bias,
+                          "%lx->%lx:%lu\n");
+    }
+
+    fclose(fp);
+  }
+
+  return 0;
+}
@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_RING_FLUSH_TRIAL 10000
+#define TRACE_RING_FLUSH_TRIAL_USLEEP 10
+
+static void get_trace_ring_name(int trace_id, char *name, size_t size)
+{
+  memset(name, 0, size);
+  snprintf(name, size, TRACE_RING_NAME_FMT, trace_id);
+}
+
+/* The ring is given to the leasing client, which need not be root. */
+struct trace_ring *create_trace_ring(int trace_id, size_t size, uid_t owner)
+{
+  char name[NAME_MAX];
+  struct trace_ring *ring;
+  size_t map_size;
+  int fd;
+
+  /* Offsets are masked by size - 1. */
+  if (size == 0 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "Trace ring size must be power of two: 0x%lx\n", size);
+    return NULL;
+  }
+
+  get_trace_ring_name(trace_id, name, sizeof(name));
+  map_size = sizeof(struct trace_ring) + size;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror("shm_open");
+    return NULL;
+  }
+  if (fchown(fd, owner, (gid_t)-1) < 0) {
+    perror("fchown");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  if (ftruncate(fd, map_size) < 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(name);
+    return NULL;
+  }
+
+  ring->trace_id = trace_id;
+  ring->size = size;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->lost, 0);
+  atomic_init(&ring->flush_req, 0);
+  atomic_init(&ring->flush_ack, 0);
+  /* Publish the ring after it is initialized. */
+  atomic_thread_fence(memory_order_release);
+  ring->magic = TRACE_RING_MAGIC;
+
+  return ring;
+}
+
+struct trace_ring *open_trace_ring(int trace_id)
+{
+  char name[NAME_MAX];
+  struct trace_ring *ring;
+  struct stat sb;
+  int fd;
+
+  get_trace_ring_name(trace_id, name, sizeof(name));
+
+  fd = shm_open(name, O_RDWR, 0600);
+  if (fd < 0) {
+    perror("shm_open");
+    return NULL;
+  }
+  if (fstat(fd, &sb) < 0) {
+    perror("fstat");
+    close(fd);
+    return NULL;
+  }
+  if ((size_t)sb.st_size < sizeof(struct trace_ring)) {
+    fprintf(stderr, "Trace ring '%s' is too small\n", name);
+    close(fd);
+    return NULL;
+  }
+
+  ring = mmap(NULL, (size_t)sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+              fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  if (ring->magic != TRACE_RING_MAGIC || ring->trace_id != trace_id ||
+      sizeof(struct trace_ring) + ring->size != (size_t)sb.st_size) {
+    fprintf(stderr, "Trace ring '%s' is corrupted\n", name);
+    munmap(ring, (size_t)sb.st_size);
+    return NULL;
+  }
+
+  return ring;
+}
+
+void close_trace_ring(struct trace_ring *ring)
+{
+  if (ring) {
+    munmap(ring, sizeof(struct trace_ring) + ring->size);
+  }
+}
+
+void unlink_trace_ring(int trace_id)
+{
+  char name[NAME_MAX];
+
+  get_trace_ring_name(trace_id, name, sizeof(name));
+  shm_unlink(name);
+}
+
+/* Count trace of the ring that was lost before it could be written. */
+void add_trace_ring_loss(struct trace_ring *ring, size_t size)
+{
+  atomic_fetch_add_explicit(&ring->lost, size, memory_order_relaxed);
+}
+
+/* Write all of buf or nothing, so that the reader never sees a partial
+ * formatter frame. */
+size_t write_trace_ring(struct trace_ring *ring, const void *buf, size_t size)
+{
+  uint64_t head, tail;
+  size_t offset, n;
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (size > ring->size - (size_t)(head - tail)) {
+    atomic_fetch_add_explicit(&ring->lost, size, memory_order_relaxed);
+    return 0;
+  }
+
+  offset = (size_t)(head & (ring->size - 1));
+  n = ring->size - offset < size ? ring->size - offset : size;
+  memcpy(&ring->data[offset], buf, n);
+  memcpy(&ring->data[0], (const unsigned char *)buf + n, size - n);
+
+  atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+  return size;
+}
+
+size_t read_trace_ring(struct trace_ring *ring, void *buf, size_t size)
+{
+  uint64_t head, tail;
+  size_t offset, n;
+
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (size > (size_t)(head - tail)) {
+    size = (size_t)(head - tail);
+  }
+
+  offset = (size_t)(tail & (ring->size - 1));
+  n = ring->size - offset < size ? ring->size - offset : size;
+  memcpy(buf, &ring->data[offset], n);
+  memcpy((unsigned char *)buf + n, &ring->data[0], size - n);
+
+  atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+
+  return size;
+}
+
+size_t get_trace_ring_unread(struct trace_ring *ring)
+{
+  return (size_t)(atomic_load_explicit(&ring->head, memory_order_acquire) -
+                  atomic_load_explicit(&ring->tail, memory_order_relaxed));
+}
+
+/* Ask the writer to push out everything captured so far and wait for it. */
+int flush_trace_ring(struct trace_ring *ring)
+{
+  unsigned int req;
+  int trial;
+
+  req = atomic_fetch_add_explicit(&ring->flush_req, 1, memory_order_acq_rel) +
+        1;
+
+  trial = 0;
+  while (atomic_load_explicit(&ring->flush_ack, memory_order_acquire) != req) {
+    if (trial++ > TRACE_RING_FLUSH_TRIAL) {
+      fprintf(stderr, "Trace ring flush timed out\n");
+      return -1;
+    }
+    usleep(TRACE_RING_FLUSH_TRIAL_USLEEP);
+  }
+
+  return 0;
+}
+
+/* Get the pending flush request, which the writer acknowledges once the
+ * trace captured before the request is written. */
+bool get_trace_ring_flush_req(struct trace_ring *ring, unsigned int *req)
+{
+  *req = atomic_load_explicit(&ring->flush_req, memory_order_acquire);
+
+  return *req != atomic_load_explicit(&ring->flush_ack, memory_order_relaxed);
+}
+
+void ack_trace_ring_flush(struct trace_ring *ring, unsigned int req)
+{
+  atomic_store_explicit(&ring->flush_ack, req, memory_order_release);
+}
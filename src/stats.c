@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "stats.h"
+
+static const char *trace_phase_names[trace_phase_count] = {
+    "enable", "disable", "flush", "drain",
+    "fetch",  "decode",  "relay", "exec",
+};
+
+static const char *trace_loss_names[trace_loss_count] = {
+    "lost_bytes",
+    "sink_wraps",
+    "etm_overflows",
+    "late_drains",
+};
+
+static struct trace_stats local_stats = {
+    .magic = TRACE_STATS_MAGIC,
+    .version = TRACE_STATS_VERSION,
+    .phase_count = trace_phase_count,
+    .loss_count = trace_loss_count,
+};
+
+struct trace_stats *trace_stats = &local_stats;
+
+/* Loss of the current execution. Only written by the process itself. */
+static atomic_uint_least64_t exec_loss[trace_loss_count];
+
+const char *get_trace_phase_name(trace_phase_t phase)
+{
+  return phase < trace_phase_count ? trace_phase_names[phase] : "unknown";
+}
+
+const char *get_trace_loss_name(trace_loss_t loss)
+{
+  return loss < trace_loss_count ? trace_loss_names[loss] : "unknown";
+}
+
+/* Move the counters into the shared memory object name. It stays after exit
+ * and is reset by the next process opening it. */
+int open_trace_stats(const char *name)
+{
+  struct trace_stats *stats;
+  int fd;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("shm_open");
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(struct trace_stats)) < 0) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+
+  stats = mmap(NULL, sizeof(struct trace_stats), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+  close(fd);
+  if (stats == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  memcpy(stats, trace_stats, sizeof(struct trace_stats));
+  stats->frequency = read_system_counter_frequency();
+  stats->pid = (int32_t)getpid();
+  /* Publish the page after it is initialized. */
+  atomic_thread_fence(memory_order_release);
+  trace_stats = stats;
+
+  return 0;
+}
+
+/* Map the counters of another process read-only. */
+const struct trace_stats *map_trace_stats(const char *name)
+{
+  const struct trace_stats *stats;
+  struct stat sb;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("shm_open");
+    return NULL;
+  }
+  if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct trace_stats)) {
+    fprintf(stderr, "Stats page '%s' is too small\n", name);
+    close(fd);
+    return NULL;
+  }
+
+  stats = mmap(NULL, sizeof(struct trace_stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (stats == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  if (stats->magic != TRACE_STATS_MAGIC ||
+      stats->version != TRACE_STATS_VERSION ||
+      stats->phase_count != trace_phase_count ||
+      stats->loss_count != trace_loss_count) {
+    fprintf(stderr, "Stats page '%s' is of another version\n", name);
+    munmap((void *)stats, sizeof(struct trace_stats));
+    return NULL;
+  }
+
+  return stats;
+}
+
+static int get_stats_bucket(unsigned long ticks)
+{
+  int bucket;
+
+  if (ticks == 0) {
+    return 0;
+  }
+
+  bucket = 64 - __builtin_clzl(ticks);
+  return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+/* Count the time since start, a read_system_counter() value. */
+void add_trace_stats(trace_phase_t phase, unsigned long start)
+{
+  struct phase_stats *stats;
+  unsigned long ticks;
+
+  ticks = read_system_counter() - start;
+  stats = &trace_stats->phases[phase];
+
+  atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->ticks, ticks, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->hist[get_stats_bucket(ticks)], 1,
+                            memory_order_relaxed);
+  /* A racing update may keep the smaller one. It is only a hint. */
+  if (ticks > atomic_load_explicit(&stats->max, memory_order_relaxed)) {
+    atomic_store_explicit(&stats->max, ticks, memory_order_relaxed);
+  }
+}
+
+void add_trace_loss(trace_loss_t loss, unsigned long count)
+{
+  if (count == 0) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(&exec_loss[loss], count, memory_order_relaxed);
+  atomic_fetch_add_explicit(&trace_stats->loss[loss], count,
+                            memory_order_relaxed);
+}
+
+/* End an execution. Its loss becomes the last one. Returns true if any of
+ * its trace was lost, which makes its coverage incomplete. */
+bool count_trace_exec(void)
+{
+  unsigned long count;
+  bool lossy;
+  int i;
+
+  lossy = false;
+  for (i = 0; i < trace_loss_count; i++) {
+    count = atomic_exchange_explicit(&exec_loss[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&trace_stats->last_loss[i], count,
+                          memory_order_relaxed);
+    if (count > 0) {
+      lossy = true;
+    }
+  }
+
+  atomic_fetch_add_explicit(&trace_stats->execs, 1, memory_order_relaxed);
+  if (lossy) {
+    atomic_fetch_add_explicit(&trace_stats->lossy_execs, 1,
+                              memory_order_relaxed);
+  }
+
+  return lossy;
+}
+
+/* Count an execution whose session was ended early as hung. */
+void count_trace_hang(void)
+{
+  atomic_fetch_add_explicit(&trace_stats->hung_execs, 1, memory_order_relaxed);
+}
@@ -0,0 +1,387 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include "stm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "demux.h"
+
+#define STM_ANNOTATIONS_INIT 0x100
+#define STP_ASYNC_NIBBLES 21 /* 0xf nibbles before the 0x0 ending an ASYNC */
+
+/* STPv2 is a stream of nibbles, the low nibble of each byte first. Payloads
+ * come the most significant nibble first. */
+typedef enum {
+  stp_unsynced, /* Waiting for an ASYNC */
+  stp_opcode,
+  stp_opcode_f,  /* After 0xf */
+  stp_opcode_f0, /* After 0xf0 */
+  stp_payload,
+  stp_ts_len,
+  stp_ts,
+  stp_async, /* Rest of an ASYNC after 0xff */
+} stp_state_t;
+
+typedef enum {
+  stp_ignored,
+  stp_master,
+  stp_channel,
+  stp_data,
+} stp_payload_t;
+
+struct stp_parser {
+  stp_state_t state;
+  stp_payload_t payload;
+  int nibbles;    /* Left in the payload or timestamp */
+  bool timestamp; /* The payload is followed by a timestamp */
+  unsigned long value;
+  unsigned int master;
+  unsigned int channel;
+  unsigned int f_run; /* 0xf nibbles in a row while unsynced */
+  int stm_trace_id;
+  int etm_trace_id;
+  size_t etm_offset;
+  struct stm_annotations *annotations; /* NULL to find markers */
+  unsigned int marker_channel;
+  unsigned long marker;
+  bool marker_found;
+  int ret;
+};
+
+static int add_stm_annotation(struct stp_parser *p)
+{
+  struct stm_annotations *annotations;
+  struct stm_annotation *entries;
+  size_t size;
+
+  annotations = p->annotations;
+  if (annotations->count == annotations->size) {
+    size = annotations->size ? annotations->size * 2 : STM_ANNOTATIONS_INIT;
+    entries =
+        realloc(annotations->entries, size * sizeof(struct stm_annotation));
+    if (!entries) {
+      perror("realloc");
+      return -1;
+    }
+    annotations->entries = entries;
+    annotations->size = size;
+  }
+
+  entries = &annotations->entries[annotations->count++];
+  memset(entries, 0, sizeof(*entries));
+  entries->offset = p->etm_offset;
+  entries->master = p->master;
+  entries->channel = p->channel;
+  entries->value = p->value;
+  entries->node = -1;
+
+  return 0;
+}
+
+static void begin_payload(struct stp_parser *p, stp_payload_t payload,
+                          int nibbles, bool timestamp)
+{
+  p->payload = payload;
+  p->nibbles = nibbles;
+  p->timestamp = timestamp;
+  p->value = 0;
+  p->state = nibbles > 0 ? stp_payload : timestamp ? stp_ts_len : stp_opcode;
+}
+
+static void end_payload(struct stp_parser *p)
+{
+  switch (p->payload) {
+    case stp_master:
+      p->master = (unsigned int)p->value;
+      p->channel = 0;
+      break;
+    case stp_channel:
+      p->channel = (unsigned int)p->value;
+      break;
+    case stp_data:
+      if (!p->annotations) {
+        p->marker_found |=
+            p->channel == p->marker_channel && p->value == p->marker;
+      } else if (add_stm_annotation(p) < 0) {
+        p->ret = -1;
+      }
+      break;
+    default:
+      break;
+  }
+
+  p->state = p->timestamp ? stp_ts_len : stp_opcode;
+}
+
+/* Data opcodes 0x4-0xd share the payload sizes of D8, D16, D32, D64 and D4. */
+static int get_data_nibbles(unsigned char op)
+{
+  static const int nibbles[] = {2, 4, 8, 16};
+
+  return op >= 0xc ? 1 : nibbles[op & 3];
+}
+
+static void walk_opcode(struct stp_parser *p, unsigned char op)
+{
+  switch (op) {
+    case 0x0: /* NULL */
+      break;
+    case 0x1: /* M8 */
+      begin_payload(p, stp_master, 2, false);
+      break;
+    case 0x2: /* MERR */
+      begin_payload(p, stp_ignored, 2, false);
+      break;
+    case 0x3: /* C8 */
+      begin_payload(p, stp_channel, 2, false);
+      break;
+    case 0x4: /* D8, D16, D32, D64 */
+    case 0x5:
+    case 0x6:
+    case 0x7:
+    case 0xc: /* D4 */
+      begin_payload(p, stp_data, get_data_nibbles(op), false);
+      break;
+    case 0x8: /* D8MTS, D16MTS, D32MTS, D64MTS */
+    case 0x9:
+    case 0xa:
+    case 0xb:
+    case 0xd: /* D4MTS */
+      begin_payload(p, stp_data, get_data_nibbles(op), true);
+      break;
+    case 0xe: /* FLAG_TS */
+      begin_payload(p, stp_ignored, 0, true);
+      break;
+    default:
+      p->state = stp_opcode_f;
+      break;
+  }
+}
+
+static void walk_opcode_f(struct stp_parser *p, unsigned char op)
+{
+  switch (op) {
+    case 0x0:
+      p->state = stp_opcode_f0;
+      break;
+    case 0x1: /* M16 */
+      begin_payload(p, stp_master, 4, false);
+      break;
+    case 0x2: /* GERR */
+      begin_payload(p, stp_ignored, 2, false);
+      break;
+    case 0x3: /* C16 */
+      begin_payload(p, stp_channel, 4, false);
+      break;
+    case 0x4: /* D8TS, D16TS, D32TS, D64TS */
+    case 0x5:
+    case 0x6:
+    case 0x7:
+    case 0xc: /* D4TS */
+      begin_payload(p, stp_data, get_data_nibbles(op), true);
+      break;
+    case 0x8: /* D8M, D16M, D32M, D64M */
+    case 0x9:
+    case 0xa:
+    case 0xb:
+    case 0xd: /* D4M */
+      begin_payload(p, stp_data, get_data_nibbles(op), false);
+      break;
+    case 0xe: /* FLAG */
+      p->state = stp_opcode;
+      break;
+    default: /* ASYNC */
+      p->state = stp_async;
+      break;
+  }
+}
+
+static void walk_opcode_f0(struct stp_parser *p, unsigned char op)
+{
+  switch (op) {
+    case 0x0: /* VERSION */
+      begin_payload(p, stp_ignored, 1, false);
+      break;
+    case 0x1: /* NULL_TS */
+      begin_payload(p, stp_ignored, 0, true);
+      break;
+    case 0x6: /* TRIG */
+      begin_payload(p, stp_ignored, 2, false);
+      break;
+    case 0x7: /* TRIG_TS */
+      begin_payload(p, stp_ignored, 2, true);
+      break;
+    case 0x8: /* FREQ */
+      begin_payload(p, stp_ignored, 8, false);
+      break;
+    case 0x9: /* FREQ_TS */
+      begin_payload(p, stp_ignored, 8, true);
+      break;
+    default:
+      /* Reserved. */
+      p->state = stp_unsynced;
+      p->f_run = 0;
+      break;
+  }
+}
+
+static void walk_nibble(struct stp_parser *p, unsigned char nibble)
+{
+  switch (p->state) {
+    case stp_unsynced:
+      if (nibble == 0xf) {
+        p->f_run++;
+      } else {
+        if (nibble == 0x0 && p->f_run >= STP_ASYNC_NIBBLES) {
+          p->state = stp_opcode;
+          p->master = 0;
+          p->channel = 0;
+        }
+        p->f_run = 0;
+      }
+      break;
+    case stp_opcode:
+      walk_opcode(p, nibble);
+      break;
+    case stp_opcode_f:
+      walk_opcode_f(p, nibble);
+      break;
+    case stp_opcode_f0:
+      walk_opcode_f0(p, nibble);
+      break;
+    case stp_payload:
+      p->value = (p->value << 4) | nibble;
+      if (--p->nibbles == 0) {
+        end_payload(p);
+      }
+      break;
+    case stp_ts_len:
+      /* Lengths above 12 nibbles are coded as 0xd for 14 and 0xe for 16. */
+      p->nibbles = nibble <= 0xc ? nibble : nibble == 0xd ? 14 : 16;
+      p->state = p->nibbles > 0 ? stp_ts : stp_opcode;
+      break;
+    case stp_ts:
+      if (--p->nibbles == 0) {
+        p->state = stp_opcode;
+      }
+      break;
+    case stp_async:
+      if (nibble == 0x0) {
+        p->state = stp_opcode;
+        p->master = 0;
+        p->channel = 0;
+      } else if (nibble != 0xf) {
+        p->state = stp_unsynced;
+        p->f_run = 0;
+      }
+      break;
+  }
+}
+
+static void emit_stp_byte(void *arg, int trace_id, unsigned char data)
+{
+  struct stp_parser *p;
+
+  p = (struct stp_parser *)arg;
+  if (trace_id == p->etm_trace_id) {
+    p->etm_offset++;
+  } else if (trace_id == p->stm_trace_id) {
+    walk_nibble(p, data & 0xf);
+    walk_nibble(p, data >> 4);
+  }
+}
+
+/* Decode the values written to the STM out of formatted trace. Each one is
+ * placed after the bytes of the ETM stream which came before it through the
+ * trace bus. */
+int decode_stm_annotations(struct stm_annotations *annotations,
+                           const void *buf, size_t size, int stm_trace_id,
+                           int etm_trace_id)
+{
+  struct stp_parser p;
+  int cur_id;
+
+  memset(annotations, 0, sizeof(*annotations));
+  annotations->trace_id = etm_trace_id;
+
+  memset(&p, 0, sizeof(p));
+  p.state = stp_unsynced;
+  p.stm_trace_id = stm_trace_id;
+  p.etm_trace_id = etm_trace_id;
+  p.annotations = annotations;
+  cur_id = 0;
+
+  deformat_trace(&cur_id, buf, size, emit_stp_byte, &p);
+  if (p.ret < 0) {
+    fini_stm_annotations(annotations);
+    return -1;
+  }
+
+  return 0;
+}
+
+void fini_stm_annotations(struct stm_annotations *annotations)
+{
+  free(annotations->entries);
+  memset(annotations, 0, sizeof(*annotations));
+}
+
+int init_stm_marker_finder(struct stm_marker_finder *finder, int stm_trace_id,
+                           unsigned int channel)
+{
+  struct stp_parser *p;
+
+  p = calloc(1, sizeof(*p));
+  if (!p) {
+    perror("calloc");
+    return -1;
+  }
+  p->stm_trace_id = stm_trace_id;
+  p->etm_trace_id = -1;
+  p->marker_channel = channel;
+
+  finder->parser = p;
+  reset_stm_marker_finder(finder);
+
+  return 0;
+}
+
+void fini_stm_marker_finder(struct stm_marker_finder *finder)
+{
+  free(finder->parser);
+  finder->parser = NULL;
+}
+
+/* Wait for the ASYNC of a new STM stream. */
+void reset_stm_marker_finder(struct stm_marker_finder *finder)
+{
+  finder->parser->state = stp_unsynced;
+  finder->parser->f_run = 0;
+  finder->cur_id = 0;
+}
+
+/* Walk the frames of buf until the data packet of the marker. Returns the end
+ * of the frame it completes in, where the next walk goes on, or 0 once all
+ * of buf is walked without it. */
+size_t find_stm_marker(struct stm_marker_finder *finder, unsigned long marker,
+                       const void *buf, size_t size)
+{
+  struct stp_parser *p;
+  size_t off;
+
+  p = finder->parser;
+  p->marker = marker;
+  for (off = 0; off + CS_FRAME_SIZE <= size; off += CS_FRAME_SIZE) {
+    p->marker_found = false;
+    deformat_trace(&finder->cur_id, (const unsigned char *)buf + off,
+                   CS_FRAME_SIZE, emit_stp_byte, p);
+    if (p->marker_found) {
+      return off + CS_FRAME_SIZE;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "symbol.h"
+#include "utils.h"
+
+/* Runtime addresses of a position independent image are shifted to its
+ * link-time addresses. Those of a fixed executable are the same. */
+unsigned long get_load_bias(const struct map_info *map_info)
+{
+  Elf64_Ehdr ehdr;
+  int fd;
+  ssize_t n;
+
+  fd = open(map_info->path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  n = read(fd, &ehdr, sizeof(ehdr));
+  close(fd);
+
+  if (n != sizeof(ehdr) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+      ehdr.e_type != ET_DYN) {
+    return 0;
+  }
+
+  return map_info->start - (unsigned long)map_info->offset;
+}
+
+static int compare_symbol(const void *a, const void *b)
+{
+  const struct symbol *x = (const struct symbol *)a;
+  const struct symbol *y = (const struct symbol *)b;
+
+  if (x->addr != y->addr) {
+    return x->addr < y->addr ? -1 : 1;
+  }
+
+  return 0;
+}
+
+static const Elf64_Shdr *find_symtab(const Elf64_Ehdr *ehdr, size_t size)
+{
+  const Elf64_Shdr *shdr;
+  const Elf64_Shdr *dynsym;
+  int i;
+
+  if (ehdr->e_shoff == 0 ||
+      ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+    return NULL;
+  }
+
+  shdr = (const Elf64_Shdr *)((const char *)ehdr + ehdr->e_shoff);
+  dynsym = NULL;
+  for (i = 0; i < ehdr->e_shnum; i++) {
+    if (shdr[i].sh_type == SHT_SYMTAB) {
+      return &shdr[i];
+    }
+    if (shdr[i].sh_type == SHT_DYNSYM) {
+      dynsym = &shdr[i];
+    }
+  }
+
+  /* Stripped images have only the exported functions. */
+  return dynsym;
+}
+
+/* Append the function symbols of a mapped ELF image. */
+static int add_image_symbols(struct symbol_table *table, const void *buf,
+                             size_t size, unsigned long bias)
+{
+  const Elf64_Ehdr *ehdr;
+  const Elf64_Shdr *symtab;
+  const Elf64_Shdr *strtab;
+  const Elf64_Sym *sym;
+  struct symbol *symbols;
+  size_t count;
+  size_t i;
+
+  ehdr = (const Elf64_Ehdr *)buf;
+  if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+    return 0;
+  }
+
+  symtab = find_symtab(ehdr, size);
+  if (!symtab || symtab->sh_link >= ehdr->e_shnum ||
+      symtab->sh_offset + symtab->sh_size > size) {
+    return 0;
+  }
+  strtab = (const Elf64_Shdr *)((const char *)buf + ehdr->e_shoff) +
+           symtab->sh_link;
+  if (strtab->sh_offset + strtab->sh_size > size) {
+    return 0;
+  }
+
+  sym = (const Elf64_Sym *)((const char *)buf + symtab->sh_offset);
+  count = symtab->sh_size / sizeof(Elf64_Sym);
+
+  symbols = realloc(table->symbols,
+                    (table->count + count) * sizeof(struct symbol));
+  if (!symbols) {
+    perror("realloc");
+    return -1;
+  }
+  table->symbols = symbols;
+
+  for (i = 0; i < count; i++) {
+    if (ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC || sym[i].st_value == 0 ||
+        sym[i].st_name >= strtab->sh_size) {
+      continue;
+    }
+    symbols[table->count].addr = sym[i].st_value + bias;
+    symbols[table->count].size = sym[i].st_size;
+    symbols[table->count].name =
+        (const char *)buf + strtab->sh_offset + sym[i].st_name;
+    table->count++;
+  }
+
+  return 0;
+}
+
+/* Load the function symbols of the traced images at their runtime
+ * addresses. The images stay mapped for the names. */
+int load_symbol_table(struct symbol_table *table, struct map_info *map_info,
+                      int map_info_num)
+{
+  struct stat st;
+  void *buf;
+  int fd;
+  int i, j;
+
+  memset(table, 0, sizeof(*table));
+
+  for (i = 0; i < map_info_num; i++) {
+    for (j = 0; j < i; j++) {
+      if (!strcmp(map_info[i].path, map_info[j].path)) {
+        break;
+      }
+    }
+    if (j < i || table->image_count >= SYMBOL_IMAGE_MAX) {
+      continue;
+    }
+
+    fd = open(map_info[i].path, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+      close(fd);
+      continue;
+    }
+    buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+      continue;
+    }
+    table->images[table->image_count].buf = buf;
+    table->images[table->image_count].size = (size_t)st.st_size;
+    table->image_count++;
+
+    if (add_image_symbols(table, buf, (size_t)st.st_size,
+                          get_load_bias(&map_info[i])) < 0) {
+      free_symbol_table(table);
+      return -1;
+    }
+  }
+
+  if (table->count > 0) {
+    qsort(table->symbols, table->count, sizeof(struct symbol),
+          compare_symbol);
+  }
+
+  return 0;
+}
+
+void free_symbol_table(struct symbol_table *table)
+{
+  int i;
+
+  for (i = 0; i < table->image_count; i++) {
+    munmap(table->images[i].buf, table->images[i].size);
+  }
+  free(table->symbols);
+  memset(table, 0, sizeof(*table));
+}
+
+/* Find the function containing addr. */
+const struct symbol *find_symbol(const struct symbol_table *table,
+                                 unsigned long addr)
+{
+  size_t lo, hi, mid;
+  const struct symbol *sym;
+
+  lo = 0;
+  hi = table->count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (table->symbols[mid].addr <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return NULL;
+  }
+
+  sym = &table->symbols[lo - 1];
+  if (sym->size > 0 && addr >= sym->addr + sym->size) {
+    return NULL;
+  }
+
+  return sym;
+}
@@ -0,0 +1,966 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <elf.h>
+
+#include <sys/stat.h>
+
+#include "common.h"
+#include "demux.h"
+#include "profile.h"
+#include "symbol.h"
+#include "utils.h"
+
+#define DEFAULT_SYNTH_SIZE 0x100000
+#define DEFAULT_SYNTH_TRACE_ID 0x10
+#define DEFAULT_SYNTH_TAKEN 50          /* Percent of conditional branches */
+#define DEFAULT_SYNTH_EXCEPTIONS 1      /* Per mille of branches */
+#define DEFAULT_SYNTH_OVERFLOWS 0       /* Per mille of branches */
+#define DEFAULT_PIE_BASE 0xaaaaaaaa0000UL /* Where Linux loads arm64 PIEs */
+#define SYNTH_SYNC_PERIOD 12            /* A-sync every 2^12 bytes */
+#define SYNTH_MAP_MAX 16
+#define SYNTH_STACK_MAX 256
+#define SYNTH_OVERFLOW_LOST 64          /* Branches dropped by an overflow */
+#define SYNTH_BUF_INIT 0x10000
+#define SYNTH_TRACE_NAME "cstrace.bin"
+
+#define ETM_EXCEPTION_IRQ 0x0e
+#define ETM_CONTEXT_EL0_AARCH64 0x30 /* NS, SF, EL0 */
+
+/* ETMv4 packet stream of a walk with the counts the profile walker should
+ * decode from it. */
+struct synth_state {
+  unsigned char *buf;
+  size_t len;
+  size_t size;
+  size_t sync_len; /* Length at the last A-sync */
+  unsigned long addr_regs[3];
+  unsigned int atoms;
+  int atom_count;
+
+  struct map_info *map_info;
+  int map_info_num;
+  unsigned long *funcs; /* Targets of indirect branches */
+  size_t func_count;
+  unsigned long stack[SYNTH_STACK_MAX];
+  int depth;
+
+  unsigned long pc;
+  unsigned long range_start;
+  struct profile expected;
+  struct profile edges; /* Branches of every decision, taken or not */
+  unsigned long branches;
+  unsigned long exceptions;
+  unsigned long overflows;
+  unsigned long restarts;
+};
+
+static uint64_t rng_state = 1;
+
+static char *script = NULL; /* E and N of conditional branches in turn */
+static size_t script_len = 0;
+static size_t script_pos = 0;
+static unsigned int taken_percent = DEFAULT_SYNTH_TAKEN;
+
+static uint64_t next_random(void)
+{
+  /* xorshift64* */
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dUL;
+}
+
+static bool roll(unsigned int per, unsigned int base)
+{
+  return per > 0 && next_random() % base < per;
+}
+
+static bool decide_branch(void)
+{
+  if (script_len > 0) {
+    return script[script_pos++ % script_len] == 'E';
+  }
+
+  return roll(taken_percent, 100);
+}
+
+static int load_script(const char *path)
+{
+  FILE *fp;
+  int c;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  while ((c = fgetc(fp)) != EOF) {
+    if (c != 'E' && c != 'N' && c != 'e' && c != 'n') {
+      continue;
+    }
+    if ((script_len & (script_len - 1)) == 0) {
+      script = realloc(script, script_len ? script_len * 2 : 64);
+      if (!script) {
+        perror("realloc");
+        fclose(fp);
+        return -1;
+      }
+    }
+    script[script_len++] = (c == 'E' || c == 'e') ? 'E' : 'N';
+  }
+  fclose(fp);
+
+  if (script_len == 0) {
+    fprintf(stderr, "No E or N in %s\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int emit(struct synth_state *s, const unsigned char *data, size_t n)
+{
+  unsigned char *buf;
+  size_t size;
+
+  if (s->len + n > s->size) {
+    size = s->size ? s->size * 2 : SYNTH_BUF_INIT;
+    while (s->len + n > size) {
+      size *= 2;
+    }
+    buf = realloc(s->buf, size);
+    if (!buf) {
+      perror("realloc");
+      return -1;
+    }
+    s->buf = buf;
+    s->size = size;
+  }
+
+  memcpy(s->buf + s->len, data, n);
+  s->len += n;
+
+  return 0;
+}
+
+static int emit_byte(struct synth_state *s, unsigned char data)
+{
+  return emit(s, &data, 1);
+}
+
+/* Pack the pending atoms, the oldest in bit 0, into format 3, 2 or 1. */
+static int flush_atoms(struct synth_state *s)
+{
+  unsigned char hdr;
+  int n;
+
+  while (s->atom_count > 0) {
+    n = s->atom_count >= 3 ? 3 : s->atom_count;
+    switch (n) {
+      case 3:
+        hdr = 0xf8 | (s->atoms & 0x7);
+        break;
+      case 2:
+        hdr = 0xd8 | (s->atoms & 0x3);
+        break;
+      default:
+        hdr = 0xf6 | (s->atoms & 0x1);
+        break;
+    }
+    if (emit_byte(s, hdr) < 0) {
+      return -1;
+    }
+    s->atoms >>= n;
+    s->atom_count -= n;
+  }
+
+  return 0;
+}
+
+static int push_atom(struct synth_state *s, bool taken)
+{
+  s->atoms |= (unsigned int)taken << s->atom_count;
+  if (++s->atom_count == 3) {
+    return flush_atoms(s);
+  }
+
+  return 0;
+}
+
+static void set_long_addr(unsigned char *p, unsigned long addr, int bytes)
+{
+  int i;
+
+  p[0] = (addr >> 2) & 0x7f;
+  p[1] = (addr >> 9) & 0x7f;
+  for (i = 2; i < bytes; i++) {
+    p[i] = (addr >> (8 * i)) & 0xff;
+  }
+}
+
+static void push_addr_reg(struct synth_state *s, unsigned long addr)
+{
+  s->addr_regs[2] = s->addr_regs[1];
+  s->addr_regs[1] = s->addr_regs[0];
+  s->addr_regs[0] = addr;
+}
+
+/* Emit the shortest IS0 address packet against the address history. */
+static int emit_addr(struct synth_state *s, unsigned long addr)
+{
+  unsigned char p[10];
+  size_t n;
+  int i;
+
+  if (flush_atoms(s) < 0) {
+    return -1;
+  }
+
+  n = 0;
+  for (i = 0; i < 3; i++) {
+    if (s->addr_regs[i] == addr && addr != 0) {
+      p[0] = 0x90 | i;
+      n = 1;
+      break;
+    }
+  }
+  if (n > 0) {
+    /* Exact match, nothing more to encode. */
+  } else if ((addr & ~0x1ffUL) == (s->addr_regs[0] & ~0x1ffUL)) {
+    p[0] = 0x95;
+    p[1] = (addr >> 2) & 0x7f;
+    n = 2;
+  } else if ((addr & ~0x1ffffUL) == (s->addr_regs[0] & ~0x1ffffUL)) {
+    p[0] = 0x95;
+    p[1] = ((addr >> 2) & 0x7f) | 0x80;
+    p[2] = (addr >> 9) & 0xff;
+    n = 3;
+  } else if ((addr & ~0xffffffffUL) == (s->addr_regs[0] & ~0xffffffffUL)) {
+    p[0] = 0x9a;
+    set_long_addr(p + 1, addr, 4);
+    n = 5;
+  } else {
+    p[0] = 0x9d;
+    set_long_addr(p + 1, addr, 8);
+    n = 9;
+  }
+  push_addr_reg(s, addr);
+
+  return emit(s, p, n);
+}
+
+/* A-sync, trace info and an address with context, after which the flow can
+ * be decoded on its own. Trace on comes before the address when tracing
+ * starts. */
+static int emit_sync(struct synth_state *s, bool trace_on)
+{
+  static const unsigned char async[] = {0, 0, 0, 0, 0, 0,
+                                        0, 0, 0, 0, 0, 0x80};
+  static const unsigned char info[] = {0x01, 0x00};
+  unsigned char p[10];
+
+  if (flush_atoms(s) < 0) {
+    return -1;
+  }
+
+  s->sync_len = s->len;
+  memset(s->addr_regs, 0, sizeof(s->addr_regs));
+  if (emit(s, async, sizeof(async)) < 0 || emit(s, info, sizeof(info)) < 0 ||
+      (trace_on && emit_byte(s, 0x04) < 0)) {
+    return -1;
+  }
+
+  p[0] = 0x85;
+  set_long_addr(p + 1, s->pc, 8);
+  p[9] = ETM_CONTEXT_EL0_AARCH64;
+  push_addr_reg(s, s->pc);
+  s->range_start = s->pc;
+
+  return emit(s, p, sizeof(p));
+}
+
+static const struct map_info *find_synth_map(const struct synth_state *s,
+                                             unsigned long addr)
+{
+  int i;
+
+  for (i = 0; i < s->map_info_num; i++) {
+    if (s->map_info[i].start <= addr && addr + 4 <= s->map_info[i].end) {
+      return &s->map_info[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Find the next P0 instruction from pc as the walker does. */
+static bool find_branch(const struct synth_state *s, unsigned long *pc,
+                        uint32_t *insn, branch_type_t *type,
+                        unsigned long *target)
+{
+  const struct map_info *map;
+  int n;
+
+  for (n = 0; n < PROFILE_SCAN_MAX; n++) {
+    if (!(map = find_synth_map(s, *pc))) {
+      return false;
+    }
+    memcpy(insn, (const char *)map->buf + (*pc - map->start), sizeof(*insn));
+    if ((*type = get_branch_type(*insn, *pc, target)) != not_branch) {
+      return true;
+    }
+    *pc += 4;
+  }
+
+  return false;
+}
+
+static unsigned long pick_function(const struct synth_state *s)
+{
+  return s->funcs[next_random() % s->func_count];
+}
+
+/* The flow ran out of the images. Start again at a function, as if the
+ * trace was filtered in between. */
+static int restart_walk(struct synth_state *s)
+{
+  s->pc = pick_function(s);
+  s->range_start = s->pc;
+  s->depth = 0;
+  s->restarts++;
+
+  if (flush_atoms(s) < 0 || emit_byte(s, 0x04) < 0) {
+    return -1;
+  }
+
+  return emit_addr(s, s->pc);
+}
+
+static int count_expected(struct synth_state *s, bool branch,
+                          unsigned long from, unsigned long to)
+{
+  return add_profile_count(branch ? &s->expected.branches
+                                  : &s->expected.ranges,
+                           from, to, 1);
+}
+
+/* An IRQ taken at an instruction of the block, returning to it. */
+static int take_exception(struct synth_state *s, unsigned long end)
+{
+  unsigned long addr;
+  unsigned char p[2];
+
+  addr = s->pc + 4 * (next_random() % ((end - s->pc) / 4 + 1));
+  p[0] = 0x06;
+  p[1] = (ETM_EXCEPTION_IRQ << 1) | 1;
+  if (flush_atoms(s) < 0 || emit(s, p, sizeof(p)) < 0 ||
+      emit_addr(s, addr) < 0) {
+    return -1;
+  }
+  if (s->range_start < addr &&
+      count_expected(s, false, s->range_start, addr - 4) < 0) {
+    return -1;
+  }
+  s->exceptions++;
+
+  /* The return resumes the flow with the same address. */
+  s->pc = addr;
+  s->range_start = addr;
+
+  return emit_addr(s, addr);
+}
+
+/* Take a branch decision without tracing it, for the flow lost to an
+ * overflow. */
+static void skip_branch(struct synth_state *s)
+{
+  unsigned long target;
+  branch_type_t type;
+  uint32_t insn;
+
+  if (!find_branch(s, &s->pc, &insn, &type, &target)) {
+    s->pc = pick_function(s);
+    return;
+  }
+
+  if (type == indirect_branch) {
+    s->pc = pick_function(s);
+  } else if ((insn & 0x7c000000) == 0x14000000 || decide_branch()) {
+    s->pc = target;
+  } else {
+    s->pc += 4;
+  }
+}
+
+/* The trace unit dropped trace, then syncs again. */
+static int overflow_walk(struct synth_state *s)
+{
+  int i;
+
+  if (flush_atoms(s) < 0 || emit_byte(s, 0x05) < 0) {
+    return -1;
+  }
+  for (i = 0; i < SYNTH_OVERFLOW_LOST; i++) {
+    skip_branch(s);
+  }
+  s->depth = 0;
+  s->overflows++;
+  if (!find_synth_map(s, s->pc)) {
+    s->pc = pick_function(s);
+  }
+
+  return emit_sync(s, false);
+}
+
+/* Walk one block to its P0 instruction and trace the decision. */
+static int step_walk(struct synth_state *s, unsigned int exception_rate,
+                     unsigned int overflow_rate)
+{
+  unsigned long branch_pc;
+  unsigned long target;
+  branch_type_t type;
+  uint32_t insn;
+  bool taken;
+
+  if (s->len - s->sync_len >= (1UL << SYNTH_SYNC_PERIOD) &&
+      emit_sync(s, false) < 0) {
+    return -1;
+  }
+  if (roll(overflow_rate, 1000)) {
+    return overflow_walk(s);
+  }
+
+  branch_pc = s->pc;
+  if (!find_branch(s, &branch_pc, &insn, &type, &target)) {
+    return restart_walk(s);
+  }
+  if (roll(exception_rate, 1000)) {
+    return take_exception(s, branch_pc);
+  }
+  s->branches++;
+
+  if (type == direct_branch) {
+    /* B and BL are always taken. */
+    taken = (insn & 0x7c000000) == 0x14000000 || decide_branch();
+    if (push_atom(s, taken) < 0) {
+      return -1;
+    }
+    if (!taken) {
+      s->pc = branch_pc + 4;
+      return add_profile_count(&s->edges.branches, branch_pc, s->pc, 1);
+    }
+  } else {
+    if (get_call_type(insn) == return_insn && s->depth > 0) {
+      target = s->stack[--s->depth];
+    } else {
+      target = pick_function(s);
+    }
+    if (push_atom(s, true) < 0 || emit_addr(s, target) < 0) {
+      return -1;
+    }
+  }
+
+  if (get_call_type(insn) == call_insn && s->depth < SYNTH_STACK_MAX) {
+    s->stack[s->depth++] = branch_pc + 4;
+  }
+  if (count_expected(s, false, s->range_start, branch_pc) < 0 ||
+      count_expected(s, true, branch_pc, target) < 0 ||
+      add_profile_count(&s->edges.branches, branch_pc, target, 1) < 0) {
+    return -1;
+  }
+  s->pc = target;
+  s->range_start = target;
+
+  if (!find_synth_map(s, target)) {
+    return restart_walk(s);
+  }
+
+  return 0;
+}
+
+/* Map the executable segments of the ELF as /proc/PID/maps would show them
+ * at base. */
+static int load_synth_image(const char *path, unsigned long base,
+                            struct map_info *map_info, unsigned long *entry)
+{
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr;
+  char real_path[PATH_MAX];
+  unsigned long bias;
+  int count;
+  int fd;
+  int i;
+
+  if (!realpath(path, real_path)) {
+    perror("realpath");
+    return -1;
+  }
+  if ((fd = open(real_path, O_RDONLY)) < 0) {
+    perror("open");
+    return -1;
+  }
+
+  count = -1;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+      ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_machine != EM_AARCH64) {
+    fprintf(stderr, "%s is not an ARM64 ELF\n", path);
+    goto exit;
+  }
+
+  bias = ehdr.e_type == ET_DYN ? base : 0;
+  *entry = ehdr.e_entry + bias;
+
+  count = 0;
+  for (i = 0; i < ehdr.e_phnum && count < SYNTH_MAP_MAX; i++) {
+    if (pread(fd, &phdr, sizeof(phdr),
+              (off_t)(ehdr.e_phoff + (size_t)i * ehdr.e_phentsize)) !=
+        sizeof(phdr)) {
+      fprintf(stderr, "Invalid program header in %s\n", path);
+      count = -1;
+      goto exit;
+    }
+    if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) {
+      continue;
+    }
+    map_info[count].start = (phdr.p_vaddr & ~(PAGE_SIZE - 1)) + bias;
+    map_info[count].end =
+        ALIGN_UP(phdr.p_vaddr + phdr.p_filesz, PAGE_SIZE) + bias;
+    map_info[count].offset = (off_t)(phdr.p_offset & ~(PAGE_SIZE - 1));
+    map_info[count].buf = NULL;
+    snprintf(map_info[count].path, sizeof(map_info[count].path), "%s",
+             real_path);
+    count++;
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "No executable segment in %s\n", path);
+    count = -1;
+  }
+
+exit:
+  close(fd);
+
+  return count;
+}
+
+/* Functions in the images are the targets of indirect branches. Without
+ * symbols, the entry point is the only one. */
+static int load_synth_functions(struct synth_state *s,
+                                const struct symbol_table *symbols,
+                                unsigned long entry)
+{
+  size_t i;
+
+  s->funcs = malloc((symbols->count + 1) * sizeof(unsigned long));
+  if (!s->funcs) {
+    perror("malloc");
+    return -1;
+  }
+
+  s->func_count = 0;
+  for (i = 0; i < symbols->count; i++) {
+    if (find_synth_map(s, symbols->symbols[i].addr)) {
+      s->funcs[s->func_count++] = symbols->symbols[i].addr;
+    }
+  }
+  if (s->func_count == 0) {
+    s->funcs[s->func_count++] = entry;
+  }
+
+  return 0;
+}
+
+static int find_synth_start(const struct symbol_table *symbols,
+                            const char *name, unsigned long *start)
+{
+  char *end;
+  size_t i;
+
+  for (i = 0; i < symbols->count; i++) {
+    if (!strcmp(symbols->symbols[i].name, name)) {
+      *start = symbols->symbols[i].addr;
+      return 0;
+    }
+  }
+
+  *start = strtoul(name, &end, 0);
+  if (*end == '\0' && end != name) {
+    return 0;
+  }
+
+  fprintf(stderr, "Symbol %s is not found\n", name);
+  return -1;
+}
+
+/* Decode the trace back with the profile walker and compare its counts. The
+ * walker classifies branches as the generator does, so this does not catch
+ * their shared mistakes; bench-decode --check compares with libcsdec. */
+static int verify_synth_trace(struct synth_state *s, const void *buf,
+                              size_t size, int trace_id)
+{
+  const struct profile_table *tables[2][2];
+  const struct profile_count *entry;
+  const struct profile_count *found;
+  struct profile actual;
+  unsigned long mismatches;
+  size_t i;
+  int t, d;
+
+  if (init_profile(&actual) < 0) {
+    return -1;
+  }
+  if (decode_profile(&actual, buf, size, &trace_id, 1, s->map_info,
+                     s->map_info_num, 0) < 0) {
+    fini_profile(&actual);
+    return -1;
+  }
+
+  tables[0][0] = &s->expected.ranges;
+  tables[0][1] = &actual.ranges;
+  tables[1][0] = &s->expected.branches;
+  tables[1][1] = &actual.branches;
+
+  /* Every entry of each side must be on the other side with its count. */
+  mismatches = 0;
+  for (t = 0; t < 2; t++) {
+    for (d = 0; d < 2; d++) {
+      for (i = 0; i < tables[t][d]->size; i++) {
+        entry = &tables[t][d]->entries[i];
+        if (entry->count == 0) {
+          continue;
+        }
+        found = find_profile_count(tables[t][!d], entry->from, entry->to);
+        if (!found || found->count != entry->count) {
+          mismatches++;
+        }
+      }
+    }
+  }
+
+  printf("verify: %zu ranges %zu branches decoded, %lu mismatches\n",
+         actual.ranges.used, actual.branches.used, mismatches);
+  fini_profile(&actual);
+
+  return mismatches > 0 ? -1 : 0;
+}
+
+static int write_synth_file(const char *path, const void *buf, size_t size)
+{
+  FILE *fp;
+
+  fp = fopen(path, "wb");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+  if (fwrite(buf, 1, size, fp) != size) {
+    fprintf(stderr, "Failed to write %s\n", path);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  return 0;
+}
+
+/* Every decision of the walk as an edge between the branch and the next
+ * instruction, one "FROM TO COUNT" line each, for bench-decode --check. */
+static int export_synth_edges(struct synth_state *s)
+{
+  const struct profile_count *entry;
+  FILE *fp;
+  size_t i;
+
+  fp = fopen(DEFAULT_TRACE_EDGES_NAME, "w");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+  for (i = 0; i < s->edges.branches.size; i++) {
+    entry = &s->edges.branches.entries[i];
+    if (entry->count > 0) {
+      fprintf(fp, "0x%lx 0x%lx %lu\n", entry->from, entry->to, entry->count);
+    }
+  }
+  fclose(fp);
+
+  return 0;
+}
+
+/* Write a trace directory as cs-trace --export does, with the expected
+ * profile in the format of cs-trace --profile and the expected edges. */
+static int export_synth_trace(struct synth_state *s, const void *buf,
+                              size_t size, int trace_id)
+{
+  char *cwd;
+  char trace_path[PATH_MAX];
+  char args_path[PATH_MAX];
+  FILE *fp;
+  int ret;
+
+  ret = -1;
+
+  cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    perror("getcwd");
+    return -1;
+  }
+  snprintf(trace_path, sizeof(trace_path), "%s/%s", cwd, SYNTH_TRACE_NAME);
+  snprintf(args_path, sizeof(args_path), "%s/%s", cwd,
+           DEFAULT_TRACE_ARGS_NAME);
+
+  if (write_synth_file(trace_path, buf, size) < 0 ||
+      export_decoder_args(trace_id, trace_path, args_path, s->map_info,
+                          s->map_info_num) < 0) {
+    goto exit;
+  }
+
+  fp = fopen(DEFAULT_TRACE_MAPS_NAME, "w");
+  if (!fp) {
+    perror("fopen");
+    goto exit;
+  }
+  dump_map_info(fp, s->map_info, s->map_info_num);
+  fclose(fp);
+
+  if (export_synth_edges(s) < 0) {
+    goto exit;
+  }
+  ret = export_profile(&s->expected, autofdo_profile, s->map_info,
+                       s->map_info_num);
+
+exit:
+  free(cwd);
+
+  return ret;
+}
+
+static void usage(char *argv0)
+{
+  fprintf(stderr, "Usage: %s [OPTIONS] ELF\n", argv0);
+  fprintf(stderr,
+          "Write a formatted ETMv4 trace of a simulated walk over the CFG of "
+          "ELF\n");
+  fprintf(stderr, "[OPTIONS]\n");
+  fprintf(stderr,
+          "  -o, --output=DIR\t\ttrace directory to write (default: .)\n");
+  fprintf(stderr,
+          "  -s, --size=SIZE\t\tformatted trace size (default: %#x)\n",
+          DEFAULT_SYNTH_SIZE);
+  fprintf(stderr, "  -S, --start=SYMBOL\t\tfunction or address to start at "
+                  "(default: entry point)\n");
+  fprintf(stderr, "  -r, --seed=INT\t\trandom seed (default: 1)\n");
+  fprintf(stderr,
+          "  -t, --taken=PERCENT\t\ttaken conditional branches (default: "
+          "%d)\n",
+          DEFAULT_SYNTH_TAKEN);
+  fprintf(stderr, "  -f, --script=FILE\t\tE and N of conditional branches "
+                  "in turn, repeated\n");
+  fprintf(stderr,
+          "  -e, --exceptions=PERMILLE\texceptions per 1000 branches "
+          "(default: %d)\n",
+          DEFAULT_SYNTH_EXCEPTIONS);
+  fprintf(stderr,
+          "  -O, --overflows=PERMILLE\toverflows per 1000 branches "
+          "(default: %d)\n",
+          DEFAULT_SYNTH_OVERFLOWS);
+  fprintf(stderr,
+          "  -i, --trace-id=ID\t\ttrace ID of the stream (default: %#x)\n",
+          DEFAULT_SYNTH_TRACE_ID);
+  fprintf(stderr,
+          "  -b, --base=ADDR\t\tload address of a PIE (default: %#lx)\n",
+          DEFAULT_PIE_BASE);
+  fprintf(stderr, "  -V, --verify\t\t\tdecode the trace back and compare\n");
+  fprintf(stderr, "  -h, --help\t\t\tshow this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const struct option long_options[] = {
+      {"output", required_argument, NULL, 'o'},
+      {"size", required_argument, NULL, 's'},
+      {"start", required_argument, NULL, 'S'},
+      {"seed", required_argument, NULL, 'r'},
+      {"taken", required_argument, NULL, 't'},
+      {"script", required_argument, NULL, 'f'},
+      {"exceptions", required_argument, NULL, 'e'},
+      {"overflows", required_argument, NULL, 'O'},
+      {"trace-id", required_argument, NULL, 'i'},
+      {"base", required_argument, NULL, 'b'},
+      {"verify", no_argument, NULL, 'V'},
+      {"help", no_argument, NULL, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  struct synth_state state;
+  struct symbol_table symbols;
+  struct map_info map_info[SYNTH_MAP_MAX];
+  unsigned char *trace;
+  size_t trace_size;
+  size_t size;
+  unsigned long entry;
+  unsigned long base;
+  unsigned int exception_rate;
+  unsigned int overflow_rate;
+  char *output;
+  char *start;
+  bool verify;
+  int trace_id;
+  int ret;
+  int opt;
+  int option_index;
+
+  output = NULL;
+  start = NULL;
+  size = DEFAULT_SYNTH_SIZE;
+  exception_rate = DEFAULT_SYNTH_EXCEPTIONS;
+  overflow_rate = DEFAULT_SYNTH_OVERFLOWS;
+  trace_id = DEFAULT_SYNTH_TRACE_ID;
+  base = DEFAULT_PIE_BASE;
+  verify = false;
+
+  while ((opt = getopt_long(argc, argv, "o:s:S:r:t:f:e:O:i:b:Vh",
+                            long_options, &option_index)) != -1) {
+    switch (opt) {
+      case 'o':
+        output = optarg;
+        break;
+      case 's':
+        size = (size_t)strtoul(optarg, NULL, 0);
+        break;
+      case 'S':
+        start = optarg;
+        break;
+      case 'r':
+        rng_state = strtoull(optarg, NULL, 0);
+        break;
+      case 't':
+        taken_percent = (unsigned int)atoi(optarg);
+        break;
+      case 'f':
+        if (load_script(optarg) < 0) {
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'e':
+        exception_rate = (unsigned int)atoi(optarg);
+        break;
+      case 'O':
+        overflow_rate = (unsigned int)atoi(optarg);
+        break;
+      case 'i':
+        trace_id = (int)strtol(optarg, NULL, 0);
+        break;
+      case 'b':
+        base = strtoul(optarg, NULL, 0);
+        break;
+      case 'V':
+        verify = true;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc || size == 0 || taken_percent > 100 || trace_id <= 0 ||
+      trace_id > CS_TRACE_ID_MAX) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (rng_state == 0) {
+    rng_state = 1; /* xorshift stays at 0 */
+  }
+
+  memset(&state, 0, sizeof(state));
+  state.map_info = map_info;
+  if ((state.map_info_num = load_synth_image(argv[optind], base, map_info,
+                                             &entry)) < 0 ||
+      mmap_map_info(map_info, state.map_info_num) < 0 ||
+      load_symbol_table(&symbols, map_info, state.map_info_num) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  if (load_synth_functions(&state, &symbols, entry) < 0 ||
+      init_profile(&state.expected) < 0 || init_profile(&state.edges) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  state.pc = entry;
+  if (start && find_synth_start(&symbols, start, &state.pc) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  if (!find_synth_map(&state, state.pc)) {
+    fprintf(stderr, "Start address 0x%lx is not in the image\n", state.pc);
+    exit(EXIT_FAILURE);
+  }
+
+  if (emit_sync(&state, true) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  while (FORMATTED_TRACE_SIZE(state.len) < size) {
+    if (step_walk(&state, exception_rate, overflow_rate) < 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (flush_atoms(&state) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  trace = malloc(FORMATTED_TRACE_SIZE(state.len));
+  if (!trace) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  trace_size = format_trace(trace_id, state.buf, state.len, trace);
+
+  if (output) {
+    if (mkdir(output, 0755) < 0 && errno != EEXIST) {
+      perror("mkdir");
+      exit(EXIT_FAILURE);
+    }
+    if (chdir(output) < 0) {
+      perror("chdir");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ret = export_synth_trace(&state, trace, trace_size, trace_id);
+  printf("trace: %zu bytes, %lu branches %lu exceptions %lu overflows "
+         "%lu restarts\n",
+         trace_size, state.branches, state.exceptions, state.overflows,
+         state.restarts);
+  if (ret == 0 && verify) {
+    ret = verify_synth_trace(&state, trace, trace_size, trace_id);
+  }
+
+  free(trace);
+  free(state.buf);
+  free(state.funcs);
+  free(script);
+  fini_profile(&state.expected);
+  fini_profile(&state.edges);
+  free_symbol_table(&symbols);
+  munmap_map_info(map_info, state.map_info_num);
+
+  return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
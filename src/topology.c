@@ -0,0 +1,572 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#define _GNU_SOURCE
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+
+#include "csregisters.h"
+
+typedef enum {
+  topology_device,
+  topology_replicator,
+  topology_affinity,
+  topology_atb,
+  topology_trigsrc,
+  topology_trigdst,
+  topology_stm_config,
+  topology_stm_select,
+} topology_op_t;
+
+/* One registration call. Devices are referred to by node index, which is
+ * the order of topology_device and topology_replicator ops. */
+struct topology_op {
+  uint32_t type;
+  int32_t args[4];
+  uint64_t addr;
+  uint32_t id[4]; /* PIDR0-2 and DEVTYPE of a device */
+};
+
+struct topology_file {
+  uint32_t magic;
+  uint32_t version;
+  char hardware[64];
+  int32_t etb;
+  int32_t trace_sink;
+  int32_t itm;
+  uint32_t cpu_id[TOPOLOGY_CPU_MAX];
+  uint32_t n_ops;
+  struct topology_op ops[TOPOLOGY_OP_MAX];
+};
+
+bool topology_cache = true;
+char *topology_cache_path = NULL;
+
+static const unsigned int id_regs[] = {CS_PIDR0, CS_PIDR1, CS_PIDR2,
+                                       CS_DEVTYPE};
+
+static struct topology_file cache;
+static cs_device_t nodes[TOPOLOGY_OP_MAX];
+static int n_nodes = 0;
+static bool recording = false;
+static bool overflowed = false;
+
+extern int registration_verbose;
+
+unsigned long get_stm_ports(const char *hardware);
+int get_coresight_window(const char *hardware, unsigned long *base,
+                         unsigned long *size);
+
+static int find_node(cs_device_t dev)
+{
+  int i;
+
+  for (i = 0; i < n_nodes; i++) {
+    if (nodes[i] == dev) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static struct topology_op *add_op(topology_op_t type)
+{
+  struct topology_op *op;
+
+  if (cache.n_ops >= TOPOLOGY_OP_MAX) {
+    overflowed = true;
+    return NULL;
+  }
+
+  op = &cache.ops[cache.n_ops++];
+  memset(op, 0, sizeof(*op));
+  op->type = type;
+  return op;
+}
+
+static int add_node(cs_device_t dev, topology_op_t type)
+{
+  struct topology_op *op;
+  int i;
+
+  if ((i = find_node(dev)) >= 0) {
+    return i;
+  }
+
+  if (!(op = add_op(type))) {
+    return -1;
+  }
+  nodes[n_nodes] = dev;
+  return n_nodes++;
+}
+
+static void record_device(cs_device_t dev, cs_physaddr_t addr)
+{
+  int i;
+
+  if (!recording || dev == CS_ERRDESC || find_node(dev) >= 0) {
+    return;
+  }
+  if (add_node(dev, topology_device) < 0) {
+    return;
+  }
+
+  cache.ops[cache.n_ops - 1].addr = addr;
+  for (i = 0; i < 4; i++) {
+    cache.ops[cache.n_ops - 1].id[i] = cs_device_read(dev, id_regs[i]);
+  }
+}
+
+/* Record an op whose arguments are a pair of devices and ports. */
+static void record_link(topology_op_t type, cs_device_t dev0,
+                        unsigned int port0, cs_device_t dev1,
+                        unsigned int port1)
+{
+  struct topology_op *op;
+  int node0, node1;
+
+  if (!recording) {
+    return;
+  }
+  if ((node0 = find_node(dev0)) < 0 || (node1 = find_node(dev1)) < 0) {
+    /* Linked to a device registered behind our back */
+    overflowed = true;
+    return;
+  }
+  if (!(op = add_op(type))) {
+    return;
+  }
+  op->args[0] = node0;
+  op->args[1] = port0;
+  op->args[2] = node1;
+  op->args[3] = port1;
+}
+
+int register_topology_romtable(cs_physaddr_t addr)
+{
+  /* Devices found in ROM tables are recorded when they are looked up. */
+  return cs_register_romtable(addr);
+}
+
+cs_device_t register_topology_device(cs_physaddr_t addr)
+{
+  cs_device_t dev;
+
+  dev = cs_device_register(addr);
+  record_device(dev, addr);
+  return dev;
+}
+
+cs_device_t get_topology_device(cs_physaddr_t addr)
+{
+  cs_device_t dev;
+
+  dev = cs_device_get(addr);
+  record_device(dev, addr);
+  return dev;
+}
+
+int set_topology_affinity(cs_device_t dev, unsigned int cpu)
+{
+  record_link(topology_affinity, dev, cpu, dev, 0);
+  return cs_device_set_affinity(dev, cpu);
+}
+
+cs_device_t add_topology_replicator(unsigned int n_out_ports)
+{
+  cs_device_t dev;
+
+  dev = cs_atb_add_replicator(n_out_ports);
+  if (recording && dev != CS_ERRDESC &&
+      add_node(dev, topology_replicator) >= 0) {
+    cache.ops[cache.n_ops - 1].args[0] = n_out_ports;
+  }
+  return dev;
+}
+
+int register_topology_atb(cs_device_t from, unsigned int from_port,
+                          cs_device_t to, unsigned int to_port)
+{
+  record_link(topology_atb, from, from_port, to, to_port);
+  return cs_atb_register(from, from_port, to, to_port);
+}
+
+int connect_topology_trigsrc(cs_device_t dev, unsigned int dev_port,
+                             cs_device_t cti, unsigned int cti_port)
+{
+  record_link(topology_trigsrc, dev, dev_port, cti, cti_port);
+  return cs_cti_connect_trigsrc(dev, dev_port, cs_cti_trigsrc(cti, cti_port));
+}
+
+int connect_topology_trigdst(cs_device_t cti, unsigned int cti_port,
+                             cs_device_t dev, unsigned int dev_port)
+{
+  record_link(topology_trigdst, cti, cti_port, dev, dev_port);
+  return cs_cti_connect_trigdst(cs_cti_trigdst(cti, cti_port), dev, dev_port);
+}
+
+int config_topology_stm_master(cs_device_t stm, unsigned int master,
+                               cs_physaddr_t addr)
+{
+  record_link(topology_stm_config, stm, master, stm, 0);
+  if (recording && !overflowed) {
+    cache.ops[cache.n_ops - 1].addr = addr;
+  }
+  return cs_stm_config_master(stm, master, addr);
+}
+
+int select_topology_stm_master(cs_device_t stm, unsigned int master)
+{
+  record_link(topology_stm_select, stm, master, stm, 0);
+  return cs_stm_select_master(stm, master);
+}
+
+static void get_topology_cache_path(const char *hardware, char *path,
+                                    size_t size)
+{
+  char *p;
+
+  if (topology_cache_path) {
+    snprintf(path, size, "%s", topology_cache_path);
+    return;
+  }
+
+  snprintf(path, size, DEFAULT_TOPOLOGY_CACHE_FMT, hardware);
+  for (p = path + strlen(path) - strlen(hardware); *p; p++) {
+    if (!isalnum((unsigned char)*p)) {
+      *p = '-';
+    }
+  }
+}
+
+static int get_node_handle(cs_device_t *handles, int node, cs_device_t *dev)
+{
+  if (node < 0) {
+    *dev = CS_ERRDESC;
+    return 0;
+  }
+  if (node >= n_nodes) {
+    return -1;
+  }
+  *dev = handles[node];
+  return 0;
+}
+
+/* Register the devices in the cache. Devices bound to CPUs the board does not
+ * trace are skipped together with their links. */
+static int replay_topology(const struct board *board,
+                           struct cs_devices_t *devices)
+{
+  static int node_cpu[TOPOLOGY_OP_MAX];
+  struct topology_op *op;
+  cs_device_t dev0, dev1;
+  unsigned int i, j;
+  int n;
+
+  n = 0;
+  for (i = 0; i < cache.n_ops; i++) {
+    op = &cache.ops[i];
+    if (op->type == topology_device || op->type == topology_replicator) {
+      node_cpu[n++] = -1;
+    } else if (op->type == topology_affinity) {
+      if (op->args[0] < 0 || op->args[0] >= n) {
+        return -1;
+      }
+      node_cpu[op->args[0]] = op->args[1];
+    }
+  }
+
+  n_nodes = 0;
+  for (i = 0; i < cache.n_ops; i++) {
+    op = &cache.ops[i];
+    switch (op->type) {
+      case topology_device:
+        if (node_cpu[n_nodes] >= board->n_cpu) {
+          nodes[n_nodes++] = CS_ERRDESC;
+          break;
+        }
+        dev0 = cs_device_register(op->addr);
+        if (dev0 == CS_ERRDESC) {
+          return -1;
+        }
+        for (j = 0; j < 4; j++) {
+          if (cs_device_read(dev0, id_regs[j]) != op->id[j]) {
+            if (registration_verbose > 0) {
+              fprintf(stderr, "Device at %#lx does not match the cache\n",
+                      (unsigned long)op->addr);
+            }
+            return -1;
+          }
+        }
+        nodes[n_nodes++] = dev0;
+        break;
+      case topology_replicator:
+        if ((dev0 = cs_atb_add_replicator(op->args[0])) == CS_ERRDESC) {
+          return -1;
+        }
+        nodes[n_nodes++] = dev0;
+        break;
+      default:
+        if (get_node_handle(nodes, op->args[0], &dev0) < 0 ||
+            get_node_handle(nodes, op->args[2], &dev1) < 0) {
+          return -1;
+        }
+        if (dev0 == CS_ERRDESC || dev1 == CS_ERRDESC) {
+          break;
+        }
+        if (op->type == topology_affinity) {
+          cs_device_set_affinity(dev0, op->args[1]);
+        } else if (op->type == topology_atb) {
+          cs_atb_register(dev0, op->args[1], dev1, op->args[3]);
+        } else if (op->type == topology_trigsrc) {
+          cs_cti_connect_trigsrc(dev0, op->args[1],
+                                 cs_cti_trigsrc(dev1, op->args[3]));
+        } else if (op->type == topology_trigdst) {
+          cs_cti_connect_trigdst(cs_cti_trigdst(dev0, op->args[1]), dev1,
+                                 op->args[3]);
+        } else if (op->type == topology_stm_config) {
+          cs_stm_config_master(dev0, op->args[1], op->addr);
+        } else if (op->type == topology_stm_select) {
+          cs_stm_select_master(dev0, op->args[1]);
+        } else {
+          return -1;
+        }
+        break;
+    }
+  }
+
+  if (get_node_handle(nodes, cache.etb, &devices->etb) < 0 ||
+      get_node_handle(nodes, cache.trace_sink, &devices->trace_sinks[0]) < 0 ||
+      get_node_handle(nodes, cache.itm, &devices->itm) < 0) {
+    return -1;
+  }
+  for (i = 0; i < TOPOLOGY_CPU_MAX && i < sizeof(devices->cpu_id) /
+                                              sizeof(devices->cpu_id[0]);
+       i++) {
+    devices->cpu_id[i] = cache.cpu_id[i];
+  }
+
+  return 0;
+}
+
+/* The cache is replayed over /dev/mem, so every address in it must be a
+ * CoreSight device or the STM ports of the board. */
+static int check_topology_addrs(const struct board *board)
+{
+  unsigned long base, size;
+  unsigned int i;
+  uint64_t addr;
+
+  if (get_coresight_window(board->hardware, &base, &size) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < cache.n_ops; i++) {
+    addr = cache.ops[i].addr;
+    if (cache.ops[i].type == topology_device &&
+        (addr < base || addr >= base + size)) {
+      fprintf(stderr, "Topology cache device %#lx is out of the board\n",
+              (unsigned long)addr);
+      return -1;
+    }
+    if (cache.ops[i].type == topology_stm_config &&
+        addr != get_stm_ports(board->hardware)) {
+      fprintf(stderr, "Topology cache STM ports %#lx are not the board's\n",
+              (unsigned long)addr);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Only a cache that root wrote and nobody else can modify is trusted. */
+static int open_topology_cache(const char *path)
+{
+  struct stat st;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 ||
+      (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    fprintf(stderr, "WARNING: Ignoring topology cache %s not owned by root "
+                    "or writable by others\n",
+            path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int load_topology_cache(const char *path, const struct board *board)
+{
+  int fd;
+  ssize_t len;
+
+  if ((fd = open_topology_cache(path)) < 0) {
+    return -1;
+  }
+  len = read(fd, &cache, sizeof(cache));
+  close(fd);
+
+  if (len < (ssize_t)offsetof(struct topology_file, ops) ||
+      cache.magic != TOPOLOGY_MAGIC || cache.version != TOPOLOGY_VERSION ||
+      strncmp(cache.hardware, board->hardware, sizeof(cache.hardware)) ||
+      cache.n_ops > TOPOLOGY_OP_MAX ||
+      len < (ssize_t)(offsetof(struct topology_file, ops) +
+                      cache.n_ops * sizeof(struct topology_op))) {
+    return -1;
+  }
+
+  return check_topology_addrs(board);
+}
+
+static int save_topology_cache(const char *path, const struct board *board,
+                               const struct cs_devices_t *devices)
+{
+  char tmp_path[PATH_MAX];
+  size_t len;
+  unsigned int i;
+  int fd;
+  int ret;
+
+  ret = -1;
+  fd = -1;
+
+  cache.magic = TOPOLOGY_MAGIC;
+  cache.version = TOPOLOGY_VERSION;
+  snprintf(cache.hardware, sizeof(cache.hardware), "%s", board->hardware);
+  cache.etb = find_node(devices->etb);
+  cache.trace_sink = find_node(devices->trace_sinks[0]);
+  cache.itm = find_node(devices->itm);
+  for (i = 0; i < TOPOLOGY_CPU_MAX && i < sizeof(devices->cpu_id) /
+                                              sizeof(devices->cpu_id[0]);
+       i++) {
+    cache.cpu_id[i] = devices->cpu_id[i];
+  }
+
+  if (overflowed || (devices->etb && cache.etb < 0)) {
+    fprintf(stderr, "WARNING: Topology of %s is not cacheable\n",
+            board->hardware);
+    goto exit;
+  }
+
+  if (!topology_cache_path && mkdir(DEFAULT_TOPOLOGY_CACHE_DIR, 0755) < 0 &&
+      errno != EEXIST) {
+    perror("mkdir");
+    goto exit;
+  }
+
+  /* Write to a temporary file first so that concurrent starts never see a
+   * partial cache. */
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp_path)) < 0) {
+    perror("mkstemp");
+    goto exit;
+  }
+
+  len = offsetof(struct topology_file, ops) +
+        cache.n_ops * sizeof(struct topology_op);
+  if (write(fd, &cache, len) != (ssize_t)len) {
+    perror("write");
+    unlink(tmp_path);
+    goto exit;
+  }
+
+  if (rename(tmp_path, path) < 0) {
+    perror("rename");
+    unlink(tmp_path);
+    goto exit;
+  }
+
+  ret = 0;
+
+exit:
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return ret;
+}
+
+/* setup_named_board() with the resolved device graph cached in a file. The
+ * cache is validated against the ID registers of every device and rebuilt
+ * from a full registration when it does not match. */
+int setup_cached_board(const char *board_name, const struct board **board,
+                       struct cs_devices_t *devices,
+                       const struct board *board_list)
+{
+  const struct board *b;
+  char path[PATH_MAX];
+  int ret;
+
+  if (!topology_cache) {
+    return setup_named_board(board_name, board, devices, board_list);
+  }
+
+  for (b = board_list; b->do_registration; b++) {
+    if (!strcmp(b->hardware, board_name)) {
+      break;
+    }
+  }
+  if (!b->do_registration) {
+    return setup_named_board(board_name, board, devices, board_list);
+  }
+
+  get_topology_cache_path(b->hardware, path, sizeof(path));
+
+  if (load_topology_cache(path, b) == 0) {
+    if (cs_init() < 0) {
+      fprintf(stderr, "cs_init() failed\n");
+      return -1;
+    }
+    memset(devices, 0, sizeof(*devices));
+    ret = replay_topology(b, devices);
+    if (ret == 0) {
+      cs_registration_complete();
+    }
+    if (ret == 0 && cs_error_count() == 0) {
+      if (registration_verbose > 0) {
+        fprintf(stderr, "Loaded topology of %s from %s\n", b->hardware, path);
+      }
+      *board = b;
+      return 0;
+    }
+    fprintf(stderr, "WARNING: Topology cache %s is stale. Rebuilding\n",
+            path);
+    cs_shutdown();
+    cs_reset_error_count();
+  }
+
+  memset(&cache, 0, sizeof(cache));
+  n_nodes = 0;
+  overflowed = false;
+
+  recording = true;
+  ret = setup_named_board(board_name, board, devices, board_list);
+  recording = false;
+
+  if (ret == 0) {
+    save_topology_cache(path, b, devices);
+  }
+
+  return ret;
+}
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "traced.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+char *traced_socket_path = DEFAULT_TRACED_SOCKET_PATH;
+
+static int traced_fd = -1;
+
+static int request_traced(struct traced_request *req,
+                          struct traced_response *res)
+{
+  ssize_t n;
+
+  if (traced_fd < 0) {
+    return -1;
+  }
+
+  if (send(traced_fd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req)) {
+    perror("send");
+    return -1;
+  }
+
+  n = recv(traced_fd, res, sizeof(*res), 0);
+  if (n != sizeof(*res)) {
+    if (n < 0) {
+      perror("recv");
+    } else {
+      fprintf(stderr, "cs-traced closed the connection\n");
+    }
+    return -1;
+  }
+
+  return res->ret;
+}
+
+static int request_traced_cmd(traced_cmd_t cmd)
+{
+  struct traced_request req;
+  struct traced_response res;
+
+  memset(&req, 0, sizeof(req));
+  req.cmd = cmd;
+
+  return request_traced(&req, &res);
+}
+
+int connect_traced(void)
+{
+  struct sockaddr_un addr;
+
+  if (traced_fd >= 0) {
+    return 0;
+  }
+
+  traced_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (traced_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, traced_socket_path, sizeof(addr.sun_path) - 1);
+
+  if (connect(traced_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    close(traced_fd);
+    traced_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+void disconnect_traced(void)
+{
+  if (traced_fd >= 0) {
+    request_traced_cmd(traced_release);
+    close(traced_fd);
+    traced_fd = -1;
+  }
+}
+
+int lease_traced_cpu(int cpu, int *leased_cpu, int *trace_id)
+{
+  struct traced_request req;
+  struct traced_response res;
+
+  memset(&req, 0, sizeof(req));
+  req.cmd = traced_lease;
+  req.cpu = cpu;
+
+  if (request_traced(&req, &res) < 0) {
+    return -1;
+  }
+
+  *leased_cpu = res.cpu;
+  *trace_id = res.trace_id;
+
+  return 0;
+}
+
+int configure_traced_source(struct map_info *range, int range_count,
+                            pid_t pid)
+{
+  struct traced_request req;
+  struct traced_response res;
+  int i;
+
+  if (range_count < 0 || range_count > TRACED_RANGE_MAX) {
+    fprintf(stderr, "cs-traced filters at most %d address ranges, not %d\n",
+            TRACED_RANGE_MAX, range_count);
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.cmd = traced_configure;
+  req.pid = pid;
+  req.range_count = range_count;
+  for (i = 0; i < req.range_count; i++) {
+    req.ranges[i].start = range[i].start;
+    req.ranges[i].end = range[i].end;
+  }
+
+  return request_traced(&req, &res);
+}
+
+int enable_traced_source(void) { return request_traced_cmd(traced_enable); }
+
+int disable_traced_source(void) { return request_traced_cmd(traced_disable); }
+
+int resume_traced_source(void) { return request_traced_cmd(traced_resume); }
+
+int suspend_traced_source(void) { return request_traced_cmd(traced_suspend); }
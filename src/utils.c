@@ -19,6 +19,7 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <assert.h>
+#include <signal.h>
 
 #include <sys/mman.h>
 #include <sys/ptrace.h>
@@ -95,7 +96,8 @@ void dump_maps(FILE *stream, pid_t pid)
   return;
 }
 
-int setup_map_info(pid_t pid, struct map_info **map_info, int info_count_max)
+/* Read the executable file mappings of the process. Buffers are not mapped. */
+int read_map_info(pid_t pid, struct map_info **map_info, int info_count_max)
 {
   FILE *fp;
   char maps_path[PATH_MAX];
@@ -104,10 +106,6 @@ int setup_map_info(pid_t pid, struct map_info **map_info, int info_count_max)
   ssize_t readn;
   int count;
   char *path;
-  int fd;
-  size_t buf_size;
-  void *buf;
-  int i;
 
   unsigned long start;
   unsigned long end;
@@ -160,22 +158,81 @@ int setup_map_info(pid_t pid, struct map_info **map_info, int info_count_max)
   }
   fclose(fp);
 
+  return count;
+}
+
+/* Map the file contents of each mapping for the decoder. */
+int mmap_map_info(struct map_info *map_info, int count)
+{
+  int fd;
+  size_t buf_size;
+  void *buf;
+  int i;
+
   for (i = 0; i < count; i++) {
-    if ((fd = open((*map_info)[i].path, O_RDONLY | O_SYNC)) < -1) {
+    if ((fd = open(map_info[i].path, O_RDONLY | O_SYNC)) < -1) {
       perror("open");
       return -1;
     }
-    buf_size = (size_t)ALIGN_UP((*map_info)[i].end - (*map_info)[i].start, PAGE_SIZE);
-    buf = mmap(NULL, buf_size, PROT_READ, MAP_PRIVATE, fd, (*map_info)[i].offset);
+    buf_size = (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE);
+    buf = mmap(NULL, buf_size, PROT_READ, MAP_PRIVATE, fd, map_info[i].offset);
     if (!buf) {
       perror("mmap");
       close(fd);
       return -1;
     }
-    (*map_info)[i].buf = buf;
+    map_info[i].buf = buf;
     close(fd);
   }
 
+  return 0;
+}
+
+void munmap_map_info(struct map_info *map_info, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (map_info[i].buf && map_info[i].buf != MAP_FAILED) {
+      munmap(map_info[i].buf,
+             (size_t)ALIGN_UP(map_info[i].end - map_info[i].start, PAGE_SIZE));
+    }
+    map_info[i].buf = NULL;
+  }
+}
+
+/* Compare the layout of two mappings, ignoring the mapped buffers. */
+bool is_same_map_info(struct map_info *a, int a_count, struct map_info *b,
+                      int b_count)
+{
+  int i;
+
+  if (a_count != b_count) {
+    return false;
+  }
+
+  for (i = 0; i < a_count; i++) {
+    if (a[i].start != b[i].start || a[i].end != b[i].end ||
+        a[i].offset != b[i].offset || strcmp(a[i].path, b[i].path)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int setup_map_info(pid_t pid, struct map_info **map_info, int info_count_max)
+{
+  int count;
+
+  if ((count = read_map_info(pid, map_info, info_count_max)) < 0) {
+    return -1;
+  }
+
+  if (mmap_map_info(*map_info, count) < 0) {
+    return -1;
+  }
+
   return count;
 }
 
@@ -230,6 +287,82 @@ exit:
   return ret;
 }
 
+/* Read back the arguments written by export_decoder_args(). trace_path must
+ * hold PATH_MAX bytes, and map_info is allocated for the ranges. Returns the
+ * number of ranges. */
+int import_decoder_args(const char *args_path, char *trace_path,
+                        int *trace_id, struct map_info **map_info)
+{
+  FILE *fp;
+  int count;
+  int i;
+
+  fp = fopen(args_path, "r");
+  if (fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+
+  *map_info = NULL;
+  if (fscanf(fp, " %4095s 0x%x %d", trace_path, trace_id, &count) != 3 ||
+      count <= 0) {
+    goto error;
+  }
+
+  *map_info = calloc(count, sizeof(struct map_info));
+  if (*map_info == NULL) {
+    perror("calloc");
+    goto error;
+  }
+  for (i = 0; i < count; i++) {
+    if (fscanf(fp, " %4095s 0x%lx 0x%lx", (*map_info)[i].path,
+               &(*map_info)[i].start, &(*map_info)[i].end) != 3) {
+      goto error;
+    }
+  }
+
+  fclose(fp);
+
+  return count;
+
+error:
+  fprintf(stderr, "Invalid decoder arguments: %s\n", args_path);
+  free(*map_info);
+  *map_info = NULL;
+  fclose(fp);
+
+  return -1;
+}
+
+/* Take the file offsets of map_info from a dump of dump_map_info(). Ranges
+ * missing there keep their offsets. */
+int import_map_offsets(const char *maps_path, struct map_info *map_info,
+                       int count)
+{
+  char path[PATH_MAX];
+  unsigned long start, end, offset;
+  FILE *fp;
+  int i;
+
+  fp = fopen(maps_path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  while (fscanf(fp, " [0x%lx-0x%lx]@0x%lx: %4095s", &start, &end, &offset,
+                path) == 4) {
+    for (i = 0; i < count; i++) {
+      if (map_info[i].start == start && map_info[i].end == end) {
+        map_info[i].offset = (off_t)offset;
+      }
+    }
+  }
+
+  fclose(fp);
+
+  return 0;
+}
+
 static cpu_set_t *alloc_cpu_set(cpu_set_t **cpu_set, size_t *setsize)
 {
   int nprocs;
@@ -480,6 +613,102 @@ exit:
   return ret;
 }
 
+/* Bind the process to every CPU set in cpus. */
+int set_cpu_list_affinity(const bool *cpus, int n_cpus, pid_t pid)
+{
+  int ret;
+  cpu_set_t *cpu_set;
+  size_t setsize;
+  int i;
+
+  ret = -1;
+
+  if (!alloc_cpu_set(&cpu_set, &setsize)) {
+    goto exit;
+  }
+  for (i = 0; i < n_cpus; i++) {
+    if (cpus[i]) {
+      CPU_SET_S(i, setsize, cpu_set);
+    }
+  }
+  if (sched_setaffinity(pid, setsize, cpu_set) < 0) {
+    perror("sched_setaffinity");
+    goto exit;
+  }
+
+  ret = 0;
+
+exit:
+  if (cpu_set) {
+    CPU_FREE(cpu_set);
+  }
+
+  return ret;
+}
+
+/* Read the CPU affinity of the process into cpus. */
+int get_cpu_list_affinity(pid_t pid, bool *cpus, int n_cpus)
+{
+  int ret;
+  cpu_set_t *cpu_set;
+  size_t setsize;
+  int i;
+
+  ret = -1;
+
+  if (!alloc_cpu_set(&cpu_set, &setsize)) {
+    goto exit;
+  }
+  if (sched_getaffinity(pid, setsize, cpu_set) < 0) {
+    perror("sched_getaffinity");
+    goto exit;
+  }
+  for (i = 0; i < n_cpus; i++) {
+    cpus[i] = CPU_ISSET_S(i, setsize, cpu_set);
+  }
+
+  ret = 0;
+
+exit:
+  if (cpu_set) {
+    CPU_FREE(cpu_set);
+  }
+
+  return ret;
+}
+
+/* Bind all threads of the process to every CPU set in cpus. Threads created
+ * afterwards inherit the affinity of their creator. */
+int set_task_cpu_list_affinity(pid_t pid, const bool *cpus, int n_cpus)
+{
+  char path[PATH_MAX];
+  DIR *task_dir;
+  struct dirent *entry;
+  pid_t tid;
+  int ret;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  task_dir = opendir(path);
+  if (!task_dir) {
+    perror("opendir");
+    return -1;
+  }
+
+  ret = 0;
+  while ((entry = readdir(task_dir)) != NULL) {
+    if ((tid = (pid_t)atoi(entry->d_name)) <= 0) {
+      continue;
+    }
+    /* The thread may have exited in the meantime. */
+    if (set_cpu_list_affinity(cpus, n_cpus, tid) < 0 && !kill(tid, 0)) {
+      ret = -1;
+    }
+  }
+  closedir(task_dir);
+
+  return ret;
+}
+
 int set_pthread_cpu_affinity(int cpu, pthread_t thread)
 {
   int ret;
@@ -518,6 +747,7 @@ void read_pid_fd_path(pid_t pid, int fd, char *buf, size_t size)
   }
 }
 
+#if defined(__aarch64__)
 static long get_pid_syscall_regs(pid_t pid, struct user_pt_regs *regs)
 {
   struct iovec iov;
@@ -537,9 +767,13 @@ static long get_pid_syscall_regs(pid_t pid, struct user_pt_regs *regs)
 
   return syscall;
 }
+#endif
 
+/* Tracee registers are only read on arm64. Tools that run on other hosts,
+ * such as synth-trace, link this file without them. */
 int get_mmap_params(pid_t pid, struct mmap_params *params)
 {
+#if defined(__aarch64__)
   struct user_pt_regs regs;
 
   if (!params) {
@@ -558,15 +792,46 @@ int get_mmap_params(pid_t pid, struct mmap_params *params)
   params->offset = (off_t)regs.regs[5];
 
   return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Returns the process of a thread, or -1 once the thread is gone. */
+pid_t get_thread_group(pid_t tid)
+{
+  char path[32];
+  char line[64];
+  FILE *fp;
+  pid_t tgid;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", tid);
+  fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+
+  tgid = -1;
+  while (fgets(line, sizeof(line), fp)) {
+    if (!strncmp(line, "Tgid:", 5)) {
+      tgid = (pid_t)atoi(line + 5);
+      break;
+    }
+  }
+  fclose(fp);
+
+  return tgid > 0 ? tgid : -1;
 }
 
 bool is_syscall_exit_group(pid_t pid)
 {
+#if defined(__aarch64__)
   struct user_pt_regs regs;
 
   if (get_pid_syscall_regs(pid, &regs) == __NR_exit_group) {
     return true;
   }
+#endif
 
   return false;
 }
@@ -628,3 +893,79 @@ int get_udmabuf_info(int udmabuf_num, unsigned long *phys_addr, size_t *size)
 
   return 0;
 }
+
+/* Map the u-dma-buf written by the ETR. Returns NULL on error. */
+void *map_udmabuf(int udmabuf_num, size_t size)
+{
+  char udmabuf_path[PATH_MAX];
+  void *buf;
+  int fd;
+
+  memset(udmabuf_path, 0, sizeof(udmabuf_path));
+  snprintf(udmabuf_path, sizeof(udmabuf_path), "/dev/udmabuf%d", udmabuf_num);
+
+  /* O_SYNC disables caching of the region written by the ETR. */
+  if ((fd = open(udmabuf_path, O_RDONLY | O_SYNC)) < 0) {
+    perror("open");
+    return NULL;
+  }
+
+  buf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  return buf;
+}
+
+/* Parse CPU list like "0,2-5" into cpus. Returns the number of CPUs set. */
+int parse_cpu_list(const char *str, bool *cpus, int n_cpus)
+{
+  const char *p;
+  char *end;
+  long first, last;
+  long i;
+  int count;
+
+  if (!str || !cpus) {
+    return -1;
+  }
+
+  memset(cpus, 0, sizeof(bool) * n_cpus);
+
+  count = 0;
+  p = str;
+  while (*p) {
+    first = strtol(p, &end, 10);
+    if (end == p) {
+      return -1;
+    }
+    last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    if (first < 0 || last >= n_cpus || first > last) {
+      return -1;
+    }
+    for (i = first; i <= last; i++) {
+      if (!cpus[i]) {
+        cpus[i] = true;
+        count++;
+      }
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    p = end;
+  }
+
+  return count;
+}
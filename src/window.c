@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <linux/elf.h>
+#include <asm/ptrace.h>
+
+#include "common.h"
+#include "utils.h"
+#include "window.h"
+
+#define BRK_INSN 0xd4200000UL /* BRK #0 */
+#define INSN_MASK 0xffffffffUL
+
+/* Parse "ENTRY:EXIT" in hexadecimal or decimal. */
+int parse_trace_window(const char *spec, unsigned long *entry_addr,
+                       unsigned long *exit_addr)
+{
+  char *end;
+
+  *entry_addr = strtoul(spec, &end, 0);
+  if (end == spec || *end != ':') {
+    return -1;
+  }
+  spec = end + 1;
+  *exit_addr = strtoul(spec, &end, 0);
+  if (end == spec || *end != '\0') {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Addresses in the first executable mapping are taken as is. Others are
+ * offsets in its image, e.g. symbols of a position independent executable
+ * as printed by nm. */
+static unsigned long resolve_window_addr(unsigned long addr,
+                                         struct map_info *map_info)
+{
+  if (map_info->start <= addr && addr < map_info->end) {
+    return addr;
+  }
+
+  return map_info->start - (unsigned long)map_info->offset + addr;
+}
+
+static unsigned long get_pid_pc(pid_t pid)
+{
+  struct user_pt_regs regs;
+  struct iovec iov;
+
+  iov.iov_base = &regs;
+  iov.iov_len = sizeof(regs);
+  if (ptrace(PTRACE_GETREGSET, pid, (void *)NT_PRSTATUS, &iov) < 0) {
+    perror("ptrace");
+    return 0;
+  }
+
+  return regs.pc;
+}
+
+static int insert_breakpoint(pid_t pid, unsigned long addr,
+                             unsigned long *insn)
+{
+  long word;
+
+  errno = 0;
+  word = ptrace(PTRACE_PEEKTEXT, pid, (void *)addr, NULL);
+  if (errno) {
+    perror("ptrace");
+    return -1;
+  }
+  if (insn) {
+    *insn = (unsigned long)word;
+  }
+
+  word = (long)(((unsigned long)word & ~INSN_MASK) | BRK_INSN);
+  if (ptrace(PTRACE_POKETEXT, pid, (void *)addr, (void *)word) < 0) {
+    perror("ptrace");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Run the original instruction under the breakpoint and put it back. */
+static int step_over_breakpoint(pid_t pid, unsigned long addr,
+                                unsigned long insn)
+{
+  int wstatus;
+
+  if (ptrace(PTRACE_POKETEXT, pid, (void *)addr, (void *)insn) < 0) {
+    perror("ptrace");
+    return -1;
+  }
+  if (ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL) < 0) {
+    perror("ptrace");
+    return -1;
+  }
+  if (waitpid(pid, &wstatus, __WALL) < 0) {
+    perror("waitpid");
+    return -1;
+  }
+  if (!WIFSTOPPED(wstatus)) {
+    return -1;
+  }
+
+  return insert_breakpoint(pid, addr, NULL);
+}
+
+int insert_trace_window(struct trace_window *window, pid_t pid,
+                        unsigned long entry_addr, unsigned long exit_addr,
+                        struct map_info *map_info, int map_info_num)
+{
+  if (!window || !map_info || map_info_num <= 0) {
+    return -1;
+  }
+
+  memset(window, 0, sizeof(*window));
+  window->pid = pid;
+  window->entry = resolve_window_addr(entry_addr, &map_info[0]);
+  window->exit = resolve_window_addr(exit_addr, &map_info[0]);
+
+  window->index_fp = fopen(DEFAULT_WINDOW_INDEX_NAME, "w");
+  if (!window->index_fp) {
+    perror("fopen");
+    return -1;
+  }
+  fprintf(window->index_fp, "# index start_ns end_ns latency_ns trace_bytes\n");
+
+  if (insert_breakpoint(pid, window->entry, &window->entry_insn) < 0 ||
+      insert_breakpoint(pid, window->exit, &window->exit_insn) < 0) {
+    fprintf(stderr, "Failed to insert trace window breakpoints\n");
+    finish_trace_window(window);
+    return -1;
+  }
+
+  return 0;
+}
+
+static long long get_timespec_ns(const struct timespec *ts)
+{
+  return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* now is the time of the breakpoint stop, taken before the trace is
+ * reconfigured, so that the latency is not the tracer's. */
+static void open_trace_window(struct trace_window *window, pid_t tid,
+                              const struct timespec *now)
+{
+  window->start = *now;
+  if (restart_trace(window->pid) < 0) {
+    fprintf(stderr, "restart_trace() failed\n");
+    return;
+  }
+  window->tid = tid;
+  window->open = true;
+}
+
+static void close_trace_window(struct trace_window *window,
+                               const struct timespec *end)
+{
+  ssize_t size;
+
+  if (stop_trace(false) < 0) {
+    fprintf(stderr, "stop_trace() failed\n");
+  }
+  window->open = false;
+
+  size = export_trace_window(window->index);
+  fprintf(window->index_fp, "%u %lld %lld %lld %zd\n", window->index,
+          get_timespec_ns(&window->start), get_timespec_ns(end),
+          get_timespec_ns(end) - get_timespec_ns(&window->start), size);
+  fflush(window->index_fp);
+  window->index++;
+}
+
+/* Handle a SIGTRAP stop of pid, any traced thread. Returns 1 if it was a
+ * window breakpoint, and the thread can be continued, or 0 if it was not. The
+ * window is closed by the thread that opened it. Entries while a window is
+ * open are only stepped over. */
+int handle_trace_window_stop(struct trace_window *window, pid_t pid)
+{
+  struct timespec now;
+  unsigned long pc;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pc = get_pid_pc(pid);
+  if (pc == window->entry) {
+    if (!window->open) {
+      open_trace_window(window, pid, &now);
+    }
+    return step_over_breakpoint(pid, pc, window->entry_insn) < 0 ? -1 : 1;
+  } else if (pc == window->exit) {
+    if (window->open && pid == window->tid) {
+      close_trace_window(window, &now);
+    }
+    return step_over_breakpoint(pid, pc, window->exit_insn) < 0 ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/* Close the window still open when the tracee exits, and the index. */
+void finish_trace_window(struct trace_window *window)
+{
+  struct timespec now;
+
+  if (window->open) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    close_trace_window(window, &now);
+  }
+  if (window->index_fp) {
+    fclose(window->index_fp);
+    window->index_fp = NULL;
+  }
+}
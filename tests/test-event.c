@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright 2021 Ricerca Security, Inc. All rights reserved. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "event.h"
+
+#define THREAD_EVENTS 100000
+
+#define THREAD_SYNC_PERIOD (EVENT_QUEUE_SIZE / 2)
+
+#define CHECK(cond)                                                       \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      fprintf(stderr, "%s:%d: %s failed\n", __func__, __LINE__, #cond); \
+      failures++;                                                         \
+    }                                                                     \
+  } while (0)
+
+enum { event_a, event_b, event_c, event_d };
+
+static int failures = 0;
+
+/* Post from index start, reading each event at once and then a whole queue
+ * of them at a time. */
+static void check_wraparound(unsigned int start)
+{
+  struct event_queue queue;
+  struct event_cursor cursor;
+  int i;
+
+  init_event_queue(&queue);
+  atomic_store(&queue.tail, start);
+  init_event_cursor(&queue, &cursor);
+
+  for (i = 0; i < EVENT_QUEUE_SIZE * 4; i++) {
+    post_event(&queue, i % 4);
+    CHECK(wait_event(&queue, &cursor, ~0U) == i % 4);
+  }
+
+  for (i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    post_event(&queue, i % 3);
+  }
+  for (i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    CHECK(wait_event(&queue, &cursor, ~0U) == i % 3);
+  }
+}
+
+/* Slots are reused every EVENT_QUEUE_SIZE events, and the indices wrap
+ * around UINT_MAX. */
+static void test_wraparound(void)
+{
+  check_wraparound(0);
+  check_wraparound(0U - EVENT_QUEUE_SIZE * 3);
+}
+
+/* A reader overrun by more than EVENT_QUEUE_SIZE events skips to the oldest
+ * one still in the queue. */
+static void test_overrun(void)
+{
+  struct event_queue queue;
+  struct event_cursor cursor;
+  int i;
+
+  init_event_queue(&queue);
+  init_event_cursor(&queue, &cursor);
+  for (i = 0; i < EVENT_QUEUE_SIZE + 3; i++) {
+    post_event(&queue, i < 3 ? event_d : i % 3);
+  }
+  for (i = 3; i < EVENT_QUEUE_SIZE + 3; i++) {
+    CHECK(wait_event(&queue, &cursor, ~0U) == i % 3);
+  }
+  CHECK(cursor.head == atomic_load(&queue.tail));
+}
+
+/* Events outside the mask are consumed without being returned. */
+static void test_masked_skips(void)
+{
+  struct event_queue queue;
+  struct event_cursor cursor;
+
+  init_event_queue(&queue);
+  init_event_cursor(&queue, &cursor);
+  post_event(&queue, event_a);
+  post_event(&queue, event_b);
+  post_event(&queue, event_c);
+  post_event(&queue, event_a);
+
+  CHECK(wait_event(&queue, &cursor, EVENT_MASK(event_c)) == event_c);
+  CHECK(cursor.head == 3);
+  CHECK(wait_event(&queue, &cursor,
+                   EVENT_MASK(event_a) | EVENT_MASK(event_b)) == event_a);
+  CHECK(cursor.head == 4);
+}
+
+/* Every cursor sees every event in order, whatever the others read. */
+static void test_multiple_cursors(void)
+{
+  struct event_queue queue;
+  struct event_cursor first, second, late;
+
+  init_event_queue(&queue);
+  init_event_cursor(&queue, &first);
+  init_event_cursor(&queue, &second);
+  post_event(&queue, event_a);
+  post_event(&queue, event_b);
+  init_event_cursor(&queue, &late);
+  post_event(&queue, event_c);
+
+  CHECK(wait_event(&queue, &first, EVENT_MASK(event_b)) == event_b);
+  CHECK(wait_event(&queue, &second, ~0U) == event_a);
+  CHECK(wait_event(&queue, &second, ~0U) == event_b);
+  CHECK(wait_event(&queue, &late, ~0U) == event_c);
+  CHECK(wait_event(&queue, &first, ~0U) == event_c);
+  CHECK(wait_event(&queue, &second, ~0U) == event_c);
+}
+
+struct reader {
+  struct event_queue *queue;
+  struct event_queue *acks;
+  struct event_cursor cursor;
+  unsigned int mask;
+  int count;
+};
+
+/* Count events up to event_d and acknowledge every event_c. */
+static void *read_events(void *arg)
+{
+  struct reader *reader = arg;
+  int event;
+
+  while ((event = wait_event(reader->queue, &reader->cursor, reader->mask)) !=
+         event_d) {
+    if (event == event_c) {
+      post_event(reader->acks, event_c);
+    } else {
+      reader->count++;
+    }
+  }
+
+  return NULL;
+}
+
+/* Readers sleeping in wait_event() are woken by posts from another thread.
+ * The writer waits for the readers now and then so that none is overrun. */
+static void test_threads(void)
+{
+  struct event_queue queue;
+  struct event_queue acks;
+  struct event_cursor ack_cursor;
+  struct reader readers[2];
+  pthread_t threads[2];
+  int i, j;
+
+  init_event_queue(&queue);
+  init_event_queue(&acks);
+  init_event_cursor(&acks, &ack_cursor);
+  for (i = 0; i < 2; i++) {
+    readers[i].queue = &queue;
+    readers[i].acks = &acks;
+    init_event_cursor(&queue, &readers[i].cursor);
+    readers[i].count = 0;
+  }
+  readers[0].mask = ~0U;
+  readers[1].mask =
+      EVENT_MASK(event_b) | EVENT_MASK(event_c) | EVENT_MASK(event_d);
+
+  for (i = 0; i < 2; i++) {
+    if (pthread_create(&threads[i], NULL, read_events, &readers[i]) != 0) {
+      fprintf(stderr, "pthread_create() failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < THREAD_EVENTS; i++) {
+    post_event(&queue, i % 2 ? event_b : event_a);
+    if (i % THREAD_SYNC_PERIOD == THREAD_SYNC_PERIOD - 1) {
+      post_event(&queue, event_c);
+      for (j = 0; j < 2; j++) {
+        CHECK(wait_event(&acks, &ack_cursor, ~0U) == event_c);
+      }
+    }
+  }
+  post_event(&queue, event_d);
+
+  for (i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  CHECK(readers[0].count == THREAD_EVENTS);
+  CHECK(readers[1].count == THREAD_EVENTS / 2);
+}
+
+int main(void)
+{
+  test_wraparound();
+  test_overrun();
+  test_masked_skips();
+  test_multiple_cursors();
+  test_threads();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("test-event: ok\n");
+
+  return EXIT_SUCCESS;
+}